@@ -3,12 +3,39 @@
 // Socialist Realist 3D Scene using OpenGL/GLUT
 // ============================================
 
+// Core GL entry points (shaders, buffers) are resolved directly from libGL
+#define GL_GLEXT_PROTOTYPES
+
 #include <GL/glut.h>
 #include <GL/gl.h>
 #include <GL/glu.h>
+#include <GL/glext.h>
+// Display-less contexts for --headless (link with -lEGL)
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+// Worker processes for --batch
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <dirent.h>
+#include <unistd.h>
 #include <cmath>
 #include <cstdlib>
 #include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <chrono>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <algorithm>
+#include <cstddef>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 // stb_image for loading image files
 #define STB_IMAGE_IMPLEMENTATION
@@ -36,9 +63,54 @@ float orbitalAngle = 0.0f;
 // Lighting states
 bool deskLampLight = true;
 bool deskLampLightOn = true;
-// Day / Night state
+// Day / Night state, derived from the time of day
 bool isDaytime = true; // true = sunlight on, lamp off; false = sunlight off, lamp on
 
+// Time of day in hours: 'L' glides to the day or the night setting, 'Y'
+// runs the whole cycle. Lighting is interpolated between the key times.
+const float TIME_OF_DAY_DAY = 15.0f;
+const float TIME_OF_DAY_NIGHT = 21.0f;
+const float TIME_OF_DAY_TRANSITION_SPEED = 4.0f; // hours per second while gliding
+const float TIME_OF_DAY_CYCLE_SPEED = 0.5f;      // hours per second, 48 s per day
+float timeOfDay = TIME_OF_DAY_DAY;
+float timeOfDayTarget = TIME_OF_DAY_DAY;
+bool timeOfDayCycle = false;
+float deskLampIntensity = 0.0f;                  // scales the lamp's colors
+
+// Light positions in world space, re-applied after the camera every frame
+GLfloat sunPosition[4] = {-1.0f, 2.0f, -1.0f, 0.0f};     // directional
+GLfloat deskLampPosition[4] = {0.0f, 2.5f, 0.0f, 1.0f};  // point
+
+// Light colors, shared by setupLighting() and the lightmap baker
+GLfloat sunDiffuse[4] = {0.9f, 0.75f, 0.5f, 1.0f};       // warm golden light
+GLfloat sunAmbient[4] = {0.4f, 0.3f, 0.2f, 1.0f};
+GLfloat deskLampDiffuse[4] = {1.0f, 0.95f, 0.8f, 1.0f};  // warmer white
+GLfloat deskLampAmbient[4] = {0.4f, 0.4f, 0.3f, 1.0f};   // brighter ambient from lamp
+GLfloat deskLampSpecular[4] = {1.0f, 1.0f, 0.9f, 1.0f};
+GLfloat deskLampAttenuation[3] = {1.0f, 0.05f, 0.01f};   // constant, linear, quadratic
+GLfloat globalAmbient[4] = {0.35f, 0.3f, 0.25f, 1.0f};   // warm overall ambient
+
+// Lighting at the key times of day, in order. The sun is kept on the
+// window's side of the room; 15:00 is the classic afternoon above and 21:00
+// the lamp-lit night.
+struct TimeOfDayKey {
+    float hour;
+    GLfloat sunPosition[4];   // directional, toward the sun
+    GLfloat sunDiffuse[3];
+    GLfloat sunAmbient[3];
+    float sunIntensity;       // 0 = below the horizon
+    float lampIntensity;      // 0 = lamp off
+};
+const TimeOfDayKey timeOfDayKeys[] = {
+    { 5.0f, {-1.0f, 0.35f, 1.2f, 0.0f}, {0.7f, 0.45f, 0.3f}, {0.25f, 0.18f, 0.14f}, 0.0f, 1.0f},
+    { 7.0f, {-1.0f, 0.35f, 1.2f, 0.0f}, {0.7f, 0.45f, 0.3f}, {0.25f, 0.18f, 0.14f}, 1.0f, 0.4f},
+    {11.0f, {-0.7f, 2.6f, 0.4f, 0.0f}, {0.95f, 0.88f, 0.75f}, {0.42f, 0.36f, 0.3f}, 1.0f, 0.0f},
+    {15.0f, {-1.0f, 2.0f, -1.0f, 0.0f}, {0.9f, 0.75f, 0.5f}, {0.4f, 0.3f, 0.2f}, 1.0f, 0.0f},
+    {19.0f, {-1.0f, 0.4f, -1.3f, 0.0f}, {0.8f, 0.45f, 0.25f}, {0.25f, 0.15f, 0.12f}, 1.0f, 0.6f},
+    {21.0f, {-1.0f, 0.4f, -1.3f, 0.0f}, {0.8f, 0.45f, 0.25f}, {0.25f, 0.15f, 0.12f}, 0.0f, 1.0f},
+};
+const int TIME_OF_DAY_KEY_COUNT = sizeof(timeOfDayKeys) / sizeof(timeOfDayKeys[0]);
+
 // Mouse control for FPS camera
 int lastMouseX = 0;
 int lastMouseY = 0;
@@ -49,6 +121,220 @@ bool animationPaused = false;
 
 // Texture loading state
 bool texturesLoaded = false;
+bool headlessMode = false; // --headless: no GLUT window, frames go to disk
+
+// Renderer backend (selectable at runtime with 'R')
+enum RendererMode {
+    RENDERER_FIXED_FUNCTION = 0, // GL_LIGHT0/GL_LIGHT1, per-vertex Gouraud
+    RENDERER_GLSL,               // per-pixel Blinn-Phong shader
+    RENDERER_LIGHTMAP,           // lighting sampled from the baked lightmaps
+    RENDERER_CLUSTERED,          // per-pixel with clustered point light lists
+    RENDERER_DEFERRED,           // G-buffer, then the clustered lights per pixel
+    RENDERER_SOFTWARE,           // tiled CPU rasterizer, the fixed-function model
+    RENDERER_PATH_TRACED,        // progressive CPU path tracer, the reference
+    RENDERER_COUNT
+};
+RendererMode rendererMode = RENDERER_FIXED_FUNCTION;
+const char* rendererNames[RENDERER_COUNT] = {"fixed-function", "GLSL per-pixel", "baked lightmap", "clustered forward", "deferred",
+                                            "software", "path traced"};
+
+// GLSL renderer state
+bool shadersLoaded = false;
+GLuint sceneProgram = 0;
+GLuint lightBlockUBO = 0;
+GLuint materialBlockUBO = 0;
+GLuint activeProgram = 0; // program used by the draw call layer, 0 = fixed-function
+
+// Shadow maps (GLSL renderer only). The room is static, so each map is only
+// re-rendered when its light moves or the scene changes.
+const int SUN_SHADOW_SIZE = 2048;
+const int LAMP_SHADOW_SIZE = 512;
+const float LAMP_SHADOW_FAR = 15.0f;
+bool shadowsEnabled = true;
+GLuint shadowProgram = 0;
+GLuint shadowFBO = 0;
+GLuint sunShadowMaps[TIME_OF_DAY_KEY_COUNT];          // one per key time with the sun up
+GLuint lampShadowMap = 0;
+GLfloat sunShadowMatrices[TIME_OF_DAY_KEY_COUNT][16]; // world -> sun shadow map [0,1] coordinates
+int sunShadowKeys[2] = {3, 3};       // maps of the current time, cross-faded by sunShadowBlend
+float sunShadowBlend = 0.0f;
+struct ShadowCache {
+    bool valid;
+    GLfloat lightPosition[4];
+    int renders;
+    int hits;
+    double lastPassMs;
+};
+ShadowCache sunShadowCaches[TIME_OF_DAY_KEY_COUNT];
+ShadowCache lampShadowCache = {false, {0, 0, 0, 0}, 0, 0, 0.0};
+
+// Baked lightmaps (written by --bake-lightmaps, sampled on texture unit 1)
+const char* LIGHTMAP_DIR = "lightmaps";
+const float LIGHTMAP_DEFAULT_DENSITY = 16.0f; // texels per meter
+const int LIGHTMAP_DEFAULT_SAMPLES = 64;      // bounce paths per texel
+const int LIGHTMAP_BOUNCES = 2;
+bool lightmapsLoaded = false;
+GLuint lightmapProgram = 0;
+GLuint lightmapVBO = 0;
+GLuint lightmapDayTexture = 0;
+GLuint lightmapNightTexture = 0;
+float lightmapDayWeight = 1.0f;               // day bake's share, follows the time of day
+
+// Per-vertex ambient occlusion, baked into the cooked mesh by --bake-ao and
+// applied to the ambient terms of the GLSL renderer
+const char* COOKED_DIR = "cooked";
+const float AO_DEFAULT_MAX_EDGE = 0.25f; // meters, quads are subdivided to this
+const int AO_DEFAULT_RAYS = 64;
+const float AO_DISTANCE = 1.0f;          // occluders further away do not count
+const int AO_ATTRIBUTE_LOCATION = 6;     // clear of the NVIDIA conventional aliases
+bool cookedMeshLoaded = false;
+bool ambientOcclusionEnabled = true;
+GLuint cookedMeshVBO = 0;
+
+// Lights, shadows and color output shared by the lit fragment shaders
+const char* SHADER_LIGHTING_PRELUDE = "shaders/lighting.glsl";
+
+// Linked program binaries, keyed by a hash of the sources, defines and
+// driver; --no-program-cache compiles everything for a cold start timing
+const char* PROGRAM_CACHE_DIR = "shadercache";
+const char PROGRAM_CACHE_MAGIC[4] = {'S', 'P', 'R', 'G'};
+const int PROGRAM_CACHE_VERSION = 1;
+bool programCacheEnabled = true;
+
+// Clustered forward renderer ('N' cycles the light count, 'B' benchmarks)
+const int CLUSTER_TILES_X = 16;
+const int CLUSTER_TILES_Y = 9;
+const int CLUSTER_SLICES = 24;
+const float CLUSTER_NEAR = 0.1f;  // depth range split into exponential slices
+const float CLUSTER_FAR = 20.0f;
+const int CLUSTER_LIGHT_COUNTS[3] = {2, 32, 256}; // sun + desk lamp + extra lights
+int clusterLightCountIndex = 0;
+GLuint clusteredProgram = 0;
+
+// Deferred shading: opaque surfaces go to a compact G-buffer (three 32-bit
+// color targets + 32-bit depth), lit by one full-screen pass with the
+// clustered light lists; blended surfaces are drawn forward on top.
+const int GBUFFER_BYTES_PER_PIXEL = 16;
+GLuint gbufferProgram = 0;
+GLuint deferredProgram = 0;
+struct GBuffer {
+    GLuint fbo;
+    GLuint textures[4];     // albedo, texel, normal, depth (units 7-10 while lighting)
+    int width;
+    int height;
+    GLuint samplesQuery;    // fragments written by the geometry pass
+    bool queryPending;
+    GLuint samplesPassed;   // one frame behind, so reading it never stalls
+    double samplesSum;
+    int frames;
+};
+GBuffer gbuffer = {0, {0, 0, 0, 0}, 0, 0, 0, false, 0, 0.0, 0};
+
+// Transparency stage ('T' cycles the mode): in the sorted and OIT modes the
+// blended draws are taken out of the opaque pass and drawn afterwards; the
+// default keeps the original inline draw order
+enum TransparencyMode {
+    TRANSPARENCY_UNSORTED = 0,  // inline, in draw function order
+    TRANSPARENCY_SORTED,        // back to front by view depth every frame
+    TRANSPARENCY_WEIGHTED_OIT,  // weighted blended order-independent
+    TRANSPARENCY_MODE_COUNT
+};
+TransparencyMode transparencyMode = TRANSPARENCY_UNSORTED;
+const char* transparencyModeNames[TRANSPARENCY_MODE_COUNT] = {"unsorted", "sorted", "weighted OIT"};
+GLuint oitProgram = 0;           // scene.frag built with WEIGHTED_OIT
+GLuint oitClusteredProgram = 0;  // clustered.frag built with WEIGHTED_OIT
+GLuint oitCompositeProgram = 0;
+
+// Volumetric sun shaft ('V' cycles off / half / quarter resolution)
+const int VOLUMETRIC_STEPS = 24;
+const float VOLUMETRIC_MAX_DISTANCE = 12.0f; // meters marched at most
+const float VOLUMETRIC_DENSITY = 0.4f;
+int volumetricDivisor = 0;                   // 0 = off, the flat beam
+GLuint volumetricMarchProgram = 0;
+GLuint volumetricUpsampleProgram = 0;
+float dustTime = 0.0f;                       // seconds, advanced by timer()
+
+// HDR pipeline ('H' toggles): the scene renders into a floating point
+// target, a bloom chain runs over it and a filmic curve maps it to the window
+const int BLOOM_LEVELS = 5;                  // each half the size of the previous
+const float BLOOM_THRESHOLD = 1.0f;          // luminance where bloom starts
+const float BLOOM_STRENGTH = 0.5f;
+const float TONEMAP_EXPOSURE = 0.8f;
+const float LAMP_GLOW_HDR_INTENSITY = 6.0f;  // the glow sphere emits above 1.0
+const double POST_BUDGET_MS = 12.0;          // bloom and tone mapping together, llvmpipe
+bool hdrEnabled = false;                     // off keeps the fixed-function look
+GLuint bloomPrefilterProgram = 0;            // bloom_downsample.frag built with PREFILTER
+GLuint bloomDownsampleProgram = 0;
+GLuint bloomUpsampleProgram = 0;
+GLuint tonemapProgram = 0;
+
+// Dynamic resolution ('G' toggles, --frame-target <ms> starts with it on)
+const float DYNAMIC_RESOLUTION_MIN_SCALE = 0.25f;
+const double DYNAMIC_RESOLUTION_SMOOTHING = 0.2;  // weight of the newest frame
+const int DYNAMIC_RESOLUTION_SETTLE_FRAMES = 6;   // after each scale change
+bool dynamicResolutionEnabled = false;
+double dynamicResolutionTargetMs = 33.3;
+
+// Anti-aliasing ('X' cycles the mode)
+enum AntiAliasingMode {
+    AA_OFF = 0,
+    AA_MSAA,          // multisampled scene target, resolved with a blit
+    AA_FXAA,          // post-process edge blur
+    AA_TAA,           // jittered projection, reprojected history
+    AA_MODE_COUNT
+};
+AntiAliasingMode antiAliasingMode = AA_OFF;
+const char* antiAliasingNames[AA_MODE_COUNT] = {"off", "MSAA", "FXAA", "TAA"};
+const int MSAA_SAMPLES = 4;
+const float TAA_BLEND = 0.1f;        // weight of the new frame in the history
+const int TAA_JITTER_PHASES = 8;
+float projectionAspect = (float)WINDOW_WIDTH / WINDOW_HEIGHT;
+GLuint fxaaProgram = 0;
+GLuint taaProgram = 0;
+
+// Frame time statistics, accumulated per renderer and printed periodically
+const int FRAME_STATS_INTERVAL = 120;
+double frameTimeSum[RENDERER_COUNT] = {0.0};
+int frameTimeCount[RENDERER_COUNT] = {0};
+double frameTimeAvg[RENDERER_COUNT] = {0.0};
+int framesSinceReport = 0;
+double lastFrameCpuMs = 0.0;   // display() up to the end of submission
+double lastFrameMs = 0.0;      // including the wait for the GPU
+double lastPresentMs = 0.0;    // when the previous frame was presented
+bool frameStatsEnabled = false; // 'M': fence frames and passes so the report times GPU work
+
+// Draw calls and state changes issued so far (the draw call layer, the
+// vertex buffer batches and the full-screen passes); --benchmark reports
+// them per frame, the perf HUD with the triangles and scene texture binds
+long drawCallCount = 0;
+long stateChangeCount = 0;
+long triangleCount = 0;
+long textureBindCount = 0;
+bool deterministicFrames = false; // --benchmark: no adaptation to measured times
+bool passTimingFences = true;     // glFinish around timed passes, off for --benchmark
+const int TRACE_DEFAULT_FRAMES = 60; // frames a GL trace capture ('F', --trace) records
+
+// GPU timer queries ('Q'): one scope per render pass and per draw function,
+// read back a few frames late so the CPU never waits on them
+enum GpuPass {
+    GPU_PASS_FRAME = 0,       // whatever no other scope covers (clears, camera)
+    GPU_PASS_SHADOWS,
+    GPU_PASS_LIGHTMAPS,
+    GPU_PASS_COOKED_MESH,
+    GPU_PASS_DEFERRED,
+    GPU_PASS_VOLUMETRIC,
+    GPU_PASS_TRANSPARENCY,
+    GPU_PASS_ANTI_ALIASING,
+    GPU_PASS_RESOLUTION_SCALE,
+    GPU_PASS_HDR_POST,
+    GPU_PASS_HUD,
+    GPU_PASS_COUNT            // draw function scopes follow, in sceneObjects order
+};
+const char* gpuPassNames[GPU_PASS_COUNT] = {"frame (other)", "shadow maps", "baked lightmaps", "cooked mesh",
+                                            "deferred", "volumetric", "transparency", "anti-aliasing",
+                                            "resolution scale", "HDR post", "perf HUD"};
+const int GPU_TIMER_LATENCY = 4;     // frames between issuing and reading a query
+bool gpuTimersEnabled = false;
 
 // Texture IDs
 // Texture IDs
@@ -71,7 +357,34 @@ GLfloat colorGray[4] = {0.4f, 0.4f, 0.4f, 1.0f}; // concrete gray
 // == Function prototypes ==
 void init();
 void display();
+void endFrame(double frameStart);
 void reshape(int w, int h);
+void loadSceneResources();
+void advanceAnimation();
+void requestRedisplay();
+int runHeadless(int argc, char** argv);
+int runBenchmark(int argc, char** argv);
+int runGolden(int argc, char** argv);
+int runBatch(int argc, char** argv);
+size_t preloadTextureCache();
+int runExport(int argc, char** argv);
+void captureExportFrame();
+void finishFrameExport();
+void toggleWindowRecording();
+bool beginTracedPass();
+void endTracedPass();
+void finishTraceFrame();
+void startStartupProfile(const char* tracePath);
+void beginStartupPhase(const char* name);
+void endStartupPhase();
+void timedStartupStep(const char* name, void (*step)());
+void beginFirstDisplayPhase();
+void finishStartupProfile();
+void writeJSONString(FILE* file, const char* text);
+void toggleTraceCapture();
+int runTraceCapture(int argc, char** argv);
+int runTraceReplay(int argc, char** argv);
+int runBench(int argc, char** argv);
 void timer(int value);
 void keyboard(unsigned char key, int x, int y);
 void specialKeys(int key, int x, int y);
@@ -99,18 +412,233 @@ void createCouchTexture();
 void createGlassTexture();
 void createGroundTexture();
 void setupLighting();
+void applyLightPositions();
+void updateTimeOfDay();
+void advanceTimeOfDay(float seconds);
+void printTimeOfDayStats();
 void updateCamera();
+void setupShaders();
+void setupShadowMaps();
+void updateShadowMaps();
+void bindShadowMaps();
+void drawShadowCasters();
+void printShadowStats();
+void updateLightBlock();
+void syncDrawState();
+void recordFrameTime(double ms);
+double nowMs();
+void finishPassTiming();
+void gpuTimerBeginFrame();
+void gpuTimerEndFrame();
+void gpuTimerPush(int scope);
+void gpuTimerPop();
+void setGpuTimers(bool enabled);
+void printGpuTimerStats();
+unsigned int hashBytes(unsigned int hash, const void* data, size_t size);
+void printProgramCacheStats(double setupMs);
+int bakeLightmaps(int samples, int threads, float density);
+int bakeAmbientOcclusion(int rays, int threads, float maxEdge);
+void setupCookedMesh();
+void drawCookedScene();
+void setupLightmaps();
+void drawLightmappedScene();
+GLuint loadProgram(const char* vsPath, const char* fsPath, const char* defines = NULL,
+                   const char* fsPreludePath = NULL);
+void configureSceneProgram(GLuint program);
+void setupClusteredLighting();
+void configureClusterUniforms(GLuint program);
+void updateClusters();
+void bindClusters();
+void setupDeferredShading();
+void renderDeferredScene(bool useCookedMesh);
+double gbufferFrameBytes();
+void printGBufferStats();
+void renderSoftwareFrame();
+void printSoftwareStats();
+void renderPathTracedFrame();
+void printPathTracerStats();
+void toggleConvergenceView();
+void togglePerfHud();
+void drawPerfHud();
+int runReference(int argc, char** argv);
+void drawFullScreenTriangle();
+void setupTransparency();
+void drawTransparentSurfaces();
+void printTransparencyStats();
+bool volumetricLightActive();
+void setupVolumetricLight();
+void renderVolumetricLight();
+void printVolumetricStats();
+bool hdrActive();
+void setupHDR();
+void beginHDRFrame();
+void finishHDRFrame();
+void updatePostBudget();
+void beginScaledFrame(bool hdr);
+void endScaledFrame(bool hdr);
+void setDynamicResolution(bool enabled);
+void updateDynamicResolution(double frameMs);
+void printDynamicResolutionStats();
+void applyProjection(float jitterX, float jitterY);
+void setupAntiAliasing();
+bool antiAliasingModeAvailable(AntiAliasingMode mode);
+void copySceneDepth(GLuint texture, const GLint* viewport);
+void beginAntiAliasedFrame(bool hdr);
+void endAntiAliasedFrame();
+void recordAntiAliasingFrame(double ms);
+bool timingFencesRequested();
+void printAntiAliasingStats();
+void resetAntiAliasingHistory();
+void printClusterStats();
+void startLightBenchmark();
+void advanceLightBenchmark(double frameMs);
 void drawAxes(); // for debugging
 
+// ============================================
+// Scene description
+// ============================================
+// Everything the draw functions emit can be recorded through the draw call
+// layer into this flat, world-space form for the offline tools.
+struct SceneVertex {
+    GLfloat position[3];
+    GLfloat normal[3];
+    GLfloat texCoord[2];
+    GLfloat color[4];
+};
+
+struct SceneDraw {
+    int object;          // index into sceneObjects
+    GLenum primitive;    // GL_TRIANGLES, GL_LINES or GL_POINTS
+    int polygonSides;    // 4 when the triangles came from GL_QUADS
+    GLuint texture;
+    bool textured, lit, blended;
+    GLenum blendSrc, blendDst;
+    bool depthWrite;
+    GLfloat specular[4];
+    GLfloat shininess;
+    int firstVertex;
+    int vertexCount;
+};
+
+struct SceneMesh {
+    std::vector<SceneVertex> vertices;
+    std::vector<SceneDraw> draws;
+};
+
+struct SceneObject {
+    const char* name;
+    void (*draw)();
+    bool castsShadow;
+};
+
+// Draw order of display(); the room shell, carpet and the light effects
+// (window glass, sun shaft) do not cast shadows
+const SceneObject sceneObjects[] = {
+    {"room", drawRoom, false},
+    {"carpet", drawCarpet, false},
+    {"desk", drawDesk, true},
+    {"chair", drawChair, true},
+    {"radio", drawRadio, true},
+    {"books", drawBooks, true},
+    {"window", drawWindow, false},
+    {"sunlight", drawSunlight, false},
+    {"cap and papers", drawCapAndPapers, true},
+    {"shelves", drawShelves, true},
+    {"desk lamp", drawDeskLamp, true},
+    {"documents", drawDocuments, true},
+    {"couch", drawCouch, true},
+};
+const int SCENE_OBJECT_COUNT = sizeof(sceneObjects) / sizeof(sceneObjects[0]);
+
+// Which primitives the draw call layer lets through
+enum DrawFilter {
+    DRAW_ALL = 0,
+    DRAW_OPAQUE,   // deferred geometry pass
+    DRAW_BLENDED   // forward pass over the deferred result
+};
+void resetDrawLayer(bool forwardToGL, SceneMesh* capture, bool skipBaked = false, DrawFilter filter = DRAW_ALL);
+void captureScene(SceneMesh& mesh);
+void drawSceneObjects(bool shadowCastersOnly);
+
 // ============================================
 // Main function
 // ============================================
+// Value following a "--name value" pair on the command line, or NULL
+const char* commandLineOption(int argc, char** argv, const char* name) {
+    for (int i = 1; i + 1 < argc; i++) {
+        if (strcmp(argv[i], name) == 0) return argv[i + 1];
+    }
+    return NULL;
+}
+
+// Creates a directory and any missing parents, like "mkdir -p" but without
+// handing a user-supplied path to the shell. False if a component could not
+// be created or the path exists and is not a directory.
+bool makeDirectories(const char* path) {
+    char partial[512];
+    size_t length = strlen(path);
+    if (length == 0 || length >= sizeof(partial)) return false;
+    memcpy(partial, path, length + 1);
+    for (size_t i = 1; i <= length; i++) {
+        if (partial[i] != '/' && partial[i] != '\0') continue;
+        char saved = partial[i];
+        partial[i] = '\0';
+        if (mkdir(partial, 0755) != 0 && errno != EEXIST) return false;
+        partial[i] = saved;
+    }
+    struct stat info;
+    return stat(path, &info) == 0 && S_ISDIR(info.st_mode);
+}
+
 int main(int argc, char** argv) {
+    startStartupProfile(commandLineOption(argc, argv, "--startup-trace"));
+    // Offline tools run before GLUT so they work without a display
+    int threads = commandLineOption(argc, argv, "--threads") ? atoi(commandLineOption(argc, argv, "--threads")) : 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--bake-lightmaps") == 0) {
+            const char* samples = commandLineOption(argc, argv, "--samples");
+            const char* density = commandLineOption(argc, argv, "--density");
+            return bakeLightmaps(samples ? atoi(samples) : LIGHTMAP_DEFAULT_SAMPLES, threads,
+                                 density ? (float)atof(density) : LIGHTMAP_DEFAULT_DENSITY);
+        }
+        if (strcmp(argv[i], "--bake-ao") == 0) {
+            const char* rays = commandLineOption(argc, argv, "--rays");
+            const char* maxEdge = commandLineOption(argc, argv, "--max-edge");
+            return bakeAmbientOcclusion(rays ? atoi(rays) : AO_DEFAULT_RAYS, threads,
+                                        maxEdge ? (float)atof(maxEdge) : AO_DEFAULT_MAX_EDGE);
+        }
+    }
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--no-program-cache") == 0) programCacheEnabled = false;
+    }
+
+    const char* frameTarget = commandLineOption(argc, argv, "--frame-target");
+    if (frameTarget && atof(frameTarget) > 0.0) {
+        dynamicResolutionTargetMs = atof(frameTarget);
+        setDynamicResolution(true);
+    }
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--benchmark") == 0) return runBenchmark(argc, argv);
+        if (strcmp(argv[i], "--golden") == 0) return runGolden(argc, argv);
+        if (strcmp(argv[i], "--batch") == 0) return runBatch(argc, argv);
+        if (strcmp(argv[i], "--export") == 0) return runExport(argc, argv);
+        if (strcmp(argv[i], "--headless") == 0) return runHeadless(argc, argv);
+        if (strcmp(argv[i], "--reference") == 0) return runReference(argc, argv);
+        if (strcmp(argv[i], "--trace") == 0) return runTraceCapture(argc, argv);
+        if (strcmp(argv[i], "--replay") == 0) return runTraceReplay(argc, argv);
+        if (strcmp(argv[i], "--bench") == 0) return runBench(argc, argv);
+    }
+
+    beginStartupPhase("glutInit");
     glutInit(&argc, argv);
+    endStartupPhase();
+    beginStartupPhase("glutCreateWindow (context)");
     glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGB | GLUT_DEPTH);
     glutInitWindowSize(WINDOW_WIDTH, WINDOW_HEIGHT);
     glutInitWindowPosition(100, 100);
     glutCreateWindow("The Model Worker's Study, 1965");
+    endStartupPhase();
 
     init();
 
@@ -122,6 +650,7 @@ int main(int argc, char** argv) {
     glutMotionFunc(motion);
     glutTimerFunc(16, timer, 0); // 60 fps
 
+    beginStartupPhase("event loop until first display()");
     glutMainLoop();
     return 0;
 }
@@ -130,6 +659,7 @@ int main(int argc, char** argv) {
 // initialization functions
 // ============================================
 void init() {
+    beginStartupPhase("init()");
     glClearColor(0.4f, 0.35f, 0.3f, 1.0f); // warm late afternoon tone
     glEnable(GL_DEPTH_TEST);
     glEnable(GL_LIGHTING);
@@ -141,7 +671,7 @@ void init() {
     glShadeModel(GL_SMOOTH);
 
     // Setup Lighting
-    setupLighting();
+    timedStartupStep("setupLighting()", setupLighting);
 
     // Note: Textures will be loaded on first display call to ensure OpenGL context is ready
 
@@ -149,64 +679,230 @@ void init() {
     printf("\n=========== CONTROLS ===========\n");
     printf("C - Switch camera mode (Orbital/FPS)\n");
     printf("L - Toggle Day/Night (Sun <-> Lamp)\n");
+    printf("Y - Run/stop the day/night cycle\n");
+    printf("R - Switch renderer (Fixed-function/GLSL per-pixel/Baked lightmap/Clustered/Deferred/Software/Path traced)\n");
+    printf("O - Toggle shadow maps (GLSL renderer)\n");
+    printf("K - Toggle baked ambient occlusion (GLSL renderer)\n");
+    printf("N - Cycle light count 2/32/256 (clustered and deferred renderers)\n");
+    printf("T - Cycle transparency (unsorted/sorted/weighted OIT)\n");
+    printf("V - Cycle volumetric sun shaft (off/half/quarter resolution)\n");
+    printf("H - Toggle HDR rendering with bloom and tone mapping\n");
+    printf("X - Cycle anti-aliasing (off/MSAA/FXAA/TAA)\n");
+    printf("G - Toggle dynamic resolution (target %.1f ms, --frame-target <ms>)\n", dynamicResolutionTargetMs);
+    printf("B - Benchmark GLSL vs clustered vs deferred at 2/32/256 lights\n");
+    printf("Q - Toggle GPU timer queries per render pass and draw function\n");
+    printf("M - Toggle fenced frame and pass timing for the periodic statistics\n");
+    printf("P - Start/stop recording the window to capture.y4m\n");
+    printf("E - Toggle the path tracer's convergence view\n");
+    printf("I - Toggle the performance HUD overlay\n");
+    printf("F - Capture a GL trace of the next %d frames to capture.trace\n", TRACE_DEFAULT_FRAMES);
     printf("Arrow Keys - Move camera (FPS mode)\n");
     printf("Mouse Drag - Look around (FPS mode)\n");
     printf("ESC - Exit\n");
     printf("===============================\n\n");
+    endStartupPhase();
 }
-// === Display Function ===
-void display() {
-    // Load textures on first display call (ensures OpenGL context is ready)
+// Textures and GPU resources are created on the first display call, once the
+// OpenGL context is ready (headless mode calls this itself)
+void loadSceneResources() {
     if (!texturesLoaded) {
-        loadTextures();
+        timedStartupStep("loadTextures()", loadTextures);
         texturesLoaded = true;
     }
+    if (!shadersLoaded) {
+        double setupStart = nowMs();
+        timedStartupStep("setupShaders()", setupShaders);
+        timedStartupStep("setupLightmaps()", setupLightmaps);
+        timedStartupStep("setupCookedMesh()", setupCookedMesh);
+        timedStartupStep("setupTransparency()", setupTransparency);
+        timedStartupStep("setupVolumetricLight()", setupVolumetricLight);
+        timedStartupStep("setupHDR()", setupHDR);
+        timedStartupStep("setupAntiAliasing()", setupAntiAliasing);
+        shadersLoaded = true;
+        printProgramCacheStats(nowMs() - setupStart);
+    }
+}
+
+// === Display Function ===
+void display() {
+    beginFirstDisplayPhase();
+    loadSceneResources();
+
+    double frameStart = nowMs();
+    gpuTimerBeginFrame();
+    updateTimeOfDay();
+
+    if (rendererMode == RENDERER_SOFTWARE || rendererMode == RENDERER_PATH_TRACED) {
+        if (rendererMode == RENDERER_SOFTWARE) renderSoftwareFrame(); else renderPathTracedFrame();
+        endFrame(frameStart);
+        return;
+    }
+
+    bool useGLSL = (rendererMode == RENDERER_GLSL && sceneProgram != 0);
+    bool useLightmaps = (rendererMode == RENDERER_LIGHTMAP && lightmapsLoaded);
+    bool useClustered = (rendererMode == RENDERER_CLUSTERED && clusteredProgram != 0);
+    bool useDeferred = (rendererMode == RENDERER_DEFERRED && deferredProgram != 0);
+    bool useCookedMesh = ((useGLSL || useClustered || useDeferred) && cookedMeshLoaded && ambientOcclusionEnabled);
+    if (((useGLSL || useClustered || useDeferred) && shadowsEnabled) || volumetricLightActive()) {
+        gpuTimerPush(GPU_PASS_SHADOWS);
+        updateShadowMaps();
+        gpuTimerPop();
+    }
+    bool hdr = hdrActive();
+    beginScaledFrame(hdr);
+    if (hdr) {
+        beginHDRFrame();
+    }
+    beginAntiAliasedFrame(hdr);
     
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
     glLoadIdentity();
 
     // Update camera postion based on mode
     updateCamera();
+    applyLightPositions();
+
+    // Bind the per-pixel program; light positions are read back from the
+    // fixed-function state so setupLighting() stays the single source of truth
+    if (useGLSL || useClustered) {
+        activeProgram = useClustered ? clusteredProgram : sceneProgram;
+        glUseProgram(activeProgram);
+        updateLightBlock();
+        bindShadowMaps();
+        if (useClustered) {
+            updateClusters();
+            bindClusters();
+        }
+    }
 
-    // Draw the scene
-    drawRoom();
-    drawCarpet();
-    drawDesk();
-    drawChair();
-    drawRadio();
-    drawBooks();
+    // Draw the scene. With baked lightmaps the lit, opaque surfaces come from
+    // one vertex buffer and only the rest goes through the draw functions.
+    bool traced = false;
+    if (useDeferred) {
+        gpuTimerPush(GPU_PASS_DEFERRED);
+        renderDeferredScene(useCookedMesh);
+        gpuTimerPop();
+    } else {
+        if (useLightmaps) {
+            gpuTimerPush(GPU_PASS_LIGHTMAPS);
+            drawLightmappedScene();
+            gpuTimerPop();
+        }
+        if (useCookedMesh) {
+            gpuTimerPush(GPU_PASS_COOKED_MESH);
+            drawCookedScene();
+            gpuTimerPop();
+        }
+        // A recorded frame keeps the blended surfaces in the traced pass
+        traced = beginTracedPass();
+        resetDrawLayer(true, NULL, useLightmaps || useCookedMesh,
+                       transparencyMode == TRANSPARENCY_UNSORTED || traced ? DRAW_ALL : DRAW_OPAQUE);
+        drawSceneObjects(false);
+        endTracedPass();
+    }
+    gpuTimerPush(GPU_PASS_VOLUMETRIC);
+    renderVolumetricLight();
+    gpuTimerPop();
+    if (!traced) {
+        gpuTimerPush(GPU_PASS_TRANSPARENCY);
+        drawTransparentSurfaces();
+        gpuTimerPop();
+    }
     //drawPortrait();
-    drawWindow();
-    drawSunlight();
-    drawCapAndPapers();
-    drawShelves();
-    drawDeskLamp();
-    drawDocuments();
-    drawCouch();
 
     // draw axes for debugging
     // drawAxes();
 
-    glutSwapBuffers();
+    if (activeProgram != 0) {
+        glUseProgram(0);
+        activeProgram = 0;
+    }
+    gpuTimerPush(GPU_PASS_ANTI_ALIASING);
+    endAntiAliasedFrame();
+    gpuTimerPop();
+    gpuTimerPush(GPU_PASS_RESOLUTION_SCALE);
+    endScaledFrame(hdr);
+    gpuTimerPop();
+    if (hdr) {
+        gpuTimerPush(GPU_PASS_HDR_POST);
+        finishHDRFrame();
+        gpuTimerPop();
+    }
+    endFrame(frameStart);
+}
+
+// Presents the frame and feeds its time to the statistics and controllers
+void endFrame(double frameStart) {
+    drawPerfHud();
+    // Submission ends here, before the frame scope's (possibly fenced) end
+    lastFrameCpuMs = nowMs() - frameStart;
+    gpuTimerEndFrame();
+    captureExportFrame();
+    finishTraceFrame();
+
+    if (!headlessMode) {
+        glutSwapBuffers();
+    }
+
+    // When something reads the frame times, wait for the frame so they cover
+    // the GPU work. Otherwise the frame lasts from one present to the next:
+    // the driver's back pressure puts the GPU time in there too, without
+    // serializing the CPU and the GPU every frame.
+    double frameMs;
+    if (timingFencesRequested() || lastPresentMs == 0.0) {
+        glFinish();
+        frameMs = nowMs() - frameStart;
+    } else {
+        frameMs = nowMs() - lastPresentMs;
+    }
+    lastPresentMs = nowMs();
+    lastFrameMs = frameMs;
+    recordFrameTime(frameMs);
+    advanceLightBenchmark(frameMs);
+    updateDynamicResolution(frameMs);
+    recordAntiAliasingFrame(frameMs);
+    finishStartupProfile();
 }
 
 // == Reshape Functon ====
 
 void reshape(int w, int h){
     glViewport(0, 0, w, h);
+    projectionAspect = (float)w / (float)h;
+    applyProjection(0.0f, 0.0f);
+}
+
+// The jitter (in pixels of the current viewport) shifts the whole image by
+// a sub-pixel amount for TAA; it is applied after the perspective divide
+void applyProjection(float jitterX, float jitterY) {
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
     glMatrixMode(GL_PROJECTION);
     glLoadIdentity();
-    gluPerspective(45.0f, (float)w / (float)h, 0.1f, 100.0f);
+    glTranslatef(2.0f * jitterX / viewport[2], 2.0f * jitterY / viewport[3], 0.0f);
+    gluPerspective(45.0f, projectionAspect, 0.1f, 100.0f);
     glMatrixMode(GL_MODELVIEW);
 }
 
 // ==== Timer function ====
-void timer(int value){
+// One 16 ms animation step
+void advanceAnimation() {
     if (!animationPaused){
         // update orbital camera angle
         orbitalAngle += 0.5f;
         if (orbitalAngle > 360.0f) orbitalAngle -= 360.0f;
+        dustTime += 0.016f;
+        advanceTimeOfDay(0.016f);
     }
+}
+
+// GLUT refuses calls without a window, headless frames are drawn in a loop
+void requestRedisplay() {
+    if (!headlessMode) glutPostRedisplay();
+}
+
+void timer(int value){
+    advanceAnimation();
     glutPostRedisplay();
     glutTimerFunc(16, timer, 0);
 }
@@ -215,6 +911,7 @@ void timer(int value){
 void keyboard(unsigned char key, int x, int y) {
     switch(key) {
         case 27: // ESC key
+            finishFrameExport();
             exit(0);
             break;
             
@@ -229,24 +926,144 @@ void keyboard(unsigned char key, int x, int y) {
             }
             break;
             
+        case 'r':
+        case 'R':
+            // Cycle renderer backend, skipping the ones that failed to load
+            do {
+                rendererMode = (RendererMode)((rendererMode + 1) % RENDERER_COUNT);
+            } while ((rendererMode == RENDERER_GLSL && sceneProgram == 0) ||
+                     (rendererMode == RENDERER_LIGHTMAP && !lightmapsLoaded) ||
+                     (rendererMode == RENDERER_CLUSTERED && clusteredProgram == 0) ||
+                     (rendererMode == RENDERER_DEFERRED && deferredProgram == 0));
+            printf("Renderer: %s\n", rendererNames[rendererMode]);
+            break;
+
+        case 'f':
+        case 'F':
+            toggleTraceCapture();
+            break;
+
+        case 'e':
+        case 'E':
+            toggleConvergenceView();
+            break;
+
+        case 'i':
+        case 'I':
+            togglePerfHud();
+            break;
+
+        case 'o':
+        case 'O':
+            shadowsEnabled = !shadowsEnabled;
+            printf("Shadow maps: %s\n", shadowsEnabled ? "ON" : "OFF");
+            break;
+
+        case 'k':
+        case 'K':
+            if (!cookedMeshLoaded) {
+                printf("Ambient occlusion: not baked (run with --bake-ao)\n");
+                break;
+            }
+            ambientOcclusionEnabled = !ambientOcclusionEnabled;
+            printf("Ambient occlusion: %s\n", ambientOcclusionEnabled ? "ON" : "OFF");
+            break;
+
+        case 'n':
+        case 'N':
+            clusterLightCountIndex = (clusterLightCountIndex + 1) % 3;
+            printf("Lights: %d%s\n", CLUSTER_LIGHT_COUNTS[clusterLightCountIndex],
+                   (rendererMode == RENDERER_CLUSTERED || rendererMode == RENDERER_DEFERRED) ? ""
+                   : " (clustered and deferred renderers only)");
+            break;
+
+        case 't':
+        case 'T':
+            do {
+                transparencyMode = (TransparencyMode)((transparencyMode + 1) % TRANSPARENCY_MODE_COUNT);
+            } while (transparencyMode == TRANSPARENCY_WEIGHTED_OIT && oitProgram == 0);
+            printf("Transparency: %s\n", transparencyModeNames[transparencyMode]);
+            break;
+
+        case 'v':
+        case 'V':
+            if (volumetricMarchProgram == 0) {
+                printf("Volumetric sun shaft: unavailable\n");
+                break;
+            }
+            volumetricDivisor = (volumetricDivisor == 0) ? 2 : (volumetricDivisor == 2) ? 4 : 0;
+            if (volumetricDivisor == 0) {
+                printf("Volumetric sun shaft: OFF (flat beam)\n");
+            } else {
+                printf("Volumetric sun shaft: 1/%d resolution\n", volumetricDivisor);
+            }
+            break;
+
+        case 'h':
+        case 'H':
+            if (tonemapProgram == 0) {
+                printf("HDR rendering: unavailable\n");
+                break;
+            }
+            hdrEnabled = !hdrEnabled;
+            printf("HDR rendering: %s\n", hdrEnabled ? "ON (bloom, filmic tone mapping)" : "OFF");
+            break;
+
+        case 'x':
+        case 'X':
+            do {
+                antiAliasingMode = (AntiAliasingMode)((antiAliasingMode + 1) % AA_MODE_COUNT);
+            } while (!antiAliasingModeAvailable(antiAliasingMode));
+            printf("Anti-aliasing: %s\n", antiAliasingNames[antiAliasingMode]);
+            break;
+
+        case 'g':
+        case 'G':
+            setDynamicResolution(!dynamicResolutionEnabled);
+            printf("Dynamic resolution: %s (target %.1f ms)\n", dynamicResolutionEnabled ? "ON" : "OFF",
+                   dynamicResolutionTargetMs);
+            break;
+
+        case 'b':
+        case 'B':
+            startLightBenchmark();
+            break;
+
+        case 'q':
+        case 'Q':
+            setGpuTimers(!gpuTimersEnabled);
+            break;
+
+        case 'p':
+        case 'P':
+            toggleWindowRecording();
+            break;
+
+        case 'm':
+        case 'M':
+            frameStatsEnabled = !frameStatsEnabled;
+            printf("Fenced frame statistics: %s\n", frameStatsEnabled ? "ON" : "OFF");
+            break;
+
         case 'l':
         case 'L':
-            // Toggle Day/Night: daytime -> sun on, lamp off; nighttime -> sun off, lamp on
-            isDaytime = !isDaytime;
-            if (isDaytime) {
-                // Daytime: enable sun, disable desk lamp
-                glEnable(GL_LIGHT0);
-                glDisable(GL_LIGHT1);
-                deskLampLightOn = false;
+            // Toggle Day/Night: glides to the afternoon (sun on, lamp off) or
+            // the night (sun off, lamp on) through the hours between
+            timeOfDayCycle = false;
+            timeOfDayTarget = (timeOfDayTarget == TIME_OF_DAY_DAY) ? TIME_OF_DAY_NIGHT : TIME_OF_DAY_DAY;
+            if (timeOfDayTarget == TIME_OF_DAY_DAY) {
                 printf("Daytime: SUN ON, Lamp OFF\n");
             } else {
-                // Nighttime: disable sun, enable desk lamp
-                glDisable(GL_LIGHT0);
-                glEnable(GL_LIGHT1);
-                deskLampLightOn = true;
                 printf("Nighttime: SUN OFF, Lamp ON\n");
             }
             break;
+
+        case 'y':
+        case 'Y':
+            timeOfDayCycle = !timeOfDayCycle;
+            timeOfDayTarget = timeOfDay;
+            printf("Day/night cycle: %s\n", timeOfDayCycle ? "RUNNING" : "STOPPED");
+            break;
             
         // WASD movement for FPS camera
         case 'w':
@@ -275,7 +1092,7 @@ void keyboard(unsigned char key, int x, int y) {
             break;
     }
     
-    glutPostRedisplay();
+    requestRedisplay();
 }
 // ============= Special Keys (Arrow Keys) =============
 void specialKeys(int key, int x, int y) {
@@ -298,7 +1115,7 @@ void specialKeys(int key, int x, int y) {
         }
     }
     
-    glutPostRedisplay();
+    requestRedisplay();
 }
 
 // ============= Mouse Controls =============
@@ -328,309 +1145,9232 @@ void motion(int x, int y){
         lastMouseX = x;
         lastMouseY = y;
         
-        glutPostRedisplay();
+        requestRedisplay();
+    }
+}
+
+// ============= Time of Day =============
+// The lighting of the current hour, interpolated between the two key times
+// around it. Re-evaluated only when the hour changes, so a still time of
+// day costs nothing per frame.
+struct TimeOfDayState {
+    bool valid;
+    float hour;
+    GLfloat sunPosition[4];
+    GLfloat sunDiffuse[4];
+    GLfloat sunAmbient[4];
+    float sunIntensity;
+    int evaluations;
+    int hits;
+    double evaluateMs;
+};
+TimeOfDayState timeOfDayState = {false, 0.0f, {0, 0, 0, 0}, {0, 0, 0, 1}, {0, 0, 0, 1}, 0.0f, 0, 0, 0.0};
+
+float wrapHour(float hour) {
+    hour = fmodf(hour, 24.0f);
+    return (hour < 0.0f) ? hour + 24.0f : hour;
+}
+
+// Finds the key times around hour (wrapping through midnight) and the
+// smoothed blend from the first to the second
+void findTimeOfDayKeys(float hour, int& first, int& second, float& blend) {
+    first = TIME_OF_DAY_KEY_COUNT - 1;
+    for (int key = 0; key < TIME_OF_DAY_KEY_COUNT; key++) {
+        if (timeOfDayKeys[key].hour <= hour) first = key;
+    }
+    second = (first + 1) % TIME_OF_DAY_KEY_COUNT;
+    float span = wrapHour(timeOfDayKeys[second].hour - timeOfDayKeys[first].hour);
+    float t = wrapHour(hour - timeOfDayKeys[first].hour) / span;
+    blend = t * t * (3.0f - 2.0f * t);
+}
+
+void updateTimeOfDay() {
+    if (timeOfDayState.valid && timeOfDayState.hour == timeOfDay) {
+        timeOfDayState.hits++;
+        return;
+    }
+    double start = nowMs();
+    int first, second;
+    float blend;
+    findTimeOfDayKeys(timeOfDay, first, second, blend);
+    const TimeOfDayKey& a = timeOfDayKeys[first];
+    const TimeOfDayKey& b = timeOfDayKeys[second];
+
+    TimeOfDayState& state = timeOfDayState;
+    state.sunIntensity = a.sunIntensity + (b.sunIntensity - a.sunIntensity) * blend;
+    for (int i = 0; i < 3; i++) {
+        state.sunPosition[i] = a.sunPosition[i] + (b.sunPosition[i] - a.sunPosition[i]) * blend;
+        state.sunDiffuse[i] = state.sunIntensity * (a.sunDiffuse[i] + (b.sunDiffuse[i] - a.sunDiffuse[i]) * blend);
+        state.sunAmbient[i] = state.sunIntensity * (a.sunAmbient[i] + (b.sunAmbient[i] - a.sunAmbient[i]) * blend);
+    }
+    state.sunPosition[3] = 0.0f;
+    deskLampIntensity = a.lampIntensity + (b.lampIntensity - a.lampIntensity) * blend;
+
+    // The fixed-function lights are the source the GLSL renderers read back.
+    // The lamp's colors are scaled here only, the globals stay what the
+    // lightmap baker uses.
+    glLightfv(GL_LIGHT0, GL_DIFFUSE, state.sunDiffuse);
+    glLightfv(GL_LIGHT0, GL_AMBIENT, state.sunAmbient);
+    GLfloat diffuse[4], ambient[4], specular[4];
+    for (int i = 0; i < 4; i++) {
+        float k = (i < 3) ? deskLampIntensity : 1.0f;
+        diffuse[i] = k * deskLampDiffuse[i];
+        ambient[i] = k * deskLampAmbient[i];
+        specular[i] = k * deskLampSpecular[i];
+    }
+    glLightfv(GL_LIGHT1, GL_DIFFUSE, diffuse);
+    glLightfv(GL_LIGHT1, GL_AMBIENT, ambient);
+    glLightfv(GL_LIGHT1, GL_SPECULAR, specular);
+    isDaytime = state.sunIntensity > 0.0f;
+    deskLampLightOn = deskLampIntensity > 0.0f;
+    if (isDaytime) glEnable(GL_LIGHT0); else glDisable(GL_LIGHT0);
+    if (deskLampLightOn) glEnable(GL_LIGHT1); else glDisable(GL_LIGHT1);
+
+    // Sun shadows cross-fade between the maps rendered at the key times; a
+    // key with the sun down borrows its neighbour's map
+    if (a.sunIntensity <= 0.0f) first = second;
+    if (b.sunIntensity <= 0.0f) second = first;
+    sunShadowKeys[0] = first;
+    sunShadowKeys[1] = second;
+    sunShadowBlend = (first == second) ? 0.0f : blend;
+
+    // Only day and night are baked, so the lightmaps are weighted by how
+    // much of the light comes from the sun
+    float total = state.sunIntensity + deskLampIntensity;
+    lightmapDayWeight = (total > 0.0f) ? state.sunIntensity / total : 0.0f;
+
+    state.valid = true;
+    state.hour = timeOfDay;
+    state.evaluations++;
+    state.evaluateMs += nowMs() - start;
+}
+
+// Moves the hour on by the running cycle, or toward the target set with 'L'
+// along the shorter way around the clock
+void advanceTimeOfDay(float seconds) {
+    if (timeOfDayCycle) {
+        timeOfDay = wrapHour(timeOfDay + TIME_OF_DAY_CYCLE_SPEED * seconds);
+        return;
+    }
+    float remaining = wrapHour(timeOfDayTarget - timeOfDay);
+    if (remaining == 0.0f) return;
+    float step = TIME_OF_DAY_TRANSITION_SPEED * seconds;
+    if (remaining > 12.0f) {
+        timeOfDay = (24.0f - remaining <= step) ? timeOfDayTarget : wrapHour(timeOfDay - step);
+    } else {
+        timeOfDay = (remaining <= step) ? timeOfDayTarget : wrapHour(timeOfDay + step);
+    }
+}
+
+void printTimeOfDayStats() {
+    TimeOfDayState& state = timeOfDayState;
+    if (state.evaluations == 0) return;
+    printf("Time of day: %02d:%02d, sun %.2f, lamp %.2f, shadow maps %d/%d blend %.2f, "
+           "lightmap day %.2f | %d evaluations (%.3f ms avg), %d cached frames\n",
+           (int)state.hour, (int)(fmodf(state.hour, 1.0f) * 60.0f), state.sunIntensity, deskLampIntensity,
+           sunShadowKeys[0], sunShadowKeys[1], sunShadowBlend, lightmapDayWeight,
+           state.evaluations, state.evaluateMs / state.evaluations, state.hits);
+    state.evaluations = 0;
+    state.hits = 0;
+    state.evaluateMs = 0.0;
+}
+
+// ===== Lighting Setup ==================
+void setupLighting(){
+    // Enable Lighting
+    glEnable(GL_LIGHTING);
+
+    // light 0: warm window light (late afternoon sun)
+    glLightfv(GL_LIGHT0, GL_POSITION, sunPosition);
+    glLightfv(GL_LIGHT0, GL_DIFFUSE, sunDiffuse);
+    glLightfv(GL_LIGHT0, GL_AMBIENT, sunAmbient);
+    glLightf(GL_LIGHT0, GL_CONSTANT_ATTENUATION, 1.0f);
+    if (isDaytime) glEnable(GL_LIGHT0); else glDisable(GL_LIGHT0);
+
+    // Light 1: Desk Lamp (Point Light)
+    glLightfv(GL_LIGHT1, GL_POSITION, deskLampPosition);
+    glLightfv(GL_LIGHT1, GL_DIFFUSE, deskLampDiffuse);
+    glLightfv(GL_LIGHT1, GL_AMBIENT, deskLampAmbient);
+    glLightfv(GL_LIGHT1, GL_SPECULAR, deskLampSpecular);
+    glLightf(GL_LIGHT1, GL_CONSTANT_ATTENUATION, deskLampAttenuation[0]);
+    glLightf(GL_LIGHT1, GL_LINEAR_ATTENUATION, deskLampAttenuation[1]);
+    glLightf(GL_LIGHT1, GL_QUADRATIC_ATTENUATION, deskLampAttenuation[2]);
+    if (!isDaytime) glEnable(GL_LIGHT1); else glDisable(GL_LIGHT1);
+
+    // Light 2: General ambient light - brighter for late afternoon
+    glLightModelfv(GL_LIGHT_MODEL_AMBIENT, globalAmbient);
+
+}
+
+// Light positions are transformed by the modelview at the time they are set,
+// so they are re-applied after the camera to keep them fixed in the room
+void applyLightPositions() {
+    glLightfv(GL_LIGHT0, GL_POSITION, timeOfDayState.valid ? timeOfDayState.sunPosition : sunPosition);
+    glLightfv(GL_LIGHT1, GL_POSITION, deskLampPosition);
+}
+
+// ====== Camera Update =======
+void updateCamera() {
+    if (cameraMode) {
+        // FPS Camera Mode
+        glRotatef(cameraAngleX, 1.0f, 0.0f, 0.0f);
+        glRotatef(cameraAngleY, 0.0f, 1.0f, 0.0f);
+        glTranslatef(-cameraPosX, -cameraPosY, -cameraPosZ);
+    } else {
+        // Orbital Camera Mode (orbit inside the room)
+        float angleRad = orbitalAngle * M_PI / 180.0f;
+        // Keep orbit radius within room bounds so camera stays inside
+        float maxRadius = 3.5f;
+        float radius = fminf(cameraDistance, maxRadius);
+        float camX = radius * sinf(angleRad);
+        float camZ = radius * cosf(angleRad);
+        float camY = 2.2f; // eye height inside room
+        gluLookAt(camX, camY, camZ,
+                  0.0f, 1.2f, 0.0f,
+                  0.0f, 1.0f, 0.0f);
+    }
+}
+
+// ============= Frame Statistics =============
+double nowMs() {
+    using namespace std::chrono;
+    return duration<double, std::milli>(steady_clock::now().time_since_epoch()).count();
+}
+
+// Waits for the GPU so the pass it ends (or starts) is timed on its own,
+// but only while something reads the pass times. The benchmark turns these
+// off, passes then overlap as they would without the per-pass statistics
+// and only whole frames are timed.
+void finishPassTiming() {
+    if (passTimingFences && timingFencesRequested()) glFinish();
+}
+
+// Accumulates frame times for the active renderer and prints the rolling
+// averages of every renderer that has been measured, so switching with 'R'
+// gives a side by side comparison.
+void recordFrameTime(double ms) {
+    frameTimeSum[rendererMode] += ms;
+    frameTimeCount[rendererMode]++;
+    if (++framesSinceReport < FRAME_STATS_INTERVAL) return;
+    framesSinceReport = 0;
+
+    printf("Frame time%s:", timingFencesRequested() ? "" : " (present to present, 'M' fences)");
+    for (int i = 0; i < RENDERER_COUNT; i++) {
+        if (frameTimeCount[i] > 0) {
+            frameTimeAvg[i] = frameTimeSum[i] / frameTimeCount[i];
+            frameTimeSum[i] = 0.0;
+            frameTimeCount[i] = 0;
+        }
+        if (frameTimeAvg[i] > 0.0) {
+            printf(" %s %.2f ms%s", rendererNames[i], frameTimeAvg[i], (i == rendererMode) ? " (active)" : "");
+        } else {
+            printf(" %s n/a", rendererNames[i]);
+        }
+        if (i + 1 < RENDERER_COUNT) printf(" |");
+    }
+    printf("\n");
+
+    bool perPixel = (rendererMode == RENDERER_GLSL || rendererMode == RENDERER_CLUSTERED ||
+                     rendererMode == RENDERER_DEFERRED);
+    if (perPixel && shadowsEnabled) {
+        printShadowStats();
+    }
+    if (rendererMode == RENDERER_CLUSTERED || rendererMode == RENDERER_DEFERRED) {
+        printClusterStats();
+    }
+    if (rendererMode == RENDERER_DEFERRED) {
+        printGBufferStats();
+    }
+    if (rendererMode == RENDERER_SOFTWARE) {
+        printSoftwareStats();
+    }
+    if (rendererMode == RENDERER_PATH_TRACED) {
+        printPathTracerStats();
+    }
+    if (transparencyMode != TRANSPARENCY_UNSORTED) {
+        printTransparencyStats();
+    }
+    if (volumetricLightActive() && isDaytime) {
+        printVolumetricStats();
+    }
+    printTimeOfDayStats();
+    if (hdrActive()) {
+        updatePostBudget();
+    }
+    if (dynamicResolutionEnabled) {
+        printDynamicResolutionStats();
+    }
+    printAntiAliasingStats();
+    if (gpuTimersEnabled) {
+        printGpuTimerStats();
+    }
+}
+
+// ============= Startup Profiler =============
+// Startup is recorded as nested phases from the top of main() to the end of
+// the first frame (glutInit, the context, init(), each texture's read,
+// decode and mipmap build, the GPU setup in the first display() and that
+// frame's rendering up to glFinish). Time to first frame is printed with
+// the phases sorted by their own time (less their children's); headless
+// modes print it only when --startup-trace PATH asks for the phases as a
+// Chrome trace (chrome://tracing or ui.perfetto.dev). After the first frame
+// the phase calls do nothing.
+const int STARTUP_REPORT_PHASES = 15;
+
+struct StartupPhase {
+    char name[64];
+    double startMs;
+    double durationMs;
+    int depth;
+};
+
+struct StartupProfile {
+    double originMs;
+    std::vector<StartupPhase> phases;
+    std::vector<int> open;   // indices of the phases still running, innermost last
+    bool finished;
+    double firstFrameMs;     // time to first frame
+    const char* tracePath;
+};
+StartupProfile startupProfile = {0.0, std::vector<StartupPhase>(), std::vector<int>(), false, 0.0, NULL};
+
+// Phases are timed from here, the top of main()
+void startStartupProfile(const char* tracePath) {
+    startupProfile.originMs = nowMs();
+    startupProfile.tracePath = tracePath;
+}
+
+void beginStartupPhase(const char* name) {
+    if (startupProfile.finished) return;
+    StartupPhase phase;
+    snprintf(phase.name, sizeof(phase.name), "%s", name);
+    phase.startMs = nowMs() - startupProfile.originMs;
+    phase.durationMs = 0.0;
+    phase.depth = (int)startupProfile.open.size();
+    startupProfile.open.push_back((int)startupProfile.phases.size());
+    startupProfile.phases.push_back(phase);
+}
+
+void endStartupPhase() {
+    if (startupProfile.finished || startupProfile.open.empty()) return;
+    StartupPhase& phase = startupProfile.phases[startupProfile.open.back()];
+    phase.durationMs = nowMs() - startupProfile.originMs - phase.startMs;
+    startupProfile.open.pop_back();
+}
+
+// Complete ("X") events on one thread; the viewer nests them by time
+bool writeStartupTrace(const char* path) {
+    FILE* file = fopen(path, "w");
+    if (!file) return false;
+    fprintf(file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    fprintf(file, "  {\"name\": \"time to first frame\", \"ph\": \"X\", \"pid\": 1, \"tid\": 1, \"ts\": 0, "
+            "\"dur\": %.0f}", startupProfile.firstFrameMs * 1000.0);
+    for (size_t i = 0; i < startupProfile.phases.size(); i++) {
+        const StartupPhase& phase = startupProfile.phases[i];
+        fprintf(file, ",\n  {\"name\": ");
+        writeJSONString(file, phase.name);
+        fprintf(file, ", \"ph\": \"X\", \"pid\": 1, \"tid\": 1, \"ts\": %.0f, \"dur\": %.0f}",
+                phase.startMs * 1000.0, phase.durationMs * 1000.0);
+    }
+    fprintf(file, "\n]}\n");
+    fclose(file);
+    return true;
+}
+
+void timedStartupStep(const char* name, void (*step)()) {
+    beginStartupPhase(name);
+    step();
+    endStartupPhase();
+}
+
+// Whatever led up to the first display() (the GLUT event loop mapping the
+// window, say) ends here
+void beginFirstDisplayPhase() {
+    if (startupProfile.finished) return;
+    while (!startupProfile.open.empty()) endStartupPhase();
+    beginStartupPhase("first display()");
+}
+
+bool compareStartupSelfTime(const std::pair<double, int>& a, const std::pair<double, int>& b) {
+    return a.first > b.first;
+}
+
+// Called at the end of the first frame
+void finishStartupProfile() {
+    if (startupProfile.finished) return;
+    while (!startupProfile.open.empty()) endStartupPhase();
+    startupProfile.firstFrameMs = nowMs() - startupProfile.originMs;
+    startupProfile.finished = true;
+    if (headlessMode && !startupProfile.tracePath) return;
+
+    // Own time: the phase less its direct children
+    const std::vector<StartupPhase>& phases = startupProfile.phases;
+    std::vector<double> selfMs(phases.size());
+    std::vector<int> parents;
+    for (size_t i = 0; i < phases.size(); i++) {
+        selfMs[i] = phases[i].durationMs;
+        parents.resize(phases[i].depth);
+        if (!parents.empty()) selfMs[parents.back()] -= phases[i].durationMs;
+        parents.push_back((int)i);
+    }
+    std::vector<std::pair<double, int> > order;
+    double tracked = 0.0;
+    for (size_t i = 0; i < phases.size(); i++) {
+        order.push_back(std::make_pair(selfMs[i], (int)i));
+        tracked += selfMs[i];
+    }
+    std::sort(order.begin(), order.end(), compareStartupSelfTime);
+
+    double total = startupProfile.firstFrameMs;
+    printf("Time to first frame: %.1f ms (%d phases, %.1f ms outside them)\n", total, (int)phases.size(),
+           total - tracked);
+    printf("  %9s %9s %6s  phase\n", "self ms", "total ms", "%");
+    for (size_t i = 0; i < order.size() && (int)i < STARTUP_REPORT_PHASES; i++) {
+        const StartupPhase& phase = phases[order[i].second];
+        printf("  %9.1f %9.1f %5.1f%%  %s\n", order[i].first, phase.durationMs,
+               total > 0.0 ? 100.0 * order[i].first / total : 0.0, phase.name);
+    }
+    if ((int)order.size() > STARTUP_REPORT_PHASES) {
+        printf("  (%d shorter phases)\n", (int)order.size() - STARTUP_REPORT_PHASES);
+    }
+    if (startupProfile.tracePath) {
+        bool written = writeStartupTrace(startupProfile.tracePath);
+        printf("Startup trace %s %s\n", written ? "written to" : "failed to write", startupProfile.tracePath);
+    }
+}
+
+// ============= GPU Timing =============
+// GL_TIME_ELAPSED queries cannot nest, so scopes form a stack: pushing one
+// ends the running query and starts the child's, popping resumes the
+// parent in a new query. Every scope's time is therefore exclusive, and a
+// draw function's total covers all of its passes (shadow, G-buffer, main).
+// Each frame's queries are read back GPU_TIMER_LATENCY frames later, by
+// which time the GPU has long finished them.
+//
+// llvmpipe bins draws and rasterizes them only when the commands are
+// flushed, and its elapsed-time queries cover the binning alone (a scope
+// of 20 full-screen quads reads 0.4 ms against 80 ms of wall time, even
+// with glFinish inside the query). There the scopes are fenced instead:
+// every boundary waits with glFinish and the CPU clock times the segment.
+const int GPU_TIMER_SCOPE_COUNT = GPU_PASS_COUNT + SCENE_OBJECT_COUNT;
+const int GPU_TIMER_MAX_DEPTH = 8;
+
+struct GpuTimerFrame {
+    std::vector<GLuint> queries;  // pool, grown on demand and reused
+    std::vector<int> scopes;      // scope of each used query
+    size_t used;
+};
+
+struct GpuTimerState {
+    bool checked;
+    bool supported;
+    bool fenced;                  // glFinish + CPU clock at every boundary
+    double segmentStart;          // fenced mode
+    GpuTimerFrame frames[GPU_TIMER_LATENCY];
+    int frame;
+    int stack[GPU_TIMER_MAX_DEPTH];
+    int depth;
+    double sumMs[GPU_TIMER_SCOPE_COUNT];
+    int sampledFrames;
+    int stalls;                   // frames dropped because their results were not ready yet
+    bool frameOnly;               // one scope per frame (--benchmark)
+    int skipped;                  // pushes ignored by frameOnly, still to pop
+    std::vector<double>* frameLog; // each read back frame's total, in order
+    double averageMs[GPU_TIMER_SCOPE_COUNT]; // per frame, as last reported
+};
+GpuTimerState gpuTimers;
+
+// The perf HUD also wants the CPU side of every scope: the same stack, timed
+// with the CPU clock and without fences, so it is submission time. Kept
+// whenever the HUD is on, with or without the GPU timers.
+struct CpuScopeTimes {
+    bool enabled;
+    int stack[GPU_TIMER_MAX_DEPTH];
+    int depth;
+    int skipped;
+    double segmentStart;
+    double sumMs[GPU_TIMER_SCOPE_COUNT];
+};
+CpuScopeTimes cpuScopes;
+
+void chargeCpuScope() {
+    double now = nowMs();
+    if (cpuScopes.depth > 0) cpuScopes.sumMs[cpuScopes.stack[cpuScopes.depth - 1]] += now - cpuScopes.segmentStart;
+    cpuScopes.segmentStart = now;
+}
+
+void cpuScopePush(int scope) {
+    if (!cpuScopes.enabled) return;
+    if (cpuScopes.depth == GPU_TIMER_MAX_DEPTH) {
+        cpuScopes.skipped++;
+        return;
+    }
+    chargeCpuScope();
+    cpuScopes.stack[cpuScopes.depth++] = scope;
+}
+
+void cpuScopePop() {
+    if (!cpuScopes.enabled || cpuScopes.depth == 0) return;
+    if (cpuScopes.skipped > 0) {
+        cpuScopes.skipped--;
+        return;
+    }
+    chargeCpuScope();
+    cpuScopes.depth--;
+}
+
+const char* gpuTimerScopeName(int scope) {
+    return (scope < GPU_PASS_COUNT) ? gpuPassNames[scope] : sceneObjects[scope - GPU_PASS_COUNT].name;
+}
+
+void startGpuTimerQuery(int scope) {
+    if (gpuTimers.fenced) {
+        gpuTimers.segmentStart = nowMs();
+        return;
+    }
+    GpuTimerFrame& frame = gpuTimers.frames[gpuTimers.frame];
+    if (frame.used == frame.queries.size()) {
+        GLuint query;
+        glGenQueries(1, &query);
+        frame.queries.push_back(query);
+        frame.scopes.push_back(0);
+    }
+    frame.scopes[frame.used] = scope;
+    glBeginQuery(GL_TIME_ELAPSED, frame.queries[frame.used++]);
+}
+
+// Adds the results of the frame recorded in this slot GPU_TIMER_LATENCY
+// frames ago to the sums, before its queries are reused. A frame whose last
+// query is not ready yet is dropped rather than waited for, unless wait is
+// set (draining at the end of a measurement)
+void collectGpuTimerFrame(GpuTimerFrame& frame, bool wait) {
+    if (frame.used == 0) return;
+    GLint available = GL_FALSE;
+    if (!wait) glGetQueryObjectiv(frame.queries[frame.used - 1], GL_QUERY_RESULT_AVAILABLE, &available);
+    if (!wait && !available) {
+        gpuTimers.stalls++;
+        frame.used = 0;
+        return;
+    }
+    double frameMs = 0.0;
+    for (size_t i = 0; i < frame.used; i++) {
+        GLuint64 ns = 0;
+        glGetQueryObjectui64v(frame.queries[i], GL_QUERY_RESULT, &ns);
+        gpuTimers.sumMs[frame.scopes[i]] += ns / 1.0e6;
+        frameMs += ns / 1.0e6;
+    }
+    if (gpuTimers.frameLog) gpuTimers.frameLog->push_back(frameMs);
+    gpuTimers.sampledFrames++;
+    frame.used = 0;
+}
+
+void endGpuTimerQuery() {
+    if (gpuTimers.fenced) {
+        glFinish();
+        double ms = nowMs() - gpuTimers.segmentStart;
+        gpuTimers.sumMs[gpuTimers.stack[gpuTimers.depth - 1]] += ms;
+        if (gpuTimers.frameLog) gpuTimers.frameLog->back() += ms;
+        return;
+    }
+    glEndQuery(GL_TIME_ELAPSED);
+}
+
+void gpuTimerPush(int scope) {
+    cpuScopePush(scope);
+    if (!gpuTimersEnabled) return;
+    if (gpuTimers.depth == GPU_TIMER_MAX_DEPTH || (gpuTimers.frameOnly && gpuTimers.depth > 0)) {
+        gpuTimers.skipped++;
+        return;
+    }
+    if (gpuTimers.depth > 0) endGpuTimerQuery();
+    gpuTimers.stack[gpuTimers.depth++] = scope;
+    startGpuTimerQuery(scope);
+}
+
+void gpuTimerPop() {
+    cpuScopePop();
+    if (!gpuTimersEnabled || gpuTimers.depth == 0) return;
+    if (gpuTimers.skipped > 0) {
+        gpuTimers.skipped--;
+        return;
+    }
+    endGpuTimerQuery();
+    if (--gpuTimers.depth > 0) startGpuTimerQuery(gpuTimers.stack[gpuTimers.depth - 1]);
+}
+
+void gpuTimerBeginFrame() {
+    cpuScopes.depth = 0;
+    cpuScopes.skipped = 0;
+    cpuScopePush(GPU_PASS_FRAME);
+    if (!gpuTimersEnabled) return;
+    if (gpuTimers.fenced) {
+        glFinish();
+        if (gpuTimers.frameLog) gpuTimers.frameLog->push_back(0.0);
+    } else {
+        gpuTimers.frame = (gpuTimers.frame + 1) % GPU_TIMER_LATENCY;
+        collectGpuTimerFrame(gpuTimers.frames[gpuTimers.frame], false);
+    }
+    gpuTimerPush(GPU_PASS_FRAME);
+}
+
+// Reads back the frames still in flight, oldest first
+void gpuTimerDrain() {
+    for (int i = 1; i <= GPU_TIMER_LATENCY; i++) {
+        collectGpuTimerFrame(gpuTimers.frames[(gpuTimers.frame + i) % GPU_TIMER_LATENCY], true);
+    }
+}
+
+void gpuTimerEndFrame() {
+    while (cpuScopes.depth > 0) cpuScopePop();
+    if (!gpuTimersEnabled) return;
+    while (gpuTimers.depth > 0) gpuTimerPop();
+    if (gpuTimers.fenced) gpuTimers.sampledFrames++;
+}
+
+void setGpuTimers(bool enabled) {
+    if (enabled && !gpuTimers.checked) {
+        gpuTimers.checked = true;
+        GLint bits = 0;
+        glGetQueryiv(GL_TIME_ELAPSED, GL_QUERY_COUNTER_BITS, &bits);
+        gpuTimers.supported = bits > 0;
+        const char* renderer = (const char*)glGetString(GL_RENDERER);
+        gpuTimers.fenced = renderer && strstr(renderer, "llvmpipe");
+    }
+    if (enabled && !gpuTimers.supported) {
+        printf("GPU timer queries not supported by the driver\n");
+        return;
+    }
+    if (enabled && gpuTimers.fenced) {
+        printf("llvmpipe rasterizes at flush time: scopes are fenced with glFinish and timed on the CPU\n");
+    }
+    // Results still in flight are dropped, the next interval starts clean
+    for (int i = 0; i < GPU_TIMER_LATENCY; i++) gpuTimers.frames[i].used = 0;
+    for (int i = 0; i < GPU_TIMER_SCOPE_COUNT; i++) gpuTimers.sumMs[i] = gpuTimers.averageMs[i] = 0.0;
+    gpuTimers.sampledFrames = 0;
+    gpuTimers.stalls = 0;
+    gpuTimers.depth = 0;
+    gpuTimers.skipped = 0;
+    gpuTimersEnabled = enabled;
+    printf("GPU timers: %s\n", enabled ? "ON" : "OFF");
+}
+
+bool compareGpuTimerScopes(int a, int b) {
+    return gpuTimers.sumMs[a] > gpuTimers.sumMs[b];
+}
+
+// Averages since the last report, most expensive scope first
+void printGpuTimerStats() {
+    if (gpuTimers.sampledFrames == 0) return;
+    int order[GPU_TIMER_SCOPE_COUNT];
+    double totalMs = 0.0;
+    for (int i = 0; i < GPU_TIMER_SCOPE_COUNT; i++) {
+        order[i] = i;
+        totalMs += gpuTimers.sumMs[i];
+    }
+    std::sort(order, order + GPU_TIMER_SCOPE_COUNT, compareGpuTimerScopes);
+    if (gpuTimers.fenced) {
+        printf("GPU time (fenced): %.2f ms/frame over %d frames\n", totalMs / gpuTimers.sampledFrames,
+               gpuTimers.sampledFrames);
+    } else {
+        printf("GPU time: %.2f ms/frame over %d frames (%d not ready in time, dropped)\n",
+               totalMs / gpuTimers.sampledFrames, gpuTimers.sampledFrames, gpuTimers.stalls);
+    }
+    for (int i = 0; i < GPU_TIMER_SCOPE_COUNT; i++) {
+        gpuTimers.averageMs[i] = gpuTimers.sumMs[i] / gpuTimers.sampledFrames;
+    }
+    for (int i = 0; i < GPU_TIMER_SCOPE_COUNT; i++) {
+        int scope = order[i];
+        if (gpuTimers.sumMs[scope] <= 0.0) break;
+        printf("  %-18s %7.3f ms %5.1f%%\n", gpuTimerScopeName(scope),
+               gpuTimers.sumMs[scope] / gpuTimers.sampledFrames, 100.0 * gpuTimers.sumMs[scope] / totalMs);
+        gpuTimers.sumMs[scope] = 0.0;
+    }
+    gpuTimers.sampledFrames = 0;
+    gpuTimers.stalls = 0;
+}
+
+// ============= Headless Rendering =============
+// --headless renders without a GLUT window or an X server: a surfaceless
+// EGL context (Mesa's EGL_MESA_platform_surfaceless, or the first EGL
+// device) draws into an FBO of any size through the same display(), and
+// each frame is written to disk as a binary PPM.
+//   --size WxH      frame size (default the window size)
+//   --frames N      frames to render, one 16 ms animation step apart
+//   --keys KEYS     keyboard presses applied before the first frame
+//   --hour H        time of day to start at
+//   --output DIR    where frame_NNNN.ppm are written (default frames)
+struct HeadlessContext {
+    EGLDisplay display;
+    EGLContext context;
+    EGLSurface surface;   // a 1x1 pbuffer when surfaceless contexts are missing
+    GLuint fbo;
+    GLuint renderbuffers[2];
+};
+
+bool hasExtension(const char* extensions, const char* name) {
+    if (!extensions) return false;
+    size_t length = strlen(name);
+    for (const char* p = strstr(extensions, name); p; p = strstr(p + length, name)) {
+        if ((p == extensions || p[-1] == ' ') && (p[length] == ' ' || p[length] == '\0')) return true;
+    }
+    return false;
+}
+
+EGLDisplay openHeadlessDisplay() {
+    const char* clientExtensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+        (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (getPlatformDisplay && hasExtension(clientExtensions, "EGL_MESA_platform_surfaceless")) {
+        EGLDisplay display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+        if (display != EGL_NO_DISPLAY && eglInitialize(display, NULL, NULL)) return display;
+    }
+    PFNEGLQUERYDEVICESEXTPROC queryDevices = (PFNEGLQUERYDEVICESEXTPROC)eglGetProcAddress("eglQueryDevicesEXT");
+    if (getPlatformDisplay && queryDevices && hasExtension(clientExtensions, "EGL_EXT_platform_device")) {
+        EGLDeviceEXT device;
+        EGLint devices = 0;
+        if (queryDevices(1, &device, &devices) && devices > 0) {
+            EGLDisplay display = getPlatformDisplay(EGL_PLATFORM_DEVICE_EXT, device, NULL);
+            if (display != EGL_NO_DISPLAY && eglInitialize(display, NULL, NULL)) return display;
+        }
+    }
+    return EGL_NO_DISPLAY;
+}
+
+bool openHeadlessContext(HeadlessContext& headless, int width, int height) {
+    headless.display = openHeadlessDisplay();
+    if (headless.display == EGL_NO_DISPLAY) {
+        printf("No display-less EGL platform (surfaceless or device) available\n");
+        return false;
+    }
+    if (!eglBindAPI(EGL_OPENGL_API)) {
+        printf("EGL cannot create desktop OpenGL contexts\n");
+        return false;
+    }
+
+    // The shaders are GLSL 330 compatibility, the scene immediate mode
+    const EGLint contextAttributes[] = {
+        EGL_CONTEXT_MAJOR_VERSION, 3, EGL_CONTEXT_MINOR_VERSION, 3,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_COMPATIBILITY_PROFILE_BIT, EGL_NONE};
+    const char* extensions = eglQueryString(headless.display, EGL_EXTENSIONS);
+    EGLConfig config = (EGLConfig)0;
+    headless.surface = EGL_NO_SURFACE;
+    if (!hasExtension(extensions, "EGL_KHR_no_config_context") ||
+        !hasExtension(extensions, "EGL_KHR_surfaceless_context")) {
+        const EGLint configAttributes[] = {EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+                                           EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE};
+        EGLint configs = 0;
+        if (!eglChooseConfig(headless.display, configAttributes, &config, 1, &configs) || configs == 0) {
+            printf("No EGL config for an OpenGL pbuffer\n");
+            return false;
+        }
+        const EGLint pbufferAttributes[] = {EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE};
+        headless.surface = eglCreatePbufferSurface(headless.display, config, pbufferAttributes);
+    }
+    headless.context = eglCreateContext(headless.display, config, EGL_NO_CONTEXT, contextAttributes);
+    if (headless.context == EGL_NO_CONTEXT ||
+        !eglMakeCurrent(headless.display, headless.surface, headless.surface, headless.context)) {
+        printf("Failed to create an OpenGL 3.3 compatibility context (EGL error 0x%x)\n", eglGetError());
+        return false;
+    }
+
+    // Everything display() draws ends up here instead of the window
+    glGenFramebuffers(1, &headless.fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, headless.fbo);
+    glGenRenderbuffers(2, headless.renderbuffers);
+    glBindRenderbuffer(GL_RENDERBUFFER, headless.renderbuffers[0]);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, headless.renderbuffers[0]);
+    glBindRenderbuffer(GL_RENDERBUFFER, headless.renderbuffers[1]);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, headless.renderbuffers[1]);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        printf("Headless framebuffer %dx%d incomplete\n", width, height);
+        return false;
+    }
+    printf("Headless context: %s, %s\n", (const char*)glGetString(GL_RENDERER), (const char*)glGetString(GL_VERSION));
+    return true;
+}
+
+bool createHeadlessContext(HeadlessContext& headless, int width, int height) {
+    beginStartupPhase("create headless context");
+    bool created = openHeadlessContext(headless, width, height);
+    endStartupPhase();
+    return created;
+}
+
+void destroyHeadlessContext(HeadlessContext& headless) {
+    eglMakeCurrent(headless.display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    if (headless.surface != EGL_NO_SURFACE) eglDestroySurface(headless.display, headless.surface);
+    eglDestroyContext(headless.display, headless.context);
+    eglTerminate(headless.display);
+}
+
+// Reads back the bound framebuffer as RGB, top row first like image files
+void readFramePixels(std::vector<unsigned char>& pixels, int width, int height) {
+    size_t rowBytes = (size_t)width * 3;
+    std::vector<unsigned char> bottomUp(rowBytes * height);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, &bottomUp[0]);
+    pixels.resize(bottomUp.size());
+    for (int y = 0; y < height; y++) {
+        memcpy(&pixels[y * rowBytes], &bottomUp[(height - 1 - y) * rowBytes], rowBytes);
+    }
+}
+
+bool writeFramePPM(const char* path, int width, int height) {
+    std::vector<unsigned char> pixels;
+    readFramePixels(pixels, width, height);
+    FILE* file = fopen(path, "wb");
+    if (!file) return false;
+    fprintf(file, "P6\n%d %d\n255\n", width, height);
+    fwrite(&pixels[0], 1, pixels.size(), file);
+    fclose(file);
+    return true;
+}
+
+struct Crc32Table {
+    unsigned int entries[256];
+    Crc32Table() {
+        for (unsigned int n = 0; n < 256; n++) {
+            unsigned int c = n;
+            for (int k = 0; k < 8; k++) c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            entries[n] = c;
+        }
+    }
+};
+
+unsigned int crc32(unsigned int crc, const unsigned char* data, size_t size) {
+    static const Crc32Table table;
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++) crc = table.entries[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+void appendBigEndian(std::vector<unsigned char>& out, unsigned int value) {
+    for (int shift = 24; shift >= 0; shift -= 8) out.push_back((unsigned char)(value >> shift));
+}
+
+void writePNGChunk(FILE* file, const char* type, const std::vector<unsigned char>& data) {
+    std::vector<unsigned char> chunk;
+    appendBigEndian(chunk, (unsigned int)data.size());
+    chunk.insert(chunk.end(), type, type + 4);
+    chunk.insert(chunk.end(), data.begin(), data.end());
+    appendBigEndian(chunk, crc32(0, &chunk[4], chunk.size() - 4));
+    fwrite(&chunk[0], 1, chunk.size(), file);
+}
+
+// 8-bit RGB PNG, rows top first. The zlib stream uses stored (uncompressed)
+// deflate blocks: the files are test and capture output, not assets, and
+// this way no compression library is needed.
+bool writePNG(const char* path, const unsigned char* rgb, int width, int height) {
+    size_t rowBytes = (size_t)width * 3;
+    std::vector<unsigned char> raw((rowBytes + 1) * height);
+    for (int y = 0; y < height; y++) {
+        raw[y * (rowBytes + 1)] = 0;   // filter type none
+        memcpy(&raw[y * (rowBytes + 1) + 1], rgb + y * rowBytes, rowBytes);
+    }
+
+    std::vector<unsigned char> zlib;
+    zlib.reserve(raw.size() + raw.size() / 65535 * 5 + 16);
+    zlib.push_back(0x78);
+    zlib.push_back(0x01);
+    for (size_t offset = 0; offset < raw.size(); offset += 65535) {
+        unsigned int length = (unsigned int)std::min((size_t)65535, raw.size() - offset);
+        zlib.push_back(offset + length == raw.size() ? 1 : 0);
+        zlib.push_back(length & 0xff);
+        zlib.push_back(length >> 8);
+        zlib.push_back(~length & 0xff);
+        zlib.push_back((~length >> 8) & 0xff);
+        zlib.insert(zlib.end(), raw.begin() + offset, raw.begin() + offset + length);
+    }
+    unsigned int s1 = 1, s2 = 0;
+    for (size_t i = 0; i < raw.size(); i++) {
+        s1 = (s1 + raw[i]) % 65521;
+        s2 = (s2 + s1) % 65521;
+    }
+    appendBigEndian(zlib, (s2 << 16) | s1);
+
+    std::vector<unsigned char> header;
+    appendBigEndian(header, (unsigned int)width);
+    appendBigEndian(header, (unsigned int)height);
+    const unsigned char format[5] = {8, 2, 0, 0, 0};   // 8 bits, RGB, deflate, no interlace
+    header.insert(header.end(), format, format + 5);
+
+    FILE* file = fopen(path, "wb");
+    if (!file) return false;
+    const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    fwrite(signature, 1, sizeof(signature), file);
+    writePNGChunk(file, "IHDR", header);
+    writePNGChunk(file, "IDAT", zlib);
+    writePNGChunk(file, "IEND", std::vector<unsigned char>());
+    bool written = !ferror(file);
+    fclose(file);
+    return written;
+}
+
+int runHeadless(int argc, char** argv) {
+    int width = WINDOW_WIDTH, height = WINDOW_HEIGHT;
+    const char* size = commandLineOption(argc, argv, "--size");
+    if (size && (sscanf(size, "%dx%d", &width, &height) != 2 || width <= 0 || height <= 0)) {
+        printf("--size expects WIDTHxHEIGHT, e.g. 1920x1080\n");
+        return 1;
+    }
+    const char* frameOption = commandLineOption(argc, argv, "--frames");
+    int frames = frameOption ? atoi(frameOption) : 1;
+    const char* keys = commandLineOption(argc, argv, "--keys");
+    const char* hour = commandLineOption(argc, argv, "--hour");
+    const char* output = commandLineOption(argc, argv, "--output");
+    if (!output) output = "frames";
+
+    if (!makeDirectories(output)) {
+        printf("Failed to create %s/\n", output);
+        return 1;
+    }
+
+    headlessMode = true;
+    HeadlessContext headless;
+    if (!createHeadlessContext(headless, width, height)) return 1;
+
+    init();
+    loadSceneResources();
+    reshape(width, height);
+    if (hour) {
+        timeOfDay = timeOfDayTarget = wrapHour((float)atof(hour));
+    }
+    for (const char* key = keys; key && *key; key++) {
+        keyboard((unsigned char)*key, 0, 0);
+    }
+
+    double start = nowMs();
+    for (int frame = 0; frame < frames; frame++) {
+        if (frame > 0) advanceAnimation();
+        display();
+        char path[512];
+        snprintf(path, sizeof(path), "%s/frame_%04d.ppm", output, frame);
+        if (!writeFramePPM(path, width, height)) {
+            printf("Failed to write %s\n", path);
+            destroyHeadlessContext(headless);
+            return 1;
+        }
+    }
+    double totalMs = nowMs() - start;
+    printf("Headless: %d frames at %dx%d written to %s/ in %.1f s (%.1f ms/frame)\n",
+           frames, width, height, output, totalMs / 1000.0, frames > 0 ? totalMs / frames : 0.0);
+    destroyHeadlessContext(headless);
+    return 0;
+}
+
+// ============= Benchmark =============
+// --benchmark renders a fixed number of frames on the headless context as
+// fast as they come, along a scripted FPS camera path driven by a virtual
+// clock (BENCHMARK_FRAME_SECONDS per frame) instead of wall time, so every
+// run draws exactly the same frames. Nothing adapts to measured times while
+// it runs: dynamic resolution is off and the bloom budget is frozen.
+//   --frames N      measured frames (default 600, one trip along the path)
+//   --warmup N      frames rendered first and not measured (default 10)
+//   --size, --keys, --hour as for --headless
+//   --json PATH     where the report goes (default benchmark.json)
+// CPU time is display() up to the end of submission, GPU time the frame's
+// elapsed-time queries (fenced on llvmpipe, see GPU Timing). The report
+// also carries the time to first frame (see Startup Profiler).
+const int BENCHMARK_DEFAULT_FRAMES = 600;
+const int BENCHMARK_DEFAULT_WARMUP = 10;
+const double BENCHMARK_FRAME_SECONDS = 1.0 / 60.0;
+const double BENCHMARK_PATH_SECONDS = 10.0;
+
+struct CameraPathKey {
+    float time;          // fraction of the path
+    float position[3];
+    float angleX;        // pitch, degrees
+    float angleY;        // yaw, degrees
+};
+const CameraPathKey benchmarkPath[] = {
+    {0.0f,  {0.0f, 2.0f, 8.0f},  0.0f,   0.0f},   // the default view
+    {0.25f, {-2.5f, 1.7f, 3.0f}, 5.0f,  -30.0f},  // toward the window
+    {0.5f,  {0.0f, 2.6f, 2.5f},  25.0f,  0.0f},   // down onto the desk
+    {0.75f, {2.5f, 1.7f, 3.0f},  5.0f,   30.0f},  // toward the couch
+    {1.0f,  {0.0f, 2.0f, 8.0f},  0.0f,   0.0f},
+};
+const int BENCHMARK_PATH_KEYS = sizeof(benchmarkPath) / sizeof(benchmarkPath[0]);
+
+void applyBenchmarkCamera(double seconds) {
+    float t = (float)fmod(seconds / BENCHMARK_PATH_SECONDS, 1.0);
+    int key = 0;
+    while (key + 2 < BENCHMARK_PATH_KEYS && benchmarkPath[key + 1].time <= t) key++;
+    const CameraPathKey& a = benchmarkPath[key];
+    const CameraPathKey& b = benchmarkPath[key + 1];
+    float u = (t - a.time) / (b.time - a.time);
+    u = u * u * (3.0f - 2.0f * u);
+    cameraMode = true;
+    cameraPosX = a.position[0] + (b.position[0] - a.position[0]) * u;
+    cameraPosY = a.position[1] + (b.position[1] - a.position[1]) * u;
+    cameraPosZ = a.position[2] + (b.position[2] - a.position[2]) * u;
+    cameraAngleX = a.angleX + (b.angleX - a.angleX) * u;
+    cameraAngleY = a.angleY + (b.angleY - a.angleY) * u;
+}
+
+struct FrameTimeSummary {
+    double min, mean, p50, p95, p99, max, stddev;
+};
+
+// Nearest-rank percentiles, population standard deviation
+FrameTimeSummary summarizeFrameTimes(std::vector<double> values) {
+    FrameTimeSummary summary = {0, 0, 0, 0, 0, 0, 0};
+    if (values.empty()) return summary;
+    std::sort(values.begin(), values.end());
+    double sum = 0.0;
+    for (size_t i = 0; i < values.size(); i++) sum += values[i];
+    size_t n = values.size();
+    summary.min = values[0];
+    summary.mean = sum / n;
+    summary.p50 = values[(size_t)ceil(0.50 * n) - 1];
+    summary.p95 = values[(size_t)ceil(0.95 * n) - 1];
+    summary.p99 = values[(size_t)ceil(0.99 * n) - 1];
+    summary.max = values[n - 1];
+    double squares = 0.0;
+    for (size_t i = 0; i < n; i++) squares += (values[i] - summary.mean) * (values[i] - summary.mean);
+    summary.stddev = sqrt(squares / n);
+    return summary;
+}
+
+// Every series in a report has the same fields:
+//   {"min", "mean", "p50", "p95", "p99", "max", "stddev"}
+void writeFrameTimeJSON(FILE* file, const char* name, const FrameTimeSummary& s, bool last) {
+    fprintf(file, "  \"%s\": {\"min\": %.3f, \"mean\": %.3f, \"p50\": %.3f, \"p95\": %.3f, "
+            "\"p99\": %.3f, \"max\": %.3f, \"stddev\": %.3f}%s\n", name, s.min, s.mean, s.p50, s.p95, s.p99,
+            s.max, s.stddev, last ? "" : ",");
+}
+
+// Renderer strings may hold anything; keep them valid JSON
+void writeJSONString(FILE* file, const char* text) {
+    fputc('"', file);
+    for (const char* c = text ? text : ""; *c; c++) {
+        if (*c == '"' || *c == '\\') fputc('\\', file);
+        if ((unsigned char)*c >= 0x20) fputc(*c, file);
+    }
+    fputc('"', file);
+}
+
+int runBenchmark(int argc, char** argv) {
+    int width = WINDOW_WIDTH, height = WINDOW_HEIGHT;
+    const char* size = commandLineOption(argc, argv, "--size");
+    if (size && (sscanf(size, "%dx%d", &width, &height) != 2 || width <= 0 || height <= 0)) {
+        printf("--size expects WIDTHxHEIGHT, e.g. 1920x1080\n");
+        return 1;
+    }
+    const char* frameOption = commandLineOption(argc, argv, "--frames");
+    const char* warmupOption = commandLineOption(argc, argv, "--warmup");
+    int frames = frameOption ? atoi(frameOption) : BENCHMARK_DEFAULT_FRAMES;
+    int warmup = warmupOption ? atoi(warmupOption) : BENCHMARK_DEFAULT_WARMUP;
+    const char* keys = commandLineOption(argc, argv, "--keys");
+    const char* hour = commandLineOption(argc, argv, "--hour");
+    const char* jsonPath = commandLineOption(argc, argv, "--json");
+    if (!jsonPath) jsonPath = "benchmark.json";
+    if (frames <= 0 || warmup < 0) {
+        printf("--frames must be positive and --warmup not negative\n");
+        return 1;
+    }
+
+    headlessMode = true;
+    deterministicFrames = true;
+    passTimingFences = false;
+    HeadlessContext headless;
+    if (!createHeadlessContext(headless, width, height)) return 1;
+
+    init();
+    loadSceneResources();
+    reshape(width, height);
+    if (hour) {
+        timeOfDay = timeOfDayTarget = wrapHour((float)atof(hour));
+    }
+    for (const char* key = keys; key && *key; key++) {
+        keyboard((unsigned char)*key, 0, 0);
+    }
+    if (dynamicResolutionEnabled) {
+        printf("Benchmark: dynamic resolution turned off, it adapts to measured times\n");
+        setDynamicResolution(false);
+    }
+    if (!gpuTimersEnabled) setGpuTimers(true);
+    gpuTimers.frameOnly = true;
+
+    std::vector<double> cpuMs, gpuMs, frameMs, drawCalls, stateChanges;
+    printf("Benchmark: %d frames (+%d warm-up) at %dx%d, %s\n", frames, warmup, width, height,
+           rendererNames[rendererMode]);
+    for (int frame = 0; frame < warmup + frames; frame++) {
+        bool measured = frame >= warmup;
+        if (frame == warmup) {
+            gpuTimerDrain();
+            gpuTimers.frameLog = &gpuMs;
+        }
+        if (frame > 0) advanceAnimation();
+        applyBenchmarkCamera(frame * BENCHMARK_FRAME_SECONDS);
+        long draws = drawCallCount, changes = stateChangeCount;
+        display();
+        if (!measured) continue;
+        cpuMs.push_back(lastFrameCpuMs);
+        frameMs.push_back(lastFrameMs);
+        drawCalls.push_back((double)(drawCallCount - draws));
+        stateChanges.push_back((double)(stateChangeCount - changes));
+    }
+    gpuTimerDrain();
+    gpuTimers.frameLog = NULL;
+    const char* gpuTiming = gpuTimers.supported ? (gpuTimers.fenced ? "fenced" : "timer_query") : "unavailable";
+
+    FrameTimeSummary cpu = summarizeFrameTimes(cpuMs);
+    FrameTimeSummary gpu = summarizeFrameTimes(gpuMs);
+    FrameTimeSummary total = summarizeFrameTimes(frameMs);
+    FrameTimeSummary draws = summarizeFrameTimes(drawCalls);
+    FrameTimeSummary changes = summarizeFrameTimes(stateChanges);
+
+    FILE* file = fopen(jsonPath, "w");
+    if (!file) {
+        printf("Failed to write %s\n", jsonPath);
+        destroyHeadlessContext(headless);
+        return 1;
+    }
+    fprintf(file, "{\n  \"renderer\": \"%s\",\n  \"gl_renderer\": ", rendererNames[rendererMode]);
+    writeJSONString(file, (const char*)glGetString(GL_RENDERER));
+    fprintf(file, ",\n  \"keys\": ");
+    writeJSONString(file, keys);
+    fprintf(file, ",\n  \"width\": %d,\n  \"height\": %d,\n  \"frames\": %d,\n  \"warmup_frames\": %d,\n",
+            width, height, frames, warmup);
+    fprintf(file, "  \"virtual_frame_seconds\": %.6f,\n  \"gpu_timing\": \"%s\",\n",
+            BENCHMARK_FRAME_SECONDS, gpuTiming);
+    fprintf(file, "  \"time_to_first_frame_ms\": %.1f,\n", startupProfile.firstFrameMs);
+    writeFrameTimeJSON(file, "cpu_ms", cpu, false);
+    writeFrameTimeJSON(file, "gpu_ms", gpu, false);
+    writeFrameTimeJSON(file, "frame_ms", total, false);
+    writeFrameTimeJSON(file, "draw_calls", draws, false);
+    writeFrameTimeJSON(file, "state_changes", changes, true);
+    fprintf(file, "}\n");
+    fclose(file);
+
+    printf("Benchmark (%s GPU timing):\n", gpuTiming);
+    const char* names[3] = {"CPU", "GPU", "frame"};
+    const FrameTimeSummary* rows[3] = {&cpu, &gpu, &total};
+    for (int i = 0; i < 3; i++) {
+        printf("  %-5s min %7.2f  mean %7.2f  p50 %7.2f  p95 %7.2f  p99 %7.2f  max %7.2f  stddev %6.2f ms\n",
+               names[i], rows[i]->min, rows[i]->mean, rows[i]->p50, rows[i]->p95, rows[i]->p99, rows[i]->max,
+               rows[i]->stddev);
+    }
+    printf("  %.1f draw calls, %.1f state changes per frame\n", draws.mean, changes.mean);
+    printf("  time to first frame %.1f ms\n", startupProfile.firstFrameMs);
+    printf("Benchmark report written to %s\n", jsonPath);
+    destroyHeadlessContext(headless);
+    return 0;
+}
+
+// ============= Golden Images =============
+// --golden renders fixed camera poses at the day and the night setting on
+// the headless context and compares each against a reference PNG, so a
+// renderer change that alters the picture does not go unnoticed. Pixels are
+// compared perceptually, by their CIE94 color difference (delta E) in
+// CIELAB, four at a time with SSE. A case fails when more than
+// --max-fraction of its pixels are over --threshold; its render and a
+// heatmap of the differences then go to the output directory. Rendering is
+// serial on the one context, the comparisons run on --threads workers.
+//   --update          store the renders as the new references instead
+//   --reference DIR   where the references are (default golden)
+//   --output DIR      renders and heatmaps of failed cases (default golden_out)
+//   --size WxH        render size (default 300x200)
+//   --keys KEYS       keyboard presses applied first, e.g. a renderer mode
+//   --threshold DE    per-pixel difference that counts (default 2.0)
+//   --max-fraction F  share of pixels allowed over it (default 0.001)
+// The references depend on the GL driver and the keys. golden/ holds a set
+// made with Mesa llvmpipe at the defaults (no keys, 300x200), which that
+// driver reproduces exactly; the default tolerance (delta E 2.0, just over
+// a noticeable difference, on at most 0.1% of the pixels) leaves room for
+// rounding differences between llvmpipe versions and CPU instruction sets.
+// Other drivers need references of their own, made with --update into
+// another --reference directory.
+const int GOLDEN_DEFAULT_WIDTH = 300;
+const int GOLDEN_DEFAULT_HEIGHT = 200;
+const int GOLDEN_SETTLE_FRAMES = 3;   // shadow caches and TAA history fill in
+const float GOLDEN_DEFAULT_THRESHOLD = 2.0f;
+const float GOLDEN_DEFAULT_MAX_FRACTION = 0.001f;
+
+struct GoldenPose {
+    const char* name;
+    float position[3];
+    float angleX;        // pitch, degrees
+    float angleY;        // yaw, degrees
+};
+const GoldenPose goldenPoses[] = {
+    {"overview", {0.0f, 2.0f, 8.0f},  0.0f,   0.0f},
+    {"window",   {-2.5f, 1.7f, 3.0f}, 5.0f,  -30.0f},
+    {"desk",     {0.0f, 2.6f, 2.5f},  25.0f,  0.0f},
+    {"couch",    {2.5f, 1.7f, 3.0f},  5.0f,   30.0f},
+};
+const int GOLDEN_POSE_COUNT = sizeof(goldenPoses) / sizeof(goldenPoses[0]);
+
+struct GoldenCase {
+    char name[64];
+    std::vector<unsigned char> pixels;   // RGB, top row first
+    bool passed;
+    bool missing;                        // no reference of the right size
+    float meanDeltaE;
+    float maxDeltaE;
+    float overFraction;
+};
+
+// sRGB to linear light, indexed by the 8-bit value
+struct SrgbTable {
+    float linear[256];
+    SrgbTable() {
+        for (int i = 0; i < 256; i++) {
+            float c = i / 255.0f;
+            linear[i] = c <= 0.04045f ? c / 12.92f : powf((c + 0.055f) / 1.055f, 2.4f);
+        }
+    }
+};
+
+// CIELAB under D65
+float labF(float t) {
+    return t > 0.008856f ? cbrtf(t) : 7.787f * t + 16.0f / 116.0f;
+}
+
+void srgbToLab(const float* linear, const unsigned char* rgb, float lab[3]) {
+    float r = linear[rgb[0]], g = linear[rgb[1]], b = linear[rgb[2]];
+    float fx = labF((0.4124f * r + 0.3576f * g + 0.1805f * b) / 0.95047f);
+    float fy = labF(0.2126f * r + 0.7152f * g + 0.0722f * b);
+    float fz = labF((0.0193f * r + 0.1192f * g + 0.9505f * b) / 1.08883f);
+    lab[0] = 116.0f * fy - 16.0f;
+    lab[1] = 500.0f * (fx - fy);
+    lab[2] = 200.0f * (fy - fz);
+}
+
+// CIE94 with the graphic arts weights; the reference's chroma sets the scale
+float deltaE94(const float reference[3], const float lab[3]) {
+    float dL = reference[0] - lab[0];
+    float da = reference[1] - lab[1];
+    float db = reference[2] - lab[2];
+    float c1 = sqrtf(reference[1] * reference[1] + reference[2] * reference[2]);
+    float dC = c1 - sqrtf(lab[1] * lab[1] + lab[2] * lab[2]);
+    float dH2 = std::max(0.0f, da * da + db * db - dC * dC);
+    float sC = 1.0f + 0.045f * c1;
+    float sH = 1.0f + 0.015f * c1;
+    return sqrtf(dL * dL + dC * dC / (sC * sC) + dH2 / (sH * sH));
+}
+
+#if defined(__SSE2__)
+// Cube roots of four non-negative values: the exponent divided by three as
+// a first guess, then three Newton steps
+__m128 cbrt4(__m128 x) {
+    const __m128 third = _mm_set1_ps(1.0f / 3.0f);
+    __m128i bits = _mm_cvttps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(_mm_castps_si128(x)), third));
+    __m128 y = _mm_castsi128_ps(_mm_add_epi32(bits, _mm_set1_epi32(709921077)));
+    for (int i = 0; i < 3; i++) {
+        y = _mm_mul_ps(third, _mm_add_ps(_mm_add_ps(y, y), _mm_div_ps(x, _mm_mul_ps(y, y))));
+    }
+    return y;
+}
+
+__m128 labF4(__m128 t) {
+    __m128 cube = _mm_cmpgt_ps(t, _mm_set1_ps(0.008856f));
+    __m128 linear = _mm_add_ps(_mm_mul_ps(t, _mm_set1_ps(7.787f)), _mm_set1_ps(16.0f / 116.0f));
+    return _mm_or_ps(_mm_and_ps(cube, cbrt4(t)), _mm_andnot_ps(cube, linear));
+}
+
+// Four consecutive RGB pixels to L, a and b lanes
+void srgbToLab4(const float* linear, const unsigned char* rgb, __m128 lab[3]) {
+    __m128 r = _mm_setr_ps(linear[rgb[0]], linear[rgb[3]], linear[rgb[6]], linear[rgb[9]]);
+    __m128 g = _mm_setr_ps(linear[rgb[1]], linear[rgb[4]], linear[rgb[7]], linear[rgb[10]]);
+    __m128 b = _mm_setr_ps(linear[rgb[2]], linear[rgb[5]], linear[rgb[8]], linear[rgb[11]]);
+    __m128 x = _mm_add_ps(_mm_add_ps(_mm_mul_ps(r, _mm_set1_ps(0.4124f / 0.95047f)),
+                                     _mm_mul_ps(g, _mm_set1_ps(0.3576f / 0.95047f))),
+                          _mm_mul_ps(b, _mm_set1_ps(0.1805f / 0.95047f)));
+    __m128 y = _mm_add_ps(_mm_add_ps(_mm_mul_ps(r, _mm_set1_ps(0.2126f)), _mm_mul_ps(g, _mm_set1_ps(0.7152f))),
+                          _mm_mul_ps(b, _mm_set1_ps(0.0722f)));
+    __m128 z = _mm_add_ps(_mm_add_ps(_mm_mul_ps(r, _mm_set1_ps(0.0193f / 1.08883f)),
+                                     _mm_mul_ps(g, _mm_set1_ps(0.1192f / 1.08883f))),
+                          _mm_mul_ps(b, _mm_set1_ps(0.9505f / 1.08883f)));
+    __m128 fx = labF4(x), fy = labF4(y), fz = labF4(z);
+    lab[0] = _mm_sub_ps(_mm_mul_ps(fy, _mm_set1_ps(116.0f)), _mm_set1_ps(16.0f));
+    lab[1] = _mm_mul_ps(_mm_sub_ps(fx, fy), _mm_set1_ps(500.0f));
+    lab[2] = _mm_mul_ps(_mm_sub_ps(fy, fz), _mm_set1_ps(200.0f));
+}
+#endif
+
+// Per-pixel CIE94 difference of two RGB images
+void perceptualDifference(const unsigned char* reference, const unsigned char* image, int pixels, float* deltaE) {
+    static const SrgbTable table;
+    int i = 0;
+#if defined(__SSE2__)
+    const __m128 one = _mm_set1_ps(1.0f);
+    for (; i + 4 <= pixels; i += 4) {
+        __m128 ref[3], lab[3];
+        srgbToLab4(table.linear, reference + i * 3, ref);
+        srgbToLab4(table.linear, image + i * 3, lab);
+        __m128 dL = _mm_sub_ps(ref[0], lab[0]);
+        __m128 da = _mm_sub_ps(ref[1], lab[1]);
+        __m128 db = _mm_sub_ps(ref[2], lab[2]);
+        __m128 c1 = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(ref[1], ref[1]), _mm_mul_ps(ref[2], ref[2])));
+        __m128 dC = _mm_sub_ps(c1, _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(lab[1], lab[1]), _mm_mul_ps(lab[2], lab[2]))));
+        __m128 dC2 = _mm_mul_ps(dC, dC);
+        __m128 dH2 = _mm_max_ps(_mm_setzero_ps(),
+                                _mm_sub_ps(_mm_add_ps(_mm_mul_ps(da, da), _mm_mul_ps(db, db)), dC2));
+        __m128 sC = _mm_add_ps(one, _mm_mul_ps(c1, _mm_set1_ps(0.045f)));
+        __m128 sH = _mm_add_ps(one, _mm_mul_ps(c1, _mm_set1_ps(0.015f)));
+        __m128 sum = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dL, dL), _mm_div_ps(dC2, _mm_mul_ps(sC, sC))),
+                                _mm_div_ps(dH2, _mm_mul_ps(sH, sH)));
+        _mm_storeu_ps(deltaE + i, _mm_sqrt_ps(sum));
+    }
+#endif
+    for (; i < pixels; i++) {
+        float ref[3], lab[3];
+        srgbToLab(table.linear, reference + i * 3, ref);
+        srgbToLab(table.linear, image + i * 3, lab);
+        deltaE[i] = deltaE94(ref, lab);
+    }
+}
+
+// Under the threshold the reference shows through as dim gray; over it the
+// difference runs from blue through red to yellow at four times the threshold
+void heatmapColor(const unsigned char* reference, float deltaE, float threshold, unsigned char* out) {
+    if (deltaE <= threshold) {
+        unsigned char gray = (unsigned char)((reference[0] * 54 + reference[1] * 183 + reference[2] * 19) >> 10);
+        out[0] = out[1] = out[2] = gray;
+        return;
+    }
+    float t = std::min(1.0f, (deltaE - threshold) / (3.0f * threshold));
+    float r = t < 0.5f ? 2.0f * t : 1.0f;
+    float g = t < 0.5f ? 0.0f : 2.0f * t - 1.0f;
+    float b = t < 0.5f ? 1.0f - 2.0f * t : 0.0f;
+    out[0] = (unsigned char)(r * 255.0f);
+    out[1] = (unsigned char)(g * 255.0f);
+    out[2] = (unsigned char)(b * 255.0f);
+}
+
+struct GoldenContext {
+    std::vector<GoldenCase>* cases;
+    int width, height;
+    bool update;
+    const char* reference;
+    const char* output;
+    float threshold;
+    float maxFraction;
+    std::atomic<int> nextCase;
+};
+
+void compareGoldenCase(const GoldenContext& ctx, GoldenCase& golden, std::vector<float>& deltaE) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s.png", ctx.reference, golden.name);
+    if (ctx.update) {
+        golden.passed = writePNG(path, &golden.pixels[0], ctx.width, ctx.height);
+        return;
+    }
+
+    int width = 0, height = 0, channels = 0;
+    unsigned char* reference = stbi_load(path, &width, &height, &channels, 3);
+    int pixels = ctx.width * ctx.height;
+    if (reference && width == ctx.width && height == ctx.height) {
+        deltaE.resize(pixels);
+        perceptualDifference(reference, &golden.pixels[0], pixels, &deltaE[0]);
+        double sum = 0.0;
+        int over = 0;
+        for (int i = 0; i < pixels; i++) {
+            sum += deltaE[i];
+            golden.maxDeltaE = std::max(golden.maxDeltaE, deltaE[i]);
+            if (deltaE[i] > ctx.threshold) over++;
+        }
+        golden.meanDeltaE = (float)(sum / pixels);
+        golden.overFraction = (float)over / pixels;
+        golden.passed = golden.overFraction <= ctx.maxFraction;
+    } else {
+        golden.missing = true;
+    }
+
+    if (!golden.passed) {
+        snprintf(path, sizeof(path), "%s/%s.png", ctx.output, golden.name);
+        writePNG(path, &golden.pixels[0], ctx.width, ctx.height);
+    }
+    if (!golden.passed && !golden.missing) {
+        std::vector<unsigned char> heatmap((size_t)pixels * 3);
+        for (int i = 0; i < pixels; i++) {
+            heatmapColor(&reference[i * 3], deltaE[i], ctx.threshold, &heatmap[i * 3]);
+        }
+        snprintf(path, sizeof(path), "%s/%s_diff.png", ctx.output, golden.name);
+        writePNG(path, &heatmap[0], ctx.width, ctx.height);
+    }
+    if (reference) stbi_image_free(reference);
+}
+
+void goldenWorker(GoldenContext* ctx) {
+    std::vector<float> deltaE;
+    int count = (int)ctx->cases->size();
+    for (int i = ctx->nextCase++; i < count; i = ctx->nextCase++) {
+        compareGoldenCase(*ctx, (*ctx->cases)[i], deltaE);
+    }
+}
+
+int runGolden(int argc, char** argv) {
+    int width = GOLDEN_DEFAULT_WIDTH, height = GOLDEN_DEFAULT_HEIGHT;
+    const char* size = commandLineOption(argc, argv, "--size");
+    if (size && (sscanf(size, "%dx%d", &width, &height) != 2 || width <= 0 || height <= 0)) {
+        printf("--size expects WIDTHxHEIGHT, e.g. 300x200\n");
+        return 1;
+    }
+    bool update = false;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--update") == 0) update = true;
+    }
+    const char* keys = commandLineOption(argc, argv, "--keys");
+    const char* reference = commandLineOption(argc, argv, "--reference");
+    const char* output = commandLineOption(argc, argv, "--output");
+    const char* threshold = commandLineOption(argc, argv, "--threshold");
+    const char* maxFraction = commandLineOption(argc, argv, "--max-fraction");
+    const char* threadOption = commandLineOption(argc, argv, "--threads");
+    if (!reference) reference = "golden";
+    if (!output) output = "golden_out";
+    int threads = threadOption ? atoi(threadOption) : 0;
+    if (threads <= 0) threads = std::max(1u, std::thread::hardware_concurrency());
+
+    if (!makeDirectories(update ? reference : output)) {
+        printf("Failed to create %s/\n", update ? reference : output);
+        return 1;
+    }
+
+    headlessMode = true;
+    deterministicFrames = true;
+    HeadlessContext headless;
+    if (!createHeadlessContext(headless, width, height)) return 1;
+
+    init();
+    loadSceneResources();
+    reshape(width, height);
+    for (const char* key = keys; key && *key; key++) {
+        keyboard((unsigned char)*key, 0, 0);
+    }
+    if (dynamicResolutionEnabled) setDynamicResolution(false);
+
+    const float hours[2] = {TIME_OF_DAY_DAY, TIME_OF_DAY_NIGHT};
+    const char* hourNames[2] = {"day", "night"};
+    std::vector<GoldenCase> cases(GOLDEN_POSE_COUNT * 2);
+    double start = nowMs();
+    for (int pose = 0; pose < GOLDEN_POSE_COUNT; pose++) {
+        for (int h = 0; h < 2; h++) {
+            GoldenCase& golden = cases[pose * 2 + h];
+            snprintf(golden.name, sizeof(golden.name), "%s_%s", goldenPoses[pose].name, hourNames[h]);
+            golden.passed = golden.missing = false;
+            golden.meanDeltaE = golden.maxDeltaE = golden.overFraction = 0.0f;
+
+            timeOfDay = timeOfDayTarget = hours[h];
+            cameraMode = true;
+            cameraPosX = goldenPoses[pose].position[0];
+            cameraPosY = goldenPoses[pose].position[1];
+            cameraPosZ = goldenPoses[pose].position[2];
+            cameraAngleX = goldenPoses[pose].angleX;
+            cameraAngleY = goldenPoses[pose].angleY;
+            // Every case starts from a cut, so none depends on the one before
+            resetAntiAliasingHistory();
+            for (int frame = 0; frame < GOLDEN_SETTLE_FRAMES; frame++) display();
+            readFramePixels(golden.pixels, width, height);
+        }
+    }
+    double renderMs = nowMs() - start;
+    destroyHeadlessContext(headless);
+
+    start = nowMs();
+    GoldenContext ctx;
+    ctx.cases = &cases;
+    ctx.width = width;
+    ctx.height = height;
+    ctx.update = update;
+    ctx.reference = reference;
+    ctx.output = output;
+    ctx.threshold = threshold ? (float)atof(threshold) : GOLDEN_DEFAULT_THRESHOLD;
+    ctx.maxFraction = maxFraction ? (float)atof(maxFraction) : GOLDEN_DEFAULT_MAX_FRACTION;
+    ctx.nextCase = 0;
+    threads = std::min(threads, (int)cases.size());
+    std::vector<std::thread> workers;
+    for (int i = 0; i < threads; i++) workers.push_back(std::thread(goldenWorker, &ctx));
+    for (size_t i = 0; i < workers.size(); i++) workers[i].join();
+    double compareMs = nowMs() - start;
+
+    int failed = 0;
+    for (size_t i = 0; i < cases.size(); i++) {
+        const GoldenCase& golden = cases[i];
+        if (!golden.passed) failed++;
+        if (update) {
+            printf("  %-16s %s\n", golden.name, golden.passed ? "stored" : "FAILED to write");
+        } else if (golden.missing) {
+            printf("  %-16s MISSING reference %s/%s.png (%dx%d)\n", golden.name, reference, golden.name,
+                   width, height);
+        } else {
+            printf("  %-16s %s  mean dE %5.2f  max dE %6.2f  %6.3f%% over %.1f\n", golden.name,
+                   golden.passed ? "pass" : "FAIL", golden.meanDeltaE, golden.maxDeltaE,
+                   golden.overFraction * 100.0f, ctx.threshold);
+        }
+    }
+    printf("Golden: %d cases at %dx%d rendered in %.1f s, %s in %.0f ms on %d threads\n", (int)cases.size(),
+           width, height, renderMs / 1000.0, update ? "stored" : "compared", compareMs, threads);
+    if (update) {
+        printf("Golden: references written to %s/\n", reference);
+    } else if (failed > 0) {
+        printf("Golden: %d of %d cases FAILED, renders and heatmaps in %s/\n", failed, (int)cases.size(), output);
+    } else {
+        printf("Golden: all %d cases match\n", (int)cases.size());
+    }
+    return failed > 0 ? 1 : 0;
+}
+
+// ============= Batch Rendering =============
+// --batch FILE renders every view listed in FILE to a numbered image. The
+// renderer keeps its GL state in globals, so the pool of headless contexts
+// is a pool of processes: the texture files are decoded once, then
+// --workers children are forked, each creating its own EGL context and
+// uploading from the decoded pixels it shares copy-on-write with the
+// others. Workers take the next view from a counter in shared memory until
+// the list is done, so a slow view does not hold up a fixed share.
+// A view is one line "x y z pitch yaw hour": FPS camera position, angles in
+// degrees and the time of day, which sets the sun, lamp and sky. '#' starts
+// a comment.
+//   --workers N     contexts rendering at once (default one per core)
+//   --size WxH      image size (default the window size)
+//   --keys KEYS     keyboard presses applied in every worker first
+//   --settle N      frames drawn before the one kept, for TAA (default 0)
+//   --format F      png or ppm (default png)
+//   --output DIR    where view_NNNN.png are written (default batch)
+const int BATCH_MAX_WORKERS = 64;
+
+struct BatchView {
+    float position[3];
+    float angleX;
+    float angleY;
+    float hour;
+};
+
+// Lives in a MAP_SHARED mapping so the workers see one counter
+struct BatchShared {
+    std::atomic<int> nextView;
+    int rendered[BATCH_MAX_WORKERS];
+    int failed[BATCH_MAX_WORKERS];
+    double startupMs[BATCH_MAX_WORKERS];
+    double renderMs[BATCH_MAX_WORKERS];
+};
+
+struct BatchOptions {
+    int width, height;
+    int settle;
+    bool png;
+    const char* keys;
+    const char* output;
+};
+
+bool readBatchViews(const char* path, std::vector<BatchView>& views) {
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        printf("Failed to open %s\n", path);
+        return false;
+    }
+    char line[512];
+    int lineNumber = 0;
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), file)) {
+        lineNumber++;
+        char* comment = strchr(line, '#');
+        if (comment) *comment = '\0';
+        char rest[2];
+        BatchView view;
+        int fields = sscanf(line, "%f %f %f %f %f %f %1s", &view.position[0], &view.position[1],
+                            &view.position[2], &view.angleX, &view.angleY, &view.hour, rest);
+        if (fields == 6) {
+            view.hour = wrapHour(view.hour);
+            views.push_back(view);
+        } else if (fields != EOF) {
+            printf("%s:%d: expected \"x y z pitch yaw hour\"\n", path, lineNumber);
+            ok = false;
+        }
+    }
+    fclose(file);
+    return ok;
+}
+
+// Runs in a forked child; the return value is its exit status
+int runBatchWorker(int worker, BatchShared* shared, const std::vector<BatchView>& views,
+                   const BatchOptions& options) {
+    double start = nowMs();
+    HeadlessContext headless;
+    if (!createHeadlessContext(headless, options.width, options.height)) return 1;
+    init();
+    loadSceneResources();
+    reshape(options.width, options.height);
+    for (const char* key = options.keys; key && *key; key++) {
+        keyboard((unsigned char)*key, 0, 0);
+    }
+    if (dynamicResolutionEnabled) setDynamicResolution(false);
+    shared->startupMs[worker] = nowMs() - start;
+
+    start = nowMs();
+    std::vector<unsigned char> pixels;
+    char path[512];
+    int count = (int)views.size();
+    for (int v = shared->nextView++; v < count; v = shared->nextView++) {
+        const BatchView& view = views[v];
+        timeOfDay = timeOfDayTarget = view.hour;
+        cameraMode = true;
+        cameraPosX = view.position[0];
+        cameraPosY = view.position[1];
+        cameraPosZ = view.position[2];
+        cameraAngleX = view.angleX;
+        cameraAngleY = view.angleY;
+        resetAntiAliasingHistory();
+        for (int frame = 0; frame <= options.settle; frame++) display();
+
+        bool written;
+        if (options.png) {
+            readFramePixels(pixels, options.width, options.height);
+            snprintf(path, sizeof(path), "%s/view_%04d.png", options.output, v);
+            written = writePNG(path, &pixels[0], options.width, options.height);
+        } else {
+            snprintf(path, sizeof(path), "%s/view_%04d.ppm", options.output, v);
+            written = writeFramePPM(path, options.width, options.height);
+        }
+        if (written) {
+            shared->rendered[worker]++;
+        } else {
+            printf("Failed to write %s\n", path);
+            shared->failed[worker]++;
+        }
+    }
+    shared->renderMs[worker] = nowMs() - start;
+    destroyHeadlessContext(headless);
+    return 0;
+}
+
+int runBatch(int argc, char** argv) {
+    const char* listPath = commandLineOption(argc, argv, "--batch");
+    BatchOptions options;
+    options.width = WINDOW_WIDTH;
+    options.height = WINDOW_HEIGHT;
+    const char* size = commandLineOption(argc, argv, "--size");
+    if (size && (sscanf(size, "%dx%d", &options.width, &options.height) != 2 ||
+                 options.width <= 0 || options.height <= 0)) {
+        printf("--size expects WIDTHxHEIGHT, e.g. 1920x1080\n");
+        return 1;
+    }
+    const char* settle = commandLineOption(argc, argv, "--settle");
+    const char* format = commandLineOption(argc, argv, "--format");
+    const char* workerOption = commandLineOption(argc, argv, "--workers");
+    options.settle = settle ? std::max(0, atoi(settle)) : 0;
+    options.png = !format || strcmp(format, "ppm") != 0;
+    options.keys = commandLineOption(argc, argv, "--keys");
+    options.output = commandLineOption(argc, argv, "--output");
+    if (!options.output) options.output = "batch";
+    if (!listPath) {
+        printf("--batch expects a file of views, one \"x y z pitch yaw hour\" per line\n");
+        return 1;
+    }
+
+    std::vector<BatchView> views;
+    if (!readBatchViews(listPath, views)) return 1;
+    if (views.empty()) {
+        printf("No views in %s\n", listPath);
+        return 1;
+    }
+    int workers = workerOption ? atoi(workerOption) : 0;
+    if (workers <= 0) workers = std::max(1u, std::thread::hardware_concurrency());
+    workers = std::min(workers, std::min((int)views.size(), BATCH_MAX_WORKERS));
+
+    if (!makeDirectories(options.output)) {
+        printf("Failed to create %s/\n", options.output);
+        return 1;
+    }
+
+    double start = nowMs();
+    size_t textureBytes = preloadTextureCache();
+    printf("Batch: %d views, textures decoded once (%.1f MB) in %.0f ms\n", (int)views.size(),
+           textureBytes / (1024.0 * 1024.0), nowMs() - start);
+
+    void* mapping = mmap(NULL, sizeof(BatchShared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED) {
+        printf("Failed to map memory shared with the workers\n");
+        return 1;
+    }
+    BatchShared* shared = new (mapping) BatchShared();
+    shared->nextView = 0;
+    for (int i = 0; i < BATCH_MAX_WORKERS; i++) {
+        shared->rendered[i] = shared->failed[i] = 0;
+        shared->startupMs[i] = shared->renderMs[i] = 0.0;
+    }
+
+    headlessMode = true;
+    deterministicFrames = true;
+    fflush(stdout);
+    std::vector<pid_t> children;
+    for (int worker = 0; worker < workers; worker++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            // One worker's setup log is enough
+            if (worker > 0) freopen("/dev/null", "w", stdout);
+            int status = runBatchWorker(worker, shared, views, options);
+            fflush(stdout);
+            _exit(status);
+        }
+        if (pid < 0) {
+            printf("Failed to start batch worker %d, going on with %d\n", worker, worker);
+            break;
+        }
+        children.push_back(pid);
+    }
+    int crashed = 0;
+    for (size_t i = 0; i < children.size(); i++) {
+        int status = 0;
+        if (waitpid(children[i], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) crashed++;
+    }
+    double totalMs = nowMs() - start;
+
+    int rendered = 0, failed = 0;
+    double steadyRate = 0.0;
+    for (size_t i = 0; i < children.size(); i++) {
+        rendered += shared->rendered[i];
+        failed += shared->failed[i];
+        double rate = shared->renderMs[i] > 0.0 ? shared->rendered[i] * 1000.0 / shared->renderMs[i] : 0.0;
+        steadyRate += rate;
+        printf("  worker %2d: %4d views, startup %6.0f ms, %6.2f frames/s\n", (int)i, shared->rendered[i],
+               shared->startupMs[i], rate);
+    }
+    printf("Batch: %d of %d views at %dx%d written to %s/ in %.1f s with %d contexts: %.2f frames/s "
+           "(%.2f frames/s once started)\n", rendered, (int)views.size(), options.width, options.height,
+           options.output, totalMs / 1000.0, (int)children.size(), rendered * 1000.0 / totalMs, steadyRate);
+    if (crashed > 0) printf("Batch: %d workers failed\n", crashed);
+    munmap(mapping, sizeof(BatchShared));
+    return (rendered == (int)views.size() && failed == 0 && crashed == 0) ? 0 : 1;
+}
+
+// ============= Video Export =============
+// Frames leave the GPU through a ring of pixel pack buffers: a frame's
+// glReadPixels goes into the next buffer of the ring and returns at once,
+// and the buffer is only mapped when the ring comes round to it again,
+// EXPORT_PBO_COUNT - 1 frames later, when the copy has long finished. The
+// mapped pixels are copied out and queued for a writer thread that flips,
+// converts and writes them, so neither readback nor disk holds up the next
+// frame unless the writer falls EXPORT_QUEUE_LIMIT frames behind.
+//   --export PATH   renders the orbital flythrough headless; a PATH ending
+//                   in .y4m or .raw is one video file (raw is rgb24, top row
+//                   first), anything else a directory of frame_NNNN.png
+//   --frames N      frames to export (default 720, one orbit)
+//   --size, --keys, --hour as for --headless
+// In the window, P starts and stops recording to capture.y4m.
+const int EXPORT_PBO_COUNT = 4;
+const int EXPORT_QUEUE_LIMIT = 8;
+const int EXPORT_DEFAULT_FRAMES = 720;
+const int EXPORT_FPS = 60;
+
+enum ExportFormat { EXPORT_RAW, EXPORT_Y4M, EXPORT_PNG };
+
+struct FrameExport {
+    bool active;
+    ExportFormat format;
+    char path[512];
+    int width, height;
+    FILE* file;
+    GLuint pbos[EXPORT_PBO_COUNT];
+    GLsync fences[EXPORT_PBO_COUNT];
+    int next;                  // ring slot the next frame is read into
+    int inFlight;              // slots read into and not mapped yet
+
+    // Frames between the render thread and the writer, bottom row first
+    std::thread writer;
+    std::mutex lock;
+    std::condition_variable wake;
+    std::deque<std::vector<unsigned char>*> queue;
+    std::vector<std::vector<unsigned char>*> spare;
+    bool closing;
+
+    int captured;
+    int written;
+    int mapWaits;              // the oldest copy was still running when mapped
+    int queueWaits;            // rendering waited for the writer
+    bool writeFailed;
+    double startMs;
+    double writeMs;            // writer thread busy time
+};
+FrameExport frameExport;
+
+// Full-range BT.601 4:2:0 planes (Y4M's C420jpeg) from bottom-up RGB;
+// chroma is the average of each 2x2 block. C420jpeg names the chroma siting
+// only, so the header also says XCOLORRANGE=FULL: without it players and
+// encoders take the planes as limited range and crush blacks and whites.
+void rgbToYuv420(const unsigned char* rgb, int width, int height, unsigned char* planes) {
+    int chromaWidth = (width + 1) / 2, chromaHeight = (height + 1) / 2;
+    unsigned char* lumaPlane = planes;
+    unsigned char* cbPlane = planes + (size_t)width * height;
+    unsigned char* crPlane = cbPlane + (size_t)chromaWidth * chromaHeight;
+    for (int y = 0; y < height; y++) {
+        const unsigned char* row = rgb + (size_t)(height - 1 - y) * width * 3;
+        for (int x = 0; x < width; x++) {
+            const unsigned char* p = row + x * 3;
+            lumaPlane[(size_t)y * width + x] = (unsigned char)(0.299f * p[0] + 0.587f * p[1] + 0.114f * p[2] + 0.5f);
+        }
+    }
+    for (int cy = 0; cy < chromaHeight; cy++) {
+        for (int cx = 0; cx < chromaWidth; cx++) {
+            float r = 0.0f, g = 0.0f, b = 0.0f;
+            int samples = 0;
+            for (int y = cy * 2; y < std::min(cy * 2 + 2, height); y++) {
+                for (int x = cx * 2; x < std::min(cx * 2 + 2, width); x++) {
+                    const unsigned char* p = rgb + ((size_t)(height - 1 - y) * width + x) * 3;
+                    r += p[0];
+                    g += p[1];
+                    b += p[2];
+                    samples++;
+                }
+            }
+            r /= samples;
+            g /= samples;
+            b /= samples;
+            size_t index = (size_t)cy * chromaWidth + cx;
+            float cb = 128.0f - 0.168736f * r - 0.331264f * g + 0.5f * b;
+            float cr = 128.0f + 0.5f * r - 0.418688f * g - 0.081312f * b;
+            cbPlane[index] = (unsigned char)std::min(255.0f, std::max(0.0f, cb + 0.5f));
+            crPlane[index] = (unsigned char)std::min(255.0f, std::max(0.0f, cr + 0.5f));
+        }
+    }
+}
+
+bool writeExportFrame(const std::vector<unsigned char>& rgb, int index, std::vector<unsigned char>& scratch) {
+    int width = frameExport.width, height = frameExport.height;
+    size_t rowBytes = (size_t)width * 3;
+    if (frameExport.format == EXPORT_PNG) {
+        scratch.resize(rgb.size());
+        for (int y = 0; y < height; y++) {
+            memcpy(&scratch[y * rowBytes], &rgb[(height - 1 - y) * rowBytes], rowBytes);
+        }
+        char path[600];
+        snprintf(path, sizeof(path), "%s/frame_%04d.png", frameExport.path, index);
+        return writePNG(path, &scratch[0], width, height);
+    }
+    if (frameExport.format == EXPORT_RAW) {
+        for (int y = height - 1; y >= 0; y--) fwrite(&rgb[y * rowBytes], 1, rowBytes, frameExport.file);
+        return !ferror(frameExport.file);
+    }
+    scratch.resize((size_t)width * height + 2 * (size_t)((width + 1) / 2) * ((height + 1) / 2));
+    rgbToYuv420(&rgb[0], width, height, &scratch[0]);
+    fputs("FRAME\n", frameExport.file);
+    fwrite(&scratch[0], 1, scratch.size(), frameExport.file);
+    return !ferror(frameExport.file);
+}
+
+void exportWriter() {
+    std::vector<unsigned char> scratch;
+    for (int index = 0;; index++) {
+        std::vector<unsigned char>* frame;
+        {
+            std::unique_lock<std::mutex> guard(frameExport.lock);
+            while (frameExport.queue.empty() && !frameExport.closing) frameExport.wake.wait(guard);
+            if (frameExport.queue.empty()) return;
+            frame = frameExport.queue.front();
+            frameExport.queue.pop_front();
+        }
+        double start = nowMs();
+        if (!writeExportFrame(*frame, index, scratch)) frameExport.writeFailed = true;
+        frameExport.writeMs += nowMs() - start;
+        {
+            std::lock_guard<std::mutex> guard(frameExport.lock);
+            frameExport.spare.push_back(frame);
+            frameExport.written++;
+        }
+        frameExport.wake.notify_all();
+    }
+}
+
+bool startFrameExport(const char* path, ExportFormat format, int width, int height) {
+    snprintf(frameExport.path, sizeof(frameExport.path), "%s", path);
+    frameExport.format = format;
+    frameExport.width = width;
+    frameExport.height = height;
+    frameExport.file = NULL;
+    if (format == EXPORT_PNG) {
+        if (!makeDirectories(path)) {
+            printf("Failed to create %s/\n", path);
+            return false;
+        }
+    } else {
+        frameExport.file = fopen(path, "wb");
+        if (!frameExport.file) {
+            printf("Failed to write %s\n", path);
+            return false;
+        }
+        if (format == EXPORT_Y4M) {
+            fprintf(frameExport.file, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg XCOLORRANGE=FULL\n",
+                    width, height, EXPORT_FPS);
+        }
+    }
+
+    glGenBuffers(EXPORT_PBO_COUNT, frameExport.pbos);
+    for (int i = 0; i < EXPORT_PBO_COUNT; i++) {
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, frameExport.pbos[i]);
+        glBufferData(GL_PIXEL_PACK_BUFFER, (GLsizeiptr)width * height * 3, NULL, GL_STREAM_READ);
+        frameExport.fences[i] = 0;
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    frameExport.next = frameExport.inFlight = 0;
+    frameExport.captured = frameExport.written = 0;
+    frameExport.mapWaits = frameExport.queueWaits = 0;
+    frameExport.writeFailed = false;
+    frameExport.writeMs = 0.0;
+    frameExport.closing = false;
+    frameExport.startMs = nowMs();
+    frameExport.writer = std::thread(exportWriter);
+    frameExport.active = true;
+    printf("Export: recording %dx%d to %s\n", width, height, path);
+    return true;
+}
+
+// Maps the oldest frame in the ring and queues its pixels for the writer
+void collectExportFrame() {
+    int slot = (frameExport.next - frameExport.inFlight + EXPORT_PBO_COUNT) % EXPORT_PBO_COUNT;
+    if (glClientWaitSync(frameExport.fences[slot], 0, 0) == GL_TIMEOUT_EXPIRED) {
+        frameExport.mapWaits++;
+        glClientWaitSync(frameExport.fences[slot], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000ull);
+    }
+    glDeleteSync(frameExport.fences[slot]);
+    frameExport.fences[slot] = 0;
+
+    std::vector<unsigned char>* frame = NULL;
+    {
+        std::unique_lock<std::mutex> guard(frameExport.lock);
+        if ((int)frameExport.queue.size() >= EXPORT_QUEUE_LIMIT) frameExport.queueWaits++;
+        while ((int)frameExport.queue.size() >= EXPORT_QUEUE_LIMIT) frameExport.wake.wait(guard);
+        if (!frameExport.spare.empty()) {
+            frame = frameExport.spare.back();
+            frameExport.spare.pop_back();
+        }
+    }
+    if (!frame) frame = new std::vector<unsigned char>();
+    size_t bytes = (size_t)frameExport.width * frameExport.height * 3;
+    frame->resize(bytes);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, frameExport.pbos[slot]);
+    const void* pixels = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, bytes, GL_MAP_READ_BIT);
+    if (pixels) {
+        memcpy(&(*frame)[0], pixels, bytes);
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    frameExport.inFlight--;
+    {
+        std::lock_guard<std::mutex> guard(frameExport.lock);
+        frameExport.queue.push_back(frame);
+    }
+    frameExport.wake.notify_all();
+}
+
+void finishFrameExport() {
+    if (!frameExport.active) return;
+    while (frameExport.inFlight > 0) collectExportFrame();
+    {
+        std::lock_guard<std::mutex> guard(frameExport.lock);
+        frameExport.closing = true;
+    }
+    frameExport.wake.notify_all();
+    frameExport.writer.join();
+    double totalMs = nowMs() - frameExport.startMs;
+
+    if (frameExport.file) fclose(frameExport.file);
+    glDeleteBuffers(EXPORT_PBO_COUNT, frameExport.pbos);
+    for (size_t i = 0; i < frameExport.spare.size(); i++) delete frameExport.spare[i];
+    frameExport.spare.clear();
+    frameExport.active = false;
+
+    printf("Export: %d frames at %dx%d written to %s in %.1f s: %.1f frames/s\n", frameExport.written,
+           frameExport.width, frameExport.height, frameExport.path, totalMs / 1000.0,
+           totalMs > 0.0 ? frameExport.written * 1000.0 / totalMs : 0.0);
+    printf("  writer busy %.0f%% (%.1f ms/frame), %d of %d maps waited for the copy, "
+           "rendering waited for the writer %d times\n",
+           totalMs > 0.0 ? frameExport.writeMs * 100.0 / totalMs : 0.0,
+           frameExport.written > 0 ? frameExport.writeMs / frameExport.written : 0.0,
+           frameExport.mapWaits, frameExport.captured, frameExport.queueWaits);
+    if (frameExport.format == EXPORT_RAW) {
+        printf("  play with: ffplay -f rawvideo -pixel_format rgb24 -video_size %dx%d -framerate %d %s\n",
+               frameExport.width, frameExport.height, EXPORT_FPS, frameExport.path);
+    }
+    if (frameExport.writeFailed) printf("Export: some frames FAILED to write\n");
+}
+
+// Called at the end of display(), before the swap; the frame is read from
+// the back buffer or the headless framebuffer
+void captureExportFrame() {
+    if (!frameExport.active) return;
+    if (!headlessMode && (glutGet(GLUT_WINDOW_WIDTH) != frameExport.width ||
+                          glutGet(GLUT_WINDOW_HEIGHT) != frameExport.height)) {
+        printf("Export: window resized, recording stopped\n");
+        finishFrameExport();
+        return;
+    }
+    if (frameExport.inFlight == EXPORT_PBO_COUNT) collectExportFrame();
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, frameExport.pbos[frameExport.next]);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(0, 0, frameExport.width, frameExport.height, GL_RGB, GL_UNSIGNED_BYTE, 0);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    frameExport.fences[frameExport.next] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    frameExport.next = (frameExport.next + 1) % EXPORT_PBO_COUNT;
+    frameExport.inFlight++;
+    frameExport.captured++;
+}
+
+void toggleWindowRecording() {
+    if (frameExport.active) {
+        finishFrameExport();
+    } else {
+        startFrameExport("capture.y4m", EXPORT_Y4M, glutGet(GLUT_WINDOW_WIDTH), glutGet(GLUT_WINDOW_HEIGHT));
+    }
+}
+
+int runExport(int argc, char** argv) {
+    int width = WINDOW_WIDTH, height = WINDOW_HEIGHT;
+    const char* size = commandLineOption(argc, argv, "--size");
+    if (size && (sscanf(size, "%dx%d", &width, &height) != 2 || width <= 0 || height <= 0)) {
+        printf("--size expects WIDTHxHEIGHT, e.g. 1920x1080\n");
+        return 1;
+    }
+    const char* path = commandLineOption(argc, argv, "--export");
+    const char* frameOption = commandLineOption(argc, argv, "--frames");
+    int frames = frameOption ? atoi(frameOption) : EXPORT_DEFAULT_FRAMES;
+    const char* keys = commandLineOption(argc, argv, "--keys");
+    const char* hour = commandLineOption(argc, argv, "--hour");
+    if (!path) {
+        printf("--export expects a .y4m or .raw file or a directory for PNG frames\n");
+        return 1;
+    }
+    size_t length = strlen(path);
+    ExportFormat format = EXPORT_PNG;
+    if (length > 4 && strcmp(path + length - 4, ".y4m") == 0) format = EXPORT_Y4M;
+    if (length > 4 && strcmp(path + length - 4, ".raw") == 0) format = EXPORT_RAW;
+
+    headlessMode = true;
+    HeadlessContext headless;
+    if (!createHeadlessContext(headless, width, height)) return 1;
+    init();
+    loadSceneResources();
+    reshape(width, height);
+    if (hour) {
+        timeOfDay = timeOfDayTarget = wrapHour((float)atof(hour));
+    }
+    for (const char* key = keys; key && *key; key++) {
+        keyboard((unsigned char)*key, 0, 0);
+    }
+    cameraMode = false;   // the orbital flythrough
+    if (!startFrameExport(path, format, width, height)) {
+        destroyHeadlessContext(headless);
+        return 1;
+    }
+
+    double start = nowMs();
+    for (int frame = 0; frame < frames; frame++) {
+        if (frame > 0) advanceAnimation();
+        display();
+    }
+    double renderMs = nowMs() - start;
+    printf("Export: rendering took %.1f s (%.1f frames/s)\n", renderMs / 1000.0,
+           renderMs > 0.0 ? frames * 1000.0 / renderMs : 0.0);
+    finishFrameExport();
+    destroyHeadlessContext(headless);
+    return frameExport.writeFailed ? 1 : 0;
+}
+
+// =========== Texture Loading =======
+// The scene's texture files: loadTextures() creates each one through its
+// create function, the bakers and the headless modes read the same list. In
+// headless mode the texture ids are placeholders, only used to tell the
+// captured draws apart.
+struct SceneTextureFile {
+    const char* path;
+    GLuint* id;
+    bool repeat;
+    void (*create)();
+};
+
+enum SceneTexture {
+    SCENE_TEXTURE_WOOD,
+    SCENE_TEXTURE_PAPER,
+    SCENE_TEXTURE_WALLPAPER,
+    SCENE_TEXTURE_CARPET,
+    SCENE_TEXTURE_COUCH,
+    SCENE_TEXTURE_GLASS,
+    SCENE_TEXTURE_GROUND
+};
+
+const SceneTextureFile sceneTextureFiles[] = {
+    {"textures/wood.jpg", &textureWood, true, createWoodTexture},
+    {"textures/paper.jpg", &texturePaper, false, createPaperTexture},
+    {"textures/wallpaper.jpg", &textureWallpaper, true, createWallpaperTexture},
+    {"textures/carpet.jpg", &textureCarpet, true, createCarpetTexture},
+    {"textures/couch.jpg", &textureCouch, true, createCouchTexture},
+    {"textures/glass.jpg", &textureGlass, false, createGlassTexture},
+    {"textures/ground.jpg", &textureGround, true, createGroundTexture},
+};
+const int SCENE_TEXTURE_COUNT = sizeof(sceneTextureFiles) / sizeof(sceneTextureFiles[0]);
+
+// File name part of a scene texture path, for labels
+const char* sceneTextureName(int index) {
+    const char* slash = strrchr(sceneTextureFiles[index].path, '/');
+    return slash ? slash + 1 : sceneTextureFiles[index].path;
+}
+
+// ============= Texture Loading Function =============
+void loadTextures() {
+    // Ensure OpenGL state is properly set up
+    glViewport(0, 0, WINDOW_WIDTH, WINDOW_HEIGHT);
+    glMatrixMode(GL_PROJECTION);
+    glLoadIdentity();
+    glMatrixMode(GL_MODELVIEW);
+    glLoadIdentity();
+    
+    // Enable texture mapping
+    glEnable(GL_TEXTURE_2D);
+    // Ensure tightly packed rows for stb_image (avoid alignment issues)
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    
+    // Generate texture IDs individually to avoid any accidental index mixups
+    glGenTextures(1, &textureWood);
+    printf("Generated textureWood: %u\n", textureWood);
+    glGenTextures(1, &texturePaper);
+    printf("Generated texturePaper: %u\n", texturePaper);
+    glGenTextures(1, &textureWallpaper);
+    printf("Generated textureWallpaper: %u\n", textureWallpaper);
+    glGenTextures(1, &textureCarpet);
+    printf("Generated textureCarpet: %u\n", textureCarpet);
+    glGenTextures(1, &textureCouch);
+    printf("Generated textureCouch: %u\n", textureCouch);
+    glGenTextures(1, &textureGlass);
+    printf("Generated textureGlass: %u\n", textureGlass);
+    glGenTextures(1, &textureGround);
+    printf("Generated textureGround: %u\n", textureGround);
+    glGenTextures(1, &texturePortrait);
+    printf("Generated texturePortrait: %u\n", texturePortrait);
+
+    // Load textures from files (each function will bind the named texture ID)
+    for (int i = 0; i < SCENE_TEXTURE_COUNT; i++) {
+        char label[64];
+        snprintf(label, sizeof(label), "texture %s", sceneTextureName(i));
+        printf("Loading %s...\n", sceneTextureName(i));
+        timedStartupStep(label, sceneTextureFiles[i].create);
+    }
+    
+    printf("Textures loaded successfully\n");
+}
+
+// ============= Texture Loading Functions =============
+// Decoded texture files by path. Normally an image is decoded when its
+// texture is created and freed right after; with the cache enabled it is
+// kept, and loading the same file again (in a forked batch worker, say)
+// returns the decoded pixels without touching the JPEG.
+struct DecodedTexture {
+    const char* path;
+    int width, height, channels;
+    unsigned char* pixels;
+};
+std::vector<DecodedTexture> decodedTextureCache;
+bool textureCacheEnabled = false;
+
+unsigned char* loadTextureImage(const char* path, int* width, int* height, int* channels) {
+    for (size_t i = 0; i < decodedTextureCache.size(); i++) {
+        const DecodedTexture& cached = decodedTextureCache[i];
+        if (strcmp(cached.path, path) == 0) {
+            *width = cached.width;
+            *height = cached.height;
+            *channels = cached.channels;
+            return cached.pixels;
+        }
+    }
+    // Read and decoded separately so startup can tell disk from decode time
+    char phase[64];
+    snprintf(phase, sizeof(phase), "read %s", path);
+    beginStartupPhase(phase);
+    std::vector<unsigned char> file;
+    FILE* in = fopen(path, "rb");
+    if (in) {
+        unsigned char buffer[65536];
+        size_t got;
+        while ((got = fread(buffer, 1, sizeof(buffer), in)) > 0) file.insert(file.end(), buffer, buffer + got);
+        fclose(in);
+    }
+    endStartupPhase();
+    if (file.empty()) return NULL;
+    snprintf(phase, sizeof(phase), "decode %s", path);
+    beginStartupPhase(phase);
+    unsigned char* image = stbi_load_from_memory(&file[0], (int)file.size(), width, height, channels, 0);
+    endStartupPhase();
+    if (image && textureCacheEnabled) {
+        DecodedTexture cached = {path, *width, *height, *channels, image};
+        decodedTextureCache.push_back(cached);
+    }
+    return image;
+}
+
+void releaseTextureImage(unsigned char* image) {
+    if (!textureCacheEnabled) stbi_image_free(image);
+}
+
+void createWoodTexture() {
+    int width, height, channels;
+    unsigned char *image = loadTextureImage(sceneTextureFiles[SCENE_TEXTURE_WOOD].path, &width, &height, &channels);
+    
+    if (!image) {
+        printf("Failed to load %s texture\n", sceneTextureName(SCENE_TEXTURE_WOOD));
+        return;
+    }
+    
+    glBindTexture(GL_TEXTURE_2D, textureWood);
+    
+    GLenum format = (channels == 4) ? GL_RGBA : GL_RGB;
+    glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, image);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    
+    releaseTextureImage(image);
+    printf("Wood texture loaded (ID: %d)\n", textureWood);
+}
+
+
+void createPaperTexture() {
+    if (texturePaper == 0) {
+        printf("ERROR: texturePaper is 0!\n");
+        return;
+    }
+    
+    int width, height, channels;
+    unsigned char *image = loadTextureImage(sceneTextureFiles[SCENE_TEXTURE_PAPER].path, &width, &height, &channels);
+    
+    if (!image) {
+        printf("Failed to load %s texture\n", sceneTextureName(SCENE_TEXTURE_PAPER));
+        return;
+    }
+    
+    printf("Binding texturePaper (ID: %u), image size: %dx%d, channels: %d\n", texturePaper, width, height, channels);
+    glBindTexture(GL_TEXTURE_2D, texturePaper);
+    
+    GLenum format = (channels == 4) ? GL_RGBA : GL_RGB;
+    // Use mipmap builder which also safely resizes to max texture size if needed
+    if (gluBuild2DMipmaps(GL_TEXTURE_2D, format, width, height, format, GL_UNSIGNED_BYTE, image) != 0) {
+        printf("Failed to build mipmaps for paper texture\n");
+    }
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
+    
+    releaseTextureImage(image);
+    printf("Paper texture loaded (ID: %d)\n", texturePaper);
+}
+
+void createGlassTexture() {
+    int width, height, channels;
+    unsigned char *image = loadTextureImage(sceneTextureFiles[SCENE_TEXTURE_GLASS].path, &width, &height, &channels);
+    
+    if (!image) {
+        printf("Failed to load %s texture\n", sceneTextureName(SCENE_TEXTURE_GLASS));
+        return;
+    }
+    
+    glBindTexture(GL_TEXTURE_2D, textureGlass);
+    
+    GLenum format = (channels == 4) ? GL_RGBA : GL_RGB;
+    gluBuild2DMipmaps(GL_TEXTURE_2D, format, width, height, format, GL_UNSIGNED_BYTE, image);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    
+    releaseTextureImage(image);
+    printf("Glass texture loaded (ID: %d)\n", textureGlass);
+}
+
+void createGroundTexture() {
+    int width, height, channels;
+    unsigned char *image = loadTextureImage(sceneTextureFiles[SCENE_TEXTURE_GROUND].path, &width, &height, &channels);
+    
+    if (!image) {
+        printf("Failed to load %s texture\n", sceneTextureName(SCENE_TEXTURE_GROUND));
+        return;
+    }
+    
+    glBindTexture(GL_TEXTURE_2D, textureGround);
+    
+    GLenum format = (channels == 4) ? GL_RGBA : GL_RGB;
+    gluBuild2DMipmaps(GL_TEXTURE_2D, format, width, height, format, GL_UNSIGNED_BYTE, image);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    
+    releaseTextureImage(image);
+    printf("Ground texture loaded (ID: %d)\n", textureGround);
+}
+
+void createWallpaperTexture() {
+    int width, height, channels;
+    unsigned char *image = loadTextureImage(sceneTextureFiles[SCENE_TEXTURE_WALLPAPER].path, &width, &height, &channels);
+    
+    if (!image) {
+        printf("Failed to load %s texture - using procedural pattern\n", sceneTextureName(SCENE_TEXTURE_WALLPAPER));
+        // Create a simple procedural wallpaper pattern if file doesn't exist
+        glBindTexture(GL_TEXTURE_2D, textureWallpaper);
+        
+        // Create a simple beige/cream colored texture with subtle pattern
+        unsigned char wallpaperData[256 * 256 * 3];
+        for(int y = 0; y < 256; y++) {
+            for(int x = 0; x < 256; x++) {
+                int idx = (y * 256 + x) * 3;
+                // Base cream/beige color
+                wallpaperData[idx + 0] = (unsigned char)(200 + (x % 16) * 2);     // Red
+                wallpaperData[idx + 1] = (unsigned char)(190 + (y % 16));         // Green
+                wallpaperData[idx + 2] = (unsigned char)(170 + ((x+y) % 16));     // Blue
+            }
+        }
+        
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, 256, 256, 0, GL_RGB, GL_UNSIGNED_BYTE, wallpaperData);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+        
+        printf("Procedural wallpaper texture created (ID: %d)\n", textureWallpaper);
+        return;
+    }
+    
+    glBindTexture(GL_TEXTURE_2D, textureWallpaper);
+    
+    GLenum format = (channels == 4) ? GL_RGBA : GL_RGB;
+    gluBuild2DMipmaps(GL_TEXTURE_2D, format, width, height, format, GL_UNSIGNED_BYTE, image);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    
+    releaseTextureImage(image);
+    printf("Wallpaper texture loaded (ID: %d)\n", textureWallpaper);
+}
+
+void createCarpetTexture() {
+    int width, height, channels;
+    unsigned char *image = loadTextureImage(sceneTextureFiles[SCENE_TEXTURE_CARPET].path, &width, &height, &channels);
+    
+    if (!image) {
+        printf("Failed to load %s texture\n", sceneTextureName(SCENE_TEXTURE_CARPET));
+        return;
+    }
+    
+    glBindTexture(GL_TEXTURE_2D, textureCarpet);
+    
+    GLenum format = (channels == 4) ? GL_RGBA : GL_RGB;
+    gluBuild2DMipmaps(GL_TEXTURE_2D, format, width, height, format, GL_UNSIGNED_BYTE, image);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    
+    releaseTextureImage(image);
+    printf("Carpet texture loaded (ID: %d)\n", textureCarpet);
+}
+
+void createCouchTexture() {
+    int width, height, channels;
+    unsigned char *image = loadTextureImage(sceneTextureFiles[SCENE_TEXTURE_COUCH].path, &width, &height, &channels);
+    
+    if (!image) {
+        printf("Failed to load %s texture\n", sceneTextureName(SCENE_TEXTURE_COUCH));
+        return;
+    }
+    
+    glBindTexture(GL_TEXTURE_2D, textureCouch);
+    
+    GLenum format = (channels == 4) ? GL_RGBA : GL_RGB;
+    gluBuild2DMipmaps(GL_TEXTURE_2D, format, width, height, format, GL_UNSIGNED_BYTE, image);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    
+    releaseTextureImage(image);
+    printf("Couch texture loaded (ID: %d)\n", textureCouch);
+}
+
+// ============= Matrix Helpers =============
+// Column-major 4x4 matrices, the same layout glLoadMatrixf/glGetFloatv use
+void identityMatrix(GLfloat* m) {
+    for (int i = 0; i < 16; i++) m[i] = (i % 5 == 0) ? 1.0f : 0.0f;
+}
+
+// out = a * b (out may not alias a or b)
+void multiplyMatrices(const GLfloat* a, const GLfloat* b, GLfloat* out) {
+    for (int col = 0; col < 4; col++) {
+        for (int row = 0; row < 4; row++) {
+            GLfloat sum = 0.0f;
+            for (int k = 0; k < 4; k++) sum += a[k * 4 + row] * b[col * 4 + k];
+            out[col * 4 + row] = sum;
+        }
+    }
+}
+
+// Inverse of a rotation + translation matrix (camera and light views)
+void invertRigidMatrix(const GLfloat* m, GLfloat* out) {
+    for (int row = 0; row < 3; row++) {
+        for (int col = 0; col < 3; col++) out[col * 4 + row] = m[row * 4 + col];
+        out[row * 4 + 3] = 0.0f;
+    }
+    for (int row = 0; row < 3; row++) {
+        out[12 + row] = -(out[row] * m[12] + out[4 + row] * m[13] + out[8 + row] * m[14]);
+    }
+    out[15] = 1.0f;
+}
+
+void lookAtMatrix(const GLfloat* eye, const GLfloat* center, const GLfloat* up, GLfloat* m) {
+    GLfloat f[3] = {center[0] - eye[0], center[1] - eye[1], center[2] - eye[2]};
+    GLfloat fl = sqrtf(f[0] * f[0] + f[1] * f[1] + f[2] * f[2]);
+    for (int i = 0; i < 3; i++) f[i] /= fl;
+    GLfloat side[3] = {f[1] * up[2] - f[2] * up[1], f[2] * up[0] - f[0] * up[2], f[0] * up[1] - f[1] * up[0]};
+    GLfloat sl = sqrtf(side[0] * side[0] + side[1] * side[1] + side[2] * side[2]);
+    for (int i = 0; i < 3; i++) side[i] /= sl;
+    GLfloat u[3] = {side[1] * f[2] - side[2] * f[1], side[2] * f[0] - side[0] * f[2], side[0] * f[1] - side[1] * f[0]};
+
+    identityMatrix(m);
+    for (int i = 0; i < 3; i++) {
+        m[i * 4 + 0] = side[i];
+        m[i * 4 + 1] = u[i];
+        m[i * 4 + 2] = -f[i];
+    }
+    m[12] = -(side[0] * eye[0] + side[1] * eye[1] + side[2] * eye[2]);
+    m[13] = -(u[0] * eye[0] + u[1] * eye[1] + u[2] * eye[2]);
+    m[14] = f[0] * eye[0] + f[1] * eye[1] + f[2] * eye[2];
+}
+
+void perspectiveMatrix(float fovY, float aspect, float zNear, float zFar, GLfloat* m) {
+    float f = 1.0f / tanf(fovY * (float)M_PI / 360.0f);
+    for (int i = 0; i < 16; i++) m[i] = 0.0f;
+    m[0] = f / aspect;
+    m[5] = f;
+    m[10] = (zFar + zNear) / (zNear - zFar);
+    m[11] = -1.0f;
+    m[14] = 2.0f * zFar * zNear / (zNear - zFar);
+}
+
+void orthoMatrix(float left, float right, float bottom, float top, float zNear, float zFar, GLfloat* m) {
+    identityMatrix(m);
+    m[0] = 2.0f / (right - left);
+    m[5] = 2.0f / (top - bottom);
+    m[10] = -2.0f / (zFar - zNear);
+    m[12] = -(right + left) / (right - left);
+    m[13] = -(top + bottom) / (top - bottom);
+    m[14] = -(zFar + zNear) / (zFar - zNear);
+}
+
+void transformPoint(const GLfloat* m, const GLfloat* p, GLfloat* out) {
+    for (int row = 0; row < 3; row++) {
+        out[row] = m[row] * p[0] + m[4 + row] * p[1] + m[8 + row] * p[2] + m[12 + row];
+    }
+}
+
+// ============= GLSL Renderer =============
+// std140 mirrors of the uniform blocks in shaders/scene.frag
+struct LightData {
+    GLfloat position[4];
+    GLfloat ambient[4];
+    GLfloat diffuse[4];
+    GLfloat specular[4];
+    GLfloat attenuation[4]; // constant, linear, quadratic, enabled
+};
+
+struct LightBlockData {
+    GLfloat globalAmbient[4];
+    LightData lights[2];
+};
+
+struct MaterialBlockData {
+    GLfloat specular[4];
+    GLfloat params[4]; // shininess, lighting enabled, texturing enabled, blending
+};
+
+MaterialBlockData materialBlockCache;
+bool materialBlockValid = false;
+
+char* readTextFile(const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (!file) return NULL;
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    char* text = (char*)malloc(size + 1);
+    size_t read = fread(text, 1, size, file);
+    text[read] = '\0';
+    fclose(file);
+    return text;
+}
+
+// defines (e.g. "#define WEIGHTED_OIT\n") go right after the #version line,
+// followed by the shared prelude source, if any
+GLuint compileShader(GLenum type, const char* path, const char* source, const char* defines,
+                     const char* prelude = NULL) {
+    const char* body = strchr(source, '\n');
+    body = body ? body + 1 : source + strlen(source);
+    const GLchar* parts[4] = {source, defines ? defines : "", prelude ? prelude : "", body};
+    GLint lengths[4] = {(GLint)(body - source), -1, -1, -1};
+    GLuint shader = glCreateShader(type);
+    glShaderSource(shader, 4, parts, lengths);
+    glCompileShader(shader);
+
+    GLint ok = GL_FALSE;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+    if (!ok) {
+        char log[2048];
+        glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+        printf("Failed to compile %s:\n%s\n", path, log);
+        glDeleteShader(shader);
+        return 0;
+    }
+    return shader;
+}
+
+// ============= Program Binary Cache =============
+// Linking the programs from source is most of the startup time on Mesa, so
+// the driver's binary of every linked program is kept in PROGRAM_CACHE_DIR
+// and handed back with glProgramBinary on the next start. Any change to a
+// source file, its defines or the driver changes the key; a binary the
+// driver still rejects is dropped and the program compiled again.
+struct ProgramCacheHeader {
+    char magic[4];
+    int version;
+    unsigned int key;
+    GLenum format;
+    GLint length;
+};
+
+struct ProgramCacheStats {
+    bool checked;
+    bool supported;
+    unsigned int driverHash;
+    int hits;
+    int misses;
+    int rejected;
+    int writes;
+    double loadMs;      // hits, including reading the file
+    double compileMs;   // misses, including writing the binary
+};
+ProgramCacheStats programCache = {false, false, 0, 0, 0, 0, 0, 0.0, 0.0};
+
+bool programCacheUsable() {
+    if (!programCache.checked) {
+        programCache.checked = true;
+        GLint formats = 0;
+        glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+        programCache.supported = formats > 0;
+        const GLenum strings[3] = {GL_VENDOR, GL_RENDERER, GL_VERSION};
+        programCache.driverHash = 2166136261u;
+        for (int i = 0; i < 3; i++) {
+            const char* text = (const char*)glGetString(strings[i]);
+            if (text) programCache.driverHash = hashBytes(programCache.driverHash, text, strlen(text));
+        }
+        if (!programCache.supported) printf("Program binaries not supported by the driver, cache disabled\n");
+    }
+    return programCacheEnabled && programCache.supported;
+}
+
+void programCachePath(unsigned int key, char* path, size_t size) {
+    snprintf(path, size, "%s/%08x.bin", PROGRAM_CACHE_DIR, key);
+}
+
+GLuint loadCachedProgram(unsigned int key) {
+    char path[256];
+    programCachePath(key, path, sizeof(path));
+    FILE* file = fopen(path, "rb");
+    if (!file) return 0;
+    ProgramCacheHeader header;
+    std::vector<char> binary;
+    bool complete = fread(&header, sizeof(header), 1, file) == 1 &&
+                    memcmp(header.magic, PROGRAM_CACHE_MAGIC, sizeof(header.magic)) == 0 &&
+                    header.version == PROGRAM_CACHE_VERSION && header.key == key && header.length > 0;
+    if (complete) {
+        binary.resize(header.length);
+        complete = fread(&binary[0], 1, binary.size(), file) == binary.size();
+    }
+    fclose(file);
+    if (!complete) {
+        programCache.rejected++;
+        return 0;
+    }
+
+    GLuint program = glCreateProgram();
+    glProgramBinary(program, header.format, &binary[0], header.length);
+    GLint ok = GL_FALSE;
+    glGetProgramiv(program, GL_LINK_STATUS, &ok);
+    if (!ok) {
+        glDeleteProgram(program);
+        programCache.rejected++;
+        return 0;
+    }
+    return program;
+}
+
+void storeCachedProgram(unsigned int key, GLuint program) {
+    GLint length = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0) return;
+    ProgramCacheHeader header;
+    memcpy(header.magic, PROGRAM_CACHE_MAGIC, sizeof(header.magic));
+    header.version = PROGRAM_CACHE_VERSION;
+    header.key = key;
+    std::vector<char> binary(length);
+    glGetProgramBinary(program, length, &header.length, &header.format, &binary[0]);
+
+    // Written to a file of this process's own and renamed into place, so a
+    // crash, a full disk or batch workers storing the same key concurrently
+    // never leave a partial binary under the final name
+    if (mkdir(PROGRAM_CACHE_DIR, 0755) != 0 && errno != EEXIST) return;
+    char path[256], temp[288];
+    programCachePath(key, path, sizeof(path));
+    snprintf(temp, sizeof(temp), "%s.tmp.%d", path, (int)getpid());
+    FILE* file = fopen(temp, "wb");
+    if (!file) return;
+    bool written = fwrite(&header, sizeof(header), 1, file) == 1 &&
+                   fwrite(&binary[0], 1, header.length, file) == (size_t)header.length;
+    if (fclose(file) != 0) written = false;
+    if (!written || rename(temp, path) != 0) {
+        printf("Failed to write program binary %s\n", path);
+        remove(temp);
+        return;
+    }
+    programCache.writes++;
+}
+
+// Reported once the lazy setup in display() is done
+void printProgramCacheStats(double setupMs) {
+    int programs = programCache.hits + programCache.misses;
+    const char* start = !programCacheUsable() ? "uncached" : (programCache.misses == 0 ? "warm" : "cold");
+    printf("Startup (%s): %d programs, %d from the binary cache in %.1f ms, %d compiled in %.1f ms; "
+           "GPU setup %.1f ms\n", start, programs, programCache.hits, programCache.loadMs,
+           programCache.misses, programCache.compileMs, setupMs);
+    if (programCache.rejected > 0) {
+        printf("  %d cached binaries were stale or rejected by the driver and rebuilt\n", programCache.rejected);
+    }
+}
+
+GLuint loadProgram(const char* vsPath, const char* fsPath, const char* defines,
+                   const char* fsPreludePath) {
+    double start = nowMs();
+    char* vsSource = readTextFile(vsPath);
+    char* fsSource = readTextFile(fsPath);
+    char* fsPrelude = fsPreludePath ? readTextFile(fsPreludePath) : NULL;
+    if (!vsSource || !fsSource || (fsPreludePath && !fsPrelude)) {
+        printf("Failed to read shader %s\n", !vsSource ? vsPath : (!fsSource ? fsPath : fsPreludePath));
+        free(vsSource);
+        free(fsSource);
+        free(fsPrelude);
+        return 0;
+    }
+
+    unsigned int key = 0;
+    bool cached = programCacheUsable();
+    if (cached) {
+        key = hashBytes(programCache.driverHash, vsSource, strlen(vsSource) + 1);
+        key = hashBytes(key, fsSource, strlen(fsSource) + 1);
+        if (fsPrelude) key = hashBytes(key, fsPrelude, strlen(fsPrelude) + 1);
+        if (defines) key = hashBytes(key, defines, strlen(defines));
+        GLuint program = loadCachedProgram(key);
+        if (program) {
+            free(vsSource);
+            free(fsSource);
+            free(fsPrelude);
+            programCache.hits++;
+            programCache.loadMs += nowMs() - start;
+            return program;
+        }
+    }
+
+    GLuint vs = compileShader(GL_VERTEX_SHADER, vsPath, vsSource, defines);
+    GLuint fs = compileShader(GL_FRAGMENT_SHADER, fsPath, fsSource, defines, fsPrelude);
+    free(vsSource);
+    free(fsSource);
+    free(fsPrelude);
+    if (!vs || !fs) {
+        if (vs) glDeleteShader(vs);
+        if (fs) glDeleteShader(fs);
+        return 0;
+    }
+
+    GLuint program = glCreateProgram();
+    glAttachShader(program, vs);
+    glAttachShader(program, fs);
+    if (cached) glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    glLinkProgram(program);
+    glDeleteShader(vs);
+    glDeleteShader(fs);
+
+    GLint ok = GL_FALSE;
+    glGetProgramiv(program, GL_LINK_STATUS, &ok);
+    if (!ok) {
+        char log[2048];
+        glGetProgramInfoLog(program, sizeof(log), NULL, log);
+        printf("Failed to link %s + %s:\n%s\n", vsPath, fsPath, log);
+        glDeleteProgram(program);
+        return 0;
+    }
+    if (cached) storeCachedProgram(key, program);
+    programCache.misses++;
+    programCache.compileMs += nowMs() - start;
+    return program;
+}
+
+void setupShaders() {
+    GLuint program = loadProgram("shaders/scene.vert", "shaders/scene.frag", NULL, SHADER_LIGHTING_PRELUDE);
+    if (!program) {
+        printf("GLSL renderer unavailable, using fixed-function only\n");
+        return;
+    }
+
+    configureSceneProgram(program);
+    // Immediate-mode geometry carries no occlusion: fully open
+    glVertexAttrib1f(AO_ATTRIBUTE_LOCATION, 1.0f);
+
+    glGenBuffers(1, &lightBlockUBO);
+    glBindBuffer(GL_UNIFORM_BUFFER, lightBlockUBO);
+    glBufferData(GL_UNIFORM_BUFFER, sizeof(LightBlockData), NULL, GL_DYNAMIC_DRAW);
+    glBindBufferBase(GL_UNIFORM_BUFFER, 0, lightBlockUBO);
+
+    glGenBuffers(1, &materialBlockUBO);
+    glBindBuffer(GL_UNIFORM_BUFFER, materialBlockUBO);
+    glBufferData(GL_UNIFORM_BUFFER, sizeof(MaterialBlockData), NULL, GL_DYNAMIC_DRAW);
+    glBindBufferBase(GL_UNIFORM_BUFFER, 1, materialBlockUBO);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+
+    sceneProgram = program;
+    printf("GLSL renderer ready (%s)\n", (const char*)glGetString(GL_SHADING_LANGUAGE_VERSION));
+
+    setupShadowMaps();
+    setupClusteredLighting();
+    setupDeferredShading();
+}
+
+// Block bindings and sampler units shared by every program that shades the
+// scene the way scene.frag does
+void configureSceneProgram(GLuint program) {
+    // Lights live at binding 0, the current material at binding 1
+    glUniformBlockBinding(program, glGetUniformBlockIndex(program, "LightBlock"), 0);
+    glUniformBlockBinding(program, glGetUniformBlockIndex(program, "MaterialBlock"), 1);
+    glUseProgram(program);
+    glUniform1i(glGetUniformLocation(program, "uTexture"), 0);
+    glUniform1i(glGetUniformLocation(program, "uSunShadow"), 2);
+    glUniform1i(glGetUniformLocation(program, "uSunShadowNext"), 11);
+    glUniform1i(glGetUniformLocation(program, "uLampShadow"), 3);
+    glUniform1f(glGetUniformLocation(program, "uLampShadowFar"), LAMP_SHADOW_FAR);
+    glUseProgram(0);
+}
+
+// Copies GL_LIGHT0/GL_LIGHT1 and the global ambient into the light block.
+// glGetLightfv returns positions already in eye space, exactly as the
+// fixed-function path sees them.
+// The fixed-function lights as set, positions in eye space
+void readLightState(LightBlockData& block) {
+    glGetFloatv(GL_LIGHT_MODEL_AMBIENT, block.globalAmbient);
+    for (int i = 0; i < 2; i++) {
+        GLenum light = GL_LIGHT0 + i;
+        LightData& data = block.lights[i];
+        glGetLightfv(light, GL_POSITION, data.position);
+        glGetLightfv(light, GL_AMBIENT, data.ambient);
+        glGetLightfv(light, GL_DIFFUSE, data.diffuse);
+        glGetLightfv(light, GL_SPECULAR, data.specular);
+        glGetLightfv(light, GL_CONSTANT_ATTENUATION, &data.attenuation[0]);
+        glGetLightfv(light, GL_LINEAR_ATTENUATION, &data.attenuation[1]);
+        glGetLightfv(light, GL_QUADRATIC_ATTENUATION, &data.attenuation[2]);
+        data.attenuation[3] = glIsEnabled(light) ? 1.0f : 0.0f;
+    }
+}
+
+void updateLightBlock() {
+    LightBlockData block;
+    readLightState(block);
+    glBindBuffer(GL_UNIFORM_BUFFER, lightBlockUBO);
+    glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(block), &block);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    materialBlockValid = false;
+}
+
+// Mirrors the material and enable state the draw functions set through
+// glMaterial/glEnable into the material block. Only uploads on change.
+void syncDrawState() {
+    if (activeProgram == 0) return;
+
+    MaterialBlockData block;
+    glGetMaterialfv(GL_FRONT, GL_SPECULAR, block.specular);
+    glGetMaterialfv(GL_FRONT, GL_SHININESS, &block.params[0]);
+    block.params[1] = glIsEnabled(GL_LIGHTING) ? 1.0f : 0.0f;
+    block.params[2] = glIsEnabled(GL_TEXTURE_2D) ? 1.0f : 0.0f;
+    block.params[3] = glIsEnabled(GL_BLEND) ? 1.0f : 0.0f;
+
+    if (materialBlockValid && memcmp(&block, &materialBlockCache, sizeof(block)) == 0) return;
+    materialBlockCache = block;
+    materialBlockValid = true;
+
+    glBindBuffer(GL_UNIFORM_BUFFER, materialBlockUBO);
+    glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(block), &block);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    stateChangeCount++;
+}
+
+// ============= Shadow Maps =============
+void setupShadowMaps() {
+    shadowProgram = loadProgram("shaders/shadow.vert", "shaders/shadow.frag");
+    if (!shadowProgram) {
+        printf("Shadow maps unavailable\n");
+        shadowsEnabled = false;
+        return;
+    }
+    glUniformBlockBinding(shadowProgram, glGetUniformBlockIndex(shadowProgram, "MaterialBlock"), 1);
+
+    // Sun: a 2D depth map with hardware depth comparison for every key time
+    // it is up at
+    int sunMaps = 0;
+    for (int key = 0; key < TIME_OF_DAY_KEY_COUNT; key++) {
+        sunShadowMaps[key] = 0;
+        if (timeOfDayKeys[key].sunIntensity <= 0.0f) continue;
+        glGenTextures(1, &sunShadowMaps[key]);
+        glBindTexture(GL_TEXTURE_2D, sunShadowMaps[key]);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, SUN_SHADOW_SIZE, SUN_SHADOW_SIZE, 0,
+                     GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+        sunMaps++;
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    // Desk lamp: cube map holding distance to the lamp / LAMP_SHADOW_FAR
+    glGenTextures(1, &lampShadowMap);
+    glBindTexture(GL_TEXTURE_CUBE_MAP, lampShadowMap);
+    for (int face = 0; face < 6; face++) {
+        glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, 0, GL_DEPTH_COMPONENT24,
+                     LAMP_SHADOW_SIZE, LAMP_SHADOW_SIZE, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+    }
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+    glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+
+    glGenFramebuffers(1, &shadowFBO);
+    printf("Shadow maps ready (sun %dx%d at %d key times, lamp cube %dx%d)\n",
+           SUN_SHADOW_SIZE, SUN_SHADOW_SIZE, sunMaps, LAMP_SHADOW_SIZE, LAMP_SHADOW_SIZE);
+}
+
+// Furniture casts shadows; the room shell does not, otherwise the walls
+// would block the sun completely.
+void drawShadowCasters() {
+    resetDrawLayer(true, NULL);
+    drawSceneObjects(true);
+}
+
+bool shadowCacheValid(const ShadowCache& cache, const GLfloat* lightPosition) {
+    return cache.valid && memcmp(cache.lightPosition, lightPosition, sizeof(cache.lightPosition)) == 0;
+}
+
+void storeShadowCache(ShadowCache& cache, const GLfloat* lightPosition, double passMs) {
+    cache.valid = true;
+    memcpy(cache.lightPosition, lightPosition, sizeof(cache.lightPosition));
+    cache.renders++;
+    cache.lastPassMs = passMs;
+}
+
+void renderSunShadowMap(int key) {
+    // Orthographic light view fitted around the whole room
+    const GLfloat* sunPosition = timeOfDayKeys[key].sunPosition;
+    GLfloat length = sqrtf(sunPosition[0] * sunPosition[0] + sunPosition[1] * sunPosition[1] +
+                           sunPosition[2] * sunPosition[2]);
+    GLfloat center[3] = {0.0f, 2.5f, 0.0f};
+    GLfloat eye[3];
+    for (int i = 0; i < 3; i++) eye[i] = center[i] + sunPosition[i] / length * 15.0f;
+    GLfloat up[3] = {0.0f, 1.0f, 0.0f};
+    if (fabsf(sunPosition[1] / length) > 0.99f) {
+        up[1] = 0.0f;
+        up[2] = 1.0f;
+    }
+
+    GLfloat view[16], proj[16];
+    lookAtMatrix(eye, center, up, view);
+
+    float minX = 1e9f, minY = 1e9f, minZ = 1e9f;
+    float maxX = -1e9f, maxY = -1e9f, maxZ = -1e9f;
+    for (int i = 0; i < 8; i++) {
+        GLfloat corner[3] = {(i & 1) ? 5.0f : -5.0f, (i & 2) ? 5.0f : 0.0f, (i & 4) ? 5.0f : -5.0f};
+        GLfloat p[3];
+        transformPoint(view, corner, p);
+        minX = fminf(minX, p[0]); maxX = fmaxf(maxX, p[0]);
+        minY = fminf(minY, p[1]); maxY = fmaxf(maxY, p[1]);
+        minZ = fminf(minZ, p[2]); maxZ = fmaxf(maxZ, p[2]);
+    }
+    orthoMatrix(minX, maxX, minY, maxY, -maxZ - 0.5f, -minZ + 0.5f, proj);
+
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, sunShadowMaps[key], 0);
+    glViewport(0, 0, SUN_SHADOW_SIZE, SUN_SHADOW_SIZE);
+    glClear(GL_DEPTH_BUFFER_BIT);
+    glUniform1f(glGetUniformLocation(shadowProgram, "uLinearDepthFar"), 0.0f);
+
+    glEnable(GL_POLYGON_OFFSET_FILL);
+    glPolygonOffset(1.1f, 4.0f);
+    glMatrixMode(GL_PROJECTION);
+    glLoadMatrixf(proj);
+    glMatrixMode(GL_MODELVIEW);
+    glLoadMatrixf(view);
+    drawShadowCasters();
+    glDisable(GL_POLYGON_OFFSET_FILL);
+
+    // Bias from clip space [-1,1] to texture space [0,1]
+    GLfloat bias[16] = {0.5f, 0, 0, 0,  0, 0.5f, 0, 0,  0, 0, 0.5f, 0,  0.5f, 0.5f, 0.5f, 1.0f};
+    GLfloat viewProj[16];
+    multiplyMatrices(proj, view, viewProj);
+    multiplyMatrices(bias, viewProj, sunShadowMatrices[key]);
+}
+
+void renderLampShadowMap() {
+    // Standard cube map face orientations
+    static const GLfloat faceDirs[6][3] = {
+        {1, 0, 0}, {-1, 0, 0}, {0, 1, 0}, {0, -1, 0}, {0, 0, 1}, {0, 0, -1}};
+    static const GLfloat faceUps[6][3] = {
+        {0, -1, 0}, {0, -1, 0}, {0, 0, 1}, {0, 0, -1}, {0, -1, 0}, {0, -1, 0}};
+
+    GLfloat proj[16];
+    perspectiveMatrix(90.0f, 1.0f, 0.05f, LAMP_SHADOW_FAR, proj);
+    glMatrixMode(GL_PROJECTION);
+    glLoadMatrixf(proj);
+    glMatrixMode(GL_MODELVIEW);
+
+    glViewport(0, 0, LAMP_SHADOW_SIZE, LAMP_SHADOW_SIZE);
+    glUniform1f(glGetUniformLocation(shadowProgram, "uLinearDepthFar"), LAMP_SHADOW_FAR);
+
+    for (int face = 0; face < 6; face++) {
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
+                               GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, lampShadowMap, 0);
+        glClear(GL_DEPTH_BUFFER_BIT);
+
+        GLfloat target[3], view[16];
+        for (int i = 0; i < 3; i++) target[i] = deskLampPosition[i] + faceDirs[face][i];
+        lookAtMatrix(deskLampPosition, target, faceUps[face], view);
+        glLoadMatrixf(view);
+        drawShadowCasters();
+    }
+}
+
+// Both maps of the current time are valid, so the sun can be shadowed
+bool sunShadowsReady() {
+    for (int i = 0; i < 2; i++) {
+        int key = sunShadowKeys[i];
+        if (!shadowCacheValid(sunShadowCaches[key], timeOfDayKeys[key].sunPosition)) return false;
+    }
+    return true;
+}
+
+// Re-renders the shadow map of each enabled light only when the cached one
+// is stale (the light moved); otherwise counts a hit. No caster moves at
+// run time, so the light position is the whole key.
+// The sun maps of all key times are rendered together the first time, so
+// moving through the day never has to render one.
+void updateShadowMaps() {
+    if (shadowProgram == 0) return;
+
+    bool sunOn = glIsEnabled(GL_LIGHT0);
+    bool lampOn = glIsEnabled(GL_LIGHT1);
+    bool renderSun = sunOn && !sunShadowsReady();
+    bool renderLamp = lampOn && !shadowCacheValid(lampShadowCache, deskLampPosition);
+    if (sunOn && !renderSun) sunShadowCaches[sunShadowKeys[0]].hits++;
+    if (lampOn && !renderLamp) lampShadowCache.hits++;
+    if (!renderSun && !renderLamp) return;
+
+    GLint previousFBO = 0;
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &previousFBO);
+    glPushAttrib(GL_ENABLE_BIT | GL_VIEWPORT_BIT | GL_POLYGON_BIT);
+    glMatrixMode(GL_PROJECTION);
+    glPushMatrix();
+    glMatrixMode(GL_MODELVIEW);
+    glPushMatrix();
+
+    glBindFramebuffer(GL_FRAMEBUFFER, shadowFBO);
+    glDrawBuffer(GL_NONE);
+    glReadBuffer(GL_NONE);
+    glUseProgram(shadowProgram);
+    activeProgram = shadowProgram;
+    materialBlockValid = false;
+
+    for (int key = 0; renderSun && key < TIME_OF_DAY_KEY_COUNT; key++) {
+        const GLfloat* keyPosition = timeOfDayKeys[key].sunPosition;
+        if (sunShadowMaps[key] == 0 || shadowCacheValid(sunShadowCaches[key], keyPosition)) continue;
+        double start = nowMs();
+        renderSunShadowMap(key);
+        finishPassTiming();
+        storeShadowCache(sunShadowCaches[key], keyPosition, nowMs() - start);
+    }
+    if (renderLamp) {
+        double start = nowMs();
+        renderLampShadowMap();
+        finishPassTiming();
+        storeShadowCache(lampShadowCache, deskLampPosition, nowMs() - start);
+    }
+
+    glUseProgram(0);
+    activeProgram = 0;
+    materialBlockValid = false;
+    glBindFramebuffer(GL_FRAMEBUFFER, previousFBO);
+
+    glMatrixMode(GL_PROJECTION);
+    glPopMatrix();
+    glMatrixMode(GL_MODELVIEW);
+    glPopMatrix();
+    glPopAttrib();
+}
+
+// Hands the cached maps to the scene program. Must run after the camera is
+// set, since the shader works in eye space.
+void bindShadowMaps() {
+    GLfloat view[16], invView[16], eyeToSun[2][16];
+    glGetFloatv(GL_MODELVIEW_MATRIX, view);
+    invertRigidMatrix(view, invView);
+    for (int i = 0; i < 2; i++) multiplyMatrices(sunShadowMatrices[sunShadowKeys[i]], invView, eyeToSun[i]);
+
+    bool active = shadowsEnabled && shadowProgram != 0;
+    bool sunShadow = active && sunShadowsReady() && glIsEnabled(GL_LIGHT0);
+    bool lampShadow = active && lampShadowCache.valid && glIsEnabled(GL_LIGHT1);
+
+    glUniform1i(glGetUniformLocation(activeProgram, "uSunShadowEnabled"), sunShadow ? 1 : 0);
+    glUniform1i(glGetUniformLocation(activeProgram, "uLampShadowEnabled"), lampShadow ? 1 : 0);
+    glUniformMatrix4fv(glGetUniformLocation(activeProgram, "uEyeToSunShadow"), 1, GL_FALSE, eyeToSun[0]);
+    glUniformMatrix4fv(glGetUniformLocation(activeProgram, "uEyeToSunShadowNext"), 1, GL_FALSE, eyeToSun[1]);
+    glUniform1f(glGetUniformLocation(activeProgram, "uSunShadowBlend"), sunShadowBlend);
+    glUniformMatrix4fv(glGetUniformLocation(activeProgram, "uEyeToWorld"), 1, GL_FALSE, invView);
+    glUniform3fv(glGetUniformLocation(activeProgram, "uLampWorldPos"), 1, deskLampPosition);
+
+    glActiveTexture(GL_TEXTURE2);
+    glBindTexture(GL_TEXTURE_2D, sunShadowMaps[sunShadowKeys[0]]);
+    glActiveTexture(GL_TEXTURE11);
+    glBindTexture(GL_TEXTURE_2D, sunShadowMaps[sunShadowKeys[1]]);
+    glActiveTexture(GL_TEXTURE3);
+    glBindTexture(GL_TEXTURE_CUBE_MAP, lampShadowMap);
+    glActiveTexture(GL_TEXTURE0);
+}
+
+void printShadowStats() {
+    // The sun's key time maps are reported as one
+    ShadowCache sunShadowCache = {false, {0, 0, 0, 0}, 0, 0, 0.0};
+    for (int key = 0; key < TIME_OF_DAY_KEY_COUNT; key++) {
+        sunShadowCache.renders += sunShadowCaches[key].renders;
+        sunShadowCache.hits += sunShadowCaches[key].hits;
+        sunShadowCache.lastPassMs = std::max(sunShadowCache.lastPassMs, sunShadowCaches[key].lastPassMs);
+    }
+    const ShadowCache* caches[2] = {&sunShadowCache, &lampShadowCache};
+    const char* names[2] = {"sun", "lamp"};
+    printf("Shadow maps:");
+    for (int i = 0; i < 2; i++) {
+        const ShadowCache& cache = *caches[i];
+        int lookups = cache.renders + cache.hits;
+        float hitRate = lookups > 0 ? 100.0f * cache.hits / lookups : 0.0f;
+        printf(" %s %d renders, %d hits (%.1f%% cached), last pass %.2f ms%s",
+               names[i], cache.renders, cache.hits, hitRate, cache.lastPassMs, i == 0 ? " |" : "");
+    }
+    printf("\n");
+}
+
+// ============= Lightmap Baker =============
+// Offline tool (--bake-lightmaps): unwraps the lit, opaque surfaces of the
+// captured room into one atlas and path traces direct plus bounced light for
+// the day state (sun) and the night state (desk lamp). Shadow rays only test
+// the shadow casters, matching the shadow maps; bounce rays hit everything
+// opaque. The result is the light that multiplies the surface color, so the
+// runtime applies it the same way the fixed-function lighting does.
+
+// One chart per source polygon, flattened into its own plane
+struct LightmapChart {
+    int firstTriangle;   // index of the chart's first triangle in the mesh
+    int triangleCount;   // 2 for quads, 1 for triangles
+    GLfloat origin[3], axisU[3], axisV[3];
+    GLfloat minU, minV;
+    int width, height;   // interior texels, padding excluded
+    int x, y;            // corner of the padded rectangle in the atlas
+};
+
+struct LightmapAtlas {
+    float density;
+    int size;
+    std::vector<LightmapChart> charts;
+    std::vector<int> chartTriangles;   // first vertex of each lightmapped triangle
+    std::vector<GLfloat> vertexCoords; // lightmap uv per mesh vertex
+    std::vector<int> texelChart;       // chart covering each atlas texel, -1 if none
+    unsigned int sceneHash;
+};
+
+void vecSub(const GLfloat* a, const GLfloat* b, GLfloat* out) {
+    out[0] = a[0] - b[0]; out[1] = a[1] - b[1]; out[2] = a[2] - b[2];
+}
+
+void vecCross(const GLfloat* a, const GLfloat* b, GLfloat* out) {
+    out[0] = a[1] * b[2] - a[2] * b[1];
+    out[1] = a[2] * b[0] - a[0] * b[2];
+    out[2] = a[0] * b[1] - a[1] * b[0];
+}
+
+GLfloat vecDot(const GLfloat* a, const GLfloat* b) {
+    return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+}
+
+GLfloat vecNormalize(GLfloat* v) {
+    GLfloat length = sqrtf(vecDot(v, v));
+    if (length > 0.0f) {
+        v[0] /= length; v[1] /= length; v[2] /= length;
+    }
+    return length;
+}
+
+bool isBakedDraw(const SceneDraw& draw) {
+    return draw.primitive == GL_TRIANGLES && draw.lit && !draw.blended;
+}
+
+unsigned int hashBytes(unsigned int hash, const void* data, size_t size) {
+    const unsigned char* bytes = (const unsigned char*)data;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ bytes[i]) * 16777619u; // FNV-1a
+    }
+    return hash;
+}
+
+// Builds the atlas layout for the captured mesh. Deterministic, so the
+// runtime rebuilds exactly the layout the baker wrote.
+void buildLightmapAtlas(const SceneMesh& mesh, float density, LightmapAtlas& atlas) {
+    atlas.density = density;
+    atlas.charts.clear();
+    atlas.chartTriangles.clear();
+    atlas.vertexCoords.assign(mesh.vertices.size() * 2, 0.0f);
+    atlas.sceneHash = hashBytes(2166136261u, &density, sizeof(density));
+
+    for (size_t d = 0; d < mesh.draws.size(); d++) {
+        const SceneDraw& draw = mesh.draws[d];
+        if (!isBakedDraw(draw)) continue;
+        int sides = (draw.polygonSides == 4) ? 2 : 1;
+        for (int v = 0; v + 3 * sides <= draw.vertexCount; v += 3 * sides) {
+            LightmapChart chart;
+            chart.firstTriangle = (int)atlas.chartTriangles.size();
+            chart.triangleCount = sides;
+            for (int t = 0; t < sides; t++) {
+                atlas.chartTriangles.push_back(draw.firstVertex + v + 3 * t);
+            }
+
+            // Plane frame from the first triangle
+            const SceneVertex* p = &mesh.vertices[draw.firstVertex + v];
+            GLfloat e1[3], e2[3], n[3];
+            vecSub(p[1].position, p[0].position, e1);
+            vecSub(p[2].position, p[0].position, e2);
+            vecCross(e1, e2, n);
+            if (vecNormalize(n) == 0.0f || vecNormalize(e1) == 0.0f) {
+                e1[0] = 1.0f; e1[1] = 0.0f; e1[2] = 0.0f;
+                n[0] = 0.0f; n[1] = 1.0f; n[2] = 0.0f;
+            }
+            memcpy(chart.origin, p[0].position, sizeof(chart.origin));
+            memcpy(chart.axisU, e1, sizeof(chart.axisU));
+            vecCross(n, e1, chart.axisV);
+
+            GLfloat minU = 1e30f, minV = 1e30f, maxU = -1e30f, maxV = -1e30f;
+            for (int k = 0; k < 3 * sides; k++) {
+                GLfloat rel[3];
+                vecSub(p[k].position, chart.origin, rel);
+                GLfloat u = vecDot(rel, chart.axisU), w = vecDot(rel, chart.axisV);
+                minU = fminf(minU, u); maxU = fmaxf(maxU, u);
+                minV = fminf(minV, w); maxV = fmaxf(maxV, w);
+                atlas.sceneHash = hashBytes(atlas.sceneHash, p[k].position, sizeof(p[k].position));
+            }
+            chart.minU = minU;
+            chart.minV = minV;
+            chart.width = (int)ceilf((maxU - minU) * density) + 1;
+            chart.height = (int)ceilf((maxV - minV) * density) + 1;
+            chart.x = chart.y = 0;
+            atlas.charts.push_back(chart);
+        }
+    }
+
+    // Shelf packing, tallest charts first, into the smallest square that fits
+    std::vector<int> order(atlas.charts.size());
+    for (size_t i = 0; i < order.size(); i++) order[i] = (int)i;
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+        return atlas.charts[a].height > atlas.charts[b].height;
+    });
+    for (atlas.size = 64; ; atlas.size *= 2) {
+        int x = 0, y = 0, shelfHeight = 0;
+        bool fits = true;
+        for (size_t i = 0; i < order.size() && fits; i++) {
+            LightmapChart& chart = atlas.charts[order[i]];
+            int w = chart.width + 2, h = chart.height + 2;
+            if (x + w > atlas.size) {
+                x = 0;
+                y += shelfHeight;
+                shelfHeight = 0;
+            }
+            if (w > atlas.size || y + h > atlas.size) fits = false;
+            chart.x = x;
+            chart.y = y;
+            x += w;
+            shelfHeight = std::max(shelfHeight, h);
+        }
+        if (fits) break;
+    }
+
+    atlas.texelChart.assign((size_t)atlas.size * atlas.size, -1);
+    for (size_t c = 0; c < atlas.charts.size(); c++) {
+        const LightmapChart& chart = atlas.charts[c];
+        for (int y = 0; y < chart.height + 2; y++) {
+            for (int x = 0; x < chart.width + 2; x++) {
+                atlas.texelChart[(size_t)(chart.y + y) * atlas.size + chart.x + x] = (int)c;
+            }
+        }
+        // Texel i of the interior has its center at u = minU + i / density
+        for (int t = 0; t < chart.triangleCount; t++) {
+            int first = atlas.chartTriangles[chart.firstTriangle + t];
+            for (int k = 0; k < 3; k++) {
+                GLfloat rel[3];
+                vecSub(mesh.vertices[first + k].position, chart.origin, rel);
+                GLfloat u = (vecDot(rel, chart.axisU) - chart.minU) * density;
+                GLfloat w = (vecDot(rel, chart.axisV) - chart.minV) * density;
+                atlas.vertexCoords[(first + k) * 2] = (chart.x + 1.5f + u) / atlas.size;
+                atlas.vertexCoords[(first + k) * 2 + 1] = (chart.y + 1.5f + w) / atlas.size;
+            }
+        }
+    }
+}
+
+// --- Ray tracing ---
+struct TraceTriangle {
+    GLfloat p0[3], e1[3], e2[3];
+    int firstVertex;
+    int draw;
+};
+
+struct BVHNode {
+    GLfloat boundsMin[3], boundsMax[3];
+    int first;  // first triangle for leaves, left child otherwise
+    int count;  // 0 for inner nodes
+};
+
+// The build stops splitting at this depth, so the traversals' fixed stacks
+// (one pending sibling per level plus the two children just pushed) can
+// never overflow
+const int BVH_MAX_DEPTH = 48;
+const int BVH_STACK_SIZE = BVH_MAX_DEPTH + 2;
+
+struct BVH {
+    std::vector<TraceTriangle> triangles;
+    std::vector<BVHNode> nodes;
+};
+
+struct RayHit {
+    float t, u, v;
+    int triangle;
+};
+
+void triangleBounds(const TraceTriangle& tri, GLfloat* boundsMin, GLfloat* boundsMax) {
+    for (int a = 0; a < 3; a++) {
+        GLfloat p1 = tri.p0[a] + tri.e1[a], p2 = tri.p0[a] + tri.e2[a];
+        boundsMin[a] = std::min(tri.p0[a], std::min(p1, p2));
+        boundsMax[a] = std::max(tri.p0[a], std::max(p1, p2));
+    }
+}
+
+float boundsArea(const GLfloat* boundsMin, const GLfloat* boundsMax) {
+    float dx = boundsMax[0] - boundsMin[0], dy = boundsMax[1] - boundsMin[1], dz = boundsMax[2] - boundsMin[2];
+    return 2.0f * (dx * dy + dy * dz + dz * dx);
+}
+
+// Binned SAH split over the triangle centroids
+void buildBVHNode(BVH& bvh, int nodeIndex, int first, int count, int depth) {
+    const int BINS = 12;
+    BVHNode node;
+    node.first = first;
+    node.count = count;
+    GLfloat centroidMin[3] = {1e30f, 1e30f, 1e30f}, centroidMax[3] = {-1e30f, -1e30f, -1e30f};
+    for (int a = 0; a < 3; a++) {
+        node.boundsMin[a] = 1e30f;
+        node.boundsMax[a] = -1e30f;
+    }
+    for (int i = first; i < first + count; i++) {
+        GLfloat tmin[3], tmax[3];
+        triangleBounds(bvh.triangles[i], tmin, tmax);
+        for (int a = 0; a < 3; a++) {
+            node.boundsMin[a] = std::min(node.boundsMin[a], tmin[a]);
+            node.boundsMax[a] = std::max(node.boundsMax[a], tmax[a]);
+            GLfloat c = 0.5f * (tmin[a] + tmax[a]);
+            centroidMin[a] = std::min(centroidMin[a], c);
+            centroidMax[a] = std::max(centroidMax[a], c);
+        }
+    }
+    bvh.nodes[nodeIndex] = node;
+    if (count <= 4 || depth >= BVH_MAX_DEPTH) return;
+
+    int bestAxis = -1, bestSplit = 0;
+    float bestCost = count * boundsArea(node.boundsMin, node.boundsMax);
+    for (int a = 0; a < 3; a++) {
+        float extent = centroidMax[a] - centroidMin[a];
+        if (extent <= 0.0f) continue;
+        int binCount[BINS] = {0};
+        GLfloat binMin[BINS][3], binMax[BINS][3];
+        for (int b = 0; b < BINS; b++) {
+            for (int k = 0; k < 3; k++) { binMin[b][k] = 1e30f; binMax[b][k] = -1e30f; }
+        }
+        for (int i = first; i < first + count; i++) {
+            GLfloat tmin[3], tmax[3];
+            triangleBounds(bvh.triangles[i], tmin, tmax);
+            int b = std::min(BINS - 1, (int)((0.5f * (tmin[a] + tmax[a]) - centroidMin[a]) / extent * BINS));
+            binCount[b]++;
+            for (int k = 0; k < 3; k++) {
+                binMin[b][k] = std::min(binMin[b][k], tmin[k]);
+                binMax[b][k] = std::max(binMax[b][k], tmax[k]);
+            }
+        }
+        for (int split = 1; split < BINS; split++) {
+            GLfloat lmin[3] = {1e30f, 1e30f, 1e30f}, lmax[3] = {-1e30f, -1e30f, -1e30f};
+            GLfloat rmin[3] = {1e30f, 1e30f, 1e30f}, rmax[3] = {-1e30f, -1e30f, -1e30f};
+            int left = 0, right = 0;
+            for (int b = 0; b < BINS; b++) {
+                GLfloat* smin = (b < split) ? lmin : rmin;
+                GLfloat* smax = (b < split) ? lmax : rmax;
+                if (binCount[b] == 0) continue;
+                (b < split ? left : right) += binCount[b];
+                for (int k = 0; k < 3; k++) {
+                    smin[k] = std::min(smin[k], binMin[b][k]);
+                    smax[k] = std::max(smax[k], binMax[b][k]);
+                }
+            }
+            if (left == 0 || right == 0) continue;
+            float cost = left * boundsArea(lmin, lmax) + right * boundsArea(rmin, rmax);
+            if (cost < bestCost) {
+                bestCost = cost;
+                bestAxis = a;
+                bestSplit = split;
+            }
+        }
+    }
+    if (bestAxis < 0) return; // splitting does not pay off
+
+    float extent = centroidMax[bestAxis] - centroidMin[bestAxis];
+    TraceTriangle* begin = &bvh.triangles[first];
+    TraceTriangle* middle = std::partition(begin, begin + count, [&](const TraceTriangle& tri) {
+        GLfloat tmin[3], tmax[3];
+        triangleBounds(tri, tmin, tmax);
+        int b = std::min(BINS - 1, (int)((0.5f * (tmin[bestAxis] + tmax[bestAxis]) - centroidMin[bestAxis]) / extent * BINS));
+        return b < bestSplit;
+    });
+    int leftCount = (int)(middle - begin);
+
+    int leftChild = (int)bvh.nodes.size();
+    bvh.nodes.resize(bvh.nodes.size() + 2);
+    bvh.nodes[nodeIndex].first = leftChild;
+    bvh.nodes[nodeIndex].count = 0;
+    buildBVHNode(bvh, leftChild, first, leftCount, depth + 1);
+    buildBVHNode(bvh, leftChild + 1, first + leftCount, count - leftCount, depth + 1);
+}
+
+// Opaque triangles of the mesh, optionally only the shadow casters
+void buildBVH(const SceneMesh& mesh, bool castersOnly, BVH& bvh) {
+    bvh.triangles.clear();
+    bvh.nodes.clear();
+    for (size_t d = 0; d < mesh.draws.size(); d++) {
+        const SceneDraw& draw = mesh.draws[d];
+        if (draw.primitive != GL_TRIANGLES || draw.blended) continue;
+        if (castersOnly && !sceneObjects[draw.object].castsShadow) continue;
+        for (int v = 0; v + 3 <= draw.vertexCount; v += 3) {
+            const SceneVertex* p = &mesh.vertices[draw.firstVertex + v];
+            TraceTriangle tri;
+            memcpy(tri.p0, p[0].position, sizeof(tri.p0));
+            vecSub(p[1].position, p[0].position, tri.e1);
+            vecSub(p[2].position, p[0].position, tri.e2);
+            tri.firstVertex = draw.firstVertex + v;
+            tri.draw = (int)d;
+            bvh.triangles.push_back(tri);
+        }
+    }
+    bvh.nodes.resize(1);
+    if (bvh.triangles.empty()) {
+        memset(&bvh.nodes[0], 0, sizeof(BVHNode));
+        return;
+    }
+    buildBVHNode(bvh, 0, 0, (int)bvh.triangles.size(), 0);
+}
+
+bool rayHitsBounds(const BVHNode& node, const GLfloat* origin, const GLfloat* invDir, float tMax) {
+    float t0 = 0.0f, t1 = tMax;
+    for (int a = 0; a < 3; a++) {
+        float tNear = (node.boundsMin[a] - origin[a]) * invDir[a];
+        float tFar = (node.boundsMax[a] - origin[a]) * invDir[a];
+        if (tNear > tFar) std::swap(tNear, tFar);
+        t0 = std::max(t0, tNear);
+        t1 = std::min(t1, tFar);
+        if (t0 > t1) return false;
+    }
+    return true;
+}
+
+// Möller-Trumbore, double sided
+bool rayHitsTriangle(const TraceTriangle& tri, const GLfloat* origin, const GLfloat* dir, float tMax, RayHit& hit) {
+    GLfloat pv[3], tv[3], qv[3];
+    vecCross(dir, tri.e2, pv);
+    float det = vecDot(tri.e1, pv);
+    if (fabsf(det) < 1e-12f) return false;
+    float invDet = 1.0f / det;
+    vecSub(origin, tri.p0, tv);
+    float u = vecDot(tv, pv) * invDet;
+    if (u < 0.0f || u > 1.0f) return false;
+    vecCross(tv, tri.e1, qv);
+    float v = vecDot(dir, qv) * invDet;
+    if (v < 0.0f || u + v > 1.0f) return false;
+    float t = vecDot(tri.e2, qv) * invDet;
+    if (t <= 1e-4f || t >= tMax) return false;
+    hit.t = t;
+    hit.u = u;
+    hit.v = v;
+    return true;
+}
+
+// Closest hit, or any hit when anyHit is set (shadow rays)
+bool traceRay(const BVH& bvh, const GLfloat* origin, const GLfloat* dir, float tMax, bool anyHit, RayHit& hit) {
+    if (bvh.triangles.empty()) return false;
+    GLfloat invDir[3];
+    for (int a = 0; a < 3; a++) {
+        invDir[a] = (fabsf(dir[a]) > 1e-12f) ? 1.0f / dir[a] : 1e12f;
+    }
+    int stack[BVH_STACK_SIZE];
+    int depth = 0;
+    stack[depth++] = 0;
+    bool found = false;
+    hit.t = tMax;
+    while (depth > 0) {
+        const BVHNode& node = bvh.nodes[stack[--depth]];
+        if (!rayHitsBounds(node, origin, invDir, hit.t)) continue;
+        if (node.count > 0) {
+            for (int i = node.first; i < node.first + node.count; i++) {
+                RayHit candidate;
+                if (rayHitsTriangle(bvh.triangles[i], origin, dir, hit.t, candidate)) {
+                    hit = candidate;
+                    hit.triangle = i;
+                    found = true;
+                    if (anyHit) return true;
+                }
+            }
+        } else {
+            stack[depth++] = node.first;
+            stack[depth++] = node.first + 1;
+        }
+    }
+    return found;
+}
+
+// --- Materials ---
+struct BakeTexture {
+    GLuint id;
+    bool repeat;
+    int width, height;
+    std::vector<unsigned char> texels; // RGB
+};
+
+void assignHeadlessTextureIds() {
+    for (int i = 0; i < SCENE_TEXTURE_COUNT; i++) {
+        if (*sceneTextureFiles[i].id == 0) *sceneTextureFiles[i].id = (GLuint)(i + 1);
+    }
+}
+
+// Index into sceneTextureFiles of a texture id, -1 for none
+int sceneTextureIndex(GLuint id) {
+    for (int i = 0; i < SCENE_TEXTURE_COUNT; i++) {
+        if (id != 0 && *sceneTextureFiles[i].id == id) return i;
+    }
+    return -1;
+}
+
+void loadBakeTextures(std::vector<BakeTexture>& textures) {
+    assignHeadlessTextureIds();
+    for (int i = 0; i < SCENE_TEXTURE_COUNT; i++) {
+        const SceneTextureFile& file = sceneTextureFiles[i];
+        int width, height, channels;
+        unsigned char* image = stbi_load(file.path, &width, &height, &channels, 3);
+        if (!image) {
+            printf("Failed to load %s, baking it as white\n", file.path);
+            continue;
+        }
+        BakeTexture texture;
+        texture.id = *file.id;
+        texture.repeat = file.repeat;
+        texture.width = width;
+        texture.height = height;
+        texture.texels.assign(image, image + width * height * 3);
+        stbi_image_free(image);
+        textures.push_back(texture);
+    }
+}
+
+// Decodes every scene texture into the cache ahead of any GL context;
+// returns the bytes held
+size_t preloadTextureCache() {
+    textureCacheEnabled = true;
+    size_t bytes = 0;
+    for (int i = 0; i < SCENE_TEXTURE_COUNT; i++) {
+        int width, height, channels;
+        if (loadTextureImage(sceneTextureFiles[i].path, &width, &height, &channels)) {
+            bytes += (size_t)width * height * channels;
+        }
+    }
+    return bytes;
+}
+
+// Surface color at a hit: vertex color modulated by the texture (nearest)
+void surfaceAlbedo(const SceneMesh& mesh, const std::vector<BakeTexture>& textures,
+                   const TraceTriangle& tri, float u, float v, GLfloat* albedo) {
+    const SceneDraw& draw = mesh.draws[tri.draw];
+    const SceneVertex* p = &mesh.vertices[tri.firstVertex];
+    float w = 1.0f - u - v;
+    for (int c = 0; c < 3; c++) {
+        albedo[c] = w * p[0].color[c] + u * p[1].color[c] + v * p[2].color[c];
+    }
+    if (!draw.textured || draw.texture == 0) return;
+    for (size_t i = 0; i < textures.size(); i++) {
+        const BakeTexture& texture = textures[i];
+        if (texture.id != draw.texture) continue;
+        float s = w * p[0].texCoord[0] + u * p[1].texCoord[0] + v * p[2].texCoord[0];
+        float t = w * p[0].texCoord[1] + u * p[1].texCoord[1] + v * p[2].texCoord[1];
+        if (texture.repeat) {
+            s -= floorf(s);
+            t -= floorf(t);
+        } else {
+            s = std::min(std::max(s, 0.0f), 1.0f);
+            t = std::min(std::max(t, 0.0f), 1.0f);
+        }
+        int x = std::min(texture.width - 1, (int)(s * texture.width));
+        int y = std::min(texture.height - 1, (int)(t * texture.height));
+        const unsigned char* texel = &texture.texels[(y * texture.width + x) * 3];
+        for (int c = 0; c < 3; c++) albedo[c] *= texel[c] / 255.0f;
+        return;
+    }
+}
+
+// --- Baking ---
+struct BakeContext {
+    const SceneMesh* mesh;
+    const LightmapAtlas* atlas;
+    const BVH* scene;    // all opaque geometry, for bounces
+    const BVH* casters;  // shadow casters, for direct light
+    const std::vector<BakeTexture>* textures;
+    int samples;
+    std::vector<float> day, night; // RGB per atlas texel
+    std::atomic<int> nextRow;
+    std::atomic<long long> rays;
+};
+
+struct BakeRandom {
+    unsigned int state;
+    float next() {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return (state >> 8) * (1.0f / 16777216.0f);
+    }
+};
+
+// Diffuse light arriving at a point from the sun (day) and the lamp (night),
+// already including the cosine term and the shadow test
+void directLight(const BakeContext& ctx, const GLfloat* point, const GLfloat* normal,
+                 GLfloat* day, GLfloat* night, long long& rays) {
+    RayHit hit;
+    GLfloat toSun[3] = {sunPosition[0], sunPosition[1], sunPosition[2]};
+    vecNormalize(toSun);
+    float sunCos = vecDot(normal, toSun);
+    for (int c = 0; c < 3; c++) day[c] = 0.0f;
+    if (sunCos > 0.0f) {
+        rays++;
+        if (!traceRay(*ctx.casters, point, toSun, 1e30f, true, hit)) {
+            for (int c = 0; c < 3; c++) day[c] = sunCos * sunDiffuse[c];
+        }
+    }
+
+    GLfloat toLamp[3];
+    vecSub(deskLampPosition, point, toLamp);
+    float distance = vecNormalize(toLamp);
+    float lampCos = vecDot(normal, toLamp);
+    for (int c = 0; c < 3; c++) night[c] = 0.0f;
+    if (lampCos > 0.0f) {
+        rays++;
+        if (!traceRay(*ctx.casters, point, toLamp, distance, true, hit)) {
+            float atten = 1.0f / (deskLampAttenuation[0] + deskLampAttenuation[1] * distance +
+                                  deskLampAttenuation[2] * distance * distance);
+            for (int c = 0; c < 3; c++) night[c] = atten * lampCos * deskLampDiffuse[c];
+        }
+    }
+}
+
+// Cosine-weighted direction around the normal
+void sampleHemisphere(const GLfloat* normal, BakeRandom& random, GLfloat* dir) {
+    float r1 = random.next(), r2 = random.next();
+    float phi = 2.0f * (float)M_PI * r1;
+    float radius = sqrtf(r2);
+    float x = radius * cosf(phi), y = radius * sinf(phi), z = sqrtf(std::max(0.0f, 1.0f - r2));
+    GLfloat helper[3] = {1.0f, 0.0f, 0.0f};
+    if (fabsf(normal[0]) > 0.9f) { helper[0] = 0.0f; helper[1] = 1.0f; }
+    GLfloat tangent[3], bitangent[3];
+    vecCross(helper, normal, tangent);
+    vecNormalize(tangent);
+    vecCross(normal, tangent, bitangent);
+    for (int a = 0; a < 3; a++) dir[a] = x * tangent[a] + y * bitangent[a] + z * normal[a];
+}
+
+// Point and shading normal of a chart at plane coordinates (u, v). Points off
+// the chart's triangles (padding, the empty half of a triangle's rectangle)
+// are clamped onto the nearest triangle so filtering never picks up black.
+void chartSurfacePoint(const SceneMesh& mesh, const LightmapAtlas& atlas, const LightmapChart& chart,
+                       float u, float v, GLfloat* point, GLfloat* normal) {
+    float best = -1e30f;
+    for (int t = 0; t < chart.triangleCount; t++) {
+        const SceneVertex* p = &mesh.vertices[atlas.chartTriangles[chart.firstTriangle + t]];
+        float pu[3], pv[3];
+        for (int k = 0; k < 3; k++) {
+            GLfloat rel[3];
+            vecSub(p[k].position, chart.origin, rel);
+            pu[k] = vecDot(rel, chart.axisU);
+            pv[k] = vecDot(rel, chart.axisV);
+        }
+        float det = (pv[1] - pv[2]) * (pu[0] - pu[2]) + (pu[2] - pu[1]) * (pv[0] - pv[2]);
+        float b[3] = {1.0f / 3.0f, 1.0f / 3.0f, 1.0f / 3.0f};
+        if (fabsf(det) > 1e-12f) {
+            b[0] = ((pv[1] - pv[2]) * (u - pu[2]) + (pu[2] - pu[1]) * (v - pv[2])) / det;
+            b[1] = ((pv[2] - pv[0]) * (u - pu[2]) + (pu[0] - pu[2]) * (v - pv[2])) / det;
+            b[2] = 1.0f - b[0] - b[1];
+        }
+        float inside = std::min(b[0], std::min(b[1], b[2]));
+        if (inside <= best) continue;
+        best = inside;
+        float sum = 0.0f;
+        for (int k = 0; k < 3; k++) {
+            b[k] = std::max(b[k], 0.0f);
+            sum += b[k];
+        }
+        for (int a = 0; a < 3; a++) {
+            point[a] = (b[0] * p[0].position[a] + b[1] * p[1].position[a] + b[2] * p[2].position[a]) / sum;
+            normal[a] = b[0] * p[0].normal[a] + b[1] * p[1].normal[a] + b[2] * p[2].normal[a];
+        }
+        vecNormalize(normal);
+    }
+}
+
+void bakeTexel(BakeContext& ctx, int x, int y, long long& rays) {
+    const LightmapAtlas& atlas = *ctx.atlas;
+    size_t index = (size_t)y * atlas.size + x;
+    int chartIndex = atlas.texelChart[index];
+    if (chartIndex < 0) return;
+    const LightmapChart& chart = atlas.charts[chartIndex];
+
+    BakeRandom random;
+    random.state = (unsigned int)(index * 2654435761u) ^ 0x9e3779b9u;
+    if (random.state == 0) random.state = 1;
+
+    GLfloat day[3] = {0, 0, 0}, night[3] = {0, 0, 0};
+    for (int s = 0; s < ctx.samples; s++) {
+        // Jitter within the texel so hard shadow edges come out antialiased
+        float u = chart.minU + (x - chart.x - 1 + random.next() - 0.5f) / atlas.density;
+        float v = chart.minV + (y - chart.y - 1 + random.next() - 0.5f) / atlas.density;
+        GLfloat point[3], normal[3];
+        chartSurfacePoint(*ctx.mesh, atlas, chart, u, v, point, normal);
+        GLfloat origin[3];
+        for (int a = 0; a < 3; a++) origin[a] = point[a] + normal[a] * 1e-3f;
+
+        GLfloat directDay[3], directNight[3];
+        directLight(ctx, origin, normal, directDay, directNight, rays);
+        for (int c = 0; c < 3; c++) {
+            day[c] += directDay[c];
+            night[c] += directNight[c];
+        }
+
+        // One bounce path shared by both states
+        GLfloat throughput[3] = {1.0f, 1.0f, 1.0f};
+        GLfloat pathOrigin[3], pathNormal[3];
+        memcpy(pathOrigin, origin, sizeof(origin));
+        memcpy(pathNormal, normal, sizeof(normal));
+        for (int bounce = 0; bounce < LIGHTMAP_BOUNCES; bounce++) {
+            GLfloat dir[3];
+            sampleHemisphere(pathNormal, random, dir);
+            RayHit hit;
+            rays++;
+            if (!traceRay(*ctx.scene, pathOrigin, dir, 1e30f, false, hit)) break;
+            const TraceTriangle& tri = ctx.scene->triangles[hit.triangle];
+            GLfloat albedo[3];
+            surfaceAlbedo(*ctx.mesh, *ctx.textures, tri, hit.u, hit.v, albedo);
+            const SceneVertex* p = &ctx.mesh->vertices[tri.firstVertex];
+            float w = 1.0f - hit.u - hit.v;
+            for (int a = 0; a < 3; a++) {
+                pathNormal[a] = w * p[0].normal[a] + hit.u * p[1].normal[a] + hit.v * p[2].normal[a];
+            }
+            vecNormalize(pathNormal);
+            if (vecDot(pathNormal, dir) > 0.0f) {
+                for (int a = 0; a < 3; a++) pathNormal[a] = -pathNormal[a];
+            }
+            for (int a = 0; a < 3; a++) {
+                pathOrigin[a] = pathOrigin[a] + dir[a] * hit.t + pathNormal[a] * 1e-3f;
+                throughput[a] *= albedo[a];
+            }
+            directLight(ctx, pathOrigin, pathNormal, directDay, directNight, rays);
+            for (int c = 0; c < 3; c++) {
+                day[c] += throughput[c] * directDay[c];
+                night[c] += throughput[c] * directNight[c];
+            }
+        }
+    }
+
+    // The ambient terms of the fixed-function model, evaluated at the texel
+    // center: global ambient plus the enabled light's ambient
+    GLfloat point[3], normal[3];
+    chartSurfacePoint(*ctx.mesh, atlas, chart, chart.minU + (x - chart.x - 1) / atlas.density,
+                      chart.minV + (y - chart.y - 1) / atlas.density, point, normal);
+    GLfloat toLamp[3];
+    vecSub(deskLampPosition, point, toLamp);
+    float distance = sqrtf(vecDot(toLamp, toLamp));
+    float atten = 1.0f / (deskLampAttenuation[0] + deskLampAttenuation[1] * distance +
+                          deskLampAttenuation[2] * distance * distance);
+    for (int c = 0; c < 3; c++) {
+        ctx.day[index * 3 + c] = globalAmbient[c] + sunAmbient[c] + day[c] / ctx.samples;
+        ctx.night[index * 3 + c] = globalAmbient[c] + atten * deskLampAmbient[c] + night[c] / ctx.samples;
+    }
+}
+
+void bakeWorker(BakeContext* ctx) {
+    long long rays = 0;
+    int size = ctx->atlas->size;
+    for (int y = ctx->nextRow++; y < size; y = ctx->nextRow++) {
+        for (int x = 0; x < size; x++) bakeTexel(*ctx, x, y, rays);
+    }
+    ctx->rays += rays;
+}
+
+// Radiance RGBE (.hdr), flat scanlines, bottom row first like GL textures
+bool writeRadianceHDR(const char* path, const std::vector<float>& rgb, int size) {
+    FILE* file = fopen(path, "wb");
+    if (!file) {
+        printf("Failed to write %s\n", path);
+        return false;
+    }
+    fprintf(file, "#?RADIANCE\nFORMAT=32-bit_rle_rgbe\n\n-Y %d +X %d\n", size, size);
+    std::vector<unsigned char> row(size * 4);
+    for (int y = size - 1; y >= 0; y--) {
+        for (int x = 0; x < size; x++) {
+            const float* c = &rgb[((size_t)y * size + x) * 3];
+            float brightest = std::max(c[0], std::max(c[1], c[2]));
+            unsigned char* out = &row[x * 4];
+            if (brightest < 1e-32f) {
+                out[0] = out[1] = out[2] = out[3] = 0;
+            } else {
+                int exponent;
+                float scale = frexpf(brightest, &exponent) * 256.0f / brightest;
+                for (int k = 0; k < 3; k++) out[k] = (unsigned char)(c[k] * scale);
+                out[3] = (unsigned char)(exponent + 128);
+            }
+        }
+        fwrite(&row[0], 1, row.size(), file);
+    }
+    fclose(file);
+    return true;
+}
+
+int bakeLightmaps(int samples, int threads, float density) {
+    double start = nowMs();
+    if (samples < 1) samples = 1;
+    if (density <= 0.0f) density = LIGHTMAP_DEFAULT_DENSITY;
+    if (threads <= 0) threads = std::max(1u, std::thread::hardware_concurrency());
+
+    std::vector<BakeTexture> textures;
+    loadBakeTextures(textures);
+
+    SceneMesh mesh;
+    captureScene(mesh);
+    LightmapAtlas atlas;
+    buildLightmapAtlas(mesh, density, atlas);
+    BVH scene, casters;
+    buildBVH(mesh, false, scene);
+    buildBVH(mesh, true, casters);
+    double setupMs = nowMs() - start;
+
+    printf("Baking lightmaps: %d triangles, %d charts, %dx%d atlas at %.1f texels/m\n",
+           (int)scene.triangles.size(), (int)atlas.charts.size(), atlas.size, atlas.size, density);
+    printf("  %d samples x %d bounces per texel on %d threads\n", samples, LIGHTMAP_BOUNCES, threads);
+
+    BakeContext ctx;
+    ctx.mesh = &mesh;
+    ctx.atlas = &atlas;
+    ctx.scene = &scene;
+    ctx.casters = &casters;
+    ctx.textures = &textures;
+    ctx.samples = samples;
+    ctx.day.assign((size_t)atlas.size * atlas.size * 3, 0.0f);
+    ctx.night.assign((size_t)atlas.size * atlas.size * 3, 0.0f);
+    ctx.nextRow = 0;
+    ctx.rays = 0;
+
+    double bakeStart = nowMs();
+    std::vector<std::thread> workers;
+    for (int i = 0; i < threads; i++) workers.push_back(std::thread(bakeWorker, &ctx));
+    for (size_t i = 0; i < workers.size(); i++) workers[i].join();
+    double bakeMs = nowMs() - bakeStart;
+
+    char path[256];
+    if (!makeDirectories(LIGHTMAP_DIR)) {
+        printf("Failed to create %s/\n", LIGHTMAP_DIR);
+        return 1;
+    }
+    snprintf(path, sizeof(path), "%s/day.hdr", LIGHTMAP_DIR);
+    if (!writeRadianceHDR(path, ctx.day, atlas.size)) return 1;
+    snprintf(path, sizeof(path), "%s/night.hdr", LIGHTMAP_DIR);
+    if (!writeRadianceHDR(path, ctx.night, atlas.size)) return 1;
+    snprintf(path, sizeof(path), "%s/atlas.txt", LIGHTMAP_DIR);
+    FILE* file = fopen(path, "w");
+    if (!file) {
+        printf("Failed to write %s\n", path);
+        return 1;
+    }
+    fprintf(file, "size %d\ndensity %g\nhash %u\nsamples %d\n", atlas.size, density, atlas.sceneHash, samples);
+    fclose(file);
+
+    long long rays = ctx.rays;
+    printf("  setup %.1f ms, bake %.1f s, %.1f Mrays/s\n", setupMs, bakeMs / 1000.0,
+           rays / (bakeMs * 1000.0));
+    printf("Lightmaps written to %s/ (day.hdr, night.hdr, atlas.txt)\n", LIGHTMAP_DIR);
+    return 0;
+}
+
+// ============= Ambient Occlusion Baker =============
+// Offline tool (--bake-ao): subdivides the large lit quads so occlusion has
+// vertices to live on, then estimates per-vertex ambient occlusion with
+// packets of four rays against the scene BVH. The result is written as the
+// cooked mesh: the baked surfaces with their occlusion, ready to upload.
+struct CookedMeshHeader {
+    char magic[8];
+    unsigned int version;
+    unsigned int sceneHash;   // sceneGeometryHash() of the captured room
+    int vertexCount;
+    int batchCount;
+    float maxEdge;
+    int rays;
+};
+
+struct CookedVertex {
+    GLfloat position[3];
+    GLfloat normal[3];
+    GLfloat texCoord[2];
+    GLfloat color[4];
+    GLfloat occlusion;    // 1 = fully open, 0 = fully occluded
+};
+
+struct CookedBatch {
+    int textureIndex;     // into sceneTextureFiles, -1 for none
+    int textured;
+    GLfloat specular[4];
+    GLfloat shininess;
+    int firstVertex;
+    int vertexCount;
+};
+
+const char COOKED_MESH_MAGIC[8] = {'S', 'D', 'M', 'E', 'S', 'H', '\0', '\0'};
+const unsigned int COOKED_MESH_VERSION = 1;
+
+// Hash of the baked surfaces, to detect bakes that no longer match the room
+unsigned int sceneGeometryHash(const SceneMesh& mesh) {
+    unsigned int hash = 2166136261u;
+    for (size_t d = 0; d < mesh.draws.size(); d++) {
+        const SceneDraw& draw = mesh.draws[d];
+        if (!isBakedDraw(draw)) continue;
+        for (int v = draw.firstVertex; v < draw.firstVertex + draw.vertexCount; v++) {
+            hash = hashBytes(hash, mesh.vertices[v].position, sizeof(mesh.vertices[v].position));
+        }
+    }
+    return hash;
+}
+
+CookedVertex lerpCookedVertex(const CookedVertex& a, const CookedVertex& b, float t) {
+    CookedVertex out;
+    const GLfloat* fa = &a.position[0];
+    const GLfloat* fb = &b.position[0];
+    GLfloat* fo = &out.position[0];
+    for (size_t i = 0; i < sizeof(CookedVertex) / sizeof(GLfloat); i++) {
+        fo[i] = fa[i] + (fb[i] - fa[i]) * t;
+    }
+    vecNormalize(out.normal);
+    return out;
+}
+
+CookedVertex toCookedVertex(const SceneVertex& v) {
+    CookedVertex out;
+    memcpy(out.position, v.position, sizeof(out.position));
+    memcpy(out.normal, v.normal, sizeof(out.normal));
+    memcpy(out.texCoord, v.texCoord, sizeof(out.texCoord));
+    memcpy(out.color, v.color, sizeof(out.color));
+    out.occlusion = 1.0f;
+    return out;
+}
+
+// Copies the baked surfaces, splitting quads into a grid of cells no longer
+// than maxEdge on a side. Triangles (GLUT solids) are already fine enough.
+void cookSceneMesh(const SceneMesh& mesh, float maxEdge,
+                   std::vector<CookedVertex>& vertices, std::vector<CookedBatch>& batches) {
+    for (size_t d = 0; d < mesh.draws.size(); d++) {
+        const SceneDraw& draw = mesh.draws[d];
+        if (!isBakedDraw(draw)) continue;
+
+        CookedBatch batch;
+        batch.textureIndex = sceneTextureIndex(draw.texture);
+        batch.textured = (draw.textured && batch.textureIndex >= 0) ? 1 : 0;
+        memcpy(batch.specular, draw.specular, sizeof(batch.specular));
+        batch.shininess = draw.shininess;
+        batch.firstVertex = (int)vertices.size();
+
+        const SceneVertex* p = &mesh.vertices[draw.firstVertex];
+        if (draw.polygonSides == 4) {
+            for (int q = 0; q + 6 <= draw.vertexCount; q += 6) {
+                // Quads were captured as (0, 1, 2), (0, 2, 3)
+                CookedVertex corners[4] = {toCookedVertex(p[q]), toCookedVertex(p[q + 1]),
+                                           toCookedVertex(p[q + 2]), toCookedVertex(p[q + 5])};
+                GLfloat edgeU[3], edgeV[3];
+                vecSub(corners[1].position, corners[0].position, edgeU);
+                vecSub(corners[2].position, corners[1].position, edgeV);
+                int cellsU = std::max(1, (int)ceilf(sqrtf(vecDot(edgeU, edgeU)) / maxEdge));
+                int cellsV = std::max(1, (int)ceilf(sqrtf(vecDot(edgeV, edgeV)) / maxEdge));
+                for (int j = 0; j < cellsV; j++) {
+                    for (int i = 0; i < cellsU; i++) {
+                        CookedVertex cell[4];
+                        const int offsets[4][2] = {{0, 0}, {1, 0}, {1, 1}, {0, 1}};
+                        for (int k = 0; k < 4; k++) {
+                            float s = (float)(i + offsets[k][0]) / cellsU;
+                            float t = (float)(j + offsets[k][1]) / cellsV;
+                            cell[k] = lerpCookedVertex(lerpCookedVertex(corners[0], corners[1], s),
+                                                       lerpCookedVertex(corners[3], corners[2], s), t);
+                        }
+                        const int order[6] = {0, 1, 2, 0, 2, 3};
+                        for (int k = 0; k < 6; k++) vertices.push_back(cell[order[k]]);
+                    }
+                }
+            }
+        } else {
+            for (int v = 0; v < draw.vertexCount; v++) vertices.push_back(toCookedVertex(p[v]));
+        }
+        batch.vertexCount = (int)vertices.size() - batch.firstVertex;
+
+        if (!batches.empty()) {
+            CookedBatch& last = batches.back();
+            if (last.textureIndex == batch.textureIndex && last.textured == batch.textured &&
+                memcmp(last.specular, batch.specular, sizeof(batch.specular)) == 0 &&
+                last.shininess == batch.shininess) {
+                last.vertexCount += batch.vertexCount;
+                continue;
+            }
+        }
+        batches.push_back(batch);
+    }
+}
+
+// Four rays from one origin against the BVH; returns a bit per ray that hits
+// something within maxDistance. With SSE the four rays are tested together
+// against each node and triangle; the shared origin makes the per-triangle
+// origin terms scalar.
+int occludedPacket(const BVH& bvh, const GLfloat* origin, const GLfloat dirs[4][3], float maxDistance) {
+    if (bvh.triangles.empty()) return 0;
+#if defined(__SSE2__)
+    __m128 dir[3], invDir[3];
+    for (int a = 0; a < 3; a++) {
+        float inv[4];
+        for (int r = 0; r < 4; r++) inv[r] = (fabsf(dirs[r][a]) > 1e-12f) ? 1.0f / dirs[r][a] : 1e12f;
+        dir[a] = _mm_setr_ps(dirs[0][a], dirs[1][a], dirs[2][a], dirs[3][a]);
+        invDir[a] = _mm_loadu_ps(inv);
+    }
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 tMax = _mm_set1_ps(maxDistance);
+    const __m128 tMin = _mm_set1_ps(1e-4f);
+    const __m128 epsilon = _mm_set1_ps(1e-12f);
+    const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+
+    int occluded = 0;
+    int stack[BVH_STACK_SIZE];
+    int depth = 0;
+    stack[depth++] = 0;
+    while (depth > 0) {
+        const BVHNode& node = bvh.nodes[stack[--depth]];
+        __m128 tEnter = zero, tExit = tMax;
+        for (int a = 0; a < 3; a++) {
+            __m128 o = _mm_set1_ps(origin[a]);
+            __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.boundsMin[a]), o), invDir[a]);
+            __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.boundsMax[a]), o), invDir[a]);
+            tEnter = _mm_max_ps(tEnter, _mm_min_ps(t0, t1));
+            tExit = _mm_min_ps(tExit, _mm_max_ps(t0, t1));
+        }
+        int active = _mm_movemask_ps(_mm_cmple_ps(tEnter, tExit)) & ~occluded;
+        if (active == 0) continue;
+
+        if (node.count == 0) {
+            stack[depth++] = node.first;
+            stack[depth++] = node.first + 1;
+            continue;
+        }
+        for (int i = node.first; i < node.first + node.count; i++) {
+            const TraceTriangle& tri = bvh.triangles[i];
+            // pvec = dir x e2, per ray
+            __m128 px = _mm_sub_ps(_mm_mul_ps(dir[1], _mm_set1_ps(tri.e2[2])), _mm_mul_ps(dir[2], _mm_set1_ps(tri.e2[1])));
+            __m128 py = _mm_sub_ps(_mm_mul_ps(dir[2], _mm_set1_ps(tri.e2[0])), _mm_mul_ps(dir[0], _mm_set1_ps(tri.e2[2])));
+            __m128 pz = _mm_sub_ps(_mm_mul_ps(dir[0], _mm_set1_ps(tri.e2[1])), _mm_mul_ps(dir[1], _mm_set1_ps(tri.e2[0])));
+            __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(tri.e1[0]), px),
+                                               _mm_mul_ps(_mm_set1_ps(tri.e1[1]), py)),
+                                    _mm_mul_ps(_mm_set1_ps(tri.e1[2]), pz));
+            __m128 invDet = _mm_div_ps(one, det);
+            // tvec and qvec only depend on the shared origin
+            GLfloat tvec[3], qvec[3];
+            vecSub(origin, tri.p0, tvec);
+            vecCross(tvec, tri.e1, qvec);
+            __m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(tvec[0]), px),
+                                                        _mm_mul_ps(_mm_set1_ps(tvec[1]), py)),
+                                             _mm_mul_ps(_mm_set1_ps(tvec[2]), pz)), invDet);
+            __m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dir[0], _mm_set1_ps(qvec[0])),
+                                                        _mm_mul_ps(dir[1], _mm_set1_ps(qvec[1]))),
+                                             _mm_mul_ps(dir[2], _mm_set1_ps(qvec[2]))), invDet);
+            __m128 t = _mm_mul_ps(_mm_set1_ps(vecDot(tri.e2, qvec)), invDet);
+            __m128 hit = _mm_cmpgt_ps(_mm_and_ps(det, absMask), epsilon);
+            hit = _mm_and_ps(hit, _mm_cmpge_ps(u, zero));
+            hit = _mm_and_ps(hit, _mm_cmpge_ps(v, zero));
+            hit = _mm_and_ps(hit, _mm_cmple_ps(_mm_add_ps(u, v), one));
+            hit = _mm_and_ps(hit, _mm_cmpgt_ps(t, tMin));
+            hit = _mm_and_ps(hit, _mm_cmplt_ps(t, tMax));
+            occluded |= _mm_movemask_ps(hit);
+            if (occluded == 0xF) return occluded;
+        }
+    }
+    return occluded;
+#else
+    int occluded = 0;
+    for (int r = 0; r < 4; r++) {
+        RayHit hit;
+        if (traceRay(bvh, origin, dirs[r], maxDistance, true, hit)) occluded |= 1 << r;
+    }
+    return occluded;
+#endif
+}
+
+struct OcclusionContext {
+    const BVH* scene;
+    std::vector<CookedVertex>* vertices;
+    int rays;
+    std::atomic<int> nextVertex;
+};
+
+void occlusionWorker(OcclusionContext* ctx) {
+    const int CHUNK = 64;
+    std::vector<CookedVertex>& vertices = *ctx->vertices;
+    int count = (int)vertices.size();
+    for (int first = ctx->nextVertex.fetch_add(CHUNK); first < count; first = ctx->nextVertex.fetch_add(CHUNK)) {
+        for (int i = first; i < std::min(first + CHUNK, count); i++) {
+            CookedVertex& vertex = vertices[i];
+            // Seeded from the vertex itself, so the copies of a shared corner
+            // get the same value and no seams appear between cells
+            BakeRandom random;
+            random.state = hashBytes(hashBytes(2166136261u, vertex.position, sizeof(vertex.position)),
+                                     vertex.normal, sizeof(vertex.normal));
+            if (random.state == 0) random.state = 1;
+
+            GLfloat origin[3];
+            for (int a = 0; a < 3; a++) origin[a] = vertex.position[a] + vertex.normal[a] * 1e-3f;
+            int hits = 0;
+            for (int r = 0; r < ctx->rays; r += 4) {
+                GLfloat dirs[4][3];
+                for (int k = 0; k < 4; k++) sampleHemisphere(vertex.normal, random, dirs[k]);
+                int mask = occludedPacket(*ctx->scene, origin, dirs, AO_DISTANCE);
+                hits += (mask & 1) + ((mask >> 1) & 1) + ((mask >> 2) & 1) + ((mask >> 3) & 1);
+            }
+            vertex.occlusion = 1.0f - (float)hits / ctx->rays;
+        }
+    }
+}
+
+int bakeAmbientOcclusion(int rays, int threads, float maxEdge) {
+    double start = nowMs();
+    rays = std::max(4, (rays + 3) / 4 * 4);
+    if (maxEdge <= 0.0f) maxEdge = AO_DEFAULT_MAX_EDGE;
+    if (threads <= 0) threads = std::max(1u, std::thread::hardware_concurrency());
+
+    assignHeadlessTextureIds();
+    SceneMesh mesh;
+    captureScene(mesh);
+    std::vector<CookedVertex> vertices;
+    std::vector<CookedBatch> batches;
+    cookSceneMesh(mesh, maxEdge, vertices, batches);
+    BVH scene;
+    buildBVH(mesh, false, scene);
+    double setupMs = nowMs() - start;
+
+    int sourceVertices = 0;
+    for (size_t d = 0; d < mesh.draws.size(); d++) {
+        if (isBakedDraw(mesh.draws[d])) sourceVertices += mesh.draws[d].vertexCount;
+    }
+    printf("Baking ambient occlusion: %d vertices (%d before subdividing to %.2f m), %d triangles in BVH\n",
+           (int)vertices.size(), sourceVertices, maxEdge, (int)scene.triangles.size());
+#if defined(__SSE2__)
+    printf("  %d rays per vertex in SSE packets of 4 on %d threads\n", rays, threads);
+#else
+    printf("  %d rays per vertex (scalar) on %d threads\n", rays, threads);
+#endif
+
+    OcclusionContext ctx;
+    ctx.scene = &scene;
+    ctx.vertices = &vertices;
+    ctx.rays = rays;
+    ctx.nextVertex = 0;
+    double bakeStart = nowMs();
+    std::vector<std::thread> workers;
+    for (int i = 0; i < threads; i++) workers.push_back(std::thread(occlusionWorker, &ctx));
+    for (size_t i = 0; i < workers.size(); i++) workers[i].join();
+    double bakeMs = nowMs() - bakeStart;
+
+    char path[256];
+    if (!makeDirectories(COOKED_DIR)) {
+        printf("Failed to create %s/\n", COOKED_DIR);
+        return 1;
+    }
+    snprintf(path, sizeof(path), "%s/scene.mesh", COOKED_DIR);
+    FILE* file = fopen(path, "wb");
+    if (!file) {
+        printf("Failed to write %s\n", path);
+        return 1;
+    }
+    CookedMeshHeader header;
+    memcpy(header.magic, COOKED_MESH_MAGIC, sizeof(header.magic));
+    header.version = COOKED_MESH_VERSION;
+    header.sceneHash = sceneGeometryHash(mesh);
+    header.vertexCount = (int)vertices.size();
+    header.batchCount = (int)batches.size();
+    header.maxEdge = maxEdge;
+    header.rays = rays;
+    fwrite(&header, sizeof(header), 1, file);
+    fwrite(&vertices[0], sizeof(CookedVertex), vertices.size(), file);
+    fwrite(&batches[0], sizeof(CookedBatch), batches.size(), file);
+    fclose(file);
+
+    double totalRays = (double)vertices.size() * rays;
+    printf("  setup %.1f ms, bake %.2f s, %.1f Mrays/s\n", setupMs, bakeMs / 1000.0, totalRays / (bakeMs * 1000.0));
+    printf("Cooked mesh written to %s\n", path);
+    return 0;
+}
+
+// ============= Baked Lightmap Renderer =============
+// Lit, opaque surfaces are drawn from a single vertex buffer whose lighting
+// comes from the baked atlas. Specular highlights are view dependent and are
+// not baked; the radio's is the only one the scene has.
+struct LightmapBatch {
+    GLuint texture;
+    bool textured;
+    int firstVertex;
+    int vertexCount;
+};
+std::vector<LightmapBatch> lightmapBatches;
+
+GLuint loadLightmapTexture(const char* path, int expectedSize) {
+    int width, height, channels;
+    float* data = stbi_loadf(path, &width, &height, &channels, 3);
+    if (!data) {
+        printf("Failed to load %s\n", path);
+        return 0;
+    }
+    if (width != expectedSize || height != expectedSize) {
+        printf("%s is %dx%d, atlas expects %d\n", path, width, height, expectedSize);
+        stbi_image_free(data);
+        return 0;
+    }
+    // stb returns the top row first; flip back to GL's bottom-up order
+    std::vector<float> flipped((size_t)width * height * 3);
+    for (int y = 0; y < height; y++) {
+        memcpy(&flipped[(size_t)y * width * 3], &data[(size_t)(height - 1 - y) * width * 3], width * 3 * sizeof(float));
+    }
+    stbi_image_free(data);
+
+    GLuint texture;
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB16F, width, height, 0, GL_RGB, GL_FLOAT, &flipped[0]);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    return texture;
+}
+
+// Loads the baked atlas if one exists and matches the current scene
+void setupLightmaps() {
+    char path[256];
+    snprintf(path, sizeof(path), "%s/atlas.txt", LIGHTMAP_DIR);
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        printf("Baked lightmaps not found (run with --bake-lightmaps to create them)\n");
+        return;
+    }
+    int size = 0, samples = 0;
+    float density = 0.0f;
+    unsigned int hash = 0;
+    if (fscanf(file, "size %d\ndensity %f\nhash %u\nsamples %d", &size, &density, &hash, &samples) != 4) {
+        fclose(file);
+        printf("Failed to parse %s\n", path);
+        return;
+    }
+    fclose(file);
+
+    SceneMesh mesh;
+    captureScene(mesh);
+    LightmapAtlas atlas;
+    buildLightmapAtlas(mesh, density, atlas);
+    if (atlas.size != size || atlas.sceneHash != hash) {
+        printf("Baked lightmaps are out of date with the scene, re-run --bake-lightmaps\n");
+        return;
+    }
+
+    lightmapProgram = loadProgram("shaders/lightmap.vert", "shaders/lightmap.frag");
+    if (lightmapProgram == 0) return;
+    glUseProgram(lightmapProgram);
+    glUniform1i(glGetUniformLocation(lightmapProgram, "uTexture"), 0);
+    glUniform1i(glGetUniformLocation(lightmapProgram, "uLightmap"), 1);
+    glUniform1i(glGetUniformLocation(lightmapProgram, "uLightmapNight"), 12);
+    glUseProgram(0);
+
+    snprintf(path, sizeof(path), "%s/day.hdr", LIGHTMAP_DIR);
+    lightmapDayTexture = loadLightmapTexture(path, size);
+    snprintf(path, sizeof(path), "%s/night.hdr", LIGHTMAP_DIR);
+    lightmapNightTexture = loadLightmapTexture(path, size);
+    if (lightmapDayTexture == 0 || lightmapNightTexture == 0) return;
+
+    // Interleaved position, texcoord, lightmap coord, color
+    std::vector<GLfloat> vertices;
+    lightmapBatches.clear();
+    for (size_t d = 0; d < mesh.draws.size(); d++) {
+        const SceneDraw& draw = mesh.draws[d];
+        if (!isBakedDraw(draw)) continue;
+        bool textured = draw.textured && draw.texture != 0;
+        int first = (int)(vertices.size() / 11);
+        if (!lightmapBatches.empty() && lightmapBatches.back().texture == draw.texture &&
+            lightmapBatches.back().textured == textured) {
+            lightmapBatches.back().vertexCount += draw.vertexCount;
+        } else {
+            LightmapBatch batch = {draw.texture, textured, first, draw.vertexCount};
+            lightmapBatches.push_back(batch);
+        }
+        for (int v = draw.firstVertex; v < draw.firstVertex + draw.vertexCount; v++) {
+            const SceneVertex& vertex = mesh.vertices[v];
+            vertices.insert(vertices.end(), vertex.position, vertex.position + 3);
+            vertices.insert(vertices.end(), vertex.texCoord, vertex.texCoord + 2);
+            vertices.push_back(atlas.vertexCoords[v * 2]);
+            vertices.push_back(atlas.vertexCoords[v * 2 + 1]);
+            vertices.insert(vertices.end(), vertex.color, vertex.color + 4);
+        }
+    }
+    glGenBuffers(1, &lightmapVBO);
+    glBindBuffer(GL_ARRAY_BUFFER, lightmapVBO);
+    glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(GLfloat), &vertices[0], GL_STATIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    lightmapsLoaded = true;
+    printf("Baked lightmaps loaded: %dx%d atlas, %d samples, %d vertices in %d batches\n",
+           size, size, samples, (int)(vertices.size() / 11), (int)lightmapBatches.size());
+}
+
+// Draws the lightmapped surfaces; expects the modelview to hold just the camera
+void drawLightmappedScene() {
+    glUseProgram(lightmapProgram);
+    glUniform1f(glGetUniformLocation(lightmapProgram, "uDayWeight"), lightmapDayWeight);
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, lightmapDayTexture);
+    glActiveTexture(GL_TEXTURE12);
+    glBindTexture(GL_TEXTURE_2D, lightmapNightTexture);
+    glActiveTexture(GL_TEXTURE0);
+
+    const GLsizei stride = 11 * sizeof(GLfloat);
+    glBindBuffer(GL_ARRAY_BUFFER, lightmapVBO);
+    for (int i = 0; i < 4; i++) glEnableVertexAttribArray(i);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, stride, (const void*)0);
+    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, stride, (const void*)(3 * sizeof(GLfloat)));
+    glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, stride, (const void*)(5 * sizeof(GLfloat)));
+    glVertexAttribPointer(3, 4, GL_FLOAT, GL_FALSE, stride, (const void*)(7 * sizeof(GLfloat)));
+
+    GLint texturedLocation = glGetUniformLocation(lightmapProgram, "uTextured");
+    for (size_t i = 0; i < lightmapBatches.size(); i++) {
+        const LightmapBatch& batch = lightmapBatches[i];
+        glBindTexture(GL_TEXTURE_2D, batch.texture);
+        glUniform1i(texturedLocation, batch.textured ? 1 : 0);
+        glDrawArrays(GL_TRIANGLES, batch.firstVertex, batch.vertexCount);
+        drawCallCount++;
+        triangleCount += batch.vertexCount / 3;
+        textureBindCount++;
+    }
+
+    for (int i = 0; i < 4; i++) glDisableVertexAttribArray(i);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glUseProgram(0);
+}
+
+// ============= Cooked Mesh Renderer =============
+// With the GLSL renderer, the baked surfaces are drawn from the cooked mesh
+// so the per-vertex occlusion can scale their ambient terms. It is just one
+// more vertex attribute; the rest of the shading is unchanged.
+struct CookedDrawBatch {
+    GLuint texture;
+    bool textured;
+    GLfloat specular[4];
+    GLfloat shininess;
+    int firstVertex;
+    int vertexCount;
+};
+std::vector<CookedDrawBatch> cookedBatches;
+
+// Reads and checks a cooked mesh file; false (with a message) if it is
+// missing, of another version or truncated
+bool readCookedMesh(const char* path, CookedMeshHeader& header, std::vector<CookedVertex>& vertices,
+                    std::vector<CookedBatch>& batches) {
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        printf("Cooked mesh not found (run with --bake-ao to create it)\n");
+        return false;
+    }
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        memcmp(header.magic, COOKED_MESH_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != COOKED_MESH_VERSION || header.vertexCount <= 0 || header.batchCount <= 0) {
+        printf("%s is not a cooked mesh of this version\n", path);
+        fclose(file);
+        return false;
+    }
+    vertices.resize(header.vertexCount);
+    batches.resize(header.batchCount);
+    bool complete = fread(&vertices[0], sizeof(CookedVertex), vertices.size(), file) == vertices.size() &&
+                    fread(&batches[0], sizeof(CookedBatch), batches.size(), file) == batches.size();
+    fclose(file);
+    if (!complete) printf("%s is truncated\n", path);
+    return complete;
+}
+
+void setupCookedMesh() {
+    if (sceneProgram == 0) return;
+    char path[256];
+    snprintf(path, sizeof(path), "%s/scene.mesh", COOKED_DIR);
+    CookedMeshHeader header;
+    std::vector<CookedVertex> vertices;
+    std::vector<CookedBatch> batches;
+    if (!readCookedMesh(path, header, vertices, batches)) return;
+
+    SceneMesh mesh;
+    captureScene(mesh);
+    if (sceneGeometryHash(mesh) != header.sceneHash) {
+        printf("Cooked mesh is out of date with the scene, re-run --bake-ao\n");
+        return;
+    }
+
+    glGenBuffers(1, &cookedMeshVBO);
+    glBindBuffer(GL_ARRAY_BUFFER, cookedMeshVBO);
+    glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(CookedVertex), &vertices[0], GL_STATIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    cookedBatches.clear();
+    for (size_t i = 0; i < batches.size(); i++) {
+        const CookedBatch& in = batches[i];
+        CookedDrawBatch batch;
+        batch.texture = (in.textureIndex >= 0 && in.textureIndex < SCENE_TEXTURE_COUNT)
+                            ? *sceneTextureFiles[in.textureIndex].id : 0;
+        batch.textured = in.textured != 0;
+        memcpy(batch.specular, in.specular, sizeof(batch.specular));
+        batch.shininess = in.shininess;
+        batch.firstVertex = in.firstVertex;
+        batch.vertexCount = in.vertexCount;
+        cookedBatches.push_back(batch);
+    }
+
+    double occlusionSum = 0.0;
+    for (size_t i = 0; i < vertices.size(); i++) occlusionSum += vertices[i].occlusion;
+    cookedMeshLoaded = true;
+    printf("Cooked mesh loaded: %d vertices in %d batches, %d AO rays, mean occlusion %.2f\n",
+           header.vertexCount, header.batchCount, header.rays, 1.0 - occlusionSum / vertices.size());
+}
+
+// Draws the cooked surfaces with the bound scene, clustered or G-buffer program
+void drawCookedScene() {
+    const GLsizei stride = sizeof(CookedVertex);
+    glBindBuffer(GL_ARRAY_BUFFER, cookedMeshVBO);
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_NORMAL_ARRAY);
+    glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+    glEnableClientState(GL_COLOR_ARRAY);
+    glEnableVertexAttribArray(AO_ATTRIBUTE_LOCATION);
+    glVertexPointer(3, GL_FLOAT, stride, (const void*)offsetof(CookedVertex, position));
+    glNormalPointer(GL_FLOAT, stride, (const void*)offsetof(CookedVertex, normal));
+    glTexCoordPointer(2, GL_FLOAT, stride, (const void*)offsetof(CookedVertex, texCoord));
+    glColorPointer(4, GL_FLOAT, stride, (const void*)offsetof(CookedVertex, color));
+    glVertexAttribPointer(AO_ATTRIBUTE_LOCATION, 1, GL_FLOAT, GL_FALSE, stride,
+                          (const void*)offsetof(CookedVertex, occlusion));
+
+    for (size_t i = 0; i < cookedBatches.size(); i++) {
+        const CookedDrawBatch& batch = cookedBatches[i];
+        glBindTexture(GL_TEXTURE_2D, batch.texture);
+        if (batch.textured) glEnable(GL_TEXTURE_2D); else glDisable(GL_TEXTURE_2D);
+        glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, batch.specular);
+        glMaterialf(GL_FRONT_AND_BACK, GL_SHININESS, batch.shininess);
+        syncDrawState();
+        glDrawArrays(GL_TRIANGLES, batch.firstVertex, batch.vertexCount);
+        drawCallCount++;
+        triangleCount += batch.vertexCount / 3;
+        textureBindCount++;
+    }
+
+    // Back to the state the draw functions start from
+    const GLfloat defaultSpecular[4] = {0.0f, 0.0f, 0.0f, 1.0f};
+    glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, defaultSpecular);
+    glMaterialf(GL_FRONT_AND_BACK, GL_SHININESS, 0.0f);
+    glEnable(GL_TEXTURE_2D);
+    glDisableVertexAttribArray(AO_ATTRIBUTE_LOCATION);
+    glVertexAttrib1f(AO_ATTRIBUTE_LOCATION, 1.0f);
+    glDisableClientState(GL_VERTEX_ARRAY);
+    glDisableClientState(GL_NORMAL_ARRAY);
+    glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+    glDisableClientState(GL_COLOR_ARRAY);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+// ============= Frame Worker Pool =============
+// Work split across cores every frame (the cluster assignment, the software
+// rasterizer's phases, the path tracer's rows) runs on threads started once
+// and parked between jobs, so no frame pays for creating and joining
+// threads. The offline bakers keep their own one-shot workers.
+struct FrameWorkerPool {
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    void (*job)(int);
+    int jobWorkers;    // workers taking part in the current job
+    int generation;    // bumped for every job
+    int pending;       // helpers still running the current job
+    int helpers;       // threads started so far
+};
+FrameWorkerPool* frameWorkers = NULL;  // never destroyed; the threads live until exit
+
+void frameWorkerLoop(int index) {
+    FrameWorkerPool& pool = *frameWorkers;
+    int seen = 0;
+    for (;;) {
+        void (*job)(int);
+        {
+            std::unique_lock<std::mutex> lock(pool.mutex);
+            pool.wake.wait(lock, [&] { return pool.generation != seen; });
+            seen = pool.generation;
+            if (index >= pool.jobWorkers) continue;
+            job = pool.job;
+        }
+        job(index);
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        if (--pool.pending == 0) pool.done.notify_one();
+    }
+}
+
+// Calls job(0) .. job(workers - 1) in parallel, job(0) on the calling
+// thread, and returns once all of them are done
+void runOnFrameWorkers(void (*job)(int), int workers) {
+    if (workers <= 1) {
+        job(0);
+        return;
+    }
+    if (!frameWorkers) {
+        frameWorkers = new FrameWorkerPool();
+        frameWorkers->job = NULL;
+        frameWorkers->jobWorkers = frameWorkers->generation = frameWorkers->pending = frameWorkers->helpers = 0;
+    }
+    FrameWorkerPool& pool = *frameWorkers;
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        while (pool.helpers < workers - 1) {
+            std::thread(frameWorkerLoop, ++pool.helpers).detach();
+        }
+        pool.job = job;
+        pool.jobWorkers = workers;
+        pool.pending = workers - 1;
+        pool.generation++;
+    }
+    pool.wake.notify_all();
+    job(0);
+    std::unique_lock<std::mutex> lock(pool.mutex);
+    pool.done.wait(lock, [&] { return pool.pending == 0; });
+}
+
+// ============= Clustered Forward Lighting =============
+// Every point light (the desk lamp plus the extra lights) is binned into a
+// CLUSTER_TILES_X x CLUSTER_TILES_Y x CLUSTER_SLICES grid over the view
+// frustum, with exponentially spaced depth slices. The lists are rebuilt on
+// the CPU each frame, slices split across the frame workers, and handed to
+// the shader through texture buffers on units 4-6.
+struct PointLight {
+    GLfloat position[3];  // world space
+    GLfloat radius;       // no contribution beyond this distance
+    GLfloat diffuse[3];
+    GLfloat ambient[3];
+    GLfloat specular[3];
+    GLfloat attenuation[3];
+    bool lampShadow;      // the desk lamp, shadowed by its cube map
+};
+
+struct ClusterBounds {
+    GLfloat boundsMin[3], boundsMax[3];
+};
+
+const int CLUSTER_COUNT = CLUSTER_TILES_X * CLUSTER_TILES_Y * CLUSTER_SLICES;
+const int LIGHT_TEXELS = 5;
+
+struct ClusterState {
+    std::vector<PointLight> lights;
+    int generatedCount;
+    std::vector<ClusterBounds> bounds;
+    GLfloat projectionX, projectionY;  // projection the bounds were built for
+    std::vector<GLfloat> lightData;    // LIGHT_TEXELS RGBA texels per visible light
+    std::vector<GLfloat> spheres;      // eye-space center and radius per visible light
+    std::vector<std::vector<GLuint> > sliceIndices;
+    std::vector<GLuint> grid;          // offset, count per cluster
+    std::vector<GLuint> indices;
+    GLuint buffers[3];                 // light data, grid, indices
+    GLuint textures[3];
+    double buildMs;
+    double buildMsSum;
+    int builds;
+    int maxPerCluster;
+};
+ClusterState clusters;
+
+// The desk lamp followed by count - 2 extra lights (the sun is the other
+// one): the red star sign outside the window, ceiling fixtures, then small
+// lamps scattered through the room. Deterministic, so runs are comparable.
+void generateClusterLights(int count) {
+    clusters.lights.clear();
+    PointLight lamp;
+    memcpy(lamp.position, deskLampPosition, sizeof(lamp.position));
+    lamp.radius = CLUSTER_FAR * 2.0f; // fixed-function falloff never reaches zero
+    memcpy(lamp.diffuse, deskLampDiffuse, sizeof(lamp.diffuse));
+    memcpy(lamp.ambient, deskLampAmbient, sizeof(lamp.ambient));
+    memcpy(lamp.specular, deskLampSpecular, sizeof(lamp.specular));
+    memcpy(lamp.attenuation, deskLampAttenuation, sizeof(lamp.attenuation));
+    lamp.lampShadow = true;
+    clusters.lights.push_back(lamp);
+
+    int extras = std::max(0, count - 2);
+    // Keep the total added light about the same whatever the count
+    float intensity = std::min(0.8f, 8.0f / std::max(1, extras));
+    BakeRandom random;
+    random.state = 12345u;
+    for (int i = 0; i < extras; i++) {
+        PointLight light;
+        memset(&light, 0, sizeof(light));
+        light.attenuation[0] = 1.0f;
+        light.attenuation[2] = 0.5f;
+        light.radius = 2.5f;
+        GLfloat color[3] = {1.0f, 0.9f, 0.75f};
+        if (i == 0) {
+            // Red star neon sign, just outside the window
+            light.position[0] = -4.6f; light.position[1] = 3.0f; light.position[2] = -0.5f;
+            color[0] = 1.0f; color[1] = 0.1f; color[2] = 0.05f;
+            light.radius = 4.0f;
+        } else if (i <= 9) {
+            // Ceiling fixtures on a 3x3 grid
+            light.position[0] = -3.0f + 3.0f * ((i - 1) % 3);
+            light.position[1] = 4.7f;
+            light.position[2] = -3.0f + 3.0f * ((i - 1) / 3);
+            light.radius = 3.5f;
+        } else {
+            light.position[0] = -4.5f + 9.0f * random.next();
+            light.position[1] = 0.3f + 4.0f * random.next();
+            light.position[2] = -4.5f + 9.0f * random.next();
+            color[1] = 0.7f + 0.3f * random.next();
+            color[2] = 0.5f + 0.5f * random.next();
+        }
+        for (int c = 0; c < 3; c++) {
+            light.diffuse[c] = color[c] * intensity;
+            light.specular[c] = color[c] * intensity;
+        }
+        clusters.lights.push_back(light);
+    }
+    clusters.generatedCount = count;
+}
+
+// Eye-space AABB of each cluster, from the projection's x and y scale
+void buildClusterBounds(const GLfloat* projection) {
+    clusters.bounds.resize(CLUSTER_COUNT);
+    clusters.projectionX = projection[0];
+    clusters.projectionY = projection[5];
+    for (int s = 0; s < CLUSTER_SLICES; s++) {
+        float nearDepth = CLUSTER_NEAR * powf(CLUSTER_FAR / CLUSTER_NEAR, (float)s / CLUSTER_SLICES);
+        float farDepth = CLUSTER_NEAR * powf(CLUSTER_FAR / CLUSTER_NEAR, (float)(s + 1) / CLUSTER_SLICES);
+        for (int ty = 0; ty < CLUSTER_TILES_Y; ty++) {
+            for (int tx = 0; tx < CLUSTER_TILES_X; tx++) {
+                ClusterBounds& b = clusters.bounds[(s * CLUSTER_TILES_Y + ty) * CLUSTER_TILES_X + tx];
+                float ndcX[2] = {-1.0f + 2.0f * tx / CLUSTER_TILES_X, -1.0f + 2.0f * (tx + 1) / CLUSTER_TILES_X};
+                float ndcY[2] = {-1.0f + 2.0f * ty / CLUSTER_TILES_Y, -1.0f + 2.0f * (ty + 1) / CLUSTER_TILES_Y};
+                for (int a = 0; a < 3; a++) { b.boundsMin[a] = 1e30f; b.boundsMax[a] = -1e30f; }
+                float depths[2] = {nearDepth, farDepth};
+                for (int d = 0; d < 2; d++) {
+                    for (int k = 0; k < 4; k++) {
+                        float corner[3] = {ndcX[k & 1] * depths[d] / projection[0],
+                                           ndcY[k >> 1] * depths[d] / projection[5], -depths[d]};
+                        for (int a = 0; a < 3; a++) {
+                            b.boundsMin[a] = std::min(b.boundsMin[a], corner[a]);
+                            b.boundsMax[a] = std::max(b.boundsMax[a], corner[a]);
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+int clusterWorkers = 1;
+
+// Fills the per-slice index lists for slices [firstSlice, lastSlice)
+void assignClusterSlices(int firstSlice, int lastSlice) {
+    int lightCount = (int)clusters.spheres.size() / 4;
+    std::vector<int> candidates;
+    for (int s = firstSlice; s < lastSlice; s++) {
+        std::vector<GLuint>& out = clusters.sliceIndices[s];
+        out.clear();
+        const ClusterBounds& sliceBounds = clusters.bounds[s * CLUSTER_TILES_Y * CLUSTER_TILES_X];
+        candidates.clear();
+        for (int i = 0; i < lightCount; i++) {
+            const GLfloat* sphere = &clusters.spheres[i * 4];
+            if (sphere[2] - sphere[3] <= sliceBounds.boundsMax[2] && sphere[2] + sphere[3] >= sliceBounds.boundsMin[2]) {
+                candidates.push_back(i);
+            }
+        }
+        for (int tile = 0; tile < CLUSTER_TILES_X * CLUSTER_TILES_Y; tile++) {
+            int cluster = s * CLUSTER_TILES_X * CLUSTER_TILES_Y + tile;
+            const ClusterBounds& b = clusters.bounds[cluster];
+            GLuint count = 0;
+            for (size_t c = 0; c < candidates.size(); c++) {
+                const GLfloat* sphere = &clusters.spheres[candidates[c] * 4];
+                float distance2 = 0.0f;
+                for (int a = 0; a < 3; a++) {
+                    float v = std::max(b.boundsMin[a], std::min(sphere[a], b.boundsMax[a])) - sphere[a];
+                    distance2 += v * v;
+                }
+                if (distance2 <= sphere[3] * sphere[3]) {
+                    out.push_back((GLuint)candidates[c]);
+                    count++;
+                }
+            }
+            clusters.grid[cluster * 2 + 1] = count;
+        }
+    }
+}
+
+// Worker t's share of the slices
+void assignClusterShare(int t) {
+    assignClusterSlices(t * CLUSTER_SLICES / clusterWorkers, (t + 1) * CLUSTER_SLICES / clusterWorkers);
+}
+
+// Sampler units and grid layout for a program that reads the light lists
+void configureClusterUniforms(GLuint program) {
+    glUseProgram(program);
+    glUniform1i(glGetUniformLocation(program, "uLightData"), 4);
+    glUniform1i(glGetUniformLocation(program, "uClusterGrid"), 5);
+    glUniform1i(glGetUniformLocation(program, "uLightIndices"), 6);
+    glUniform3i(glGetUniformLocation(program, "uClusterDims"), CLUSTER_TILES_X, CLUSTER_TILES_Y, CLUSTER_SLICES);
+    glUniform2f(glGetUniformLocation(program, "uClusterDepth"), CLUSTER_NEAR, CLUSTER_FAR);
+    glUseProgram(0);
+}
+
+void setupClusteredLighting() {
+    GLuint program = loadProgram("shaders/scene.vert", "shaders/clustered.frag", NULL, SHADER_LIGHTING_PRELUDE);
+    if (!program) {
+        printf("Clustered renderer unavailable\n");
+        return;
+    }
+    configureSceneProgram(program);
+    configureClusterUniforms(program);
+
+    const GLenum formats[3] = {GL_RGBA32F, GL_RG32UI, GL_R32UI};
+    glGenBuffers(3, clusters.buffers);
+    glGenTextures(3, clusters.textures);
+    for (int i = 0; i < 3; i++) {
+        glBindBuffer(GL_TEXTURE_BUFFER, clusters.buffers[i]);
+        glBufferData(GL_TEXTURE_BUFFER, 16, NULL, GL_STREAM_DRAW);
+        glBindTexture(GL_TEXTURE_BUFFER, clusters.textures[i]);
+        glTexBuffer(GL_TEXTURE_BUFFER, formats[i], clusters.buffers[i]);
+    }
+    glBindTexture(GL_TEXTURE_BUFFER, 0);
+    glBindBuffer(GL_TEXTURE_BUFFER, 0);
+
+    clusters.generatedCount = 0;
+    clusters.projectionX = clusters.projectionY = 0.0f;
+    clusters.sliceIndices.resize(CLUSTER_SLICES);
+    clusters.grid.resize(CLUSTER_COUNT * 2);
+    clusters.buildMsSum = 0.0;
+    clusters.builds = 0;
+    clusteredProgram = program;
+    printf("Clustered renderer ready (%dx%dx%d clusters)\n", CLUSTER_TILES_X, CLUSTER_TILES_Y, CLUSTER_SLICES);
+}
+
+void uploadTextureBuffer(GLuint buffer, const void* data, size_t size) {
+    glBindBuffer(GL_TEXTURE_BUFFER, buffer);
+    glBufferData(GL_TEXTURE_BUFFER, std::max(size, (size_t)16), NULL, GL_STREAM_DRAW); // orphan
+    if (size > 0) glBufferSubData(GL_TEXTURE_BUFFER, 0, size, data);
+}
+
+// Rebuilds and uploads the light lists for the current camera; expects the
+// modelview to hold just the camera
+void updateClusters() {
+    double start = nowMs();
+    int count = CLUSTER_LIGHT_COUNTS[clusterLightCountIndex];
+    if (clusters.generatedCount != count) generateClusterLights(count);
+
+    GLfloat view[16], projection[16];
+    glGetFloatv(GL_MODELVIEW_MATRIX, view);
+    glGetFloatv(GL_PROJECTION_MATRIX, projection);
+    if (projection[0] != clusters.projectionX || projection[5] != clusters.projectionY) {
+        buildClusterBounds(projection);
+    }
+
+    clusters.lightData.clear();
+    clusters.spheres.clear();
+    bool lampOn = glIsEnabled(GL_LIGHT1);
+    for (size_t i = 0; i < clusters.lights.size(); i++) {
+        const PointLight& light = clusters.lights[i];
+        if (light.lampShadow && !lampOn) continue;
+        GLfloat eye[3];
+        transformPoint(view, light.position, eye);
+        // Behind the camera beyond reach, or past the sliced range
+        if (eye[2] - light.radius > -CLUSTER_NEAR || eye[2] + light.radius < -CLUSTER_FAR) {
+            if (!light.lampShadow) continue;
+        }
+        clusters.spheres.insert(clusters.spheres.end(), eye, eye + 3);
+        clusters.spheres.push_back(light.radius);
+        float k = light.lampShadow ? deskLampIntensity : 1.0f; // the desk lamp follows the time of day
+        const GLfloat texels[LIGHT_TEXELS * 4] = {
+            eye[0], eye[1], eye[2], light.radius,
+            k * light.diffuse[0], k * light.diffuse[1], k * light.diffuse[2], light.lampShadow ? 1.0f : 0.0f,
+            k * light.ambient[0], k * light.ambient[1], k * light.ambient[2], 0.0f,
+            k * light.specular[0], k * light.specular[1], k * light.specular[2], 0.0f,
+            light.attenuation[0], light.attenuation[1], light.attenuation[2], 0.0f};
+        clusters.lightData.insert(clusters.lightData.end(), texels, texels + LIGHT_TEXELS * 4);
+    }
+
+    // Slices are independent; split them over the cores
+    clusterWorkers = std::min((int)std::max(1u, std::thread::hardware_concurrency()), CLUSTER_SLICES);
+    runOnFrameWorkers(assignClusterShare, clusterWorkers);
+
+    clusters.indices.clear();
+    clusters.maxPerCluster = 0;
+    for (int s = 0; s < CLUSTER_SLICES; s++) {
+        const std::vector<GLuint>& slice = clusters.sliceIndices[s];
+        GLuint offset = (GLuint)clusters.indices.size();
+        for (int tile = 0; tile < CLUSTER_TILES_X * CLUSTER_TILES_Y; tile++) {
+            int cluster = s * CLUSTER_TILES_X * CLUSTER_TILES_Y + tile;
+            clusters.grid[cluster * 2] = offset;
+            offset += clusters.grid[cluster * 2 + 1];
+            clusters.maxPerCluster = std::max(clusters.maxPerCluster, (int)clusters.grid[cluster * 2 + 1]);
+        }
+        clusters.indices.insert(clusters.indices.end(), slice.begin(), slice.end());
+    }
+
+    uploadTextureBuffer(clusters.buffers[0], clusters.lightData.empty() ? NULL : &clusters.lightData[0],
+                        clusters.lightData.size() * sizeof(GLfloat));
+    uploadTextureBuffer(clusters.buffers[1], &clusters.grid[0], clusters.grid.size() * sizeof(GLuint));
+    uploadTextureBuffer(clusters.buffers[2], clusters.indices.empty() ? NULL : &clusters.indices[0],
+                        clusters.indices.size() * sizeof(GLuint));
+    glBindBuffer(GL_TEXTURE_BUFFER, 0);
+
+    clusters.buildMs = nowMs() - start;
+    clusters.buildMsSum += clusters.buildMs;
+    clusters.builds++;
+}
+
+// Points the active program at the light lists built by updateClusters()
+void bindClusters() {
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    glUniform2f(glGetUniformLocation(activeProgram, "uClusterTileSize"),
+                (float)viewport[2] / CLUSTER_TILES_X, (float)viewport[3] / CLUSTER_TILES_Y);
+    for (int i = 0; i < 3; i++) {
+        glActiveTexture(GL_TEXTURE4 + i);
+        glBindTexture(GL_TEXTURE_BUFFER, clusters.textures[i]);
+    }
+    glActiveTexture(GL_TEXTURE0);
+}
+
+void printClusterStats() {
+    int lights = (int)clusters.spheres.size() / 4;
+    printf("Clusters: %d lights (%d point lights visible), build %.3f ms avg, %.1f lights per cluster avg, %d max\n",
+           CLUSTER_LIGHT_COUNTS[clusterLightCountIndex], lights,
+           clusters.builds > 0 ? clusters.buildMsSum / clusters.builds : 0.0,
+           (double)clusters.indices.size() / CLUSTER_COUNT, clusters.maxPerCluster);
+    clusters.buildMsSum = 0.0;
+    clusters.builds = 0;
+}
+
+// 'B' runs the same orbit at 2, 32 and 256 lights through the clustered
+// forward and the deferred renderer, with the two-light GLSL renderer as
+// the baseline, and prints one line per configuration
+struct LightBenchmarkStage {
+    RendererMode renderer;
+    int countIndex;
+};
+const LightBenchmarkStage lightBenchmarkStages[] = {
+    {RENDERER_GLSL, 0},
+    {RENDERER_CLUSTERED, 0},
+    {RENDERER_DEFERRED, 0},
+    {RENDERER_CLUSTERED, 1},
+    {RENDERER_DEFERRED, 1},
+    {RENDERER_CLUSTERED, 2},
+    {RENDERER_DEFERRED, 2},
+};
+const int LIGHT_BENCHMARK_STAGES = sizeof(lightBenchmarkStages) / sizeof(lightBenchmarkStages[0]);
+const int LIGHT_BENCHMARK_WARMUP = 30;
+const int LIGHT_BENCHMARK_FRAMES = 240;
+
+struct LightBenchmark {
+    int stage;               // -1 when not running
+    int frames;
+    double frameMsSum;
+    double buildMsSum;
+    double gbufferBytesSum;
+    RendererMode savedRenderer;
+    int savedCountIndex;
+    double frameMs[LIGHT_BENCHMARK_STAGES];
+    double buildMs[LIGHT_BENCHMARK_STAGES];
+    double gbufferBytes[LIGHT_BENCHMARK_STAGES];
+};
+LightBenchmark lightBenchmark = {-1, 0, 0.0, 0.0, 0.0, RENDERER_FIXED_FUNCTION, 0, {0.0}, {0.0}, {0.0}};
+
+void startLightBenchmark() {
+    if (sceneProgram == 0 || clusteredProgram == 0 || deferredProgram == 0) {
+        printf("Light benchmark needs the GLSL, clustered and deferred renderers\n");
+        return;
+    }
+    lightBenchmark.savedRenderer = rendererMode;
+    lightBenchmark.savedCountIndex = clusterLightCountIndex;
+    lightBenchmark.stage = 0;
+    lightBenchmark.frames = 0;
+    lightBenchmark.frameMsSum = lightBenchmark.buildMsSum = lightBenchmark.gbufferBytesSum = 0.0;
+    rendererMode = lightBenchmarkStages[0].renderer;
+    clusterLightCountIndex = lightBenchmarkStages[0].countIndex;
+    printf("Light benchmark: %d stages of %d frames...\n", LIGHT_BENCHMARK_STAGES, LIGHT_BENCHMARK_FRAMES);
+}
+
+void advanceLightBenchmark(double frameMs) {
+    if (lightBenchmark.stage < 0) return;
+    int frame = lightBenchmark.frames++;
+    if (frame < LIGHT_BENCHMARK_WARMUP) return;
+    lightBenchmark.frameMsSum += frameMs;
+    if (rendererMode == RENDERER_CLUSTERED || rendererMode == RENDERER_DEFERRED) {
+        lightBenchmark.buildMsSum += clusters.buildMs;
+    }
+    if (rendererMode == RENDERER_DEFERRED) lightBenchmark.gbufferBytesSum += gbufferFrameBytes();
+    if (frame + 1 < LIGHT_BENCHMARK_WARMUP + LIGHT_BENCHMARK_FRAMES) return;
+
+    int stage = lightBenchmark.stage;
+    lightBenchmark.frameMs[stage] = lightBenchmark.frameMsSum / LIGHT_BENCHMARK_FRAMES;
+    lightBenchmark.buildMs[stage] = lightBenchmark.buildMsSum / LIGHT_BENCHMARK_FRAMES;
+    lightBenchmark.gbufferBytes[stage] = lightBenchmark.gbufferBytesSum / LIGHT_BENCHMARK_FRAMES;
+    lightBenchmark.frames = 0;
+    lightBenchmark.frameMsSum = lightBenchmark.buildMsSum = lightBenchmark.gbufferBytesSum = 0.0;
+
+    if (++lightBenchmark.stage < LIGHT_BENCHMARK_STAGES) {
+        rendererMode = lightBenchmarkStages[lightBenchmark.stage].renderer;
+        clusterLightCountIndex = lightBenchmarkStages[lightBenchmark.stage].countIndex;
+        return;
+    }
+
+    printf("Light benchmark (%s):\n", isDaytime ? "day" : "night");
+    for (int i = 0; i < LIGHT_BENCHMARK_STAGES; i++) {
+        const LightBenchmarkStage& s = lightBenchmarkStages[i];
+        printf("  %-18s %3d lights: %7.2f ms/frame", rendererNames[s.renderer],
+               CLUSTER_LIGHT_COUNTS[s.countIndex], lightBenchmark.frameMs[i]);
+        if (s.renderer != RENDERER_GLSL) printf(" (cluster build %.3f ms)", lightBenchmark.buildMs[i]);
+        if (s.renderer == RENDERER_DEFERRED) {
+            printf(" G-buffer %.1f MB/frame, %.2f GB/s", lightBenchmark.gbufferBytes[i] / 1e6,
+                   lightBenchmark.gbufferBytes[i] / (lightBenchmark.frameMs[i] * 1e6));
+        }
+        printf("\n");
+    }
+    lightBenchmark.stage = -1;
+    rendererMode = lightBenchmark.savedRenderer;
+    clusterLightCountIndex = lightBenchmark.savedCountIndex;
+}
+
+// ============= Deferred Shading =============
+// Geometry pass into the G-buffer, one full-screen lighting pass with the
+// sun and the clustered point lights, then the blended surfaces forward.
+// Bandwidth is estimated from the G-buffer layout: the clear and every
+// fragment the geometry pass writes, plus one read per pixel when lighting.
+void setupDeferredShading() {
+    if (clusteredProgram == 0) {
+        printf("Deferred renderer unavailable (needs the clustered renderer)\n");
+        return;
+    }
+    GLuint geometry = loadProgram("shaders/scene.vert", "shaders/gbuffer.frag");
+    GLuint lighting = loadProgram("shaders/deferred.vert", "shaders/deferred.frag", NULL, SHADER_LIGHTING_PRELUDE);
+    if (!geometry || !lighting) {
+        if (geometry) glDeleteProgram(geometry);
+        if (lighting) glDeleteProgram(lighting);
+        printf("Deferred renderer unavailable\n");
+        return;
+    }
+    configureSceneProgram(geometry);
+    configureSceneProgram(lighting);
+    configureClusterUniforms(lighting);
+    glUseProgram(lighting);
+    glUniform1i(glGetUniformLocation(lighting, "uGBufferAlbedo"), 7);
+    glUniform1i(glGetUniformLocation(lighting, "uGBufferTexel"), 8);
+    glUniform1i(glGetUniformLocation(lighting, "uGBufferNormal"), 9);
+    glUniform1i(glGetUniformLocation(lighting, "uGBufferDepth"), 10);
+    glUseProgram(0);
+
+    glGenFramebuffers(1, &gbuffer.fbo);
+    glGenTextures(4, gbuffer.textures);
+    glGenQueries(1, &gbuffer.samplesQuery);
+    gbufferProgram = geometry;
+    deferredProgram = lighting;
+    printf("Deferred renderer ready (%d bytes per pixel G-buffer)\n", GBUFFER_BYTES_PER_PIXEL);
+}
+
+// (Re)allocates the targets when the viewport size changes
+void resizeGBuffer(int width, int height) {
+    if (gbuffer.width == width && gbuffer.height == height) return;
+    const GLenum internalFormats[4] = {GL_RGBA8, GL_RGBA8, GL_RGB10_A2, GL_DEPTH_COMPONENT24};
+    const GLenum formats[4] = {GL_RGBA, GL_RGBA, GL_RGBA, GL_DEPTH_COMPONENT};
+    const GLenum types[4] = {GL_UNSIGNED_BYTE, GL_UNSIGNED_BYTE, GL_UNSIGNED_INT_2_10_10_10_REV, GL_FLOAT};
+
+    glBindFramebuffer(GL_FRAMEBUFFER, gbuffer.fbo);
+    for (int i = 0; i < 4; i++) {
+        glBindTexture(GL_TEXTURE_2D, gbuffer.textures[i]);
+        glTexImage2D(GL_TEXTURE_2D, 0, internalFormats[i], width, height, 0, formats[i], types[i], NULL);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, i < 3 ? GL_COLOR_ATTACHMENT0 + i : GL_DEPTH_ATTACHMENT,
+                               GL_TEXTURE_2D, gbuffer.textures[i], 0);
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+    const GLenum drawBuffers[3] = {GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2};
+    glDrawBuffers(3, drawBuffers);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        printf("G-buffer %dx%d incomplete\n", width, height);
+    }
+    gbuffer.width = width;
+    gbuffer.height = height;
+}
+
+// Expects the modelview to hold just the camera, like updateClusters()
+void renderDeferredScene(bool useCookedMesh) {
+    GLint viewport[4], previousFBO;
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &previousFBO);
+    updateLightBlock();
+    updateClusters();
+
+    // Collect last frame's fragment count before reusing the query
+    if (gbuffer.queryPending) {
+        glGetQueryObjectuiv(gbuffer.samplesQuery, GL_QUERY_RESULT, &gbuffer.samplesPassed);
+        gbuffer.samplesSum += gbuffer.samplesPassed;
+        gbuffer.frames++;
+        gbuffer.queryPending = false;
+    }
+
+    // Geometry pass: opaque surfaces only, zero means "nothing here"
+    resizeGBuffer(viewport[2], viewport[3]);
+    glBindFramebuffer(GL_FRAMEBUFFER, gbuffer.fbo);
+    const GLfloat zero[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+    const GLfloat farDepth = 1.0f;
+    for (int i = 0; i < 3; i++) glClearBufferfv(GL_COLOR, i, zero);
+    glClearBufferfv(GL_DEPTH, 0, &farDepth);
+
+    activeProgram = gbufferProgram;
+    glUseProgram(activeProgram);
+    glBeginQuery(GL_SAMPLES_PASSED, gbuffer.samplesQuery);
+    if (useCookedMesh) {
+        drawCookedScene();
+    }
+    resetDrawLayer(true, NULL, useCookedMesh, DRAW_OPAQUE);
+    drawSceneObjects(false);
+    glEndQuery(GL_SAMPLES_PASSED);
+    gbuffer.queryPending = true;
+    glBindFramebuffer(GL_FRAMEBUFFER, previousFBO);
+
+    // Lighting pass: one triangle over the viewport, depth copied through
+    activeProgram = deferredProgram;
+    glUseProgram(activeProgram);
+    bindShadowMaps();
+    bindClusters();
+    glUniform2f(glGetUniformLocation(activeProgram, "uGBufferSize"), (float)viewport[2], (float)viewport[3]);
+    for (int i = 0; i < 4; i++) {
+        glActiveTexture(GL_TEXTURE7 + i);
+        glBindTexture(GL_TEXTURE_2D, gbuffer.textures[i]);
+    }
+    glActiveTexture(GL_TEXTURE0);
+
+    glPushAttrib(GL_ENABLE_BIT | GL_DEPTH_BUFFER_BIT);
+    glDisable(GL_BLEND);
+    glDisable(GL_CULL_FACE);
+    glDepthFunc(GL_ALWAYS);
+    drawFullScreenTriangle();
+    glPopAttrib();
+
+    for (int i = 0; i < 4; i++) {
+        glActiveTexture(GL_TEXTURE7 + i);
+        glBindTexture(GL_TEXTURE_2D, 0);
+    }
+    glActiveTexture(GL_TEXTURE0);
+
+    // Blended surfaces go on top forward, shaded exactly as the clustered
+    // renderer; the transparency stage picks them up from here
+    activeProgram = clusteredProgram;
+    glUseProgram(activeProgram);
+    bindShadowMaps();
+    bindClusters();
+    if (transparencyMode == TRANSPARENCY_UNSORTED) {
+        resetDrawLayer(true, NULL, false, DRAW_BLENDED);
+        drawSceneObjects(false);
+    }
+}
+
+// One triangle over the viewport for the full-screen passes
+void drawFullScreenTriangle() {
+    drawCallCount++;
+    triangleCount++;
+    glBegin(GL_TRIANGLES);
+    glVertex2f(-1.0f, -1.0f);
+    glVertex2f(3.0f, -1.0f);
+    glVertex2f(-1.0f, 3.0f);
+    glEnd();
+}
+
+// Estimated G-buffer traffic of the last measured frame
+double gbufferFrameBytes() {
+    double pixels = (double)gbuffer.width * gbuffer.height;
+    return (2.0 * pixels + gbuffer.samplesPassed) * GBUFFER_BYTES_PER_PIXEL;
+}
+
+void printGBufferStats() {
+    if (gbuffer.frames == 0) return;
+    double pixels = (double)gbuffer.width * gbuffer.height;
+    double samples = gbuffer.samplesSum / gbuffer.frames;
+    double bytes = (2.0 * pixels + samples) * GBUFFER_BYTES_PER_PIXEL;
+    double frameMs = frameTimeAvg[RENDERER_DEFERRED];
+    printf("G-buffer: %dx%d, %d bytes/pixel (%.1f MB), overdraw %.2fx, %.1f MB/frame",
+           gbuffer.width, gbuffer.height, GBUFFER_BYTES_PER_PIXEL, pixels * GBUFFER_BYTES_PER_PIXEL / 1e6,
+           samples / pixels, bytes / 1e6);
+    if (frameMs > 0.0) printf(", %.2f GB/s", bytes / (frameMs * 1e6));
+    printf("\n");
+    gbuffer.samplesSum = 0.0;
+    gbuffer.frames = 0;
+}
+
+// ============= Transparency =============
+// Every blended draw (window glass, sunlight shaft, lamp glow, the contact
+// shadows under the papers and the radio) is captured in world space
+// through the draw call layer and kept in a vertex buffer. The capture only
+// changes with the day/night state (and with the volumetric shaft replacing
+// the beam quad, or the HDR lamp glow), so it is redone when that changes;
+// the polygons are re-sorted by view depth every frame.
+struct TransparentPolygon {
+    int draw;          // index into transparency.mesh.draws
+    int firstVertex;
+    int vertexCount;
+    GLfloat center[3]; // world space
+    GLfloat depth;     // eye-space z this frame, more negative is further
+};
+
+struct TransparentRun {
+    int draw;
+    int firstIndex;
+    int indexCount;
+};
+
+struct TransparencyState {
+    SceneMesh mesh;
+    std::vector<TransparentPolygon> polygons;
+    std::vector<int> order;
+    std::vector<GLuint> indices;
+    std::vector<TransparentRun> runs;
+    GLuint vbo;
+    bool valid;
+    bool daytime;
+    bool lampOn;
+    float lampIntensity;  // the glow's alpha follows it through the day
+    bool volumetric;
+    bool hdr;
+    double collectMs;
+    int collects;
+
+    // Weighted OIT targets: accumulation, revealage, copy of the scene depth
+    GLuint fbo;
+    GLuint textures[3];
+    int width;
+    int height;
+
+    // Cost per mode, summed between reports
+    double sortMsSum[TRANSPARENCY_MODE_COUNT];
+    double passMsSum[TRANSPARENCY_MODE_COUNT];
+    int frames[TRANSPARENCY_MODE_COUNT];
+    double sortMsAvg[TRANSPARENCY_MODE_COUNT];
+    double passMsAvg[TRANSPARENCY_MODE_COUNT];
+};
+TransparencyState transparency;
+
+enum TransparentSubset {
+    TRANSPARENT_ALL = 0,
+    TRANSPARENT_OVER,      // alpha blended, resolved by the OIT pass
+    TRANSPARENT_ADDITIVE   // order does not matter, drawn directly
+};
+
+bool isAdditiveDraw(const SceneDraw& draw) {
+    return draw.blendDst == GL_ONE;
+}
+
+void setupTransparency() {
+    glGenBuffers(1, &transparency.vbo);
+    transparency.valid = false;
+    transparency.collects = 0;
+    if (sceneProgram == 0) {
+        printf("Weighted OIT unavailable (needs the GLSL renderer)\n");
+        return;
+    }
+
+    const char* defines = "#define WEIGHTED_OIT\n";
+    oitProgram = loadProgram("shaders/scene.vert", "shaders/scene.frag", defines, SHADER_LIGHTING_PRELUDE);
+    if (clusteredProgram != 0) {
+        oitClusteredProgram = loadProgram("shaders/scene.vert", "shaders/clustered.frag", defines,
+                                          SHADER_LIGHTING_PRELUDE);
+    }
+    oitCompositeProgram = loadProgram("shaders/deferred.vert", "shaders/oit_composite.frag");
+    if (!oitProgram || !oitCompositeProgram) {
+        printf("Weighted OIT unavailable\n");
+        oitProgram = 0;
+        return;
+    }
+    configureSceneProgram(oitProgram);
+    if (oitClusteredProgram) {
+        configureSceneProgram(oitClusteredProgram);
+        configureClusterUniforms(oitClusteredProgram);
+    }
+    glUseProgram(oitCompositeProgram);
+    glUniform1i(glGetUniformLocation(oitCompositeProgram, "uAccum"), 7);
+    glUniform1i(glGetUniformLocation(oitCompositeProgram, "uRevealage"), 8);
+    glUseProgram(0);
+
+    glGenFramebuffers(1, &transparency.fbo);
+    glGenTextures(3, transparency.textures);
+    printf("Weighted OIT ready\n");
+}
+
+void collectTransparentSurfaces() {
+    double start = nowMs();
+    SceneMesh& mesh = transparency.mesh;
+    mesh.vertices.clear();
+    mesh.draws.clear();
+    resetDrawLayer(false, &mesh, false, DRAW_BLENDED);
+    drawSceneObjects(false);
+
+    transparency.polygons.clear();
+    for (size_t d = 0; d < mesh.draws.size(); d++) {
+        const SceneDraw& draw = mesh.draws[d];
+        int step = (draw.primitive == GL_TRIANGLES) ? (draw.polygonSides == 4 ? 6 : 3)
+                 : (draw.primitive == GL_LINES) ? 2 : 1;
+        for (int first = draw.firstVertex; first + step <= draw.firstVertex + draw.vertexCount; first += step) {
+            TransparentPolygon polygon = {(int)d, first, step, {0.0f, 0.0f, 0.0f}, 0.0f};
+            for (int v = first; v < first + step; v++) {
+                for (int i = 0; i < 3; i++) polygon.center[i] += mesh.vertices[v].position[i] / step;
+            }
+            transparency.polygons.push_back(polygon);
+        }
+    }
+
+    glBindBuffer(GL_ARRAY_BUFFER, transparency.vbo);
+    glBufferData(GL_ARRAY_BUFFER, std::max(mesh.vertices.size(), (size_t)1) * sizeof(SceneVertex),
+                 mesh.vertices.empty() ? NULL : &mesh.vertices[0], GL_STATIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    transparency.valid = true;
+    transparency.daytime = isDaytime;
+    transparency.lampOn = deskLampLightOn;
+    transparency.lampIntensity = deskLampIntensity;
+    transparency.volumetric = volumetricLightActive();
+    transparency.hdr = hdrActive();
+    transparency.collectMs = nowMs() - start;
+    transparency.collects++;
+}
+
+bool compareTransparentDepth(int a, int b) {
+    return transparency.polygons[a].depth < transparency.polygons[b].depth;
+}
+
+// Orders the polygons back to front (or keeps submission order) and groups
+// neighbours that share a draw into one indexed call. Expects the modelview
+// to hold just the camera.
+void buildTransparentRuns(bool sortByDepth) {
+    std::vector<int>& order = transparency.order;
+    order.resize(transparency.polygons.size());
+    for (size_t i = 0; i < order.size(); i++) order[i] = (int)i;
+
+    if (sortByDepth) {
+        GLfloat view[16];
+        glGetFloatv(GL_MODELVIEW_MATRIX, view);
+        for (size_t i = 0; i < transparency.polygons.size(); i++) {
+            TransparentPolygon& polygon = transparency.polygons[i];
+            const GLfloat* c = polygon.center;
+            polygon.depth = view[2] * c[0] + view[6] * c[1] + view[10] * c[2] + view[14];
+        }
+        // Stable, so coplanar decals keep the order they were drawn in
+        std::stable_sort(order.begin(), order.end(), compareTransparentDepth);
+    }
+
+    transparency.indices.clear();
+    transparency.runs.clear();
+    for (size_t i = 0; i < order.size(); i++) {
+        const TransparentPolygon& polygon = transparency.polygons[order[i]];
+        if (transparency.runs.empty() || transparency.runs.back().draw != polygon.draw) {
+            TransparentRun run = {polygon.draw, (int)transparency.indices.size(), 0};
+            transparency.runs.push_back(run);
+        }
+        for (int v = 0; v < polygon.vertexCount; v++) {
+            transparency.indices.push_back(polygon.firstVertex + v);
+        }
+        transparency.runs.back().indexCount += polygon.vertexCount;
+    }
+}
+
+// Draws the runs with the bound program, or fixed-function when none is
+void drawTransparentRuns(TransparentSubset subset, bool applyBlendState) {
+    const SceneMesh& mesh = transparency.mesh;
+    const GLsizei stride = sizeof(SceneVertex);
+    glPushAttrib(GL_ENABLE_BIT | GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_LIGHTING_BIT);
+    glBindBuffer(GL_ARRAY_BUFFER, transparency.vbo);
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_NORMAL_ARRAY);
+    glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+    glEnableClientState(GL_COLOR_ARRAY);
+    glVertexPointer(3, GL_FLOAT, stride, (const void*)offsetof(SceneVertex, position));
+    glNormalPointer(GL_FLOAT, stride, (const void*)offsetof(SceneVertex, normal));
+    glTexCoordPointer(2, GL_FLOAT, stride, (const void*)offsetof(SceneVertex, texCoord));
+    glColorPointer(4, GL_FLOAT, stride, (const void*)offsetof(SceneVertex, color));
+
+    glEnable(GL_BLEND);
+    for (size_t i = 0; i < transparency.runs.size(); i++) {
+        const TransparentRun& run = transparency.runs[i];
+        const SceneDraw& draw = mesh.draws[run.draw];
+        if (subset == TRANSPARENT_OVER && isAdditiveDraw(draw)) continue;
+        if (subset == TRANSPARENT_ADDITIVE && !isAdditiveDraw(draw)) continue;
+
+        if (applyBlendState) {
+            glBlendFunc(draw.blendSrc, draw.blendDst);
+            glDepthMask(draw.depthWrite ? GL_TRUE : GL_FALSE);
+        }
+        if (draw.lit) glEnable(GL_LIGHTING); else glDisable(GL_LIGHTING);
+        if (draw.textured) glEnable(GL_TEXTURE_2D); else glDisable(GL_TEXTURE_2D);
+        glBindTexture(GL_TEXTURE_2D, draw.texture);
+        glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, draw.specular);
+        glMaterialf(GL_FRONT_AND_BACK, GL_SHININESS, draw.shininess);
+        syncDrawState();
+        glDrawElements(draw.primitive, run.indexCount, GL_UNSIGNED_INT, &transparency.indices[run.firstIndex]);
+        drawCallCount++;
+        if (draw.primitive == GL_TRIANGLES) triangleCount += run.indexCount / 3;
+        textureBindCount++;
+    }
+
+    glDisableClientState(GL_VERTEX_ARRAY);
+    glDisableClientState(GL_NORMAL_ARRAY);
+    glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+    glDisableClientState(GL_COLOR_ARRAY);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glPopAttrib();
+}
+
+// (Re)allocates the OIT targets when the viewport size changes
+void resizeTransparencyTargets(int width, int height) {
+    if (transparency.width == width && transparency.height == height) return;
+    const GLenum internalFormats[3] = {GL_RGBA16F, GL_R8, GL_DEPTH_COMPONENT24};
+    const GLenum formats[3] = {GL_RGBA, GL_RED, GL_DEPTH_COMPONENT};
+    const GLenum types[3] = {GL_FLOAT, GL_UNSIGNED_BYTE, GL_FLOAT};
+
+    GLint previousFBO;
+    glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &previousFBO);
+    glBindFramebuffer(GL_FRAMEBUFFER, transparency.fbo);
+    for (int i = 0; i < 3; i++) {
+        glBindTexture(GL_TEXTURE_2D, transparency.textures[i]);
+        glTexImage2D(GL_TEXTURE_2D, 0, internalFormats[i], width, height, 0, formats[i], types[i], NULL);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, i < 2 ? GL_COLOR_ATTACHMENT0 + i : GL_DEPTH_ATTACHMENT,
+                               GL_TEXTURE_2D, transparency.textures[i], 0);
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+    const GLenum drawBuffers[2] = {GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1};
+    glDrawBuffers(2, drawBuffers);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        printf("OIT targets %dx%d incomplete\n", width, height);
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, previousFBO);
+    transparency.width = width;
+    transparency.height = height;
+}
+
+// Alpha-blended surfaces accumulate into the OIT targets against a copy of
+// the opaque depth, one full-screen pass resolves them over the scene, and
+// the additive glow is drawn directly on top.
+void drawWeightedTransparency() {
+    GLint viewport[4], previousFBO;
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &previousFBO);
+    resizeTransparencyTargets(viewport[2], viewport[3]);
+
+    copySceneDepth(transparency.textures[2], viewport);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, transparency.fbo);
+    const GLfloat zero[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+    const GLfloat one[4] = {1.0f, 1.0f, 1.0f, 1.0f};
+    glClearBufferfv(GL_COLOR, 0, zero);
+    glClearBufferfv(GL_COLOR, 1, one);
+
+    // Same lighting model as the renderer; the fixed-function and lightmap
+    // renderers fall back to the per-pixel one for these few surfaces
+    GLuint forwardProgram = activeProgram;
+    bool clustered = (forwardProgram == clusteredProgram && oitClusteredProgram != 0);
+    activeProgram = clustered ? oitClusteredProgram : oitProgram;
+    glUseProgram(activeProgram);
+    if (forwardProgram == 0) updateLightBlock();
+    bindShadowMaps();
+    if (clustered) bindClusters();
+
+    glPushAttrib(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    glBlendFunci(0, GL_ONE, GL_ONE);
+    glBlendFunci(1, GL_ZERO, GL_ONE_MINUS_SRC_COLOR);
+    glDepthMask(GL_FALSE);
+    drawTransparentRuns(TRANSPARENT_OVER, false);
+    glPopAttrib();
+    glBindFramebuffer(GL_FRAMEBUFFER, previousFBO);
+
+    // Resolve
+    glUseProgram(oitCompositeProgram);
+    for (int i = 0; i < 2; i++) {
+        glActiveTexture(GL_TEXTURE7 + i);
+        glBindTexture(GL_TEXTURE_2D, transparency.textures[i]);
+    }
+    glActiveTexture(GL_TEXTURE0);
+    glPushAttrib(GL_ENABLE_BIT | GL_COLOR_BUFFER_BIT);
+    glDisable(GL_DEPTH_TEST);
+    glDisable(GL_CULL_FACE);
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    drawFullScreenTriangle();
+    glPopAttrib();
+    for (int i = 0; i < 2; i++) {
+        glActiveTexture(GL_TEXTURE7 + i);
+        glBindTexture(GL_TEXTURE_2D, 0);
+    }
+    glActiveTexture(GL_TEXTURE0);
+
+    activeProgram = forwardProgram;
+    glUseProgram(activeProgram);
+    materialBlockValid = false;
+    drawTransparentRuns(TRANSPARENT_ADDITIVE, true);
+}
+
+// Runs after the opaque pass with the renderer's program still bound. In
+// unsorted mode the blended draws already went out with everything else.
+void drawTransparentSurfaces() {
+    if (transparencyMode == TRANSPARENCY_UNSORTED) return;
+    bool weighted = (transparencyMode == TRANSPARENCY_WEIGHTED_OIT && oitProgram != 0);
+    if (!transparency.valid || transparency.daytime != isDaytime ||
+        transparency.lampOn != deskLampLightOn || transparency.lampIntensity != deskLampIntensity ||
+        transparency.volumetric != volumetricLightActive() || transparency.hdr != hdrActive()) {
+        collectTransparentSurfaces();
+    }
+
+    // Finish the opaque work first so the pass is timed on its own
+    finishPassTiming();
+    double start = nowMs();
+    buildTransparentRuns(!weighted);
+    double sortMs = nowMs() - start;
+    if (weighted) {
+        drawWeightedTransparency();
+    } else {
+        drawTransparentRuns(TRANSPARENT_ALL, true);
+    }
+    finishPassTiming();
+
+    transparency.sortMsSum[transparencyMode] += sortMs;
+    transparency.passMsSum[transparencyMode] += nowMs() - start - sortMs;
+    transparency.frames[transparencyMode]++;
+}
+
+void printTransparencyStats() {
+    printf("Transparency (%s): %d polygons in %d draws, capture %.2f ms (%d captures)",
+           transparencyModeNames[transparencyMode], (int)transparency.polygons.size(),
+           (int)transparency.mesh.draws.size(), transparency.collectMs, transparency.collects);
+    for (int i = TRANSPARENCY_SORTED; i < TRANSPARENCY_MODE_COUNT; i++) {
+        if (transparency.frames[i] > 0) {
+            transparency.sortMsAvg[i] = transparency.sortMsSum[i] / transparency.frames[i];
+            transparency.passMsAvg[i] = transparency.passMsSum[i] / transparency.frames[i];
+            transparency.sortMsSum[i] = transparency.passMsSum[i] = 0.0;
+            transparency.frames[i] = 0;
+        }
+        if (transparency.passMsAvg[i] > 0.0) {
+            printf(" | %s: sort %.3f ms, pass %.2f ms", transparencyModeNames[i],
+                   transparency.sortMsAvg[i], transparency.passMsAvg[i]);
+        }
+    }
+    printf("\n");
+}
+
+// ============= Volumetric Sun Shaft =============
+// Replaces the hand-placed beam quad in drawSunlight(). The opening the
+// sun comes through is taken from the window glass the draw functions emit,
+// so moving the window moves the shaft. Cost is bounded by the fixed step
+// count and the buffer scale, and timed each frame. Off by default: it is
+// about 20 ms a frame on llvmpipe and needs the sun's shadow map.
+struct VolumetricState {
+    GLuint fbo;
+    GLuint scatterTexture;   // RG16F at 1/divisor resolution
+    GLuint depthTexture;     // copy of the scene depth
+    int width;               // full resolution
+    int height;
+    int divisor;
+    bool windowFound;
+    GLfloat windowMin[3];
+    GLfloat windowMax[3];
+    int windowAxis;
+    double passMsSum;
+    int frames;
+    double passMsAvg;
+};
+VolumetricState volumetric = {0, 0, 0, 0, 0, 0, false, {0, 0, 0}, {0, 0, 0}, 0, 0.0, 0, 0.0};
+
+bool volumetricLightActive() {
+    return volumetricDivisor != 0 && volumetricMarchProgram != 0 && volumetric.windowFound;
+}
+
+// Bounds of the window's glass, captured through the draw call layer
+void findWindowOpening() {
+    SceneMesh mesh;
+    resetDrawLayer(false, &mesh, false, DRAW_BLENDED);
+    drawSceneObjects(false);
+
+    bool found = false;
+    for (size_t d = 0; d < mesh.draws.size(); d++) {
+        const SceneDraw& draw = mesh.draws[d];
+        if (strcmp(sceneObjects[draw.object].name, "window") != 0) continue;
+        for (int v = draw.firstVertex; v < draw.firstVertex + draw.vertexCount; v++) {
+            const GLfloat* p = mesh.vertices[v].position;
+            for (int axis = 0; axis < 3; axis++) {
+                if (!found || p[axis] < volumetric.windowMin[axis]) volumetric.windowMin[axis] = p[axis];
+                if (!found || p[axis] > volumetric.windowMax[axis]) volumetric.windowMax[axis] = p[axis];
+            }
+            found = true;
+        }
+    }
+    if (!found) return;
+
+    // The pane is flat, so its thinnest extent is the direction it faces
+    volumetric.windowAxis = 0;
+    for (int axis = 1; axis < 3; axis++) {
+        if (volumetric.windowMax[axis] - volumetric.windowMin[axis] <
+            volumetric.windowMax[volumetric.windowAxis] - volumetric.windowMin[volumetric.windowAxis]) {
+            volumetric.windowAxis = axis;
+        }
+    }
+    volumetric.windowFound = true;
+}
+
+void setupVolumetricLight() {
+    if (shadowProgram == 0) {
+        printf("Volumetric sun shaft unavailable (needs shadow maps)\n");
+        return;
+    }
+    GLuint march = loadProgram("shaders/deferred.vert", "shaders/volumetric_march.frag");
+    GLuint upsample = loadProgram("shaders/deferred.vert", "shaders/volumetric_upsample.frag");
+    if (!march || !upsample) {
+        if (march) glDeleteProgram(march);
+        if (upsample) glDeleteProgram(upsample);
+        printf("Volumetric sun shaft unavailable\n");
+        return;
+    }
+    glUseProgram(march);
+    glUniform1i(glGetUniformLocation(march, "uSceneDepth"), 7);
+    glUniform1i(glGetUniformLocation(march, "uSunShadow"), 2);
+    glUniform1i(glGetUniformLocation(march, "uSunShadowNext"), 11);
+    glUniform1i(glGetUniformLocation(march, "uSteps"), VOLUMETRIC_STEPS);
+    glUniform1f(glGetUniformLocation(march, "uMaxDistance"), VOLUMETRIC_MAX_DISTANCE);
+    glUniform1f(glGetUniformLocation(march, "uDensity"), VOLUMETRIC_DENSITY);
+    glUseProgram(upsample);
+    glUniform1i(glGetUniformLocation(upsample, "uSceneDepth"), 7);
+    glUniform1i(glGetUniformLocation(upsample, "uScattering"), 8);
+    glUseProgram(0);
+
+    findWindowOpening();
+    if (!volumetric.windowFound) {
+        glDeleteProgram(march);
+        glDeleteProgram(upsample);
+        printf("Volumetric sun shaft unavailable (no window glass)\n");
+        return;
+    }
+    glGenFramebuffers(1, &volumetric.fbo);
+    glGenTextures(1, &volumetric.scatterTexture);
+    glGenTextures(1, &volumetric.depthTexture);
+    volumetricMarchProgram = march;
+    volumetricUpsampleProgram = upsample;
+    printf("Volumetric sun shaft ready (%d steps, window %.2f..%.2f %.2f..%.2f %.2f..%.2f)\n", VOLUMETRIC_STEPS,
+           volumetric.windowMin[0], volumetric.windowMax[0], volumetric.windowMin[1], volumetric.windowMax[1],
+           volumetric.windowMin[2], volumetric.windowMax[2]);
+}
+
+// (Re)allocates the buffers when the viewport or the divisor changes
+void resizeVolumetricTargets(int width, int height, int divisor) {
+    if (volumetric.width == width && volumetric.height == height && volumetric.divisor == divisor) return;
+    int lowWidth = std::max(1, width / divisor);
+    int lowHeight = std::max(1, height / divisor);
+
+    glBindTexture(GL_TEXTURE_2D, volumetric.depthTexture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, width, height, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glBindTexture(GL_TEXTURE_2D, volumetric.scatterTexture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RG16F, lowWidth, lowHeight, 0, GL_RG, GL_FLOAT, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    GLint previousFBO;
+    glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &previousFBO);
+    glBindFramebuffer(GL_FRAMEBUFFER, volumetric.fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, volumetric.scatterTexture, 0);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        printf("Volumetric buffer %dx%d incomplete\n", lowWidth, lowHeight);
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, previousFBO);
+    volumetric.width = width;
+    volumetric.height = height;
+    volumetric.divisor = divisor;
+}
+
+// Runs after the opaque pass; expects the modelview to hold just the camera
+void renderVolumetricLight() {
+    if (!volumetricLightActive() || !glIsEnabled(GL_LIGHT0)) return;
+
+    finishPassTiming();
+    double start = nowMs();
+    GLint viewport[4], previousFBO;
+    GLuint previousProgram = activeProgram;
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &previousFBO);
+    int divisor = volumetricDivisor;
+    resizeVolumetricTargets(viewport[2], viewport[3], divisor);
+
+    copySceneDepth(volumetric.depthTexture, viewport);
+
+    GLfloat view[16], invView[16];
+    glGetFloatv(GL_MODELVIEW_MATRIX, view);
+    invertRigidMatrix(view, invView);
+    const GLfloat* sunPosition = timeOfDayState.sunPosition;
+    GLfloat length = sqrtf(sunPosition[0] * sunPosition[0] + sunPosition[1] * sunPosition[1] +
+                           sunPosition[2] * sunPosition[2]);
+    GLfloat sunDirection[3] = {sunPosition[0] / length, sunPosition[1] / length, sunPosition[2] / length};
+    bool sunShadow = sunShadowsReady();
+
+    glPushAttrib(GL_ENABLE_BIT | GL_COLOR_BUFFER_BIT | GL_VIEWPORT_BIT);
+    glDisable(GL_DEPTH_TEST);
+    glDisable(GL_CULL_FACE);
+    glDisable(GL_BLEND);
+    glActiveTexture(GL_TEXTURE7);
+    glBindTexture(GL_TEXTURE_2D, volumetric.depthTexture);
+    glActiveTexture(GL_TEXTURE2);
+    glBindTexture(GL_TEXTURE_2D, sunShadowMaps[sunShadowKeys[0]]);
+    glActiveTexture(GL_TEXTURE11);
+    glBindTexture(GL_TEXTURE_2D, sunShadowMaps[sunShadowKeys[1]]);
+    glActiveTexture(GL_TEXTURE0);
+
+    // March at reduced resolution
+    glBindFramebuffer(GL_FRAMEBUFFER, volumetric.fbo);
+    glViewport(0, 0, std::max(1, viewport[2] / divisor), std::max(1, viewport[3] / divisor));
+    GLuint program = volumetricMarchProgram;
+    glUseProgram(program);
+    glUniform1i(glGetUniformLocation(program, "uSunShadowEnabled"), sunShadow ? 1 : 0);
+    glUniformMatrix4fv(glGetUniformLocation(program, "uEyeToWorld"), 1, GL_FALSE, invView);
+    glUniformMatrix4fv(glGetUniformLocation(program, "uWorldToSunShadow"), 1, GL_FALSE,
+                       sunShadowMatrices[sunShadowKeys[0]]);
+    glUniformMatrix4fv(glGetUniformLocation(program, "uWorldToSunShadowNext"), 1, GL_FALSE,
+                       sunShadowMatrices[sunShadowKeys[1]]);
+    glUniform1f(glGetUniformLocation(program, "uSunShadowBlend"), sunShadowBlend);
+    glUniform3fv(glGetUniformLocation(program, "uSunDirection"), 1, sunDirection);
+    glUniform3fv(glGetUniformLocation(program, "uWindowMin"), 1, volumetric.windowMin);
+    glUniform3fv(glGetUniformLocation(program, "uWindowMax"), 1, volumetric.windowMax);
+    glUniform1i(glGetUniformLocation(program, "uWindowAxis"), volumetric.windowAxis);
+    glUniform1f(glGetUniformLocation(program, "uTime"), dustTime);
+    glUniform1f(glGetUniformLocation(program, "uScale"), (float)divisor);
+    drawFullScreenTriangle();
+
+    // Bilateral upsample, added over the scene
+    glBindFramebuffer(GL_FRAMEBUFFER, previousFBO);
+    glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+    program = volumetricUpsampleProgram;
+    glUseProgram(program);
+    glUniform1f(glGetUniformLocation(program, "uScale"), (float)divisor);
+    glUniform3fv(glGetUniformLocation(program, "uLightColor"), 1, timeOfDayState.sunDiffuse);
+    glActiveTexture(GL_TEXTURE8);
+    glBindTexture(GL_TEXTURE_2D, volumetric.scatterTexture);
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_ONE, GL_ONE);
+    drawFullScreenTriangle();
+    glPopAttrib();
+
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glActiveTexture(GL_TEXTURE7);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glActiveTexture(GL_TEXTURE0);
+    glUseProgram(previousProgram);
+    finishPassTiming();
+
+    volumetric.passMsSum += nowMs() - start;
+    volumetric.frames++;
+}
+
+void printVolumetricStats() {
+    if (volumetric.frames > 0) {
+        volumetric.passMsAvg = volumetric.passMsSum / volumetric.frames;
+        volumetric.passMsSum = 0.0;
+        volumetric.frames = 0;
+    }
+    printf("Sun shaft: 1/%d resolution (%dx%d), %d steps, %.2f ms avg\n", volumetric.divisor,
+           std::max(1, volumetric.width / std::max(1, volumetric.divisor)),
+           std::max(1, volumetric.height / std::max(1, volumetric.divisor)), VOLUMETRIC_STEPS, volumetric.passMsAvg);
+}
+
+// ============= HDR and Bloom =============
+// The scene goes to an RGBA16F target instead of the window. Afterwards a
+// bright pass extracts what is above the threshold at reduced resolution,
+// the bloom chain halves it BLOOM_LEVELS - 1 more times and adds it back up
+// level by level, and the tone mapping pass writes the window. Each pass is
+// timed; when the chain runs over POST_BUDGET_MS it starts at the next lower
+// resolution, quartering the cost of the bloom passes.
+enum PostPass {
+    POST_PREFILTER = 0,
+    POST_DOWNSAMPLE,
+    POST_UPSAMPLE,
+    POST_TONEMAP,
+    POST_PASS_COUNT
+};
+const char* postPassNames[POST_PASS_COUNT] = {"bright pass", "downsample", "upsample", "tone map"};
+
+struct HDRState {
+    GLuint sceneFBO;
+    GLuint sceneTexture;     // RGBA16F
+    GLuint depthBuffer;
+    GLuint bloomFBOs[BLOOM_LEVELS];
+    GLuint bloomTextures[BLOOM_LEVELS];  // R11F_G11F_B10F, level 0 the largest
+    int bloomWidths[BLOOM_LEVELS];
+    int bloomHeights[BLOOM_LEVELS];
+    int width;
+    int height;
+    int bloomDivisor;        // size of level 0 relative to the scene, 2 to 8
+    int targetDivisor;       // what the budget asks for from the next frame
+    GLint previousFBO;
+    double passMsSum[POST_PASS_COUNT];
+    int frames;
+    double passMsAvg[POST_PASS_COUNT];
+};
+HDRState hdrState = {0, 0, 0, {0}, {0}, {0}, {0}, 0, 0, 0, 2, 0, {0.0}, 0, {0.0}};
+
+bool hdrActive() {
+    return hdrEnabled && tonemapProgram != 0;
+}
+
+void setupHDR() {
+    GLuint prefilter = loadProgram("shaders/deferred.vert", "shaders/bloom_downsample.frag", "#define PREFILTER\n");
+    GLuint downsample = loadProgram("shaders/deferred.vert", "shaders/bloom_downsample.frag");
+    GLuint upsample = loadProgram("shaders/deferred.vert", "shaders/bloom_upsample.frag");
+    GLuint tonemap = loadProgram("shaders/deferred.vert", "shaders/tonemap.frag");
+    if (!prefilter || !downsample || !upsample || !tonemap) {
+        if (prefilter) glDeleteProgram(prefilter);
+        if (downsample) glDeleteProgram(downsample);
+        if (upsample) glDeleteProgram(upsample);
+        if (tonemap) glDeleteProgram(tonemap);
+        printf("HDR rendering unavailable\n");
+        return;
+    }
+    GLuint samplers[3] = {prefilter, downsample, upsample};
+    for (int i = 0; i < 3; i++) {
+        glUseProgram(samplers[i]);
+        glUniform1i(glGetUniformLocation(samplers[i], "uSource"), 0);
+    }
+    glUseProgram(prefilter);
+    glUniform1f(glGetUniformLocation(prefilter, "uThreshold"), BLOOM_THRESHOLD);
+    glUseProgram(tonemap);
+    glUniform1i(glGetUniformLocation(tonemap, "uScene"), 0);
+    glUniform1i(glGetUniformLocation(tonemap, "uBloom"), 1);
+    glUniform1f(glGetUniformLocation(tonemap, "uBloomStrength"), BLOOM_STRENGTH / BLOOM_LEVELS);
+    glUniform1f(glGetUniformLocation(tonemap, "uExposure"), TONEMAP_EXPOSURE);
+    glUseProgram(0);
+
+    glGenFramebuffers(1, &hdrState.sceneFBO);
+    glGenTextures(1, &hdrState.sceneTexture);
+    glGenRenderbuffers(1, &hdrState.depthBuffer);
+    glGenFramebuffers(BLOOM_LEVELS, hdrState.bloomFBOs);
+    glGenTextures(BLOOM_LEVELS, hdrState.bloomTextures);
+    bloomPrefilterProgram = prefilter;
+    bloomDownsampleProgram = downsample;
+    bloomUpsampleProgram = upsample;
+    tonemapProgram = tonemap;
+    printf("HDR rendering ready (%d bloom levels, budget %.1f ms)\n", BLOOM_LEVELS, POST_BUDGET_MS);
+}
+
+// (Re)allocates the scene target and the bloom chain when the viewport or
+// the bloom resolution changes
+void resizeHDRTargets(int width, int height, int bloomDivisor) {
+    if (hdrState.width == width && hdrState.height == height && hdrState.bloomDivisor == bloomDivisor) return;
+    GLint previousFBO;
+    glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &previousFBO);
+
+    if (hdrState.width != width || hdrState.height != height) {
+        glBindTexture(GL_TEXTURE_2D, hdrState.sceneTexture);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, width, height, 0, GL_RGBA, GL_FLOAT, NULL);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glBindRenderbuffer(GL_RENDERBUFFER, hdrState.depthBuffer);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+        glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+        glBindFramebuffer(GL_FRAMEBUFFER, hdrState.sceneFBO);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, hdrState.sceneTexture, 0);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, hdrState.depthBuffer);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+            printf("HDR target %dx%d incomplete\n", width, height);
+        }
+    }
+
+    for (int i = 0; i < BLOOM_LEVELS; i++) {
+        hdrState.bloomWidths[i] = std::max(1, width / (bloomDivisor << i));
+        hdrState.bloomHeights[i] = std::max(1, height / (bloomDivisor << i));
+        glBindTexture(GL_TEXTURE_2D, hdrState.bloomTextures[i]);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_R11F_G11F_B10F, hdrState.bloomWidths[i], hdrState.bloomHeights[i], 0,
+                     GL_RGB, GL_FLOAT, NULL);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glBindFramebuffer(GL_FRAMEBUFFER, hdrState.bloomFBOs[i]);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, hdrState.bloomTextures[i], 0);
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glBindFramebuffer(GL_FRAMEBUFFER, previousFBO);
+    hdrState.width = width;
+    hdrState.height = height;
+    hdrState.bloomDivisor = bloomDivisor;
+}
+
+// Redirects the frame into the HDR target. Vertex colors are left
+// unclamped so the fixed-function path can exceed 1.0 as well.
+void beginHDRFrame() {
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    resizeHDRTargets(viewport[2], viewport[3], hdrState.targetDivisor);
+    glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &hdrState.previousFBO);
+    glBindFramebuffer(GL_FRAMEBUFFER, hdrState.sceneFBO);
+    glClampColor(GL_CLAMP_VERTEX_COLOR, GL_FALSE);
+}
+
+void drawBloomPass(GLuint program, GLuint source, int level) {
+    glBindFramebuffer(GL_FRAMEBUFFER, hdrState.bloomFBOs[level]);
+    glViewport(0, 0, hdrState.bloomWidths[level], hdrState.bloomHeights[level]);
+    glUseProgram(program);
+    glUniform2f(glGetUniformLocation(program, "uTargetSize"),
+                (float)hdrState.bloomWidths[level], (float)hdrState.bloomHeights[level]);
+    glBindTexture(GL_TEXTURE_2D, source);
+    drawFullScreenTriangle();
+}
+
+// Bloom and tone mapping into the framebuffer that was bound before
+// beginHDRFrame(), filling the current viewport (upscaling the scene when
+// dynamic resolution drew it smaller); runs with no program bound
+void finishHDRFrame() {
+    glClampColor(GL_CLAMP_VERTEX_COLOR, GL_TRUE);
+    double passStart[POST_PASS_COUNT + 1];
+    finishPassTiming();
+    passStart[POST_PREFILTER] = nowMs();
+
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    glPushAttrib(GL_ENABLE_BIT | GL_COLOR_BUFFER_BIT | GL_VIEWPORT_BIT);
+    glDisable(GL_DEPTH_TEST);
+    glDisable(GL_CULL_FACE);
+    glDisable(GL_BLEND);
+    glDisable(GL_LIGHTING);
+    glActiveTexture(GL_TEXTURE0);
+
+    drawBloomPass(bloomPrefilterProgram, hdrState.sceneTexture, 0);
+    finishPassTiming();
+    passStart[POST_DOWNSAMPLE] = nowMs();
+
+    for (int i = 1; i < BLOOM_LEVELS; i++) {
+        drawBloomPass(bloomDownsampleProgram, hdrState.bloomTextures[i - 1], i);
+    }
+    finishPassTiming();
+    passStart[POST_UPSAMPLE] = nowMs();
+
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_ONE, GL_ONE);
+    for (int i = BLOOM_LEVELS - 1; i > 0; i--) {
+        drawBloomPass(bloomUpsampleProgram, hdrState.bloomTextures[i], i - 1);
+    }
+    glDisable(GL_BLEND);
+    finishPassTiming();
+    passStart[POST_TONEMAP] = nowMs();
+
+    glBindFramebuffer(GL_FRAMEBUFFER, hdrState.previousFBO);
+    glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+    glUseProgram(tonemapProgram);
+    glUniform2f(glGetUniformLocation(tonemapProgram, "uOutputSize"), (float)viewport[2], (float)viewport[3]);
+    glBindTexture(GL_TEXTURE_2D, hdrState.sceneTexture);
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, hdrState.bloomTextures[0]);
+    drawFullScreenTriangle();
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glUseProgram(0);
+    glPopAttrib();
+    finishPassTiming();
+    passStart[POST_PASS_COUNT] = nowMs();
+
+    for (int i = 0; i < POST_PASS_COUNT; i++) {
+        hdrState.passMsSum[i] += passStart[i + 1] - passStart[i];
+    }
+    hdrState.frames++;
+}
+
+// Prints the per-pass averages and moves the bloom chain to a lower
+// resolution when it is over budget (back up when well under it)
+void updatePostBudget() {
+    if (hdrState.frames == 0) return;
+    double total = 0.0;
+    for (int i = 0; i < POST_PASS_COUNT; i++) {
+        hdrState.passMsAvg[i] = hdrState.passMsSum[i] / hdrState.frames;
+        hdrState.passMsSum[i] = 0.0;
+        total += hdrState.passMsAvg[i];
+    }
+    hdrState.frames = 0;
+
+    printf("Post (bloom from 1/%d, %dx%d):", hdrState.bloomDivisor, hdrState.bloomWidths[0], hdrState.bloomHeights[0]);
+    for (int i = 0; i < POST_PASS_COUNT; i++) {
+        printf(" %s %.2f ms%s", postPassNames[i], hdrState.passMsAvg[i], (i + 1 < POST_PASS_COUNT) ? " |" : "");
+    }
+    printf(" = %.2f ms of %.1f ms budget\n", total, POST_BUDGET_MS);
+
+    // Unfenced pass times are only submission; nothing to adapt to
+    if (deterministicFrames || !timingFencesRequested()) return;
+    if (total > POST_BUDGET_MS && hdrState.targetDivisor < 8) {
+        hdrState.targetDivisor *= 2;
+        printf("Post over budget: bloom chain moved to 1/%d resolution\n", hdrState.targetDivisor);
+    } else if (total < 0.5 * POST_BUDGET_MS && hdrState.targetDivisor > 2) {
+        hdrState.targetDivisor /= 2;
+        printf("Post well under budget: bloom chain back to 1/%d resolution\n", hdrState.targetDivisor);
+    }
+}
+
+// ============= Dynamic Resolution =============
+// The scene is drawn at a fraction of the window and scaled up to it. The
+// scale is picked from a smoothed frame time: it moves in 1/16 steps toward
+// the scale that would meet the target (frame cost taken to follow the
+// pixel count), then waits a few frames so the average reflects the new
+// size before moving again. Quantizing keeps the render targets from being
+// reallocated every frame. Without HDR the scene goes to an 8-bit target
+// that is blitted to the window; with HDR the tone mapping pass upscales.
+struct DynamicResolutionState {
+    float scale;
+    double smoothedMs;
+    int cooldown;            // frames until the scale may change again
+    int changes;             // since the last report
+    GLuint fbo;              // 8-bit target when HDR is off
+    GLuint colorBuffer;
+    GLuint depthBuffer;
+    int width;
+    int height;
+    GLint windowViewport[4];
+    GLint previousFBO;
+    bool active;             // this frame is being drawn scaled
+};
+DynamicResolutionState dynamicResolution = {1.0f, 0.0, 0, 0, 0, 0, 0, 0, 0, {0, 0, 0, 0}, 0, false};
+
+void resizeDynamicResolutionTarget(int width, int height) {
+    if (dynamicResolution.fbo == 0) {
+        glGenFramebuffers(1, &dynamicResolution.fbo);
+        glGenRenderbuffers(1, &dynamicResolution.colorBuffer);
+        glGenRenderbuffers(1, &dynamicResolution.depthBuffer);
+    }
+    if (dynamicResolution.width == width && dynamicResolution.height == height) return;
+    glBindRenderbuffer(GL_RENDERBUFFER, dynamicResolution.colorBuffer);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+    glBindRenderbuffer(GL_RENDERBUFFER, dynamicResolution.depthBuffer);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+    GLint previousFBO;
+    glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &previousFBO);
+    glBindFramebuffer(GL_FRAMEBUFFER, dynamicResolution.fbo);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, dynamicResolution.colorBuffer);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, dynamicResolution.depthBuffer);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        printf("Dynamic resolution target %dx%d incomplete\n", width, height);
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, previousFBO);
+    dynamicResolution.width = width;
+    dynamicResolution.height = height;
+}
+
+// Shrinks the viewport to the current scale. Call before beginHDRFrame(),
+// which then sizes the HDR target to match.
+void beginScaledFrame(bool hdr) {
+    dynamicResolution.active = dynamicResolutionEnabled && dynamicResolution.scale < 1.0f;
+    if (!dynamicResolution.active) return;
+
+    GLint* window = dynamicResolution.windowViewport;
+    glGetIntegerv(GL_VIEWPORT, window);
+    int width = std::max(1, (int)(window[2] * dynamicResolution.scale + 0.5f));
+    int height = std::max(1, (int)(window[3] * dynamicResolution.scale + 0.5f));
+    if (!hdr) {
+        resizeDynamicResolutionTarget(width, height);
+        glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &dynamicResolution.previousFBO);
+        glBindFramebuffer(GL_FRAMEBUFFER, dynamicResolution.fbo);
+    }
+    glViewport(0, 0, width, height);
+}
+
+// Restores the window viewport; without HDR the scaled frame is also
+// stretched over the window here
+void endScaledFrame(bool hdr) {
+    if (!dynamicResolution.active) return;
+    GLint* window = dynamicResolution.windowViewport;
+    if (!hdr) {
+        GLint viewport[4];
+        glGetIntegerv(GL_VIEWPORT, viewport);
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, dynamicResolution.fbo);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, dynamicResolution.previousFBO);
+        glBlitFramebuffer(0, 0, viewport[2], viewport[3], window[0], window[1], window[0] + window[2],
+                          window[1] + window[3], GL_COLOR_BUFFER_BIT, GL_LINEAR);
+        glBindFramebuffer(GL_FRAMEBUFFER, dynamicResolution.previousFBO);
+    }
+    glViewport(window[0], window[1], window[2], window[3]);
+}
+
+// Every run starts from full resolution
+void setDynamicResolution(bool enabled) {
+    dynamicResolutionEnabled = enabled;
+    dynamicResolution.scale = 1.0f;
+    dynamicResolution.smoothedMs = 0.0;
+    dynamicResolution.cooldown = 0;
+}
+
+void updateDynamicResolution(double frameMs) {
+    if (!dynamicResolutionEnabled) return;
+    if (dynamicResolution.smoothedMs <= 0.0) dynamicResolution.smoothedMs = frameMs;
+    dynamicResolution.smoothedMs += (frameMs - dynamicResolution.smoothedMs) * DYNAMIC_RESOLUTION_SMOOTHING;
+    if (dynamicResolution.cooldown > 0) {
+        dynamicResolution.cooldown--;
+        return;
+    }
+
+    const float step = 1.0f / 16.0f;
+    float scale = dynamicResolution.scale;
+    float wanted = scale * sqrtf((float)(dynamicResolutionTargetMs / dynamicResolution.smoothedMs));
+    float next = scale;
+    if (dynamicResolution.smoothedMs > dynamicResolutionTargetMs * 1.05 && wanted < scale - 0.5f * step) {
+        // Over target: drop up to two steps at once
+        next = std::max(wanted, scale - 2.0f * step);
+    } else if (dynamicResolution.smoothedMs < dynamicResolutionTargetMs * 0.9 && wanted > scale + step) {
+        next = scale + step;
+    }
+    next = std::max(DYNAMIC_RESOLUTION_MIN_SCALE, std::min(1.0f, floorf(next / step + 0.5f) * step));
+    if (next != scale) {
+        dynamicResolution.scale = next;
+        dynamicResolution.cooldown = DYNAMIC_RESOLUTION_SETTLE_FRAMES;
+        dynamicResolution.changes++;
+    }
+}
+
+void printDynamicResolutionStats() {
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    printf("Dynamic resolution: scale %.3f (%dx%d of %dx%d), frame %.2f ms smoothed, target %.2f ms, %d changes\n",
+           dynamicResolution.scale, std::max(1, (int)(viewport[2] * dynamicResolution.scale + 0.5f)),
+           std::max(1, (int)(viewport[3] * dynamicResolution.scale + 0.5f)), viewport[2], viewport[3],
+           dynamicResolution.smoothedMs, dynamicResolutionTargetMs, dynamicResolution.changes);
+    dynamicResolution.changes = 0;
+}
+
+// ============= Anti-Aliasing =============
+// With a mode selected the scene is drawn into a target of its own and
+// resolved into whatever was bound before (the window, the HDR target or
+// the dynamic resolution target): MSAA resolves with a blit, FXAA and TAA
+// with a full-screen pass. Every mode also accumulates the frame time it
+// was measured at, so the stats show what each one costs over 'off'.
+struct AntiAliasingState {
+    GLuint fbo;                  // single-sample scene, and where MSAA resolves to
+    GLuint colorTexture;
+    GLuint depthTexture;
+    int width;
+    int height;
+    bool hdr;                    // RGBA16F instead of RGBA8
+    GLuint msFBO;
+    GLuint msColorBuffer;
+    GLuint msDepthBuffer;
+    int msWidth;                 // 0 until MSAA is first used at this size
+    int samples;
+    GLuint historyFBOs[2];       // TAA output, ping-ponged
+    GLuint historyTextures[2];
+    int historyIndex;
+    bool historyValid;
+    int jitterIndex;
+    GLfloat previousViewProjection[16];
+    GLuint depthCopyFBO;         // for copySceneDepth() out of a multisampled target
+    AntiAliasingMode frameMode;  // mode the current frame started with
+    GLint previousFBO;
+    double passMsSum[AA_MODE_COUNT];
+    int passFrames[AA_MODE_COUNT];
+    double passMsAvg[AA_MODE_COUNT];
+    double frameMsSum[AA_MODE_COUNT];
+    int frames[AA_MODE_COUNT];
+    double frameMsAvg[AA_MODE_COUNT];
+};
+AntiAliasingState antiAliasing;
+
+bool antiAliasingModeAvailable(AntiAliasingMode mode) {
+    switch (mode) {
+        case AA_MSAA: return antiAliasing.samples > 1;
+        case AA_FXAA: return fxaaProgram != 0;
+        case AA_TAA: return taaProgram != 0;
+        default: return true;
+    }
+}
+
+void setupAntiAliasing() {
+    GLint maxSamples = 0;
+    glGetIntegerv(GL_MAX_SAMPLES, &maxSamples);
+    antiAliasing.samples = std::min(MSAA_SAMPLES, (int)maxSamples);
+    glGenFramebuffers(1, &antiAliasing.fbo);
+    glGenTextures(1, &antiAliasing.colorTexture);
+    glGenTextures(1, &antiAliasing.depthTexture);
+    glGenFramebuffers(1, &antiAliasing.msFBO);
+    glGenRenderbuffers(1, &antiAliasing.msColorBuffer);
+    glGenRenderbuffers(1, &antiAliasing.msDepthBuffer);
+    glGenFramebuffers(2, antiAliasing.historyFBOs);
+    glGenTextures(2, antiAliasing.historyTextures);
+    glGenFramebuffers(1, &antiAliasing.depthCopyFBO);
+
+    fxaaProgram = loadProgram("shaders/deferred.vert", "shaders/fxaa.frag");
+    taaProgram = loadProgram("shaders/deferred.vert", "shaders/taa.frag");
+    if (fxaaProgram) {
+        glUseProgram(fxaaProgram);
+        glUniform1i(glGetUniformLocation(fxaaProgram, "uScene"), 0);
+    }
+    if (taaProgram) {
+        glUseProgram(taaProgram);
+        glUniform1i(glGetUniformLocation(taaProgram, "uCurrent"), 0);
+        glUniform1i(glGetUniformLocation(taaProgram, "uHistory"), 1);
+        glUniform1i(glGetUniformLocation(taaProgram, "uDepth"), 2);
+        glUniform1f(glGetUniformLocation(taaProgram, "uBlend"), TAA_BLEND);
+    }
+    glUseProgram(0);
+    printf("Anti-aliasing: %d-sample MSAA %s, FXAA %s, TAA %s\n", antiAliasing.samples,
+           antiAliasing.samples > 1 ? "ready" : "unavailable", fxaaProgram ? "ready" : "unavailable",
+           taaProgram ? "ready" : "unavailable");
+}
+
+void allocateColorTexture(GLuint texture, int width, int height, bool hdr) {
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, hdr ? GL_RGBA16F : GL_RGBA8, width, height, 0, GL_RGBA,
+                 hdr ? GL_FLOAT : GL_UNSIGNED_BYTE, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+}
+
+// (Re)allocates the targets the mode needs for this viewport and format
+void resizeAntiAliasingTargets(int width, int height, bool hdr, AntiAliasingMode mode) {
+    GLint previousFBO;
+    glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &previousFBO);
+    if (antiAliasing.width != width || antiAliasing.height != height || antiAliasing.hdr != hdr) {
+        allocateColorTexture(antiAliasing.colorTexture, width, height, hdr);
+        glBindTexture(GL_TEXTURE_2D, antiAliasing.depthTexture);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, width, height, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glBindFramebuffer(GL_FRAMEBUFFER, antiAliasing.fbo);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, antiAliasing.colorTexture, 0);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, antiAliasing.depthTexture, 0);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+            printf("Anti-aliasing target %dx%d incomplete\n", width, height);
+        }
+        for (int i = 0; i < 2; i++) {
+            allocateColorTexture(antiAliasing.historyTextures[i], width, height, hdr);
+            glBindFramebuffer(GL_FRAMEBUFFER, antiAliasing.historyFBOs[i]);
+            glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
+                                   antiAliasing.historyTextures[i], 0);
+        }
+        glBindTexture(GL_TEXTURE_2D, 0);
+        antiAliasing.width = width;
+        antiAliasing.height = height;
+        antiAliasing.hdr = hdr;
+        antiAliasing.msWidth = 0;
+        antiAliasing.historyValid = false;
+    }
+
+    if (mode == AA_MSAA && antiAliasing.msWidth == 0) {
+        glBindRenderbuffer(GL_RENDERBUFFER, antiAliasing.msColorBuffer);
+        glRenderbufferStorageMultisample(GL_RENDERBUFFER, antiAliasing.samples, hdr ? GL_RGBA16F : GL_RGBA8,
+                                         width, height);
+        glBindRenderbuffer(GL_RENDERBUFFER, antiAliasing.msDepthBuffer);
+        glRenderbufferStorageMultisample(GL_RENDERBUFFER, antiAliasing.samples, GL_DEPTH_COMPONENT24, width, height);
+        glBindRenderbuffer(GL_RENDERBUFFER, 0);
+        glBindFramebuffer(GL_FRAMEBUFFER, antiAliasing.msFBO);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, antiAliasing.msColorBuffer);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, antiAliasing.msDepthBuffer);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+            printf("MSAA target %dx%d incomplete\n", width, height);
+        }
+        antiAliasing.msWidth = width;
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, previousFBO);
+}
+
+// Copies the depth of the bound framebuffer into a DEPTH_COMPONENT24
+// texture the size of the viewport. Multisampled depth cannot be read with
+// glCopyTexSubImage2D, so it is resolved with a blit instead.
+void copySceneDepth(GLuint texture, const GLint* viewport) {
+    GLint sampleBuffers = 0;
+    glGetIntegerv(GL_SAMPLE_BUFFERS, &sampleBuffers);
+    if (sampleBuffers == 0) {
+        glBindTexture(GL_TEXTURE_2D, texture);
+        glCopyTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, viewport[0], viewport[1], viewport[2], viewport[3]);
+        glBindTexture(GL_TEXTURE_2D, 0);
+        return;
+    }
+    GLint drawFBO;
+    glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &drawFBO);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, drawFBO);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, antiAliasing.depthCopyFBO);
+    glFramebufferTexture2D(GL_DRAW_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, texture, 0);
+    glDrawBuffer(GL_NONE);
+    glBlitFramebuffer(viewport[0], viewport[1], viewport[0] + viewport[2], viewport[1] + viewport[3], 0, 0,
+                      viewport[2], viewport[3], GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+    glBindFramebuffer(GL_FRAMEBUFFER, drawFBO);
+}
+
+// Radical inverse of index in the given base, in [0, 1)
+float haltonSequence(int index, int base) {
+    float result = 0.0f;
+    float fraction = 1.0f / base;
+    for (; index > 0; index /= base) {
+        result += fraction * (index % base);
+        fraction /= base;
+    }
+    return result;
+}
+
+// Binds the mode's target; TAA also offsets the projection by this frame's
+// sub-pixel jitter (Halton 2, 3)
+void beginAntiAliasedFrame(bool hdr) {
+    antiAliasing.frameMode = antiAliasingMode;
+    if (antiAliasingMode == AA_OFF) return;
+
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    resizeAntiAliasingTargets(viewport[2], viewport[3], hdr, antiAliasingMode);
+    glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &antiAliasing.previousFBO);
+    glBindFramebuffer(GL_FRAMEBUFFER, antiAliasingMode == AA_MSAA ? antiAliasing.msFBO : antiAliasing.fbo);
+
+    if (antiAliasingMode == AA_TAA) {
+        antiAliasing.jitterIndex = antiAliasing.jitterIndex % TAA_JITTER_PHASES + 1;
+        applyProjection(haltonSequence(antiAliasing.jitterIndex, 2) - 0.5f,
+                        haltonSequence(antiAliasing.jitterIndex, 3) - 0.5f);
+    } else {
+        antiAliasing.historyValid = false;
+    }
+}
+
+// The next frame starts the jitter sequence over and keeps no history, as
+// after a camera cut
+void resetAntiAliasingHistory() {
+    antiAliasing.historyValid = false;
+    antiAliasing.jitterIndex = 0;
+}
+
+// Resolves into the framebuffer bound before beginAntiAliasedFrame().
+// Expects the modelview to hold just the camera and no program bound.
+void endAntiAliasedFrame() {
+    AntiAliasingMode mode = antiAliasing.frameMode;
+    if (mode == AA_OFF) return;
+
+    finishPassTiming();
+    double start = nowMs();
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    int width = viewport[2], height = viewport[3];
+
+    if (mode == AA_MSAA) {
+        // Resolve, then copy over; the window's format may differ from the target's
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, antiAliasing.msFBO);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, antiAliasing.fbo);
+        glBlitFramebuffer(0, 0, width, height, 0, 0, width, height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, antiAliasing.fbo);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, antiAliasing.previousFBO);
+        glBlitFramebuffer(0, 0, width, height, viewport[0], viewport[1], viewport[0] + width, viewport[1] + height,
+                          GL_COLOR_BUFFER_BIT, GL_NEAREST);
+        glBindFramebuffer(GL_FRAMEBUFFER, antiAliasing.previousFBO);
+    } else {
+        glPushAttrib(GL_ENABLE_BIT);
+        glDisable(GL_DEPTH_TEST);
+        glDisable(GL_CULL_FACE);
+        glDisable(GL_BLEND);
+        glDisable(GL_LIGHTING);
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, antiAliasing.colorTexture);
+
+        if (mode == AA_FXAA) {
+            glBindFramebuffer(GL_FRAMEBUFFER, antiAliasing.previousFBO);
+            glUseProgram(fxaaProgram);
+            drawFullScreenTriangle();
+        } else {
+            // Reproject through last frame's unjittered camera
+            GLfloat view[16], inverseView[16], projection[16], viewProjection[16], eyeToPrevious[16];
+            glGetFloatv(GL_MODELVIEW_MATRIX, view);
+            invertRigidMatrix(view, inverseView);
+            perspectiveMatrix(45.0f, projectionAspect, 0.1f, 100.0f, projection);
+            multiplyMatrices(projection, view, viewProjection);
+            multiplyMatrices(antiAliasing.previousViewProjection, inverseView, eyeToPrevious);
+
+            int next = 1 - antiAliasing.historyIndex;
+            glBindFramebuffer(GL_FRAMEBUFFER, antiAliasing.historyFBOs[next]);
+            glUseProgram(taaProgram);
+            glUniformMatrix4fv(glGetUniformLocation(taaProgram, "uEyeToPreviousClip"), 1, GL_FALSE, eyeToPrevious);
+            glUniform1i(glGetUniformLocation(taaProgram, "uHistoryValid"), antiAliasing.historyValid ? 1 : 0);
+            glActiveTexture(GL_TEXTURE1);
+            glBindTexture(GL_TEXTURE_2D, antiAliasing.historyTextures[antiAliasing.historyIndex]);
+            glActiveTexture(GL_TEXTURE2);
+            glBindTexture(GL_TEXTURE_2D, antiAliasing.depthTexture);
+            drawFullScreenTriangle();
+            glBindTexture(GL_TEXTURE_2D, 0);
+            glActiveTexture(GL_TEXTURE1);
+            glBindTexture(GL_TEXTURE_2D, 0);
+            glActiveTexture(GL_TEXTURE0);
+
+            glBindFramebuffer(GL_READ_FRAMEBUFFER, antiAliasing.historyFBOs[next]);
+            glBindFramebuffer(GL_DRAW_FRAMEBUFFER, antiAliasing.previousFBO);
+            glBlitFramebuffer(0, 0, width, height, viewport[0], viewport[1], viewport[0] + width,
+                              viewport[1] + height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+            glBindFramebuffer(GL_FRAMEBUFFER, antiAliasing.previousFBO);
+            memcpy(antiAliasing.previousViewProjection, viewProjection, sizeof(viewProjection));
+            antiAliasing.historyIndex = next;
+            antiAliasing.historyValid = true;
+            applyProjection(0.0f, 0.0f);
+        }
+        glUseProgram(0);
+        glBindTexture(GL_TEXTURE_2D, 0);
+        glPopAttrib();
+    }
+    finishPassTiming();
+    antiAliasing.passMsSum[mode] += nowMs() - start;
+    antiAliasing.passFrames[mode]++;
+}
+
+void recordAntiAliasingFrame(double ms) {
+    antiAliasing.frameMsSum[antiAliasing.frameMode] += ms;
+    antiAliasing.frames[antiAliasing.frameMode]++;
+}
+
+// Frame time of every mode measured so far, with its difference to 'off'
+void printAntiAliasingStats() {
+    bool measured = false;
+    for (int i = 0; i < AA_MODE_COUNT; i++) {
+        if (antiAliasing.frames[i] > 0) {
+            antiAliasing.frameMsAvg[i] = antiAliasing.frameMsSum[i] / antiAliasing.frames[i];
+            antiAliasing.frameMsSum[i] = 0.0;
+            antiAliasing.frames[i] = 0;
+        }
+        if (antiAliasing.passFrames[i] > 0) {
+            antiAliasing.passMsAvg[i] = antiAliasing.passMsSum[i] / antiAliasing.passFrames[i];
+            antiAliasing.passMsSum[i] = 0.0;
+            antiAliasing.passFrames[i] = 0;
+        }
+        if (i != AA_OFF && antiAliasing.frameMsAvg[i] > 0.0) measured = true;
+    }
+    if (!measured) return;
+
+    printf("Anti-aliasing (%s):", antiAliasingNames[antiAliasingMode]);
+    for (int i = 0; i < AA_MODE_COUNT; i++) {
+        if (antiAliasing.frameMsAvg[i] <= 0.0) continue;
+        printf(" | %s frame %.2f ms", antiAliasingNames[i], antiAliasing.frameMsAvg[i]);
+        if (i == AA_OFF) continue;
+        printf(" (resolve %.2f ms", antiAliasing.passMsAvg[i]);
+        if (antiAliasing.frameMsAvg[AA_OFF] > 0.0) {
+            printf(", %+.2f ms vs off", antiAliasing.frameMsAvg[i] - antiAliasing.frameMsAvg[AA_OFF]);
+        }
+        printf(")");
+    }
+    printf("\n");
+}
+
+// ============= Performance HUD =============
+// 'I' overlays the live numbers on the finished frame: a rolling frame-time
+// graph, CPU (and, with 'Q', GPU) time of the busiest scopes, draw calls,
+// triangles, scene texture binds, state changes, what was culled and the
+// texture memory in use. Text comes from a glyph atlas (the X11 "fixed"
+// 8x13 font, the one GLUT_BITMAP_8_BY_13 draws) and the whole overlay is
+// one client-array draw of quads. The graph is a strip of the atlas below
+// the glyphs, rewritten every frame, so it costs one quad rather than one
+// per bar (llvmpipe transforms and bins every vertex on the CPU). The text
+// only changes every HUD_REFRESH_FRAMES frames, when the averages are taken.
+const int HUD_GLYPH_WIDTH = 8;
+const int HUD_GLYPH_HEIGHT = 14;
+const int HUD_ATLAS_SIZE = 128;          // 16 x 6 cells of 8x16, then the graph strip
+const int HUD_SOLID_GLYPH = 95;          // the DEL cell, filled for the panel
+const int HUD_GRAPH_ROW = 96;            // first atlas row of the graph strip
+const int HUD_GRAPH_FRAMES = 120;
+const int HUD_GRAPH_HEIGHT = 32;         // texels, drawn twice as tall
+const int HUD_REFRESH_FRAMES = 20;
+const int HUD_SCOPE_ROWS = 8;
+const int HUD_COLUMNS = 46;
+
+// Printable ASCII, rows bottom to top as glBitmap takes them
+const unsigned char hudFont[95][HUD_GLYPH_HEIGHT] = {
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, // ' '
+    {0x00, 0x00, 0x00, 0x10, 0x00, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x00, 0x00}, // '!'
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x24, 0x24, 0x24, 0x00, 0x00}, // '"'
+    {0x00, 0x00, 0x00, 0x00, 0x24, 0x24, 0x7e, 0x24, 0x7e, 0x24, 0x24, 0x00, 0x00, 0x00}, // '#'
+    {0x00, 0x00, 0x00, 0x10, 0x78, 0x14, 0x14, 0x38, 0x50, 0x50, 0x3c, 0x10, 0x00, 0x00}, // '$'
+    {0x00, 0x00, 0x00, 0x44, 0x2a, 0x24, 0x10, 0x08, 0x08, 0x24, 0x52, 0x22, 0x00, 0x00}, // '%'
+    {0x00, 0x00, 0x00, 0x3a, 0x44, 0x4a, 0x30, 0x48, 0x48, 0x30, 0x00, 0x00, 0x00, 0x00}, // '&'
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x40, 0x30, 0x38, 0x00, 0x00}, // '''
+    {0x00, 0x00, 0x00, 0x04, 0x08, 0x08, 0x10, 0x10, 0x10, 0x08, 0x08, 0x04, 0x00, 0x00}, // '('
+    {0x00, 0x00, 0x00, 0x20, 0x10, 0x10, 0x08, 0x08, 0x08, 0x10, 0x10, 0x20, 0x00, 0x00}, // ')'
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x24, 0x18, 0x7e, 0x18, 0x24, 0x00, 0x00, 0x00, 0x00}, // '*'
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x10, 0x10, 0x7c, 0x10, 0x10, 0x00, 0x00, 0x00, 0x00}, // '+'
+    {0x00, 0x00, 0x40, 0x30, 0x38, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, // ','
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x7e, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, // '-'
+    {0x00, 0x00, 0x10, 0x38, 0x10, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, // '.'
+    {0x00, 0x00, 0x00, 0x80, 0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x02, 0x00, 0x00}, // '/'
+    {0x00, 0x00, 0x00, 0x18, 0x24, 0x42, 0x42, 0x42, 0x42, 0x42, 0x24, 0x18, 0x00, 0x00}, // '0'
+    {0x00, 0x00, 0x00, 0x7c, 0x10, 0x10, 0x10, 0x10, 0x10, 0x50, 0x30, 0x10, 0x00, 0x00}, // '1'
+    {0x00, 0x00, 0x00, 0x7e, 0x40, 0x20, 0x18, 0x04, 0x02, 0x42, 0x42, 0x3c, 0x00, 0x00}, // '2'
+    {0x00, 0x00, 0x00, 0x3c, 0x42, 0x02, 0x02, 0x1c, 0x08, 0x04, 0x02, 0x7e, 0x00, 0x00}, // '3'
+    {0x00, 0x00, 0x00, 0x04, 0x04, 0x7e, 0x44, 0x44, 0x24, 0x14, 0x0c, 0x04, 0x00, 0x00}, // '4'
+    {0x00, 0x00, 0x00, 0x3c, 0x42, 0x02, 0x02, 0x62, 0x5c, 0x40, 0x40, 0x7e, 0x00, 0x00}, // '5'
+    {0x00, 0x00, 0x00, 0x3c, 0x42, 0x42, 0x62, 0x5c, 0x40, 0x40, 0x20, 0x1c, 0x00, 0x00}, // '6'
+    {0x00, 0x00, 0x00, 0x20, 0x20, 0x10, 0x10, 0x08, 0x08, 0x04, 0x02, 0x7e, 0x00, 0x00}, // '7'
+    {0x00, 0x00, 0x00, 0x3c, 0x42, 0x42, 0x42, 0x3c, 0x42, 0x42, 0x42, 0x3c, 0x00, 0x00}, // '8'
+    {0x00, 0x00, 0x00, 0x38, 0x04, 0x02, 0x02, 0x3a, 0x46, 0x42, 0x42, 0x3c, 0x00, 0x00}, // '9'
+    {0x00, 0x00, 0x10, 0x38, 0x10, 0x00, 0x00, 0x10, 0x38, 0x10, 0x00, 0x00, 0x00, 0x00}, // ':'
+    {0x00, 0x00, 0x40, 0x30, 0x38, 0x00, 0x00, 0x10, 0x38, 0x10, 0x00, 0x00, 0x00, 0x00}, // ';'
+    {0x00, 0x00, 0x00, 0x02, 0x04, 0x08, 0x10, 0x20, 0x10, 0x08, 0x04, 0x02, 0x00, 0x00}, // '<'
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x7e, 0x00, 0x00, 0x7e, 0x00, 0x00, 0x00, 0x00, 0x00}, // '='
+    {0x00, 0x00, 0x00, 0x40, 0x20, 0x10, 0x08, 0x04, 0x08, 0x10, 0x20, 0x40, 0x00, 0x00}, // '>'
+    {0x00, 0x00, 0x00, 0x08, 0x00, 0x08, 0x08, 0x04, 0x02, 0x42, 0x42, 0x3c, 0x00, 0x00}, // '?'
+    {0x00, 0x00, 0x00, 0x3c, 0x40, 0x4a, 0x56, 0x52, 0x4e, 0x42, 0x42, 0x3c, 0x00, 0x00}, // '@'
+    {0x00, 0x00, 0x00, 0x42, 0x42, 0x42, 0x7e, 0x42, 0x42, 0x42, 0x24, 0x18, 0x00, 0x00}, // 'A'
+    {0x00, 0x00, 0x00, 0xfc, 0x42, 0x42, 0x42, 0x7c, 0x42, 0x42, 0x42, 0xfc, 0x00, 0x00}, // 'B'
+    {0x00, 0x00, 0x00, 0x3c, 0x42, 0x40, 0x40, 0x40, 0x40, 0x40, 0x42, 0x3c, 0x00, 0x00}, // 'C'
+    {0x00, 0x00, 0x00, 0xfc, 0x42, 0x42, 0x42, 0x42, 0x42, 0x42, 0x42, 0xfc, 0x00, 0x00}, // 'D'
+    {0x00, 0x00, 0x00, 0x7e, 0x40, 0x40, 0x40, 0x78, 0x40, 0x40, 0x40, 0x7e, 0x00, 0x00}, // 'E'
+    {0x00, 0x00, 0x00, 0x40, 0x40, 0x40, 0x40, 0x78, 0x40, 0x40, 0x40, 0x7e, 0x00, 0x00}, // 'F'
+    {0x00, 0x00, 0x00, 0x3a, 0x46, 0x42, 0x4e, 0x40, 0x40, 0x40, 0x42, 0x3c, 0x00, 0x00}, // 'G'
+    {0x00, 0x00, 0x00, 0x42, 0x42, 0x42, 0x42, 0x7e, 0x42, 0x42, 0x42, 0x42, 0x00, 0x00}, // 'H'
+    {0x00, 0x00, 0x00, 0x7c, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x7c, 0x00, 0x00}, // 'I'
+    {0x00, 0x00, 0x00, 0x38, 0x44, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x1f, 0x00, 0x00}, // 'J'
+    {0x00, 0x00, 0x00, 0x42, 0x44, 0x48, 0x50, 0x60, 0x50, 0x48, 0x44, 0x42, 0x00, 0x00}, // 'K'
+    {0x00, 0x00, 0x00, 0x7e, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x00, 0x00}, // 'L'
+    {0x00, 0x00, 0x00, 0x82, 0x82, 0x82, 0x92, 0x92, 0xaa, 0xc6, 0x82, 0x82, 0x00, 0x00}, // 'M'
+    {0x00, 0x00, 0x00, 0x42, 0x42, 0x42, 0x46, 0x4a, 0x52, 0x62, 0x42, 0x42, 0x00, 0x00}, // 'N'
+    {0x00, 0x00, 0x00, 0x3c, 0x42, 0x42, 0x42, 0x42, 0x42, 0x42, 0x42, 0x3c, 0x00, 0x00}, // 'O'
+    {0x00, 0x00, 0x00, 0x40, 0x40, 0x40, 0x40, 0x7c, 0x42, 0x42, 0x42, 0x7c, 0x00, 0x00}, // 'P'
+    {0x00, 0x00, 0x02, 0x3c, 0x4a, 0x52, 0x42, 0x42, 0x42, 0x42, 0x42, 0x3c, 0x00, 0x00}, // 'Q'
+    {0x00, 0x00, 0x00, 0x42, 0x44, 0x48, 0x50, 0x7c, 0x42, 0x42, 0x42, 0x7c, 0x00, 0x00}, // 'R'
+    {0x00, 0x00, 0x00, 0x3c, 0x42, 0x02, 0x02, 0x3c, 0x40, 0x40, 0x42, 0x3c, 0x00, 0x00}, // 'S'
+    {0x00, 0x00, 0x00, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0xfe, 0x00, 0x00}, // 'T'
+    {0x00, 0x00, 0x00, 0x3c, 0x42, 0x42, 0x42, 0x42, 0x42, 0x42, 0x42, 0x42, 0x00, 0x00}, // 'U'
+    {0x00, 0x00, 0x00, 0x10, 0x28, 0x28, 0x28, 0x44, 0x44, 0x44, 0x82, 0x82, 0x00, 0x00}, // 'V'
+    {0x00, 0x00, 0x00, 0x44, 0xaa, 0x92, 0x92, 0x92, 0x82, 0x82, 0x82, 0x82, 0x00, 0x00}, // 'W'
+    {0x00, 0x00, 0x00, 0x82, 0x82, 0x44, 0x28, 0x10, 0x28, 0x44, 0x82, 0x82, 0x00, 0x00}, // 'X'
+    {0x00, 0x00, 0x00, 0x10, 0x10, 0x10, 0x10, 0x10, 0x28, 0x44, 0x82, 0x82, 0x00, 0x00}, // 'Y'
+    {0x00, 0x00, 0x00, 0x7e, 0x40, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x7e, 0x00, 0x00}, // 'Z'
+    {0x00, 0x00, 0x00, 0x3c, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x3c, 0x00, 0x00}, // '['
+    {0x00, 0x00, 0x00, 0x02, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x80, 0x00, 0x00}, // backslash
+    {0x00, 0x00, 0x00, 0x78, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x78, 0x00, 0x00}, // ']'
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x44, 0x28, 0x10, 0x00, 0x00}, // '^'
+    {0x00, 0x00, 0xfe, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, // '_'
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x04, 0x18, 0x38, 0x00, 0x00}, // '`'
+    {0x00, 0x00, 0x00, 0x3a, 0x46, 0x42, 0x3e, 0x02, 0x3c, 0x00, 0x00, 0x00, 0x00, 0x00}, // 'a'
+    {0x00, 0x00, 0x00, 0x5c, 0x62, 0x42, 0x42, 0x62, 0x5c, 0x40, 0x40, 0x40, 0x00, 0x00}, // 'b'
+    {0x00, 0x00, 0x00, 0x3c, 0x42, 0x40, 0x40, 0x42, 0x3c, 0x00, 0x00, 0x00, 0x00, 0x00}, // 'c'
+    {0x00, 0x00, 0x00, 0x3a, 0x46, 0x42, 0x42, 0x46, 0x3a, 0x02, 0x02, 0x02, 0x00, 0x00}, // 'd'
+    {0x00, 0x00, 0x00, 0x3c, 0x42, 0x40, 0x7e, 0x42, 0x3c, 0x00, 0x00, 0x00, 0x00, 0x00}, // 'e'
+    {0x00, 0x00, 0x00, 0x20, 0x20, 0x20, 0x20, 0x7c, 0x20, 0x20, 0x22, 0x1c, 0x00, 0x00}, // 'f'
+    {0x00, 0x3c, 0x42, 0x3c, 0x40, 0x38, 0x44, 0x44, 0x3a, 0x00, 0x00, 0x00, 0x00, 0x00}, // 'g'
+    {0x00, 0x00, 0x00, 0x42, 0x42, 0x42, 0x42, 0x62, 0x5c, 0x40, 0x40, 0x40, 0x00, 0x00}, // 'h'
+    {0x00, 0x00, 0x00, 0x7c, 0x10, 0x10, 0x10, 0x10, 0x30, 0x00, 0x10, 0x00, 0x00, 0x00}, // 'i'
+    {0x00, 0x38, 0x44, 0x44, 0x04, 0x04, 0x04, 0x04, 0x0c, 0x00, 0x04, 0x00, 0x00, 0x00}, // 'j'
+    {0x00, 0x00, 0x00, 0x42, 0x44, 0x48, 0x70, 0x48, 0x44, 0x40, 0x40, 0x40, 0x00, 0x00}, // 'k'
+    {0x00, 0x00, 0x00, 0x7c, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x30, 0x00, 0x00}, // 'l'
+    {0x00, 0x00, 0x00, 0x82, 0x92, 0x92, 0x92, 0x92, 0xec, 0x00, 0x00, 0x00, 0x00, 0x00}, // 'm'
+    {0x00, 0x00, 0x00, 0x42, 0x42, 0x42, 0x42, 0x62, 0x5c, 0x00, 0x00, 0x00, 0x00, 0x00}, // 'n'
+    {0x00, 0x00, 0x00, 0x3c, 0x42, 0x42, 0x42, 0x42, 0x3c, 0x00, 0x00, 0x00, 0x00, 0x00}, // 'o'
+    {0x00, 0x40, 0x40, 0x40, 0x5c, 0x62, 0x42, 0x62, 0x5c, 0x00, 0x00, 0x00, 0x00, 0x00}, // 'p'
+    {0x00, 0x02, 0x02, 0x02, 0x3a, 0x46, 0x42, 0x46, 0x3a, 0x00, 0x00, 0x00, 0x00, 0x00}, // 'q'
+    {0x00, 0x00, 0x00, 0x20, 0x20, 0x20, 0x20, 0x22, 0x5c, 0x00, 0x00, 0x00, 0x00, 0x00}, // 'r'
+    {0x00, 0x00, 0x00, 0x3c, 0x42, 0x0c, 0x30, 0x42, 0x3c, 0x00, 0x00, 0x00, 0x00, 0x00}, // 's'
+    {0x00, 0x00, 0x00, 0x1c, 0x22, 0x20, 0x20, 0x20, 0x7c, 0x20, 0x20, 0x00, 0x00, 0x00}, // 't'
+    {0x00, 0x00, 0x00, 0x3a, 0x44, 0x44, 0x44, 0x44, 0x44, 0x00, 0x00, 0x00, 0x00, 0x00}, // 'u'
+    {0x00, 0x00, 0x00, 0x10, 0x28, 0x28, 0x44, 0x44, 0x44, 0x00, 0x00, 0x00, 0x00, 0x00}, // 'v'
+    {0x00, 0x00, 0x00, 0x44, 0xaa, 0x92, 0x92, 0x82, 0x82, 0x00, 0x00, 0x00, 0x00, 0x00}, // 'w'
+    {0x00, 0x00, 0x00, 0x42, 0x24, 0x18, 0x18, 0x24, 0x42, 0x00, 0x00, 0x00, 0x00, 0x00}, // 'x'
+    {0x00, 0x3c, 0x42, 0x02, 0x3a, 0x46, 0x42, 0x42, 0x42, 0x00, 0x00, 0x00, 0x00, 0x00}, // 'y'
+    {0x00, 0x00, 0x00, 0x7e, 0x20, 0x10, 0x08, 0x04, 0x7e, 0x00, 0x00, 0x00, 0x00, 0x00}, // 'z'
+    {0x00, 0x00, 0x00, 0x0e, 0x10, 0x10, 0x08, 0x30, 0x08, 0x10, 0x10, 0x0e, 0x00, 0x00}, // '{'
+    {0x00, 0x00, 0x00, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x00, 0x00}, // '|'
+    {0x00, 0x00, 0x00, 0x70, 0x08, 0x08, 0x10, 0x0c, 0x10, 0x08, 0x08, 0x70, 0x00, 0x00}, // '}'
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x48, 0x54, 0x24, 0x00, 0x00}, // '~'
+};
+
+struct HudVertex {
+    GLfloat position[2];
+    GLfloat texCoord[2];
+    GLubyte color[4];
+};
+
+struct PerfHudState {
+    bool enabled;
+    GLuint atlas;
+    std::vector<HudVertex> vertices;
+    size_t textVertices;           // panel and text, rebuilt on refresh
+    float history[HUD_GRAPH_FRAMES];
+    int historyNext;
+    int historyCount;
+    int framesSinceRefresh;
+    long lastDraws, lastTriangles, lastBinds, lastChanges;
+    double sumDraws, sumTriangles, sumBinds, sumChanges;
+    double sumFrameMs, sumCpuMs, sumHudMs;
+    double textureBytes;           // -1 when the driver cannot be asked
+    std::vector<unsigned char> graph; // the strip's texels
+};
+PerfHudState perfHud;
+
+void createHudAtlas() {
+    std::vector<unsigned char> texels(HUD_ATLAS_SIZE * HUD_ATLAS_SIZE, 0);
+    for (int glyph = 0; glyph <= HUD_SOLID_GLYPH; glyph++) {
+        int x0 = (glyph % 16) * HUD_GLYPH_WIDTH;
+        int y0 = (glyph / 16) * 16;
+        for (int row = 0; row < 16; row++) {
+            for (int x = 0; x < HUD_GLYPH_WIDTH; x++) {
+                bool set = (glyph == HUD_SOLID_GLYPH) ||
+                           (row < HUD_GLYPH_HEIGHT && (hudFont[glyph][row] & (0x80 >> x)));
+                texels[(y0 + row) * HUD_ATLAS_SIZE + x0 + x] = set ? 255 : 0;
+            }
+        }
+    }
+    perfHud.graph.assign(HUD_ATLAS_SIZE * HUD_GRAPH_HEIGHT, 0);
+    glGenTextures(1, &perfHud.atlas);
+    glBindTexture(GL_TEXTURE_2D, perfHud.atlas);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA8, HUD_ATLAS_SIZE, HUD_ATLAS_SIZE, 0, GL_ALPHA, GL_UNSIGNED_BYTE, &texels[0]);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+// Quad over [x0,x1]x[y0,y1] (y down) showing the atlas rectangle [u0,u1]x[v0,v1],
+// shaded from the top color to the bottom one
+void addHudQuad(float x0, float y0, float x1, float y1, float u0, float v0, float u1, float v1,
+                const GLubyte* top, const GLubyte* bottom) {
+    const float corners[4][4] = {{x0, y0, u0, v1}, {x0, y1, u0, v0}, {x1, y1, u1, v0}, {x1, y0, u1, v1}};
+    for (int i = 0; i < 4; i++) {
+        HudVertex v;
+        v.position[0] = corners[i][0];
+        v.position[1] = corners[i][1];
+        v.texCoord[0] = corners[i][2];
+        v.texCoord[1] = corners[i][3];
+        memcpy(v.color, (i == 1 || i == 2) ? bottom : top, sizeof(v.color));
+        perfHud.vertices.push_back(v);
+    }
+}
+
+void addHudRect(float x0, float y0, float x1, float y1, const GLubyte* color) {
+    // Centre of the solid cell, so filtering never reaches a glyph
+    float u = ((HUD_SOLID_GLYPH % 16) * HUD_GLYPH_WIDTH + 4.0f) / HUD_ATLAS_SIZE;
+    float v = ((HUD_SOLID_GLYPH / 16) * 16 + 8.0f) / HUD_ATLAS_SIZE;
+    addHudQuad(x0, y0, x1, y1, u, v, u, v, color, color);
+}
+
+void addHudText(float x, float y, const char* text, const GLubyte* color) {
+    for (const char* c = text; *c; c++, x += HUD_GLYPH_WIDTH) {
+        int glyph = (unsigned char)*c - 32;
+        if (glyph <= 0 || glyph >= HUD_SOLID_GLYPH) continue; // spaces and anything unprintable
+        float u0 = (float)((glyph % 16) * HUD_GLYPH_WIDTH) / HUD_ATLAS_SIZE;
+        float v0 = (float)((glyph / 16) * 16) / HUD_ATLAS_SIZE;
+        addHudQuad(x, y, x + HUD_GLYPH_WIDTH, y + HUD_GLYPH_HEIGHT, u0, v0,
+                   u0 + (float)HUD_GLYPH_WIDTH / HUD_ATLAS_SIZE, v0 + (float)HUD_GLYPH_HEIGHT / HUD_ATLAS_SIZE,
+                   color, color);
+    }
+}
+
+// Every texture level the driver holds, from the sizes it reports
+// (GL 4.5 direct state access); render buffers are not included
+double residentTextureBytes() {
+    GLint major = 0, minor = 0;
+    glGetIntegerv(GL_MAJOR_VERSION, &major);
+    glGetIntegerv(GL_MINOR_VERSION, &minor);
+    if (major * 10 + minor < 45) return -1.0;
+    const GLenum sizes[8] = {GL_TEXTURE_RED_SIZE, GL_TEXTURE_GREEN_SIZE, GL_TEXTURE_BLUE_SIZE, GL_TEXTURE_ALPHA_SIZE,
+                             GL_TEXTURE_LUMINANCE_SIZE, GL_TEXTURE_INTENSITY_SIZE, GL_TEXTURE_DEPTH_SIZE,
+                             GL_TEXTURE_STENCIL_SIZE};
+    double bytes = 0.0;
+    int misses = 0;
+    // Names are handed out in order; a long run of unused ones is the end
+    for (GLuint id = 1; misses < 64; id++) {
+        if (!glIsTexture(id)) {
+            misses++;
+            continue;
+        }
+        misses = 0;
+        GLint target = 0;
+        glGetTextureParameteriv(id, GL_TEXTURE_TARGET, &target);
+        if (target == GL_TEXTURE_BUFFER) {
+            GLint size = 0;
+            glGetTextureLevelParameteriv(id, 0, GL_TEXTURE_BUFFER_SIZE, &size);
+            bytes += size;
+            continue;
+        }
+        int faces = (target == GL_TEXTURE_CUBE_MAP) ? 6 : 1;
+        for (int level = 0; level < 16; level++) {
+            GLint width = 0, height = 0, depth = 0, samples = 0, compressed = 0;
+            glGetTextureLevelParameteriv(id, level, GL_TEXTURE_WIDTH, &width);
+            if (width == 0) break;
+            glGetTextureLevelParameteriv(id, level, GL_TEXTURE_HEIGHT, &height);
+            glGetTextureLevelParameteriv(id, level, GL_TEXTURE_DEPTH, &depth);
+            glGetTextureLevelParameteriv(id, level, GL_TEXTURE_SAMPLES, &samples);
+            glGetTextureLevelParameteriv(id, level, GL_TEXTURE_COMPRESSED, &compressed);
+            if (compressed) {
+                GLint size = 0;
+                glGetTextureLevelParameteriv(id, level, GL_TEXTURE_COMPRESSED_IMAGE_SIZE, &size);
+                bytes += (double)size * faces;
+                continue;
+            }
+            int bits = 0;
+            for (int i = 0; i < 8; i++) {
+                GLint componentBits = 0;
+                glGetTextureLevelParameteriv(id, level, sizes[i], &componentBits);
+                bits += componentBits;
+            }
+            bytes += (double)width * height * std::max(1, depth) * std::max(1, samples) * faces * bits / 8.0;
+        }
+    }
+    while (glGetError() != GL_NO_ERROR) {} // targets that refuse a query are skipped, not reported
+    return bytes;
+}
+
+bool compareCpuScopes(int a, int b) {
+    return cpuScopes.sumMs[a] > cpuScopes.sumMs[b];
+}
+
+// Takes the averages since the last refresh and lays out the panel text
+void refreshPerfHud(float panelWidth, float panelHeight) {
+    int frames = std::max(1, perfHud.framesSinceRefresh);
+    perfHud.textureBytes = residentTextureBytes();
+    perfHud.vertices.clear();
+    const GLubyte panel[4] = {0, 0, 0, 170};
+    const GLubyte white[4] = {255, 255, 255, 255};
+    const GLubyte gray[4] = {170, 170, 170, 255};
+    addHudRect(0.0f, 0.0f, panelWidth, panelHeight, panel);
+
+    char line[HUD_COLUMNS + 16];
+    float x = 8.0f, y = 6.0f;
+    const float lineHeight = HUD_GLYPH_HEIGHT + 2.0f;
+    double frameMs = perfHud.sumFrameMs / frames;
+    snprintf(line, sizeof(line), "%-18s %6.2f ms %6.1f fps", rendererNames[rendererMode], frameMs,
+             frameMs > 0.0 ? 1000.0 / frameMs : 0.0);
+    addHudText(x, y, line, white);
+    y += lineHeight + 2 * HUD_GRAPH_HEIGHT + 6.0f; // the graph goes between
+
+    double gpuFrameMs = 0.0;
+    for (int i = 0; i < GPU_TIMER_SCOPE_COUNT; i++) gpuFrameMs += gpuTimers.averageMs[i];
+    char gpu[24];
+    if (gpuTimersEnabled && gpuFrameMs > 0.0) snprintf(gpu, sizeof(gpu), "%6.2f ms", gpuFrameMs);
+    else snprintf(gpu, sizeof(gpu), "%s", gpuTimersEnabled ? "pending" : "off (Q)");
+    snprintf(line, sizeof(line), "CPU %6.2f ms   GPU %s", perfHud.sumCpuMs / frames, gpu);
+    addHudText(x, y, line, white);
+    y += lineHeight;
+    snprintf(line, sizeof(line), "draws %5.0f  tris %7.0f  binds %4.0f", perfHud.sumDraws / frames,
+             perfHud.sumTriangles / frames, perfHud.sumBinds / frames);
+    addHudText(x, y, line, white);
+    y += lineHeight;
+    snprintf(line, sizeof(line), "state changes %5.0f", perfHud.sumChanges / frames);
+    addHudText(x, y, line, white);
+    y += lineHeight;
+    // Nothing culls whole objects; the clustered lights are culled per view
+    bool lightCulling = (rendererMode == RENDERER_CLUSTERED || rendererMode == RENDERER_DEFERRED) &&
+                        !clusters.lights.empty();
+    if (lightCulling) {
+        int visible = (int)clusters.spheres.size() / 4;
+        snprintf(line, sizeof(line), "culled 0/%d objects, %d/%d lights", SCENE_OBJECT_COUNT,
+                 (int)clusters.lights.size() - visible, (int)clusters.lights.size());
+    } else {
+        snprintf(line, sizeof(line), "culled 0/%d objects", SCENE_OBJECT_COUNT);
+    }
+    addHudText(x, y, line, white);
+    y += lineHeight;
+    if (perfHud.textureBytes >= 0.0) {
+        snprintf(line, sizeof(line), "textures %.1f MB resident", perfHud.textureBytes / (1024.0 * 1024.0));
+    } else {
+        snprintf(line, sizeof(line), "textures n/a (needs GL 4.5)");
+    }
+    addHudText(x, y, line, white);
+    y += lineHeight + 4.0f;
+
+    snprintf(line, sizeof(line), "%-22s %8s %8s", "scope", "CPU ms", "GPU ms");
+    addHudText(x, y, line, gray);
+    y += lineHeight;
+    int order[GPU_TIMER_SCOPE_COUNT];
+    for (int i = 0; i < GPU_TIMER_SCOPE_COUNT; i++) order[i] = i;
+    std::sort(order, order + GPU_TIMER_SCOPE_COUNT, compareCpuScopes);
+    for (int i = 0; i < HUD_SCOPE_ROWS; i++) {
+        int scope = order[i];
+        if (cpuScopes.sumMs[scope] <= 0.0) break;
+        char gpuMs[16] = "-";
+        if (gpuTimersEnabled && gpuTimers.averageMs[scope] > 0.0) {
+            snprintf(gpuMs, sizeof(gpuMs), "%.2f", gpuTimers.averageMs[scope]);
+        }
+        snprintf(line, sizeof(line), "%-22.22s %8.2f %8s", gpuTimerScopeName(scope),
+                 cpuScopes.sumMs[scope] / frames, gpuMs);
+        addHudText(x, y, line, white);
+        y += lineHeight;
+    }
+    y = panelHeight - lineHeight - 2.0f;
+    snprintf(line, sizeof(line), "HUD %.3f ms, 1 draw of %d quads", perfHud.sumHudMs / frames,
+             (int)(perfHud.vertices.size() / 4 + 2));
+    addHudText(x, y, line, gray);
+    perfHud.textVertices = perfHud.vertices.size();
+
+    for (int i = 0; i < GPU_TIMER_SCOPE_COUNT; i++) cpuScopes.sumMs[i] = 0.0;
+    perfHud.framesSinceRefresh = 0;
+    perfHud.sumDraws = perfHud.sumTriangles = perfHud.sumBinds = perfHud.sumChanges = 0.0;
+    perfHud.sumFrameMs = perfHud.sumCpuMs = perfHud.sumHudMs = 0.0;
+}
+
+void togglePerfHud() {
+    perfHud.enabled = !perfHud.enabled;
+    cpuScopes.enabled = perfHud.enabled;
+    if (perfHud.enabled) {
+        for (int i = 0; i < GPU_TIMER_SCOPE_COUNT; i++) cpuScopes.sumMs[i] = 0.0;
+        perfHud.historyCount = perfHud.historyNext = 0;
+        perfHud.framesSinceRefresh = 0;
+        perfHud.textVertices = 0;
+        perfHud.lastDraws = drawCallCount;
+        perfHud.lastTriangles = triangleCount;
+        perfHud.lastBinds = textureBindCount;
+        perfHud.lastChanges = stateChangeCount;
+        perfHud.sumDraws = perfHud.sumTriangles = perfHud.sumBinds = perfHud.sumChanges = 0.0;
+        perfHud.sumFrameMs = perfHud.sumCpuMs = perfHud.sumHudMs = 0.0;
+    }
+    printf("Perf HUD: %s\n", perfHud.enabled ? "ON" : "OFF");
+}
+
+// Frames and the timed passes are fenced with glFinish only while something
+// reads their times: the 'M' statistics, the GPU timers, this HUD, the
+// frame-time driven dynamic resolution, the light benchmark, --benchmark
+// and the startup profile's first frame
+bool timingFencesRequested() {
+    return frameStatsEnabled || gpuTimersEnabled || perfHud.enabled || dynamicResolutionEnabled ||
+           lightBenchmark.stage >= 0 || deterministicFrames || !startupProfile.finished;
+}
+
+// Drawn on top of the finished frame, before it is presented; the numbers
+// are those of the frames before this one
+void drawPerfHud() {
+    if (!perfHud.enabled) return;
+    gpuTimerPush(GPU_PASS_HUD);
+    double start = nowMs();
+    if (perfHud.atlas == 0) createHudAtlas();
+
+    // Counters since the last overlay, i.e. over the previous frame
+    perfHud.sumDraws += drawCallCount - perfHud.lastDraws;
+    perfHud.sumTriangles += triangleCount - perfHud.lastTriangles;
+    perfHud.sumBinds += textureBindCount - perfHud.lastBinds;
+    perfHud.sumChanges += stateChangeCount - perfHud.lastChanges;
+    perfHud.sumFrameMs += lastFrameMs;
+    perfHud.sumCpuMs += lastFrameCpuMs;
+    perfHud.history[perfHud.historyNext] = (float)lastFrameMs;
+    perfHud.historyNext = (perfHud.historyNext + 1) % HUD_GRAPH_FRAMES;
+    perfHud.historyCount = std::min(perfHud.historyCount + 1, HUD_GRAPH_FRAMES);
+    perfHud.framesSinceRefresh++;
+
+    const float panelWidth = HUD_COLUMNS * HUD_GLYPH_WIDTH + 16.0f;
+    // Title, graph, five lines, scope header and rows, cost line
+    const float panelHeight = 6.0f + (8 + HUD_SCOPE_ROWS) * (HUD_GLYPH_HEIGHT + 2.0f) + 2 * HUD_GRAPH_HEIGHT + 16.0f;
+    if (perfHud.textVertices == 0 || perfHud.framesSinceRefresh >= HUD_REFRESH_FRAMES) {
+        refreshPerfHud(panelWidth, panelHeight);
+    }
+
+    // Graph: one column per frame, oldest on the left, against 16.7 ms (60 Hz);
+    // the quad shades it from green at the bottom to red at the top
+    float scaleMs = 33.3f;
+    for (int i = 0; i < perfHud.historyCount; i++) scaleMs = std::max(scaleMs, perfHud.history[i]);
+    std::fill(perfHud.graph.begin(), perfHud.graph.end(), 0);
+    for (int i = 0; i < perfHud.historyCount; i++) {
+        int slot = (perfHud.historyNext - perfHud.historyCount + i + HUD_GRAPH_FRAMES) % HUD_GRAPH_FRAMES;
+        int column = HUD_GRAPH_FRAMES - perfHud.historyCount + i;
+        int height = std::max(1, (int)(HUD_GRAPH_HEIGHT * std::min(1.0f, perfHud.history[slot] / scaleMs) + 0.5f));
+        for (int row = 0; row < height; row++) perfHud.graph[row * HUD_ATLAS_SIZE + column] = 230;
+    }
+    int guideRow = std::min(HUD_GRAPH_HEIGHT - 1, (int)(HUD_GRAPH_HEIGHT * 16.7f / scaleMs));
+    for (int column = 0; column < HUD_GRAPH_FRAMES; column++) {
+        unsigned char& texel = perfHud.graph[guideRow * HUD_ATLAS_SIZE + column];
+        if (texel == 0) texel = 110;
+    }
+    glBindTexture(GL_TEXTURE_2D, perfHud.atlas);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, HUD_GRAPH_ROW, HUD_ATLAS_SIZE, HUD_GRAPH_HEIGHT, GL_ALPHA, GL_UNSIGNED_BYTE,
+                    &perfHud.graph[0]);
+
+    perfHud.vertices.resize(perfHud.textVertices);
+    const GLubyte top[4] = {230, 70, 60, 255}, bottom[4] = {90, 200, 90, 255};
+    const float graphTop = 6.0f + HUD_GLYPH_HEIGHT + 4.0f;
+    addHudQuad(8.0f, graphTop, panelWidth - 8.0f, graphTop + 2 * HUD_GRAPH_HEIGHT,
+               0.0f, (float)HUD_GRAPH_ROW / HUD_ATLAS_SIZE, (float)HUD_GRAPH_FRAMES / HUD_ATLAS_SIZE,
+               (float)(HUD_GRAPH_ROW + HUD_GRAPH_HEIGHT) / HUD_ATLAS_SIZE, top, bottom);
+
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    glPushAttrib(GL_ENABLE_BIT | GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_TEXTURE_BIT);
+    glPushClientAttrib(GL_CLIENT_VERTEX_ARRAY_BIT);
+    glMatrixMode(GL_PROJECTION);
+    glPushMatrix();
+    glLoadIdentity();
+    glOrtho(-8.0, viewport[2] - 8.0, viewport[3] - 8.0, -8.0, -1.0, 1.0); // 8 px in from the top left
+    glMatrixMode(GL_MODELVIEW);
+    glPushMatrix();
+    glLoadIdentity();
+
+    glDisable(GL_DEPTH_TEST);
+    glDisable(GL_LIGHTING);
+    glDisable(GL_CULL_FACE);
+    glDisable(GL_FOG);
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    glEnable(GL_TEXTURE_2D);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, perfHud.atlas);
+    glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+    glEnableClientState(GL_COLOR_ARRAY);
+    glDisableClientState(GL_NORMAL_ARRAY);
+    const GLsizei stride = sizeof(HudVertex);
+    const HudVertex* first = &perfHud.vertices[0];
+    glVertexPointer(2, GL_FLOAT, stride, first->position);
+    glTexCoordPointer(2, GL_FLOAT, stride, first->texCoord);
+    glColorPointer(4, GL_UNSIGNED_BYTE, stride, first->color);
+    glDrawArrays(GL_QUADS, 0, (GLsizei)perfHud.vertices.size());
+    drawCallCount++;
+
+    glMatrixMode(GL_PROJECTION);
+    glPopMatrix();
+    glMatrixMode(GL_MODELVIEW);
+    glPopMatrix();
+    glPopClientAttrib();
+    glPopAttrib();
+    perfHud.sumHudMs += nowMs() - start;
+    gpuTimerPop();
+    // Counted after the overlay's own draw, so the next frame's numbers are the scene's
+    perfHud.lastDraws = drawCallCount;
+    perfHud.lastTriangles = triangleCount;
+    perfHud.lastBinds = textureBindCount;
+    perfHud.lastChanges = stateChangeCount;
+}
+
+// ============= GL Trace =============
+// Capture (--trace PATH, or 'F' in the window) records the GL calls of the
+// forward main pass for a number of frames: the frame's setup (clear,
+// matrices, enables and the two lights as readLightState() sees them) and
+// then every call the draw call layer forwards to GL. Each call is one
+// opcode byte and its arguments; textures are stored as their index in
+// sceneTextureFiles. Shadow, shader and post passes are not recorded.
+// While a capture runs, the sorted and OIT transparency modes send the
+// blended surfaces out with the main pass, in submission order as the
+// replay draws them, so the trace holds the whole scene.
+//
+// Replay (--replay PATH) re-executes the trace on the headless context
+// with the fixed-function pipeline, in a loop, with nothing from the app
+// but the texture files: no input, no animation and no time of day. Each
+// frame is fenced with glFinish, and the frame times go out as percentiles
+// (and with --json to a report), so the submission cost of the same frames
+// can be compared across machines and drivers.
+//   --loops N         passes over the trace (default 10)
+//   --screenshot PNG  the first frame of the first pass, to check the replay
+//   --json PATH       report like --benchmark's
+const char TRACE_MAGIC[8] = {'S', 'D', 'T', 'R', 'A', 'C', 'E', '\0'};
+const unsigned int TRACE_VERSION = 1;
+const int TRACE_DEFAULT_LOOPS = 10;
+
+enum TraceOp {
+    TRACE_FRAME = 0,
+    TRACE_BEGIN,
+    TRACE_END,
+    TRACE_VERTEX,
+    TRACE_NORMAL,
+    TRACE_TEXCOORD,
+    TRACE_COLOR,
+    TRACE_BIND_TEXTURE,
+    TRACE_ENABLE,
+    TRACE_DISABLE,
+    TRACE_PUSH_ATTRIB,
+    TRACE_POP_ATTRIB,
+    TRACE_BLEND_FUNC,
+    TRACE_DEPTH_MASK,
+    TRACE_LINE_WIDTH,
+    TRACE_POINT_SIZE,
+    TRACE_MATERIAL,
+    TRACE_PUSH_MATRIX,
+    TRACE_POP_MATRIX,
+    TRACE_TRANSLATE,
+    TRACE_ROTATE,
+    TRACE_SCALE,
+    TRACE_OP_COUNT
+};
+
+// Enables at the start of the pass
+const unsigned int TRACE_ENABLE_LIGHTING = 1;
+const unsigned int TRACE_ENABLE_TEXTURE = 2;
+const unsigned int TRACE_ENABLE_BLEND = 4;
+const unsigned int TRACE_ENABLE_DEPTH_TEST = 8;
+
+struct TraceFrameSetup {
+    GLfloat clearColor[4];
+    GLfloat projection[16];
+    GLfloat modelview[16];
+    unsigned int enables;
+    LightBlockData lights;    // positions in eye space
+};
+
+struct TraceMaterial {
+    GLenum face, pname;
+    GLfloat params[4];
+};
+
+// Argument bytes after each opcode
+const int traceArgumentBytes[TRACE_OP_COUNT] = {
+    sizeof(TraceFrameSetup), 4, 0, 12, 12, 8, 16, 4, 4, 4, 4, 0, 8, 4, 4, 4,
+    sizeof(TraceMaterial), 0, 0, 12, 16, 12};
+
+struct TraceFileHeader {
+    char magic[8];
+    unsigned int version;
+    int width, height;
+    int frames;
+    unsigned int bytes;       // of commands after the header
+};
+
+struct GLTrace {
+    bool capturing;
+    bool inPass;              // inside the recorded pass of a frame
+    const char* path;
+    int width, height;
+    int framesWanted;
+    int frames;
+    std::vector<unsigned char> commands;
+    double startMs;
+};
+GLTrace glTrace = {false, false, NULL, 0, 0, 0, 0, std::vector<unsigned char>(), 0.0};
+
+void traceCall(TraceOp op, const void* arguments) {
+    if (!glTrace.inPass) return;
+    glTrace.commands.push_back((unsigned char)op);
+    const unsigned char* bytes = (const unsigned char*)arguments;
+    glTrace.commands.insert(glTrace.commands.end(), bytes, bytes + traceArgumentBytes[op]);
+}
+
+void startTraceCapture(const char* path, int frames, int width, int height) {
+    glTrace.capturing = true;
+    glTrace.path = path;
+    glTrace.framesWanted = frames;
+    glTrace.frames = 0;
+    glTrace.width = width;
+    glTrace.height = height;
+    glTrace.commands.clear();
+    glTrace.startMs = nowMs();
+    printf("GL trace: capturing %d frames at %dx%d to %s\n", frames, width, height, path);
+}
+
+bool writeTrace() {
+    FILE* file = fopen(glTrace.path, "wb");
+    if (!file) {
+        printf("Failed to write %s\n", glTrace.path);
+        return false;
+    }
+    TraceFileHeader header;
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.width = glTrace.width;
+    header.height = glTrace.height;
+    header.frames = glTrace.frames;
+    header.bytes = (unsigned int)glTrace.commands.size();
+    fwrite(&header, sizeof(header), 1, file);
+    if (!glTrace.commands.empty()) fwrite(&glTrace.commands[0], 1, glTrace.commands.size(), file);
+    fclose(file);
+    return true;
+}
+
+// Called by display() once the camera and lights are set for the main pass;
+// true when the pass is being recorded
+bool beginTracedPass() {
+    if (!glTrace.capturing) return false;
+    TraceFrameSetup setup;
+    glGetFloatv(GL_COLOR_CLEAR_VALUE, setup.clearColor);
+    glGetFloatv(GL_PROJECTION_MATRIX, setup.projection);
+    glGetFloatv(GL_MODELVIEW_MATRIX, setup.modelview);
+    setup.enables = (glIsEnabled(GL_LIGHTING) ? TRACE_ENABLE_LIGHTING : 0) |
+                    (glIsEnabled(GL_TEXTURE_2D) ? TRACE_ENABLE_TEXTURE : 0) |
+                    (glIsEnabled(GL_BLEND) ? TRACE_ENABLE_BLEND : 0) |
+                    (glIsEnabled(GL_DEPTH_TEST) ? TRACE_ENABLE_DEPTH_TEST : 0);
+    readLightState(setup.lights);
+    glTrace.inPass = true;
+    traceCall(TRACE_FRAME, &setup);
+    return true;
+}
+
+void endTracedPass() {
+    glTrace.inPass = false;
+}
+
+// Counts the frame, and writes the trace once it has all of them
+void finishTraceFrame() {
+    if (!glTrace.capturing) return;
+    glTrace.inPass = false;
+    if (++glTrace.frames < glTrace.framesWanted) return;
+    glTrace.capturing = false;
+    if (writeTrace()) {
+        printf("GL trace: %d frames, %.1f KB (%.1f KB/frame) written to %s in %.1f s\n", glTrace.frames,
+               glTrace.commands.size() / 1024.0, glTrace.commands.size() / 1024.0 / glTrace.frames, glTrace.path,
+               (nowMs() - glTrace.startMs) / 1000.0);
+    }
+    glTrace.commands.clear();
+}
+
+void toggleTraceCapture() {
+    if (glTrace.capturing) {
+        glTrace.framesWanted = glTrace.frames + 1;   // ends with the next frame
+        return;
+    }
+    startTraceCapture("capture.trace", TRACE_DEFAULT_FRAMES, glutGet(GLUT_WINDOW_WIDTH), glutGet(GLUT_WINDOW_HEIGHT));
+}
+
+// --trace PATH: like --headless (--size, --frames, --keys, --hour) but the
+// frames go to a trace instead of images
+int runTraceCapture(int argc, char** argv) {
+    int width = WINDOW_WIDTH, height = WINDOW_HEIGHT;
+    const char* size = commandLineOption(argc, argv, "--size");
+    if (size && (sscanf(size, "%dx%d", &width, &height) != 2 || width <= 0 || height <= 0)) {
+        printf("--size expects WIDTHxHEIGHT, e.g. 1920x1080\n");
+        return 1;
+    }
+    const char* path = commandLineOption(argc, argv, "--trace");
+    const char* frameOption = commandLineOption(argc, argv, "--frames");
+    int frames = frameOption ? atoi(frameOption) : TRACE_DEFAULT_FRAMES;
+    const char* keys = commandLineOption(argc, argv, "--keys");
+    const char* hour = commandLineOption(argc, argv, "--hour");
+    if (!path || frames <= 0) {
+        printf("--trace expects an output path, and --frames a positive count\n");
+        return 1;
+    }
+
+    headlessMode = true;
+    HeadlessContext headless;
+    if (!createHeadlessContext(headless, width, height)) return 1;
+    init();
+    loadSceneResources();
+    reshape(width, height);
+    if (hour) {
+        timeOfDay = timeOfDayTarget = wrapHour((float)atof(hour));
+    }
+    for (const char* key = keys; key && *key; key++) {
+        keyboard((unsigned char)*key, 0, 0);
+    }
+    startTraceCapture(path, frames, width, height);
+    for (int frame = 0; frame < frames; frame++) {
+        if (frame > 0) advanceAnimation();
+        display();
+    }
+    destroyHeadlessContext(headless);
+    return glTrace.capturing ? 1 : 0;
+}
+
+struct TraceReplayStats {
+    long drawCalls;
+    long vertices;
+    long stateChanges;
+};
+
+// Executes one frame's commands; returns where the next frame starts, or
+// NULL when the trace is malformed
+const unsigned char* replayTraceFrame(const unsigned char* p, const unsigned char* end, TraceReplayStats& stats) {
+    bool started = false;
+    while (p < end) {
+        int op = *p;
+        if (op >= TRACE_OP_COUNT || end - p - 1 < traceArgumentBytes[op]) return NULL;
+        if (op == TRACE_FRAME && started) return p;
+        started = true;
+        const unsigned char* args = p + 1;
+        GLfloat f[4];
+        GLenum e[2];
+        int i;
+        switch (op) {
+            case TRACE_FRAME: {
+                TraceFrameSetup setup;
+                memcpy(&setup, args, sizeof(setup));
+                glClearColor(setup.clearColor[0], setup.clearColor[1], setup.clearColor[2], setup.clearColor[3]);
+                glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+                glMatrixMode(GL_PROJECTION);
+                glLoadMatrixf(setup.projection);
+                glMatrixMode(GL_MODELVIEW);
+                // Positions are in eye space, set them under an identity
+                glLoadIdentity();
+                glLightModelfv(GL_LIGHT_MODEL_AMBIENT, setup.lights.globalAmbient);
+                for (int l = 0; l < 2; l++) {
+                    const LightData& light = setup.lights.lights[l];
+                    GLenum id = GL_LIGHT0 + l;
+                    glLightfv(id, GL_POSITION, light.position);
+                    glLightfv(id, GL_AMBIENT, light.ambient);
+                    glLightfv(id, GL_DIFFUSE, light.diffuse);
+                    glLightfv(id, GL_SPECULAR, light.specular);
+                    glLightf(id, GL_CONSTANT_ATTENUATION, light.attenuation[0]);
+                    glLightf(id, GL_LINEAR_ATTENUATION, light.attenuation[1]);
+                    glLightf(id, GL_QUADRATIC_ATTENUATION, light.attenuation[2]);
+                    if (light.attenuation[3] > 0.5f) glEnable(id); else glDisable(id);
+                }
+                glLoadMatrixf(setup.modelview);
+                if (setup.enables & TRACE_ENABLE_LIGHTING) glEnable(GL_LIGHTING); else glDisable(GL_LIGHTING);
+                if (setup.enables & TRACE_ENABLE_TEXTURE) glEnable(GL_TEXTURE_2D); else glDisable(GL_TEXTURE_2D);
+                if (setup.enables & TRACE_ENABLE_BLEND) glEnable(GL_BLEND); else glDisable(GL_BLEND);
+                if (setup.enables & TRACE_ENABLE_DEPTH_TEST) glEnable(GL_DEPTH_TEST); else glDisable(GL_DEPTH_TEST);
+                glBlendFunc(GL_ONE, GL_ZERO);
+                glDepthMask(GL_TRUE);
+                break;
+            }
+            case TRACE_BEGIN:
+                memcpy(e, args, 4);
+                glBegin(e[0]);
+                stats.drawCalls++;
+                break;
+            case TRACE_END:
+                glEnd();
+                break;
+            case TRACE_VERTEX:
+                memcpy(f, args, 12);
+                glVertex3f(f[0], f[1], f[2]);
+                stats.vertices++;
+                break;
+            case TRACE_NORMAL:
+                memcpy(f, args, 12);
+                glNormal3f(f[0], f[1], f[2]);
+                break;
+            case TRACE_TEXCOORD:
+                memcpy(f, args, 8);
+                glTexCoord2f(f[0], f[1]);
+                break;
+            case TRACE_COLOR:
+                memcpy(f, args, 16);
+                glColor4f(f[0], f[1], f[2], f[3]);
+                break;
+            case TRACE_BIND_TEXTURE:
+                memcpy(&i, args, 4);
+                glBindTexture(GL_TEXTURE_2D, (i >= 0 && i < SCENE_TEXTURE_COUNT) ? *sceneTextureFiles[i].id : 0);
+                stats.stateChanges++;
+                break;
+            case TRACE_ENABLE:
+            case TRACE_DISABLE:
+                memcpy(e, args, 4);
+                if (op == TRACE_ENABLE) glEnable(e[0]); else glDisable(e[0]);
+                stats.stateChanges++;
+                break;
+            case TRACE_PUSH_ATTRIB:
+                memcpy(e, args, 4);
+                glPushAttrib(e[0]);
+                stats.stateChanges++;
+                break;
+            case TRACE_POP_ATTRIB:
+                glPopAttrib();
+                stats.stateChanges++;
+                break;
+            case TRACE_BLEND_FUNC:
+                memcpy(e, args, 8);
+                glBlendFunc(e[0], e[1]);
+                stats.stateChanges++;
+                break;
+            case TRACE_DEPTH_MASK:
+                memcpy(&i, args, 4);
+                glDepthMask(i ? GL_TRUE : GL_FALSE);
+                stats.stateChanges++;
+                break;
+            case TRACE_LINE_WIDTH:
+            case TRACE_POINT_SIZE:
+                memcpy(f, args, 4);
+                if (op == TRACE_LINE_WIDTH) glLineWidth(f[0]); else glPointSize(f[0]);
+                stats.stateChanges++;
+                break;
+            case TRACE_MATERIAL: {
+                TraceMaterial material;
+                memcpy(&material, args, sizeof(material));
+                glMaterialfv(material.face, material.pname, material.params);
+                stats.stateChanges++;
+                break;
+            }
+            case TRACE_PUSH_MATRIX:
+                glPushMatrix();
+                break;
+            case TRACE_POP_MATRIX:
+                glPopMatrix();
+                break;
+            case TRACE_TRANSLATE:
+                memcpy(f, args, 12);
+                glTranslatef(f[0], f[1], f[2]);
+                break;
+            case TRACE_ROTATE:
+                memcpy(f, args, 16);
+                glRotatef(f[0], f[1], f[2], f[3]);
+                break;
+            case TRACE_SCALE:
+                memcpy(f, args, 12);
+                glScalef(f[0], f[1], f[2]);
+                break;
+        }
+        p = args + traceArgumentBytes[op];
+    }
+    return p;
+}
+
+int runTraceReplay(int argc, char** argv) {
+    const char* path = commandLineOption(argc, argv, "--replay");
+    const char* loopOption = commandLineOption(argc, argv, "--loops");
+    int loops = loopOption ? atoi(loopOption) : TRACE_DEFAULT_LOOPS;
+    const char* screenshot = commandLineOption(argc, argv, "--screenshot");
+    const char* jsonPath = commandLineOption(argc, argv, "--json");
+    if (!path || loops <= 0) {
+        printf("--replay expects a trace file, and --loops a positive count\n");
+        return 1;
+    }
+
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        printf("Failed to open %s\n", path);
+        return 1;
+    }
+    TraceFileHeader header;
+    std::vector<unsigned char> commands;
+    bool valid = fread(&header, sizeof(header), 1, file) == 1 &&
+                 memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) == 0 && header.version == TRACE_VERSION &&
+                 header.width > 0 && header.height > 0 && header.frames > 0;
+    if (valid) {
+        commands.resize(header.bytes);
+        valid = header.bytes > 0 && fread(&commands[0], 1, header.bytes, file) == header.bytes;
+    }
+    fclose(file);
+    if (!valid) {
+        printf("%s is not a version %u trace, or it is truncated\n", path, TRACE_VERSION);
+        return 1;
+    }
+
+    headlessMode = true;
+    HeadlessContext headless;
+    if (!createHeadlessContext(headless, header.width, header.height)) return 1;
+    // The fixed-function state init() leaves that the trace does not carry
+    // (loadTextures() resets the viewport to the window's, so it goes first)
+    loadTextures();
+    glViewport(0, 0, header.width, header.height);
+    glEnable(GL_NORMALIZE);
+    glEnable(GL_COLOR_MATERIAL);
+    glColorMaterial(GL_FRONT_AND_BACK, GL_AMBIENT_AND_DIFFUSE);
+    glShadeModel(GL_SMOOTH);
+
+    printf("Replay: %s, %d frames at %dx%d, %.1f KB, %d loops on %s\n", path, header.frames, header.width,
+           header.height, header.bytes / 1024.0, loops, (const char*)glGetString(GL_RENDERER));
+    const unsigned char* begin = &commands[0];
+    const unsigned char* end = begin + commands.size();
+    std::vector<double> frameMs;
+    TraceReplayStats stats = {0, 0, 0};
+    double start = nowMs();
+    for (int loop = 0; loop < loops; loop++) {
+        const unsigned char* p = begin;
+        int frame = 0;
+        while (p && p < end) {
+            double frameStart = nowMs();
+            p = replayTraceFrame(p, end, stats);
+            glFinish();
+            frameMs.push_back(nowMs() - frameStart);
+            if (loop == 0 && frame == 0 && screenshot) {
+                std::vector<unsigned char> pixels;
+                readFramePixels(pixels, header.width, header.height);
+                if (!writePNG(screenshot, &pixels[0], header.width, header.height)) screenshot = NULL;
+            }
+            frame++;
+        }
+        if (!p) {
+            printf("%s is malformed after %d frames\n", path, frame);
+            destroyHeadlessContext(headless);
+            return 1;
+        }
+    }
+    double totalMs = nowMs() - start;
+
+    size_t frames = frameMs.size();
+    FrameTimeSummary summary = summarizeFrameTimes(frameMs);
+    printf("  frame min %7.2f  mean %7.2f  p50 %7.2f  p95 %7.2f  p99 %7.2f  max %7.2f ms\n", summary.min,
+           summary.mean, summary.p50, summary.p95, summary.p99, summary.max);
+    printf("  %.1f draw calls, %.0f vertices, %.1f state changes per frame; %.1f s total\n",
+           (double)stats.drawCalls / frames, (double)stats.vertices / frames, (double)stats.stateChanges / frames,
+           totalMs / 1000.0);
+    if (screenshot) printf("  first frame written to %s\n", screenshot);
+    if (jsonPath) {
+        FILE* json = fopen(jsonPath, "w");
+        if (!json) {
+            printf("Failed to write %s\n", jsonPath);
+            destroyHeadlessContext(headless);
+            return 1;
+        }
+        fprintf(json, "{\n  \"trace\": ");
+        writeJSONString(json, path);
+        fprintf(json, ",\n  \"gl_renderer\": ");
+        writeJSONString(json, (const char*)glGetString(GL_RENDERER));
+        fprintf(json, ",\n  \"gl_version\": ");
+        writeJSONString(json, (const char*)glGetString(GL_VERSION));
+        fprintf(json, ",\n  \"width\": %d,\n  \"height\": %d,\n  \"frames\": %d,\n  \"loops\": %d,\n",
+                header.width, header.height, header.frames, loops);
+        writeFrameTimeJSON(json, "frame_ms", summary, false);
+        fprintf(json, "  \"draw_calls\": %.1f,\n  \"vertices\": %.0f,\n  \"state_changes\": %.1f\n}\n",
+                (double)stats.drawCalls / frames, (double)stats.vertices / frames,
+                (double)stats.stateChanges / frames);
+        fclose(json);
+        printf("Replay report written to %s\n", jsonPath);
+    }
+    destroyHeadlessContext(headless);
+    return 0;
+}
+
+// ============= Software Rasterizer =============
+// A CPU renderer for machines without a GPU, where llvmpipe runs every GL
+// pass through its generic paths. It draws the captured scene (the world-
+// space mesh the bakers use, captured again only when the light state
+// changes what the draw functions emit) with the fixed-function renderer's
+// model: per-vertex lighting from GL_LIGHT0 and GL_LIGHT1 as
+// setupLighting() and the time of day leave them, Gouraud shading,
+// perspective-correct bilinear texturing modulated by the lit color, the
+// depth test and the scene's blend modes.
+//
+// A frame runs in two parallel phases. First each thread takes a range of
+// primitives, lights and projects their vertices, clips triangles to the
+// near plane and bins them by bounding box into screen tiles; lines and
+// points become one-pixel screen-space quads. Then threads take whole tiles
+// and rasterize them with SSE edge functions, four pixels at a time. Both
+// phases run on the frame worker pool.
+// Reading a tile's bins in thread order keeps the submission order, so
+// blending matches GL. The image reaches the framebuffer with one
+// glDrawPixels. HDR, anti-aliasing, shadows and the volumetric shaft are
+// GPU passes and are not drawn in this mode.
+const int SOFTWARE_TILE_SIZE = 64;
+
+struct SoftwarePrimitive {
+    int draw;            // index into the mesh's draws
+    int firstVertex;
+    int vertexCount;     // 3 triangle, 2 line, 1 point
+};
+
+// Texels packed one per word, so a bilinear tap is four loads
+struct SoftwareTexture {
+    GLuint id;
+    bool repeat;
+    int width, height;
+    std::vector<unsigned int> texels;
+};
+
+struct SoftwareMaterial {
+    const SoftwareTexture* texture;   // NULL when untextured
+    bool blended;
+    GLenum blendSrc, blendDst;
+    bool depthWrite;
+};
+
+// Before the perspective divide: clip position and lit color, texcoord
+struct SoftwareClipVertex {
+    float clip[4];
+    float attributes[6];          // r, g, b, a, s, t
+};
+
+// Window coordinates (y up, like GL), attributes divided by w
+struct SoftwareVertex {
+    float x, y, z;
+    float invW;
+    float attributes[6];
+};
+
+// Edge functions are >= bias inside; every interpolated value is a plane
+// a x + b y + c over the window
+struct SoftwareTriangle {
+    float edges[3][3];
+    float bias[3];                // 0 on top-left edges, so shared edges are drawn once
+    float planes[8][3];           // z, 1 / w, then the six attributes over w
+    int minX, minY, maxX, maxY;
+    int material;
+};
+
+struct SoftwareRasterizer {
+    bool captured;
+    bool capturedDaytime, capturedVolumetric;
+    float capturedLampIntensity;
+    SceneMesh mesh;
+    std::vector<SoftwarePrimitive> primitives;
+    std::vector<SoftwareMaterial> materials;   // one per mesh draw
+    std::vector<SoftwareTexture> textures;
+
+    int width, height;
+    int tilesX, tilesY;
+    int pitch;                    // pixels per row, whole tiles
+    std::vector<unsigned int> color;   // RGBA8, bottom row first
+    std::vector<float> depth;
+    unsigned int clearColor;
+
+    int threads;
+    std::vector<std::vector<SoftwareTriangle> > triangles;      // per thread
+    std::vector<std::vector<std::vector<int> > > bins;          // per thread, per tile
+    std::atomic<int> nextTile;
+
+    GLfloat view[16];
+    GLfloat projection[16];
+    LightBlockData lights;
+
+    int frames;
+    int captures;
+    long trianglesBinned;
+    long binEntries;
+    double captureMs, geometryMs, rasterMs, presentMs;
+};
+SoftwareRasterizer softwareRasterizer;
+
+void captureSoftwareScene() {
+    SoftwareRasterizer& sw = softwareRasterizer;
+    double start = nowMs();
+    if (sw.textures.empty()) {
+        std::vector<BakeTexture> decoded;
+        loadBakeTextures(decoded);
+        sw.textures.resize(decoded.size());
+        for (size_t t = 0; t < decoded.size(); t++) {
+            SoftwareTexture& texture = sw.textures[t];
+            texture.id = decoded[t].id;
+            texture.repeat = decoded[t].repeat;
+            texture.width = decoded[t].width;
+            texture.height = decoded[t].height;
+            texture.texels.resize((size_t)texture.width * texture.height);
+            const unsigned char* rgb = &decoded[t].texels[0];
+            for (size_t i = 0; i < texture.texels.size(); i++, rgb += 3) {
+                texture.texels[i] = rgb[0] | (rgb[1] << 8) | (rgb[2] << 16);
+            }
+        }
+    }
+    captureScene(sw.mesh);
+    sw.primitives.clear();
+    sw.materials.clear();
+    for (size_t d = 0; d < sw.mesh.draws.size(); d++) {
+        const SceneDraw& draw = sw.mesh.draws[d];
+        SoftwareMaterial material;
+        material.texture = NULL;
+        for (size_t t = 0; t < sw.textures.size() && draw.textured; t++) {
+            if (sw.textures[t].id == draw.texture) material.texture = &sw.textures[t];
+        }
+        material.blended = draw.blended;
+        material.blendSrc = draw.blendSrc;
+        material.blendDst = draw.blendDst;
+        material.depthWrite = draw.depthWrite;
+        sw.materials.push_back(material);
+
+        int size = (draw.primitive == GL_TRIANGLES) ? 3 : (draw.primitive == GL_LINES) ? 2 : 1;
+        for (int v = 0; v + size <= draw.vertexCount; v += size) {
+            SoftwarePrimitive primitive = {(int)d, draw.firstVertex + v, size};
+            sw.primitives.push_back(primitive);
+        }
+    }
+    sw.captured = true;
+    sw.capturedDaytime = isDaytime;
+    sw.capturedVolumetric = volumetricLightActive();
+    sw.capturedLampIntensity = deskLampIntensity;
+    sw.captures++;
+    sw.captureMs += nowMs() - start;
+}
+
+// Fixed-function vertex lighting: GL_COLOR_MATERIAL on ambient and diffuse,
+// no emission, infinite viewer, the result clamped like GL clamps it
+void lightSoftwareVertex(const SceneVertex& vertex, const SceneDraw& draw, const GLfloat* eye,
+                         const GLfloat* normal, float* out) {
+    const LightBlockData& lights = softwareRasterizer.lights;
+    float color[3];
+    for (int c = 0; c < 3; c++) color[c] = lights.globalAmbient[c] * vertex.color[c];
+    for (int i = 0; i < 2; i++) {
+        const LightData& light = lights.lights[i];
+        if (light.attenuation[3] < 0.5f) continue;
+        float L[3];
+        float atten = 1.0f;
+        if (light.position[3] == 0.0f) {
+            for (int a = 0; a < 3; a++) L[a] = light.position[a];
+        } else {
+            for (int a = 0; a < 3; a++) L[a] = light.position[a] - eye[a];
+            float d = sqrtf(vecDot(L, L));
+            atten = 1.0f / (light.attenuation[0] + light.attenuation[1] * d + light.attenuation[2] * d * d);
+        }
+        vecNormalize(L);
+        float NdotL = std::max(0.0f, vecDot(normal, L));
+        float specular = 0.0f;
+        if (NdotL > 0.0f) {
+            float H[3] = {L[0], L[1], L[2] + 1.0f};
+            vecNormalize(H);
+            float NdotH = std::max(0.0f, vecDot(normal, H));
+            specular = (draw.shininess > 0.0f) ? powf(NdotH, draw.shininess) : 1.0f;
+        }
+        for (int c = 0; c < 3; c++) {
+            color[c] += atten * (light.ambient[c] * vertex.color[c] + NdotL * light.diffuse[c] * vertex.color[c] +
+                                 specular * light.specular[c] * draw.specular[c]);
+        }
+    }
+    for (int c = 0; c < 3; c++) out[c] = std::min(1.0f, std::max(0.0f, color[c]));
+    out[3] = vertex.color[3];
+}
+
+void transformSoftwareVertex(const SceneVertex& vertex, const SceneDraw& draw, SoftwareClipVertex& out) {
+    const SoftwareRasterizer& sw = softwareRasterizer;
+    GLfloat eye[3];
+    transformPoint(sw.view, vertex.position, eye);
+    for (int row = 0; row < 4; row++) {
+        out.clip[row] = sw.projection[row] * eye[0] + sw.projection[4 + row] * eye[1] +
+                        sw.projection[8 + row] * eye[2] + sw.projection[12 + row];
+    }
+    if (draw.lit) {
+        GLfloat normal[3];
+        for (int row = 0; row < 3; row++) {
+            normal[row] = sw.view[row] * vertex.normal[0] + sw.view[4 + row] * vertex.normal[1] +
+                          sw.view[8 + row] * vertex.normal[2];
+        }
+        vecNormalize(normal);
+        lightSoftwareVertex(vertex, draw, eye, normal, out.attributes);
+    } else {
+        for (int c = 0; c < 4; c++) out.attributes[c] = std::min(1.0f, std::max(0.0f, vertex.color[c]));
+    }
+    out.attributes[4] = vertex.texCoord[0];
+    out.attributes[5] = vertex.texCoord[1];
+}
+
+SoftwareClipVertex lerpClipVertex(const SoftwareClipVertex& a, const SoftwareClipVertex& b, float t) {
+    SoftwareClipVertex out;
+    for (int i = 0; i < 4; i++) out.clip[i] = a.clip[i] + (b.clip[i] - a.clip[i]) * t;
+    for (int i = 0; i < 6; i++) out.attributes[i] = a.attributes[i] + (b.attributes[i] - a.attributes[i]) * t;
+    return out;
+}
+
+// Sutherland-Hodgman against the near plane (z >= -w); a triangle comes out
+// as up to four vertices. The other planes are left to the tile bounds and
+// the depth test.
+int clipToNearPlane(const SoftwareClipVertex* in, int count, SoftwareClipVertex* out) {
+    int outCount = 0;
+    for (int i = 0; i < count; i++) {
+        const SoftwareClipVertex& a = in[i];
+        const SoftwareClipVertex& b = in[(i + 1) % count];
+        float da = a.clip[2] + a.clip[3];
+        float db = b.clip[2] + b.clip[3];
+        if (da >= 0.0f) out[outCount++] = a;
+        if ((da >= 0.0f) != (db >= 0.0f)) out[outCount++] = lerpClipVertex(a, b, da / (da - db));
+    }
+    return outCount;
+}
+
+SoftwareVertex toWindow(const SoftwareClipVertex& in) {
+    const SoftwareRasterizer& sw = softwareRasterizer;
+    SoftwareVertex out;
+    out.invW = 1.0f / in.clip[3];
+    out.x = (in.clip[0] * out.invW * 0.5f + 0.5f) * sw.width;
+    out.y = (in.clip[1] * out.invW * 0.5f + 0.5f) * sw.height;
+    out.z = in.clip[2] * out.invW * 0.5f + 0.5f;
+    for (int i = 0; i < 6; i++) out.attributes[i] = in.attributes[i] * out.invW;
+    return out;
+}
+
+void setupSoftwareTriangle(int thread, int material, const SoftwareVertex& a, const SoftwareVertex& b,
+                           const SoftwareVertex& c) {
+    SoftwareRasterizer& sw = softwareRasterizer;
+    float area = (b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x);
+    if (fabsf(area) < 1e-8f) return;
+    // Both faces are drawn (GL_CULL_FACE is off); wind them all one way
+    const SoftwareVertex* v[3] = {&a, &b, &c};
+    if (area < 0.0f) {
+        v[1] = &c;
+        v[2] = &b;
+        area = -area;
+    }
+
+    SoftwareTriangle tri;
+    float minX = v[0]->x, maxX = v[0]->x, minY = v[0]->y, maxY = v[0]->y;
+    for (int i = 0; i < 3; i++) {
+        const SoftwareVertex& p = *v[(i + 1) % 3];
+        const SoftwareVertex& q = *v[(i + 2) % 3];
+        float dx = q.x - p.x, dy = q.y - p.y;
+        tri.edges[i][0] = -dy;
+        tri.edges[i][1] = dx;
+        tri.edges[i][2] = dy * p.x - dx * p.y;
+        bool topLeft = dy < 0.0f || (dy == 0.0f && dx < 0.0f);
+        tri.bias[i] = topLeft ? 0.0f : 1e-30f;
+        minX = std::min(minX, v[i]->x);
+        maxX = std::max(maxX, v[i]->x);
+        minY = std::min(minY, v[i]->y);
+        maxY = std::max(maxY, v[i]->y);
+    }
+    tri.minX = std::max(0, (int)floorf(minX));
+    tri.maxX = std::min(sw.width - 1, (int)ceilf(maxX));
+    tri.minY = std::max(0, (int)floorf(minY));
+    tri.maxY = std::min(sw.height - 1, (int)ceilf(maxY));
+    if (tri.minX > tri.maxX || tri.minY > tri.maxY) return;
+
+    // A value f_i at each vertex is sum(f_i E_i(x, y)) / area
+    float values[8][3];
+    for (int i = 0; i < 3; i++) {
+        values[0][i] = v[i]->z;
+        values[1][i] = v[i]->invW;
+        for (int k = 0; k < 6; k++) values[2 + k][i] = v[i]->attributes[k];
+    }
+    float invArea = 1.0f / area;
+    for (int k = 0; k < 8; k++) {
+        for (int j = 0; j < 3; j++) {
+            tri.planes[k][j] = (values[k][0] * tri.edges[0][j] + values[k][1] * tri.edges[1][j] +
+                                values[k][2] * tri.edges[2][j]) * invArea;
+        }
+    }
+    tri.material = material;
+
+    std::vector<SoftwareTriangle>& triangles = sw.triangles[thread];
+    int index = (int)triangles.size();
+    triangles.push_back(tri);
+    std::vector<std::vector<int> >& bins = sw.bins[thread];
+    for (int ty = tri.minY / SOFTWARE_TILE_SIZE; ty <= tri.maxY / SOFTWARE_TILE_SIZE; ty++) {
+        for (int tx = tri.minX / SOFTWARE_TILE_SIZE; tx <= tri.maxX / SOFTWARE_TILE_SIZE; tx++) {
+            bins[ty * sw.tilesX + tx].push_back(index);
+        }
+    }
+}
+
+// A one-pixel-wide screen-space quad; a == b makes a one-pixel square
+void setupSoftwareQuad(int thread, int material, const SoftwareVertex& a, const SoftwareVertex& b) {
+    float dx = b.x - a.x, dy = b.y - a.y;
+    float length = sqrtf(dx * dx + dy * dy);
+    float along[2] = {0.5f, 0.0f}, across[2] = {0.0f, 0.5f};
+    if (length > 1e-4f) {
+        along[0] = 0.0f;
+        across[0] = -dy / length * 0.5f;
+        across[1] = dx / length * 0.5f;
+    }
+    SoftwareVertex corners[4] = {a, a, b, b};
+    const float signs[4][2] = {{-1.0f, 1.0f}, {-1.0f, -1.0f}, {1.0f, -1.0f}, {1.0f, 1.0f}};
+    for (int i = 0; i < 4; i++) {
+        corners[i].x += signs[i][0] * along[0] + signs[i][1] * across[0];
+        corners[i].y += signs[i][0] * along[1] + signs[i][1] * across[1];
+    }
+    setupSoftwareTriangle(thread, material, corners[0], corners[1], corners[2]);
+    setupSoftwareTriangle(thread, material, corners[0], corners[2], corners[3]);
+}
+
+// Phase one: a contiguous share of the primitives, so the per-thread bins
+// read in thread order are in submission order
+void softwareGeometryWorker(int thread) {
+    SoftwareRasterizer& sw = softwareRasterizer;
+    sw.triangles[thread].clear();
+    for (size_t i = 0; i < sw.bins[thread].size(); i++) sw.bins[thread][i].clear();
+    int count = (int)sw.primitives.size();
+    int first = (int)((long long)count * thread / sw.threads);
+    int last = (int)((long long)count * (thread + 1) / sw.threads);
+
+    for (int p = first; p < last; p++) {
+        const SoftwarePrimitive& primitive = sw.primitives[p];
+        const SceneDraw& draw = sw.mesh.draws[primitive.draw];
+        SoftwareClipVertex in[3], clipped[4];
+        for (int v = 0; v < primitive.vertexCount; v++) {
+            transformSoftwareVertex(sw.mesh.vertices[primitive.firstVertex + v], draw, in[v]);
+        }
+        if (primitive.vertexCount == 3) {
+            int n = clipToNearPlane(in, 3, clipped);
+            if (n < 3) continue;
+            SoftwareVertex window[4];
+            for (int v = 0; v < n; v++) window[v] = toWindow(clipped[v]);
+            for (int v = 2; v < n; v++) {
+                setupSoftwareTriangle(thread, primitive.draw, window[0], window[v - 1], window[v]);
+            }
+        } else if (primitive.vertexCount == 2) {
+            float da = in[0].clip[2] + in[0].clip[3];
+            float db = in[1].clip[2] + in[1].clip[3];
+            if (da < 0.0f && db < 0.0f) continue;
+            if (da < 0.0f) in[0] = lerpClipVertex(in[0], in[1], da / (da - db));
+            if (db < 0.0f) in[1] = lerpClipVertex(in[0], in[1], da / (da - db));
+            setupSoftwareQuad(thread, primitive.draw, toWindow(in[0]), toWindow(in[1]));
+        } else if (in[0].clip[2] + in[0].clip[3] >= 0.0f) {
+            SoftwareVertex point = toWindow(in[0]);
+            setupSoftwareQuad(thread, primitive.draw, point, point);
+        }
+    }
+}
+
+// GL_LINEAR on the base level; GL_CLAMP is taken as clamp to edge
+void sampleSoftwareTexture(const SoftwareTexture& texture, float s, float t, float* out) {
+    float u = s * texture.width - 0.5f, v = t * texture.height - 0.5f;
+    float fu = floorf(u), fv = floorf(v);
+    int wu = (int)((u - fu) * 256.0f), wv = (int)((v - fv) * 256.0f);
+    int x0, x1, y0, y1;
+    if (texture.repeat) {
+        x0 = (int)(fu - floorf(fu / texture.width) * texture.width);
+        y0 = (int)(fv - floorf(fv / texture.height) * texture.height);
+        if (x0 >= texture.width) x0 = 0;
+        if (y0 >= texture.height) y0 = 0;
+        x1 = (x0 + 1 == texture.width) ? 0 : x0 + 1;
+        y1 = (y0 + 1 == texture.height) ? 0 : y0 + 1;
+    } else {
+        x0 = std::min(texture.width - 1, std::max(0, (int)fu));
+        y0 = std::min(texture.height - 1, std::max(0, (int)fv));
+        x1 = std::min(texture.width - 1, std::max(0, (int)fu + 1));
+        y1 = std::min(texture.height - 1, std::max(0, (int)fv + 1));
+    }
+    const unsigned int* row0 = &texture.texels[(size_t)y0 * texture.width];
+    const unsigned int* row1 = &texture.texels[(size_t)y1 * texture.width];
+    unsigned int t00 = row0[x0], t10 = row0[x1], t01 = row1[x0], t11 = row1[x1];
+    for (int c = 0; c < 3; c++) {
+        int shift = 8 * c;
+        int c00 = (t00 >> shift) & 0xff, c10 = (t10 >> shift) & 0xff;
+        int c01 = (t01 >> shift) & 0xff, c11 = (t11 >> shift) & 0xff;
+        int top = (c00 << 8) + (c10 - c00) * wu;
+        int bottom = (c01 << 8) + (c11 - c01) * wu;
+        out[c] = ((top << 8) + (bottom - top) * wv) * (1.0f / (255.0f * 65536.0f));
+    }
+}
+
+float softwareBlendFactor(GLenum factor, const float* src, const float* dst, int c) {
+    switch (factor) {
+        case GL_ZERO: return 0.0f;
+        case GL_ONE: return 1.0f;
+        case GL_SRC_COLOR: return src[c];
+        case GL_ONE_MINUS_SRC_COLOR: return 1.0f - src[c];
+        case GL_DST_COLOR: return dst[c];
+        case GL_ONE_MINUS_DST_COLOR: return 1.0f - dst[c];
+        case GL_SRC_ALPHA: return src[3];
+        case GL_ONE_MINUS_SRC_ALPHA: return 1.0f - src[3];
+        case GL_DST_ALPHA: return dst[3];
+        case GL_ONE_MINUS_DST_ALPHA: return 1.0f - dst[3];
+        default: return 1.0f;
+    }
+}
+
+unsigned int packSoftwareColor(const float* color) {
+    unsigned int packed = 0;
+    for (int c = 0; c < 4; c++) {
+        float v = std::min(1.0f, std::max(0.0f, color[c]));
+        packed |= (unsigned int)(v * 255.0f + 0.5f) << (8 * c);
+    }
+    return packed;
+}
+
+void rasterizeSoftwareTriangle(const SoftwareTriangle& tri, int tileX0, int tileY0, int tileX1, int tileY1) {
+    SoftwareRasterizer& sw = softwareRasterizer;
+    int minX = std::max(tri.minX, tileX0), maxX = std::min(tri.maxX, tileX1);
+    int minY = std::max(tri.minY, tileY0), maxY = std::min(tri.maxY, tileY1);
+    if (minX > maxX || minY > maxY) return;
+    const SoftwareMaterial& material = sw.materials[tri.material];
+
+    for (int y = minY; y <= maxY; y++) {
+        float py = y + 0.5f;
+        unsigned int* colorRow = &sw.color[(size_t)y * sw.pitch];
+        float* depthRow = &sw.depth[(size_t)y * sw.pitch];
+        for (int x = minX & ~3; x <= maxX; x += 4) {
+            int mask = 0;
+            float z[4], invW[4], attributes[6][4];
+#if defined(__SSE2__)
+            __m128 px = _mm_add_ps(_mm_set1_ps((float)x), _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f));
+            __m128 inside = _mm_and_ps(_mm_cmpgt_ps(px, _mm_set1_ps((float)minX)),
+                                       _mm_cmplt_ps(px, _mm_set1_ps((float)maxX + 1.0f)));
+            for (int e = 0; e < 3; e++) {
+                __m128 edge = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(tri.edges[e][0]), px),
+                                         _mm_set1_ps(tri.edges[e][1] * py + tri.edges[e][2]));
+                inside = _mm_and_ps(inside, _mm_cmpge_ps(edge, _mm_set1_ps(tri.bias[e])));
+            }
+            if (_mm_movemask_ps(inside) == 0) continue;
+            __m128 zv = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(tri.planes[0][0]), px),
+                                   _mm_set1_ps(tri.planes[0][1] * py + tri.planes[0][2]));
+            inside = _mm_and_ps(inside, _mm_cmplt_ps(zv, _mm_loadu_ps(depthRow + x)));
+            mask = _mm_movemask_ps(inside);
+            if (mask == 0) continue;
+            __m128 iw = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(tri.planes[1][0]), px),
+                                   _mm_set1_ps(tri.planes[1][1] * py + tri.planes[1][2]));
+            __m128 w = _mm_div_ps(_mm_set1_ps(1.0f), iw);
+            for (int k = 0; k < 6; k++) {
+                __m128 value = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(tri.planes[2 + k][0]), px),
+                                          _mm_set1_ps(tri.planes[2 + k][1] * py + tri.planes[2 + k][2]));
+                _mm_storeu_ps(attributes[k], _mm_mul_ps(value, w));
+            }
+            _mm_storeu_ps(z, zv);
+            _mm_storeu_ps(invW, iw);
+#else
+            for (int lane = 0; lane < 4; lane++) {
+                int pixel = x + lane;
+                float fx = pixel + 0.5f;
+                bool covered = pixel >= minX && pixel <= maxX;
+                for (int e = 0; e < 3 && covered; e++) {
+                    covered = tri.edges[e][0] * fx + tri.edges[e][1] * py + tri.edges[e][2] >= tri.bias[e];
+                }
+                if (!covered) continue;
+                z[lane] = tri.planes[0][0] * fx + tri.planes[0][1] * py + tri.planes[0][2];
+                if (!(z[lane] < depthRow[pixel])) continue;
+                invW[lane] = tri.planes[1][0] * fx + tri.planes[1][1] * py + tri.planes[1][2];
+                for (int k = 0; k < 6; k++) {
+                    attributes[k][lane] = (tri.planes[2 + k][0] * fx + tri.planes[2 + k][1] * py +
+                                           tri.planes[2 + k][2]) / invW[lane];
+                }
+                mask |= 1 << lane;
+            }
+            if (mask == 0) continue;
+#endif
+            for (int lane = 0; lane < 4; lane++) {
+                if (!(mask & (1 << lane))) continue;
+                int pixel = x + lane;
+                float color[4] = {attributes[0][lane], attributes[1][lane], attributes[2][lane], attributes[3][lane]};
+                if (material.texture) {
+                    float texel[3];
+                    sampleSoftwareTexture(*material.texture, attributes[4][lane], attributes[5][lane], texel);
+                    for (int c = 0; c < 3; c++) color[c] *= texel[c];
+                }
+                if (material.blended) {
+                    unsigned int packed = colorRow[pixel];
+                    float dst[4];
+                    for (int c = 0; c < 4; c++) dst[c] = ((packed >> (8 * c)) & 0xff) * (1.0f / 255.0f);
+                    float src[4] = {color[0], color[1], color[2], color[3]};
+                    for (int c = 0; c < 4; c++) {
+                        color[c] = src[c] * softwareBlendFactor(material.blendSrc, src, dst, c) +
+                                   dst[c] * softwareBlendFactor(material.blendDst, src, dst, c);
+                    }
+                }
+                colorRow[pixel] = packSoftwareColor(color);
+                if (material.depthWrite) depthRow[pixel] = z[lane];
+            }
+            (void)invW;
+        }
+    }
+}
+
+// Phase two: whole tiles, cleared and then drawn bin by bin
+void softwareRasterWorker(int thread) {
+    SoftwareRasterizer& sw = softwareRasterizer;
+    int tileCount = sw.tilesX * sw.tilesY;
+    for (int tile = sw.nextTile++; tile < tileCount; tile = sw.nextTile++) {
+        int x0 = (tile % sw.tilesX) * SOFTWARE_TILE_SIZE, y0 = (tile / sw.tilesX) * SOFTWARE_TILE_SIZE;
+        int x1 = std::min(x0 + SOFTWARE_TILE_SIZE, sw.width) - 1;
+        int y1 = std::min(y0 + SOFTWARE_TILE_SIZE, sw.height) - 1;
+        for (int y = y0; y <= y1; y++) {
+            std::fill(&sw.color[(size_t)y * sw.pitch + x0], &sw.color[(size_t)y * sw.pitch + x1 + 1], sw.clearColor);
+            std::fill(&sw.depth[(size_t)y * sw.pitch + x0], &sw.depth[(size_t)y * sw.pitch + x1 + 1], 1.0f);
+        }
+        for (int t = 0; t < sw.threads; t++) {
+            const std::vector<int>& bin = sw.bins[t][tile];
+            const std::vector<SoftwareTriangle>& triangles = sw.triangles[t];
+            for (size_t i = 0; i < bin.size(); i++) rasterizeSoftwareTriangle(triangles[bin[i]], x0, y0, x1, y1);
+        }
+    }
+    (void)thread;
+}
+
+void runSoftwarePhase(void (*phase)(int)) {
+    runOnFrameWorkers(phase, softwareRasterizer.threads);
+}
+
+// Draws the frame into the bound framebuffer in place of the GL passes
+void renderSoftwareFrame() {
+    SoftwareRasterizer& sw = softwareRasterizer;
+    if (!sw.captured || sw.capturedDaytime != isDaytime || sw.capturedVolumetric != volumetricLightActive() ||
+        sw.capturedLampIntensity != deskLampIntensity) {
+        captureSoftwareScene();
+    }
+    double start = nowMs();
+
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    if (sw.threads == 0) {
+        sw.threads = std::max(1, std::min((int)std::thread::hardware_concurrency(), 64));
+        sw.triangles.resize(sw.threads);
+        sw.bins.resize(sw.threads);
+    }
+    if (viewport[2] != sw.width || viewport[3] != sw.height) {
+        sw.width = viewport[2];
+        sw.height = viewport[3];
+        sw.tilesX = (sw.width + SOFTWARE_TILE_SIZE - 1) / SOFTWARE_TILE_SIZE;
+        sw.tilesY = (sw.height + SOFTWARE_TILE_SIZE - 1) / SOFTWARE_TILE_SIZE;
+        sw.pitch = sw.tilesX * SOFTWARE_TILE_SIZE;
+        sw.color.assign((size_t)sw.pitch * sw.tilesY * SOFTWARE_TILE_SIZE, 0);
+        sw.depth.assign(sw.color.size(), 1.0f);
+        for (int t = 0; t < sw.threads; t++) sw.bins[t].assign(sw.tilesX * sw.tilesY, std::vector<int>());
+    }
+
+    // The camera and lights exactly as the GL renderers set them up
+    applyProjection(0.0f, 0.0f);
+    glLoadIdentity();
+    updateCamera();
+    applyLightPositions();
+    glGetFloatv(GL_MODELVIEW_MATRIX, sw.view);
+    glGetFloatv(GL_PROJECTION_MATRIX, sw.projection);
+    readLightState(sw.lights);
+    GLfloat clear[4];
+    glGetFloatv(GL_COLOR_CLEAR_VALUE, clear);
+    sw.clearColor = packSoftwareColor(clear);
+
+    runSoftwarePhase(softwareGeometryWorker);
+    double geometryEnd = nowMs();
+    sw.nextTile = 0;
+    runSoftwarePhase(softwareRasterWorker);
+    double rasterEnd = nowMs();
+
+    glPushAttrib(GL_ENABLE_BIT);
+    glDisable(GL_DEPTH_TEST);
+    glDisable(GL_LIGHTING);
+    glDisable(GL_TEXTURE_2D);
+    glDisable(GL_BLEND);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, sw.pitch);
+    glWindowPos2i(viewport[0], viewport[1]);
+    glDrawPixels(sw.width, sw.height, GL_RGBA, GL_UNSIGNED_BYTE, &sw.color[0]);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    glPopAttrib();
+    drawCallCount++;
+
+    for (int t = 0; t < sw.threads; t++) {
+        sw.trianglesBinned += (long)sw.triangles[t].size();
+        for (size_t i = 0; i < sw.bins[t].size(); i++) sw.binEntries += (long)sw.bins[t][i].size();
+    }
+    sw.frames++;
+    sw.geometryMs += geometryEnd - start;
+    sw.rasterMs += rasterEnd - geometryEnd;
+    sw.presentMs += nowMs() - rasterEnd;
+}
+
+void printSoftwareStats() {
+    SoftwareRasterizer& sw = softwareRasterizer;
+    if (sw.frames == 0) return;
+    printf("Software rasterizer: %d threads, %dx%d tiles of %d px, %ld triangles/frame in %.1f tile bins each | "
+           "geometry %.2f ms, raster %.2f ms, present %.2f ms",
+           sw.threads, sw.tilesX, sw.tilesY, SOFTWARE_TILE_SIZE, sw.trianglesBinned / sw.frames,
+           sw.trianglesBinned > 0 ? (double)sw.binEntries / sw.trianglesBinned : 0.0, sw.geometryMs / sw.frames,
+           sw.rasterMs / sw.frames, sw.presentMs / sw.frames);
+    if (sw.captures > 0) printf(" | %d scene captures (%.1f ms avg)", sw.captures, sw.captureMs / sw.captures);
+    printf("\n");
+    sw.frames = 0;
+    sw.captures = 0;
+    sw.trianglesBinned = sw.binEntries = 0;
+    sw.captureMs = sw.geometryMs = sw.rasterMs = sw.presentMs = 0.0;
+}
+
+// ============= Path Tracer =============
+// A reference renderer ('R' to "path traced", or --reference for an image
+// file): the captured scene and textures path traced on every core, with
+// the same lights as the time of day sets up for setupLighting()'s model,
+// minus its ambient terms. Light that the fixed-function model fakes with
+// GL_AMBIENT is here the bounced light itself, so the difference to the
+// real-time renderers is what the ambient terms and the missing bounces
+// get wrong. Surfaces are Lambertian with the scene's Blinn-Phong
+// highlight added where the camera sees them directly. As in the lightmap
+// baker, shadow rays test the shadow casters only (the painted window
+// lets no sun through the closed room otherwise) and bounce rays hit
+// everything opaque.
+//
+// Samples accumulate for as long as the view, hour and lamp stay put; each
+// frame adds as many rows of samples as fit PATH_TRACE_FRAME_BUDGET_MS.
+// Primary rays go through the BVH in SSE packets of four pixels, which
+// share the camera origin; bounce and shadow rays are incoherent and go
+// one at a time. 'E' shows the convergence instead of the image: pixels
+// whose standard error is under PATH_TRACE_NOISE_TARGET of their
+// brightness are gray, noisier ones blue through red.
+const int PATH_TRACE_BOUNCES = 3;
+const double PATH_TRACE_FRAME_BUDGET_MS = 50.0;
+const float PATH_TRACE_NOISE_TARGET = 0.02f;
+const int REFERENCE_DEFAULT_SAMPLES = 256;
+
+struct PathTracer {
+    bool captured;
+    bool capturedDaytime, capturedVolumetric;
+    float capturedLampIntensity;
+    SceneMesh mesh;
+    BVH scene, casters;
+    std::vector<BakeTexture> textures;
+
+    // What the accumulated samples were taken with
+    int width, height;
+    GLfloat view[16];
+    GLfloat projection[16];
+    float hour;
+    float lampIntensity;
+    std::vector<float> radiance;       // RGB sums
+    std::vector<float> luminance;      // sum and sum of squares per pixel
+    std::vector<int> rowSamples;
+    std::vector<unsigned int> image;   // RGBA8 for glDrawPixels
+    bool showConvergence;
+
+    // Per frame
+    GLfloat eye[3];
+    GLfloat sunDirection[3];
+    GLfloat sunColor[3];
+    GLfloat lampColor[3], lampSpecular[3];
+    bool sunOn, lampOn;
+    bool fullPasses;                   // --reference: whole passes, no budget
+    int threads;
+    int rowsPerFrame;
+    long long nextTicket, endTicket;
+    std::mutex ticketMutex;
+    std::atomic<long long> rays;
+
+    int frames;
+    int resets;
+    long long raysReported;
+    double traceMs;
+};
+PathTracer pathTracer;
+
+// Closest hits for four rays from one origin. Like occludedPacket(), the
+// shared origin keeps the per-triangle origin terms scalar; each ray keeps
+// its own nearest distance so far.
+void tracePrimaryPacket(const BVH& bvh, const GLfloat* origin, const GLfloat dirs[4][3], RayHit hits[4]) {
+    for (int r = 0; r < 4; r++) {
+        hits[r].t = 1e30f;
+        hits[r].triangle = -1;
+    }
+    if (bvh.triangles.empty()) return;
+#if defined(__SSE2__)
+    __m128 dir[3], invDir[3];
+    for (int a = 0; a < 3; a++) {
+        float inv[4];
+        for (int r = 0; r < 4; r++) inv[r] = (fabsf(dirs[r][a]) > 1e-12f) ? 1.0f / dirs[r][a] : 1e12f;
+        dir[a] = _mm_setr_ps(dirs[0][a], dirs[1][a], dirs[2][a], dirs[3][a]);
+        invDir[a] = _mm_loadu_ps(inv);
+    }
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 tMin = _mm_set1_ps(1e-4f);
+    const __m128 epsilon = _mm_set1_ps(1e-12f);
+    const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    __m128 nearest = _mm_set1_ps(1e30f);
+    __m128 nearestU = zero, nearestV = zero;
+    __m128i nearestTriangle = _mm_set1_epi32(-1);
+
+    int stack[BVH_STACK_SIZE];
+    int depth = 0;
+    stack[depth++] = 0;
+    while (depth > 0) {
+        const BVHNode& node = bvh.nodes[stack[--depth]];
+        __m128 tEnter = zero, tExit = nearest;
+        for (int a = 0; a < 3; a++) {
+            __m128 o = _mm_set1_ps(origin[a]);
+            __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.boundsMin[a]), o), invDir[a]);
+            __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.boundsMax[a]), o), invDir[a]);
+            tEnter = _mm_max_ps(tEnter, _mm_min_ps(t0, t1));
+            tExit = _mm_min_ps(tExit, _mm_max_ps(t0, t1));
+        }
+        if (_mm_movemask_ps(_mm_cmple_ps(tEnter, tExit)) == 0) continue;
+
+        if (node.count == 0) {
+            stack[depth++] = node.first;
+            stack[depth++] = node.first + 1;
+            continue;
+        }
+        for (int i = node.first; i < node.first + node.count; i++) {
+            const TraceTriangle& tri = bvh.triangles[i];
+            __m128 px = _mm_sub_ps(_mm_mul_ps(dir[1], _mm_set1_ps(tri.e2[2])), _mm_mul_ps(dir[2], _mm_set1_ps(tri.e2[1])));
+            __m128 py = _mm_sub_ps(_mm_mul_ps(dir[2], _mm_set1_ps(tri.e2[0])), _mm_mul_ps(dir[0], _mm_set1_ps(tri.e2[2])));
+            __m128 pz = _mm_sub_ps(_mm_mul_ps(dir[0], _mm_set1_ps(tri.e2[1])), _mm_mul_ps(dir[1], _mm_set1_ps(tri.e2[0])));
+            __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(tri.e1[0]), px),
+                                               _mm_mul_ps(_mm_set1_ps(tri.e1[1]), py)),
+                                    _mm_mul_ps(_mm_set1_ps(tri.e1[2]), pz));
+            __m128 invDet = _mm_div_ps(one, det);
+            GLfloat tvec[3], qvec[3];
+            vecSub(origin, tri.p0, tvec);
+            vecCross(tvec, tri.e1, qvec);
+            __m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(tvec[0]), px),
+                                                        _mm_mul_ps(_mm_set1_ps(tvec[1]), py)),
+                                             _mm_mul_ps(_mm_set1_ps(tvec[2]), pz)), invDet);
+            __m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dir[0], _mm_set1_ps(qvec[0])),
+                                                        _mm_mul_ps(dir[1], _mm_set1_ps(qvec[1]))),
+                                             _mm_mul_ps(dir[2], _mm_set1_ps(qvec[2]))), invDet);
+            __m128 t = _mm_mul_ps(_mm_set1_ps(vecDot(tri.e2, qvec)), invDet);
+            __m128 hit = _mm_cmpgt_ps(_mm_and_ps(det, absMask), epsilon);
+            hit = _mm_and_ps(hit, _mm_cmpge_ps(u, zero));
+            hit = _mm_and_ps(hit, _mm_cmpge_ps(v, zero));
+            hit = _mm_and_ps(hit, _mm_cmple_ps(_mm_add_ps(u, v), one));
+            hit = _mm_and_ps(hit, _mm_cmpgt_ps(t, tMin));
+            hit = _mm_and_ps(hit, _mm_cmplt_ps(t, nearest));
+            if (_mm_movemask_ps(hit) == 0) continue;
+            nearest = _mm_or_ps(_mm_and_ps(hit, t), _mm_andnot_ps(hit, nearest));
+            nearestU = _mm_or_ps(_mm_and_ps(hit, u), _mm_andnot_ps(hit, nearestU));
+            nearestV = _mm_or_ps(_mm_and_ps(hit, v), _mm_andnot_ps(hit, nearestV));
+            __m128i hitInt = _mm_castps_si128(hit);
+            nearestTriangle = _mm_or_si128(_mm_and_si128(hitInt, _mm_set1_epi32(i)),
+                                           _mm_andnot_si128(hitInt, nearestTriangle));
+        }
+    }
+    float t[4], u[4], v[4];
+    int triangle[4];
+    _mm_storeu_ps(t, nearest);
+    _mm_storeu_ps(u, nearestU);
+    _mm_storeu_ps(v, nearestV);
+    _mm_storeu_si128((__m128i*)triangle, nearestTriangle);
+    for (int r = 0; r < 4; r++) {
+        hits[r].t = t[r];
+        hits[r].u = u[r];
+        hits[r].v = v[r];
+        hits[r].triangle = triangle[r];
+    }
+#else
+    for (int r = 0; r < 4; r++) {
+        if (!traceRay(bvh, origin, dirs[r], 1e30f, false, hits[r])) hits[r].triangle = -1;
+    }
+#endif
+}
+
+// Direct light at a surface point with next event estimation toward both
+// lights; with viewDir set (the camera's hit) the Blinn-Phong highlight of
+// the draw is added on top of the diffuse term
+void pathDirectLight(const GLfloat* point, const GLfloat* normal, const GLfloat* albedo,
+                     const SceneDraw& draw, const GLfloat* viewDir, GLfloat* out, long long& rays) {
+    PathTracer& pt = pathTracer;
+    for (int c = 0; c < 3; c++) out[c] = 0.0f;
+    RayHit hit;
+    for (int light = 0; light < 2; light++) {
+        GLfloat toLight[3];
+        float distance = 1e30f, atten = 1.0f;
+        const GLfloat* color;
+        const GLfloat* specular;
+        static const GLfloat white[3] = {1.0f, 1.0f, 1.0f};
+        if (light == 0) {
+            if (!pt.sunOn) continue;
+            memcpy(toLight, pt.sunDirection, sizeof(toLight));
+            color = pt.sunColor;
+            specular = white;   // GL_LIGHT0's default specular
+        } else {
+            if (!pt.lampOn) continue;
+            vecSub(deskLampPosition, point, toLight);
+            distance = vecNormalize(toLight);
+            atten = 1.0f / (deskLampAttenuation[0] + deskLampAttenuation[1] * distance +
+                            deskLampAttenuation[2] * distance * distance);
+            color = pt.lampColor;
+            specular = pt.lampSpecular;
+        }
+        float cosine = vecDot(normal, toLight);
+        if (cosine <= 0.0f) continue;
+        rays++;
+        if (traceRay(pt.casters, point, toLight, distance, true, hit)) continue;
+        float highlight = 0.0f;
+        if (viewDir) {
+            GLfloat half[3] = {toLight[0] - viewDir[0], toLight[1] - viewDir[1], toLight[2] - viewDir[2]};
+            vecNormalize(half);
+            float NdotH = std::max(0.0f, vecDot(normal, half));
+            highlight = (draw.shininess > 0.0f) ? powf(NdotH, draw.shininess) : 1.0f;
+        }
+        for (int c = 0; c < 3; c++) {
+            out[c] += atten * (cosine * color[c] * albedo[c] + highlight * specular[c] * draw.specular[c]);
+        }
+    }
+}
+
+// One path from a primary hit; returns the radiance along the camera ray
+void tracePath(const GLfloat* cameraDir, const RayHit& primary, BakeRandom& random, GLfloat* radiance,
+               long long& rays) {
+    PathTracer& pt = pathTracer;
+    GLfloat throughput[3] = {1.0f, 1.0f, 1.0f};
+    GLfloat origin[3], dir[3];
+    memcpy(origin, pt.eye, sizeof(origin));
+    memcpy(dir, cameraDir, sizeof(dir));
+    RayHit hit = primary;
+    for (int c = 0; c < 3; c++) radiance[c] = 0.0f;
+
+    for (int bounce = 0; ; bounce++) {
+        if (hit.triangle < 0) return;
+        const TraceTriangle& tri = pt.scene.triangles[hit.triangle];
+        const SceneVertex* p = &pt.mesh.vertices[tri.firstVertex];
+        float w = 1.0f - hit.u - hit.v;
+        GLfloat normal[3], point[3], albedo[3];
+        for (int a = 0; a < 3; a++) {
+            normal[a] = w * p[0].normal[a] + hit.u * p[1].normal[a] + hit.v * p[2].normal[a];
+        }
+        vecNormalize(normal);
+        if (vecDot(normal, dir) > 0.0f) {
+            for (int a = 0; a < 3; a++) normal[a] = -normal[a];
+        }
+        for (int a = 0; a < 3; a++) point[a] = origin[a] + dir[a] * hit.t + normal[a] * 1e-3f;
+        surfaceAlbedo(pt.mesh, pt.textures, tri, hit.u, hit.v, albedo);
+
+        GLfloat direct[3];
+        pathDirectLight(point, normal, albedo, pt.mesh.draws[tri.draw], bounce == 0 ? dir : NULL, direct, rays);
+        for (int c = 0; c < 3; c++) {
+            radiance[c] += throughput[c] * direct[c];
+            throughput[c] *= albedo[c];
+        }
+        if (bounce == PATH_TRACE_BOUNCES) return;
+
+        memcpy(origin, point, sizeof(origin));
+        sampleHemisphere(normal, random, dir);
+        rays++;
+        if (!traceRay(pt.scene, origin, dir, 1e30f, false, hit)) hit.triangle = -1;
+    }
+}
+
+// Camera ray through a point of the viewport, from the captured matrices
+void pathCameraRay(float x, float y, GLfloat* dir) {
+    const PathTracer& pt = pathTracer;
+    GLfloat eyeDir[3] = {(2.0f * x / pt.width - 1.0f) / pt.projection[0],
+                         (2.0f * y / pt.height - 1.0f) / pt.projection[5], -1.0f};
+    // The view's rotation is orthonormal, its transpose takes eye to world
+    for (int a = 0; a < 3; a++) {
+        dir[a] = pt.view[a * 4] * eyeDir[0] + pt.view[a * 4 + 1] * eyeDir[1] + pt.view[a * 4 + 2] * eyeDir[2];
+    }
+    vecNormalize(dir);
+}
+
+void tracePathRow(int y, long long& rays) {
+    PathTracer& pt = pathTracer;
+    int sample = pt.rowSamples[y];
+    for (int x0 = 0; x0 < pt.width; x0 += 4) {
+        BakeRandom random[4];
+        GLfloat dirs[4][3];
+        for (int r = 0; r < 4; r++) {
+            int x = std::min(x0 + r, pt.width - 1);
+            unsigned int seed = ((unsigned int)(y * pt.width + x) * 2654435761u) ^ ((unsigned int)sample * 0x9e3779b9u);
+            random[r].state = seed ? seed : 1;
+            pathCameraRay(x + random[r].next(), y + random[r].next(), dirs[r]);
+        }
+        RayHit hits[4];
+        rays += 4;
+        tracePrimaryPacket(pt.scene, pt.eye, dirs, hits);
+        for (int r = 0; r < 4 && x0 + r < pt.width; r++) {
+            GLfloat radiance[3];
+            tracePath(dirs[r], hits[r], random[r], radiance, rays);
+            size_t pixel = (size_t)y * pt.width + x0 + r;
+            for (int c = 0; c < 3; c++) pt.radiance[pixel * 3 + c] += radiance[c];
+            float luminance = 0.2126f * radiance[0] + 0.7152f * radiance[1] + 0.0722f * radiance[2];
+            pt.luminance[pixel * 2] += luminance;
+            pt.luminance[pixel * 2 + 1] += luminance * luminance;
+        }
+    }
+    pt.rowSamples[y]++;
+}
+
+// Rows are handed out as tickets; ticket k is row k % height of pass k / height
+void pathTraceWorker(int) {
+    PathTracer& pt = pathTracer;
+    long long rays = 0;
+    for (;;) {
+        long long ticket;
+        {
+            std::lock_guard<std::mutex> lock(pt.ticketMutex);
+            if (pt.nextTicket >= pt.endTicket) break;
+            ticket = pt.nextTicket++;
+        }
+        tracePathRow((int)(ticket % pt.height), rays);
+    }
+    pt.rays += rays;
+}
+
+void capturePathTracerScene() {
+    PathTracer& pt = pathTracer;
+    // Texture decoding happens once and dwarfs the rest, so it is reported
+    // apart from the per-capture work
+    double start = nowMs();
+    bool loadTextures = pt.textures.empty();
+    if (loadTextures) loadBakeTextures(pt.textures);
+    double textureMs = nowMs() - start;
+    start = nowMs();
+    captureScene(pt.mesh);
+    double captureMs = nowMs() - start;
+    start = nowMs();
+    buildBVH(pt.mesh, false, pt.scene);
+    buildBVH(pt.mesh, true, pt.casters);
+    double bvhMs = nowMs() - start;
+    pt.captured = true;
+    pt.capturedDaytime = isDaytime;
+    pt.capturedVolumetric = volumetricLightActive();
+    pt.capturedLampIntensity = deskLampIntensity;
+    printf("Path tracer: %d triangles captured in %.1f ms, %d BVH nodes built in %.1f ms",
+           (int)pt.scene.triangles.size(), captureMs, (int)pt.scene.nodes.size(), bvhMs);
+    if (loadTextures) printf(", textures decoded in %.1f ms", textureMs);
+    printf("\n");
+}
+
+void resetPathTracer() {
+    PathTracer& pt = pathTracer;
+    size_t pixels = (size_t)pt.width * pt.height;
+    pt.radiance.assign(pixels * 3, 0.0f);
+    pt.luminance.assign(pixels * 2, 0.0f);
+    pt.rowSamples.assign(pt.height, 0);
+    pt.image.resize(pixels);
+    pt.nextTicket = pt.endTicket = 0;
+    pt.resets++;
+}
+
+// Standard error of a pixel's mean luminance relative to that luminance
+float pathPixelNoise(size_t pixel, int samples) {
+    const PathTracer& pt = pathTracer;
+    if (samples < 2) return 1.0f;
+    float mean = pt.luminance[pixel * 2] / samples;
+    float variance = std::max(0.0f, pt.luminance[pixel * 2 + 1] / samples - mean * mean);
+    return sqrtf(variance / samples) / std::max(mean, 0.05f);
+}
+
+// Samples per pixel of the least sampled row, and the mean relative noise
+void pathTracerConvergence(int& samples, float& noise) {
+    const PathTracer& pt = pathTracer;
+    samples = pt.rowSamples.empty() ? 0 : *std::min_element(pt.rowSamples.begin(), pt.rowSamples.end());
+    double sum = 0.0;
+    for (int y = 0; y < pt.height; y++) {
+        for (int x = 0; x < pt.width; x++) sum += pathPixelNoise((size_t)y * pt.width + x, pt.rowSamples[y]);
+    }
+    noise = (pt.width * pt.height > 0) ? (float)(sum / ((double)pt.width * pt.height)) : 1.0f;
+}
+
+// Adds this frame's samples and draws the average so far
+void renderPathTracedFrame() {
+    PathTracer& pt = pathTracer;
+    if (!pt.captured || pt.capturedDaytime != isDaytime || pt.capturedVolumetric != volumetricLightActive() ||
+        pt.capturedLampIntensity != deskLampIntensity) {
+        capturePathTracerScene();
+        pt.width = 0;
+    }
+    if (pt.threads == 0) pt.threads = std::max(1u, std::thread::hardware_concurrency());
+
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    applyProjection(0.0f, 0.0f);
+    glLoadIdentity();
+    updateCamera();
+    GLfloat view[16], projection[16];
+    glGetFloatv(GL_MODELVIEW_MATRIX, view);
+    glGetFloatv(GL_PROJECTION_MATRIX, projection);
+    if (viewport[2] != pt.width || viewport[3] != pt.height || memcmp(view, pt.view, sizeof(view)) != 0 ||
+        memcmp(projection, pt.projection, sizeof(projection)) != 0 || timeOfDay != pt.hour ||
+        deskLampIntensity != pt.lampIntensity) {
+        pt.width = viewport[2];
+        pt.height = viewport[3];
+        memcpy(pt.view, view, sizeof(view));
+        memcpy(pt.projection, projection, sizeof(projection));
+        pt.hour = timeOfDay;
+        pt.lampIntensity = deskLampIntensity;
+        resetPathTracer();
+    }
+
+    // The camera and lights in world space, as the time of day left them
+    for (int a = 0; a < 3; a++) {
+        pt.eye[a] = -(view[a * 4] * view[12] + view[a * 4 + 1] * view[13] + view[a * 4 + 2] * view[14]);
+    }
+    const GLfloat* sun = timeOfDayState.valid ? timeOfDayState.sunPosition : sunPosition;
+    memcpy(pt.sunDirection, sun, sizeof(pt.sunDirection));
+    vecNormalize(pt.sunDirection);
+    pt.sunOn = isDaytime;
+    pt.lampOn = deskLampLightOn;
+    for (int c = 0; c < 3; c++) {
+        pt.sunColor[c] = timeOfDayState.valid ? timeOfDayState.sunDiffuse[c] : sunDiffuse[c];
+        pt.lampColor[c] = deskLampIntensity * deskLampDiffuse[c];
+        pt.lampSpecular[c] = deskLampIntensity * deskLampSpecular[c];
+    }
+
+    // Rows for this frame, from the time the last rows took
+    double start = nowMs();
+    int rows = pt.fullPasses ? pt.height : std::max(pt.threads, std::min(pt.height, pt.rowsPerFrame));
+    pt.endTicket = pt.nextTicket + rows;
+    runOnFrameWorkers(pathTraceWorker, pt.threads);
+    double traceMs = nowMs() - start;
+    pt.traceMs += traceMs;
+    pt.rowsPerFrame = std::max(1, (int)(rows * PATH_TRACE_FRAME_BUDGET_MS / std::max(traceMs, 1.0)));
+
+    // Display: the average, clamped like the fixed-function output, or the
+    // convergence map
+    for (int y = 0; y < pt.height; y++) {
+        int samples = pt.rowSamples[y];
+        float scale = samples > 0 ? 1.0f / samples : 0.0f;
+        for (int x = 0; x < pt.width; x++) {
+            size_t pixel = (size_t)y * pt.width + x;
+            unsigned char rgb[3];
+            for (int c = 0; c < 3; c++) {
+                rgb[c] = (unsigned char)(std::min(1.0f, pt.radiance[pixel * 3 + c] * scale) * 255.0f + 0.5f);
+            }
+            if (pt.showConvergence) {
+                unsigned char heat[3];
+                heatmapColor(rgb, pathPixelNoise(pixel, samples), PATH_TRACE_NOISE_TARGET, heat);
+                memcpy(rgb, heat, sizeof(rgb));
+            }
+            pt.image[pixel] = rgb[0] | (rgb[1] << 8) | (rgb[2] << 16) | 0xff000000u;
+        }
+    }
+    glPushAttrib(GL_ENABLE_BIT);
+    glDisable(GL_DEPTH_TEST);
+    glDisable(GL_LIGHTING);
+    glDisable(GL_TEXTURE_2D);
+    glDisable(GL_BLEND);
+    glWindowPos2i(viewport[0], viewport[1]);
+    glDrawPixels(pt.width, pt.height, GL_RGBA, GL_UNSIGNED_BYTE, &pt.image[0]);
+    glPopAttrib();
+    drawCallCount++;
+    pt.frames++;
+}
+
+void printPathTracerStats() {
+    PathTracer& pt = pathTracer;
+    if (pt.frames == 0) return;
+    int samples;
+    float noise;
+    pathTracerConvergence(samples, noise);
+    long long rays = pt.rays;
+    printf("Path tracer: %d spp at %dx%d, noise %.1f%% (target %.0f%%), %d threads, %.2f Mrays/s, "
+           "%d rows/frame | %d resets\n",
+           samples, pt.width, pt.height, noise * 100.0f, PATH_TRACE_NOISE_TARGET * 100.0f, pt.threads,
+           pt.traceMs > 0.0 ? (rays - pt.raysReported) / (pt.traceMs * 1000.0) : 0.0, pt.rowsPerFrame, pt.resets);
+    pt.raysReported = rays;
+    pt.frames = 0;
+    pt.resets = 0;
+    pt.traceMs = 0.0;
+}
+
+void toggleConvergenceView() {
+    pathTracer.showConvergence = !pathTracer.showConvergence;
+    printf("Path tracer view: %s\n", pathTracer.showConvergence ? "convergence (noise above target in color)" : "image");
+}
+
+// --reference PATH renders a converged path traced PNG of a view set up
+// like --headless (--size, --hour, --keys), for comparing the real-time
+// renderers against. It stops after --samples passes, reporting the noise
+// every doubling.
+int runReference(int argc, char** argv) {
+    const char* output = commandLineOption(argc, argv, "--reference");
+    if (!output) {
+        printf("--reference expects an output path, e.g. --reference reference.png\n");
+        return 1;
+    }
+    int width = 600, height = 400;
+    const char* size = commandLineOption(argc, argv, "--size");
+    if (size && (sscanf(size, "%dx%d", &width, &height) != 2 || width <= 0 || height <= 0)) {
+        printf("--size expects WIDTHxHEIGHT, e.g. 600x400\n");
+        return 1;
+    }
+    const char* samplesOption = commandLineOption(argc, argv, "--samples");
+    int samples = samplesOption ? std::max(1, atoi(samplesOption)) : REFERENCE_DEFAULT_SAMPLES;
+    const char* threads = commandLineOption(argc, argv, "--threads");
+    const char* keys = commandLineOption(argc, argv, "--keys");
+    const char* hour = commandLineOption(argc, argv, "--hour");
+
+    headlessMode = true;
+    HeadlessContext headless;
+    if (!createHeadlessContext(headless, width, height)) return 1;
+    init();
+    loadSceneResources();
+    reshape(width, height);
+    if (hour) {
+        timeOfDay = timeOfDayTarget = wrapHour((float)atof(hour));
+    }
+    for (const char* key = keys; key && *key; key++) {
+        keyboard((unsigned char)*key, 0, 0);
+    }
+    rendererMode = RENDERER_PATH_TRACED;
+    pathTracer.fullPasses = true;
+    if (threads && atoi(threads) > 0) pathTracer.threads = atoi(threads);
+
+    double start = nowMs();
+    long long raysBefore = pathTracer.rays;
+    for (int pass = 1; pass <= samples; pass++) {
+        display();
+        if ((pass & (pass - 1)) == 0 || pass == samples) {
+            int spp;
+            float noise;
+            pathTracerConvergence(spp, noise);
+            printf("  %4d spp  noise %5.2f%%  %.1f s\n", spp, noise * 100.0f, (nowMs() - start) / 1000.0);
+        }
+    }
+    double totalMs = nowMs() - start;
+
+    std::vector<unsigned char> pixels;
+    readFramePixels(pixels, width, height);
+    bool written = writePNG(output, &pixels[0], width, height);
+    printf("Reference: %d spp at %dx%d on %d threads in %.1f s (%.2f Mrays/s), %s %s\n", samples, width, height,
+           pathTracer.threads, totalMs / 1000.0, (pathTracer.rays - raysBefore) / (totalMs * 1000.0),
+           written ? "written to" : "failed to write", output);
+    destroyHeadlessContext(headless);
+    return written ? 0 : 1;
+}
+
+// ============= Microbenchmarks =============
+// --bench times the CPU-side hot paths one at a time on the headless
+// context, outside any frame: JPEG decode of each file in textures/, mip
+// generation (GLU scales on the CPU), capturing the scene mesh and building
+// its BVH, the clustered light culling (the sphere-vs-cluster-frustum test),
+// the transparency depth sort, the matrix helpers and reading the cooked
+// mesh file. Each case runs its warm-up repetitions, then the measured
+// ones; a repetition times a batch of calls so the short cases are not all
+// timer resolution, and the report is per call.
+//   --warmup N      unmeasured repetitions per case (default 3)
+//   --reps N        measured repetitions per case (default 20)
+//   --filter TEXT   only the cases whose name contains TEXT
+//   --json PATH     where the report goes (default bench.json)
+// Compare two reports by case name; the coefficient of variation says how
+// much a difference has to be before it means anything on that machine.
+const int BENCH_DEFAULT_WARMUP = 3;
+const int BENCH_DEFAULT_REPS = 20;
+const int BENCH_MATRIX_BATCH = 1000;
+
+struct BenchCase {
+    const char* name;
+    void (*run)(int arg);
+    int arg;
+    int callsPerRep;
+};
+
+struct BenchResult {
+    char name[64];
+    int callsPerRep;
+    FrameTimeSummary summary; // per call, ms
+    bool skipped;
+};
+
+// Whatever the cases compute is folded in here so none of it is optimized out
+volatile float benchSink = 0.0f;
+SceneMesh benchMesh;
+BVH benchBVH;
+GLuint benchMipTexture = 0;
+
+// Every JPEG in textures/, whether or not the scene uses it yet
+struct BenchTextureFile {
+    char path[256];
+    char name[64];  // case name
+};
+std::vector<BenchTextureFile> benchTextureFiles;
+
+bool compareBenchTextureFiles(const BenchTextureFile& a, const BenchTextureFile& b) {
+    return strcmp(a.path, b.path) < 0;
+}
+
+void listBenchTextureFiles() {
+    DIR* dir = opendir("textures");
+    if (!dir) return;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        size_t length = strlen(entry->d_name);
+        if (length < 4 || strcmp(entry->d_name + length - 4, ".jpg") != 0) continue;
+        BenchTextureFile file;
+        snprintf(file.path, sizeof(file.path), "textures/%s", entry->d_name);
+        snprintf(file.name, sizeof(file.name), "jpeg_decode/%s", entry->d_name);
+        benchTextureFiles.push_back(file);
+    }
+    closedir(dir);
+    std::sort(benchTextureFiles.begin(), benchTextureFiles.end(), compareBenchTextureFiles);
+}
+
+void benchDecodeTexture(int index) {
+    int width, height, channels;
+    unsigned char* image = stbi_load(benchTextureFiles[index].path, &width, &height, &channels, 0);
+    if (image) benchSink = benchSink + image[0];
+    stbi_image_free(image);
+}
+
+// The mip chain createWallpaperTexture() builds; wood is uploaded as a
+// single level, so it is not the one to time
+std::vector<unsigned char> benchMipSource;
+int benchMipWidth = 0, benchMipHeight = 0;
+GLenum benchMipFormat = GL_RGB;
+
+void benchBuildMipmaps(int) {
+    glBindTexture(GL_TEXTURE_2D, benchMipTexture);
+    gluBuild2DMipmaps(GL_TEXTURE_2D, benchMipFormat, benchMipWidth, benchMipHeight, benchMipFormat,
+                      GL_UNSIGNED_BYTE, &benchMipSource[0]);
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+void benchCaptureScene(int) {
+    captureScene(benchMesh);
+    benchSink = benchSink + (float)benchMesh.vertices.size();
+}
+
+void benchBuildBVH(int castersOnly) {
+    buildBVH(benchMesh, castersOnly != 0, benchBVH);
+    benchSink = benchSink + (float)benchBVH.nodes.size();
+}
+
+void benchCullClusterLights(int) {
+    assignClusterSlices(0, CLUSTER_SLICES);
+    benchSink = benchSink + (float)clusters.sliceIndices[CLUSTER_SLICES / 2].size();
+}
+
+void benchSortTransparency(int) {
+    buildTransparentRuns(true);
+    benchSink = benchSink + (float)transparency.runs.size();
+}
+
+void benchMatrixMath(int) {
+    GLfloat a[16], b[16], product[16], inverse[16];
+    const GLfloat eye[3] = {0.0f, 2.0f, 8.0f}, center[3] = {0.0f, 1.2f, 0.0f}, up[3] = {0.0f, 1.0f, 0.0f};
+    perspectiveMatrix(45.0f, 1.5f, 0.1f, 100.0f, a);
+    lookAtMatrix(eye, center, up, b);
+    GLfloat point[3] = {0.5f, 1.0f, -0.5f};
+    for (int i = 0; i < BENCH_MATRIX_BATCH; i++) {
+        b[12] = point[0] * 1e-3f;
+        multiplyMatrices(a, b, product);
+        invertRigidMatrix(b, inverse);
+        transformPoint(product, point, point);
+        transformPoint(inverse, point, point);
+    }
+    benchSink = benchSink + point[0] + point[1] + point[2];
+}
+
+void benchReadCookedMesh(int) {
+    char path[256];
+    snprintf(path, sizeof(path), "%s/scene.mesh", COOKED_DIR);
+    CookedMeshHeader header;
+    std::vector<CookedVertex> vertices;
+    std::vector<CookedBatch> batches;
+    if (readCookedMesh(path, header, vertices, batches)) benchSink = benchSink + vertices[0].occlusion;
+}
+
+BenchResult runBenchCase(const BenchCase& bench, int warmup, int reps) {
+    BenchResult result;
+    snprintf(result.name, sizeof(result.name), "%s", bench.name);
+    result.callsPerRep = bench.callsPerRep;
+    result.skipped = false;
+    std::vector<double> perCall;
+    for (int rep = -warmup; rep < reps; rep++) {
+        double start = nowMs();
+        for (int call = 0; call < bench.callsPerRep; call++) bench.run(bench.arg);
+        if (rep >= 0) perCall.push_back((nowMs() - start) / bench.callsPerRep);
+    }
+    result.summary = summarizeFrameTimes(perCall);
+    return result;
+}
+
+int runBench(int argc, char** argv) {
+    const char* warmupOption = commandLineOption(argc, argv, "--warmup");
+    const char* repsOption = commandLineOption(argc, argv, "--reps");
+    int warmup = warmupOption ? atoi(warmupOption) : BENCH_DEFAULT_WARMUP;
+    int reps = repsOption ? atoi(repsOption) : BENCH_DEFAULT_REPS;
+    const char* filter = commandLineOption(argc, argv, "--filter");
+    const char* jsonPath = commandLineOption(argc, argv, "--json");
+    if (!jsonPath) jsonPath = "bench.json";
+    if (reps <= 0 || warmup < 0) {
+        printf("--reps must be positive and --warmup not negative\n");
+        return 1;
+    }
+
+    headlessMode = true;
+    deterministicFrames = true;
+    HeadlessContext headless;
+    if (!createHeadlessContext(headless, WINDOW_WIDTH, WINDOW_HEIGHT)) return 1;
+    init();
+    loadSceneResources();
+    reshape(WINDOW_WIDTH, WINDOW_HEIGHT);
+
+    // Inputs the cases share: the decoded wallpaper, the captured scene,
+    // the 256-light cluster grid and the transparent polygons, all for the
+    // default view
+    int channels;
+    unsigned char* image = stbi_load(sceneTextureFiles[SCENE_TEXTURE_WALLPAPER].path, &benchMipWidth,
+                                     &benchMipHeight, &channels, 0);
+    if (image) {
+        benchMipFormat = (channels == 4) ? GL_RGBA : GL_RGB;
+        benchMipSource.assign(image, image + (size_t)benchMipWidth * benchMipHeight * channels);
+        stbi_image_free(image);
+    }
+    glGenTextures(1, &benchMipTexture);
+    captureScene(benchMesh);
+    glMatrixMode(GL_MODELVIEW);
+    glLoadIdentity();
+    updateCamera();
+    clusterLightCountIndex = 2;
+    updateClusters();
+    collectTransparentSurfaces();
+
+    char cookedPath[256];
+    snprintf(cookedPath, sizeof(cookedPath), "%s/scene.mesh", COOKED_DIR);
+    bool cookedMeshExists = access(cookedPath, R_OK) == 0;
+
+    std::vector<BenchCase> cases;
+    listBenchTextureFiles();
+    for (size_t i = 0; i < benchTextureFiles.size(); i++) {
+        BenchCase decode = {benchTextureFiles[i].name, benchDecodeTexture, (int)i, 1};
+        cases.push_back(decode);
+    }
+    const BenchCase fixedCases[] = {
+        {"mipmaps/wallpaper", benchBuildMipmaps, 0, 1},
+        {"mesh/capture_scene", benchCaptureScene, 0, 1},
+        {"mesh/bvh_scene", benchBuildBVH, 0, 1},
+        {"mesh/bvh_casters", benchBuildBVH, 1, 1},
+        {"culling/cluster_lights_256", benchCullClusterLights, 0, 10},
+        {"transparency/sort", benchSortTransparency, 0, 100},
+        {"matrix/multiply_invert_transform_x1000", benchMatrixMath, 0, 10},
+        {"scene_file/cooked_mesh", benchReadCookedMesh, 0, 1},
+    };
+    cases.insert(cases.end(), fixedCases, fixedCases + sizeof(fixedCases) / sizeof(fixedCases[0]));
+
+    printf("Microbenchmarks (%d warm-up, %d measured repetitions, ms per call):\n", warmup, reps);
+    std::vector<BenchResult> results;
+    for (size_t i = 0; i < cases.size(); i++) {
+        const BenchCase& bench = cases[i];
+        if (filter && !strstr(bench.name, filter)) continue;
+        BenchResult result;
+        if (bench.run == benchReadCookedMesh && !cookedMeshExists) {
+            memset(&result, 0, sizeof(result));
+            snprintf(result.name, sizeof(result.name), "%s", bench.name);
+            result.skipped = true;
+            printf("  %-40s skipped (no %s, run --bake-ao)\n", bench.name, cookedPath);
+        } else {
+            result = runBenchCase(bench, warmup, reps);
+            const FrameTimeSummary& s = result.summary;
+            printf("  %-40s min %9.4f  mean %9.4f  p50 %9.4f  max %9.4f  cv %5.1f%%\n", bench.name,
+                   s.min, s.mean, s.p50, s.max, s.mean > 0.0 ? 100.0 * s.stddev / s.mean : 0.0);
+        }
+        results.push_back(result);
+    }
+    glDeleteTextures(1, &benchMipTexture);
+
+    FILE* file = fopen(jsonPath, "w");
+    if (!file) {
+        printf("Failed to write %s\n", jsonPath);
+        destroyHeadlessContext(headless);
+        return 1;
+    }
+    fprintf(file, "{\n  \"gl_renderer\": ");
+    writeJSONString(file, (const char*)glGetString(GL_RENDERER));
+    fprintf(file, ",\n  \"threads\": %u,\n  \"warmup_reps\": %d,\n  \"reps\": %d,\n  \"unit\": \"ms\",\n",
+            std::max(1u, std::thread::hardware_concurrency()), warmup, reps);
+    fprintf(file, "  \"cases\": [\n");
+    for (size_t i = 0; i < results.size(); i++) {
+        const BenchResult& r = results[i];
+        const FrameTimeSummary& s = r.summary;
+        const char* separator = (i + 1 < results.size()) ? "," : "";
+        if (r.skipped) {
+            fprintf(file, "    {\"name\": \"%s\", \"skipped\": true}%s\n", r.name, separator);
+            continue;
+        }
+        fprintf(file, "    {\"name\": \"%s\", \"calls_per_rep\": %d, \"min\": %.6f, \"mean\": %.6f, "
+                "\"p50\": %.6f, \"p95\": %.6f, \"max\": %.6f, \"stddev\": %.6f, \"variance\": %.9f, "
+                "\"cv\": %.4f}%s\n", r.name, r.callsPerRep, s.min, s.mean, s.p50, s.p95, s.max, s.stddev,
+                s.stddev * s.stddev, s.mean > 0.0 ? s.stddev / s.mean : 0.0, separator);
+    }
+    fprintf(file, "  ]\n}\n");
+    fclose(file);
+    printf("Microbenchmark report written to %s\n", jsonPath);
+    destroyHeadlessContext(headless);
+    return 0;
+}
+
+// ============= Draw Call Layer =============
+// The draw functions below are plain immediate-mode GL. The macros at the
+// end of this section route every call they make through these wrappers,
+// which forward to GL (when a context is current) and can also record the
+// geometry into a SceneMesh in world space, without any GL context at all.
+// Keeping one copy of the draw code means the offline tools see exactly
+// the room the window shows.
+struct DrawLayer {
+    bool forwardToGL;      // issue the calls to the current GL context
+    SceneMesh* capture;    // non-NULL while recording geometry
+    bool skipBaked;        // baked surfaces are drawn from a vertex buffer instead
+    DrawFilter filter;
+    int object;            // sceneObjects index of the draw function running
+
+    // State mirrored from the calls above
+    bool lighting, texturing, blending;
+    GLenum blendSrc, blendDst;
+    bool depthWrite;
+    GLuint boundTexture;
+    GLfloat color[4];
+    GLfloat normal[3];
+    GLfloat texCoord[2];
+    GLfloat specular[4];
+    GLfloat shininess;
+    GLfloat matrix[16];
+    GLfloat normalMatrix[9];
+    GLfloat matrixStack[32][16];
+    int matrixDepth;
+    bool attribStack[16][3];
+    int attribDepth;
+
+    // Primitive in progress
+    GLenum mode;
+    bool skipping;
+    int forwardedVertices;
+    std::vector<SceneVertex> pending;
+};
+
+DrawLayer drawLayer;
+
+// Lit, opaque surfaces are the ones whose lighting can be baked
+bool isBakeable(GLenum mode, bool lighting, bool blending) {
+    return lighting && !blending && (mode == GL_QUADS || mode == GL_TRIANGLES);
+}
+
+void updateLayerNormalMatrix() {
+    // Inverse transpose of the upper 3x3, so glScalef keeps normals correct
+    const GLfloat* m = drawLayer.matrix;
+    GLfloat a = m[0], b = m[4], c = m[8];
+    GLfloat d = m[1], e = m[5], f = m[9];
+    GLfloat g = m[2], h = m[6], i = m[10];
+    GLfloat det = a * (e * i - f * h) - b * (d * i - f * g) + c * (d * h - e * g);
+    if (fabsf(det) < 1e-12f) det = 1.0f;
+    GLfloat* n = drawLayer.normalMatrix;
+    // Row-major inverse transpose: n[row * 3 + col]
+    n[0] = (e * i - f * h) / det; n[1] = -(d * i - f * g) / det; n[2] = (d * h - e * g) / det;
+    n[3] = -(b * i - c * h) / det; n[4] = (a * i - c * g) / det; n[5] = -(a * h - b * g) / det;
+    n[6] = (b * f - c * e) / det; n[7] = -(a * f - c * d) / det; n[8] = (a * e - b * d) / det;
+}
+
+// Resets the mirrored state to what the draw functions expect at the start
+// of a frame. With a context the enables are read back from GL.
+void resetDrawLayer(bool forwardToGL, SceneMesh* capture, bool skipBaked, DrawFilter filter) {
+    drawLayer.forwardToGL = forwardToGL;
+    drawLayer.capture = capture;
+    drawLayer.skipBaked = skipBaked;
+    drawLayer.filter = filter;
+    drawLayer.object = -1;
+    drawLayer.lighting = forwardToGL ? glIsEnabled(GL_LIGHTING) : true;
+    drawLayer.texturing = forwardToGL ? glIsEnabled(GL_TEXTURE_2D) : true;
+    drawLayer.blending = forwardToGL ? glIsEnabled(GL_BLEND) : false;
+    drawLayer.blendSrc = GL_ONE;
+    drawLayer.blendDst = GL_ZERO;
+    drawLayer.depthWrite = true;
+    drawLayer.boundTexture = 0;
+    GLfloat white[4] = {1.0f, 1.0f, 1.0f, 1.0f};
+    GLfloat black[4] = {0.0f, 0.0f, 0.0f, 1.0f};
+    memcpy(drawLayer.color, white, sizeof(white));
+    memcpy(drawLayer.specular, black, sizeof(black));
+    drawLayer.shininess = 0.0f;
+    drawLayer.normal[0] = 0.0f; drawLayer.normal[1] = 0.0f; drawLayer.normal[2] = 1.0f;
+    drawLayer.texCoord[0] = 0.0f; drawLayer.texCoord[1] = 0.0f;
+    identityMatrix(drawLayer.matrix);
+    updateLayerNormalMatrix();
+    drawLayer.matrixDepth = 0;
+    drawLayer.attribDepth = 0;
+    drawLayer.mode = GL_NONE;
+    drawLayer.skipping = false;
+    drawLayer.pending.clear();
+}
+
+void layerMultMatrix(const GLfloat* m) {
+    GLfloat result[16];
+    multiplyMatrices(drawLayer.matrix, m, result);
+    memcpy(drawLayer.matrix, result, sizeof(result));
+    updateLayerNormalMatrix();
+}
+
+// Appends the finished primitive to the capture, triangulating quads and
+// line loops, and merging with the previous draw when the state matches.
+void captureFinishedPrimitive() {
+    SceneMesh& mesh = *drawLayer.capture;
+    std::vector<SceneVertex>& in = drawLayer.pending;
+    GLenum primitive;
+    int polygonSides = 0;
+    size_t first = mesh.vertices.size();
+
+    switch (drawLayer.mode) {
+        case GL_QUADS:
+            primitive = GL_TRIANGLES;
+            polygonSides = 4;
+            for (size_t i = 0; i + 3 < in.size(); i += 4) {
+                const SceneVertex quad[6] = {in[i], in[i + 1], in[i + 2], in[i], in[i + 2], in[i + 3]};
+                mesh.vertices.insert(mesh.vertices.end(), quad, quad + 6);
+            }
+            break;
+        case GL_TRIANGLES:
+            primitive = GL_TRIANGLES;
+            polygonSides = 3;
+            mesh.vertices.insert(mesh.vertices.end(), in.begin(), in.begin() + in.size() / 3 * 3);
+            break;
+        case GL_LINES:
+            primitive = GL_LINES;
+            mesh.vertices.insert(mesh.vertices.end(), in.begin(), in.begin() + in.size() / 2 * 2);
+            break;
+        case GL_LINE_LOOP:
+            primitive = GL_LINES;
+            for (size_t i = 0; i < in.size() && in.size() > 1; i++) {
+                mesh.vertices.push_back(in[i]);
+                mesh.vertices.push_back(in[(i + 1) % in.size()]);
+            }
+            break;
+        case GL_POINTS:
+            primitive = GL_POINTS;
+            mesh.vertices.insert(mesh.vertices.end(), in.begin(), in.end());
+            break;
+        default:
+            return;
+    }
+
+    int count = (int)(mesh.vertices.size() - first);
+    if (count == 0) return;
+
+    SceneDraw draw;
+    draw.object = drawLayer.object;
+    draw.primitive = primitive;
+    draw.polygonSides = polygonSides;
+    draw.texture = drawLayer.boundTexture;
+    draw.textured = drawLayer.texturing;
+    draw.lit = drawLayer.lighting;
+    draw.blended = drawLayer.blending;
+    draw.blendSrc = drawLayer.blendSrc;
+    draw.blendDst = drawLayer.blendDst;
+    draw.depthWrite = drawLayer.depthWrite;
+    memcpy(draw.specular, drawLayer.specular, sizeof(draw.specular));
+    draw.shininess = drawLayer.shininess;
+    draw.firstVertex = (int)first;
+    draw.vertexCount = count;
+
+    if (!mesh.draws.empty()) {
+        SceneDraw& last = mesh.draws.back();
+        if (last.object == draw.object && last.primitive == draw.primitive &&
+            last.polygonSides == draw.polygonSides && last.texture == draw.texture &&
+            last.textured == draw.textured && last.lit == draw.lit && last.blended == draw.blended &&
+            last.blendSrc == draw.blendSrc && last.blendDst == draw.blendDst && last.depthWrite == draw.depthWrite &&
+            memcmp(last.specular, draw.specular, sizeof(draw.specular)) == 0 &&
+            last.shininess == draw.shininess && last.firstVertex + last.vertexCount == draw.firstVertex) {
+            last.vertexCount += count;
+            return;
+        }
+    }
+    mesh.draws.push_back(draw);
+}
+
+// Triangles a glBegin/glEnd block of the given mode rasterizes (lines and
+// points count none)
+long primitiveTriangles(GLenum mode, int vertices) {
+    switch (mode) {
+        case GL_TRIANGLES: return vertices / 3;
+        case GL_QUADS: return vertices / 4 * 2;
+        case GL_TRIANGLE_STRIP:
+        case GL_TRIANGLE_FAN:
+        case GL_POLYGON: return std::max(0, vertices - 2);
+        case GL_QUAD_STRIP: return std::max(0, vertices - 2) / 2 * 2;
+        default: return 0;
+    }
+}
+
+void sceneBegin(GLenum mode) {
+    drawLayer.mode = mode;
+    drawLayer.skipping = (drawLayer.skipBaked && isBakeable(mode, drawLayer.lighting, drawLayer.blending)) ||
+                         (drawLayer.filter == DRAW_OPAQUE && drawLayer.blending) ||
+                         (drawLayer.filter == DRAW_BLENDED && !drawLayer.blending);
+    drawLayer.pending.clear();
+    drawLayer.forwardedVertices = 0;
+    if (drawLayer.forwardToGL && !drawLayer.skipping) {
+        syncDrawState();
+        glBegin(mode);
+        traceCall(TRACE_BEGIN, &mode);
+        drawCallCount++;
+    }
+}
+
+void sceneEnd() {
+    if (drawLayer.capture && !drawLayer.skipping) captureFinishedPrimitive();
+    if (drawLayer.forwardToGL && !drawLayer.skipping) {
+        glEnd();
+        traceCall(TRACE_END, NULL);
+        triangleCount += primitiveTriangles(drawLayer.mode, drawLayer.forwardedVertices);
+    }
+    drawLayer.mode = GL_NONE;
+    drawLayer.skipping = false;
+}
+
+void sceneVertex3f(GLfloat x, GLfloat y, GLfloat z) {
+    if (drawLayer.capture) {
+        const GLfloat* m = drawLayer.matrix;
+        const GLfloat* n = drawLayer.normalMatrix;
+        const GLfloat* in = drawLayer.normal;
+        SceneVertex v;
+        v.position[0] = m[0] * x + m[4] * y + m[8] * z + m[12];
+        v.position[1] = m[1] * x + m[5] * y + m[9] * z + m[13];
+        v.position[2] = m[2] * x + m[6] * y + m[10] * z + m[14];
+        for (int row = 0; row < 3; row++) {
+            v.normal[row] = n[row * 3] * in[0] + n[row * 3 + 1] * in[1] + n[row * 3 + 2] * in[2];
+        }
+        GLfloat length = sqrtf(v.normal[0] * v.normal[0] + v.normal[1] * v.normal[1] + v.normal[2] * v.normal[2]);
+        if (length > 0.0f) {
+            for (int i = 0; i < 3; i++) v.normal[i] /= length;
+        }
+        memcpy(v.texCoord, drawLayer.texCoord, sizeof(v.texCoord));
+        memcpy(v.color, drawLayer.color, sizeof(v.color));
+        drawLayer.pending.push_back(v);
+    }
+    if (drawLayer.forwardToGL && !drawLayer.skipping) {
+        glVertex3f(x, y, z);
+        const GLfloat args[3] = {x, y, z};
+        traceCall(TRACE_VERTEX, args);
+        drawLayer.forwardedVertices++;
+    }
+}
+
+void sceneNormal3f(GLfloat x, GLfloat y, GLfloat z) {
+    drawLayer.normal[0] = x; drawLayer.normal[1] = y; drawLayer.normal[2] = z;
+    if (drawLayer.forwardToGL) {
+        glNormal3f(x, y, z);
+        traceCall(TRACE_NORMAL, drawLayer.normal);
+    }
+}
+
+void sceneTexCoord2f(GLfloat s, GLfloat t) {
+    drawLayer.texCoord[0] = s; drawLayer.texCoord[1] = t;
+    if (drawLayer.forwardToGL) {
+        glTexCoord2f(s, t);
+        traceCall(TRACE_TEXCOORD, drawLayer.texCoord);
+    }
+}
+
+void sceneColor4f(GLfloat r, GLfloat g, GLfloat b, GLfloat a) {
+    drawLayer.color[0] = r; drawLayer.color[1] = g; drawLayer.color[2] = b; drawLayer.color[3] = a;
+    if (drawLayer.forwardToGL) {
+        glColor4f(r, g, b, a);
+        traceCall(TRACE_COLOR, drawLayer.color);
+    }
+}
+
+void sceneColor3f(GLfloat r, GLfloat g, GLfloat b) {
+    sceneColor4f(r, g, b, 1.0f);
+}
+
+void sceneColor3fv(const GLfloat* c) {
+    sceneColor4f(c[0], c[1], c[2], 1.0f);
+}
+
+void sceneBindTexture(GLenum target, GLuint texture) {
+    if (target == GL_TEXTURE_2D) drawLayer.boundTexture = texture;
+    if (drawLayer.forwardToGL) {
+        glBindTexture(target, texture);
+        int index = sceneTextureIndex(texture);
+        if (target == GL_TEXTURE_2D) traceCall(TRACE_BIND_TEXTURE, &index);
+        stateChangeCount++;
+        textureBindCount++;
+    }
+}
+
+void sceneSetCap(GLenum cap, bool enabled) {
+    if (cap == GL_LIGHTING) drawLayer.lighting = enabled;
+    else if (cap == GL_TEXTURE_2D) drawLayer.texturing = enabled;
+    else if (cap == GL_BLEND) drawLayer.blending = enabled;
+}
+
+void sceneEnable(GLenum cap) {
+    sceneSetCap(cap, true);
+    if (drawLayer.forwardToGL) {
+        glEnable(cap);
+        traceCall(TRACE_ENABLE, &cap);
+        stateChangeCount++;
     }
 }
 
-// ===== Lighting Setup ==================
-void setupLighting(){
-    // Enable Lighting
-    glEnable(GL_LIGHTING);
-
-    // light 0: warm window light (late afternoon sun)
-    GLfloat sunPosition[] = {-1.0f, 2.0f, -1.0f, 0.0f};
-    GLfloat sunDiffuse[] = {0.9f, 0.75f, 0.5f, 1.0f}; // warm golden light
-    GLfloat sunAmbient[] = {0.4f, 0.3f, 0.2f, 1.0f};
-
-    glLightfv(GL_LIGHT0, GL_POSITION, sunPosition);
-    glLightfv(GL_LIGHT0, GL_DIFFUSE, sunDiffuse);
-    glLightfv(GL_LIGHT0, GL_AMBIENT, sunAmbient);
-    glLightf(GL_LIGHT0, GL_CONSTANT_ATTENUATION, 1.0f);
-    if (isDaytime) glEnable(GL_LIGHT0); else glDisable(GL_LIGHT0);
+void sceneDisable(GLenum cap) {
+    sceneSetCap(cap, false);
+    if (drawLayer.forwardToGL) {
+        glDisable(cap);
+        traceCall(TRACE_DISABLE, &cap);
+        stateChangeCount++;
+    }
+}
 
-    // Light 1: Desk Lamp (Point Light)
-    GLfloat deskLampPosition[] = {0.0f, 2.5f, 0.0f, 1.0f};
-    GLfloat deskLampDiffuse[] = {1.0f, 0.95f, 0.8f, 1.0f}; // warmer white
-    GLfloat deskLampAmbient[] = {0.4f, 0.4f, 0.3f, 1.0f}; // brighter ambient from lamp
-    GLfloat deskLampSpecular[] = {1.0f, 1.0f, 0.9f, 1.0f};
+void scenePushAttrib(GLbitfield mask) {
+    if (drawLayer.attribDepth < 16) {
+        bool* saved = drawLayer.attribStack[drawLayer.attribDepth];
+        saved[0] = drawLayer.lighting;
+        saved[1] = drawLayer.texturing;
+        saved[2] = drawLayer.blending;
+    }
+    drawLayer.attribDepth++;
+    if (drawLayer.forwardToGL) {
+        glPushAttrib(mask);
+        traceCall(TRACE_PUSH_ATTRIB, &mask);
+        stateChangeCount++;
+    }
+}
 
-    glLightfv(GL_LIGHT1, GL_POSITION, deskLampPosition);
-    glLightfv(GL_LIGHT1, GL_DIFFUSE, deskLampDiffuse);
-    glLightfv(GL_LIGHT1, GL_AMBIENT, deskLampAmbient);
-    glLightfv(GL_LIGHT1, GL_SPECULAR, deskLampSpecular);
-    glLightf(GL_LIGHT1, GL_CONSTANT_ATTENUATION, 1.0f);
-    glLightf(GL_LIGHT1, GL_LINEAR_ATTENUATION, 0.05f);
-    glLightf(GL_LIGHT1, GL_QUADRATIC_ATTENUATION, 0.01f);
-    if (!isDaytime) glEnable(GL_LIGHT1); else glDisable(GL_LIGHT1);
+void scenePopAttrib() {
+    drawLayer.attribDepth--;
+    if (drawLayer.attribDepth >= 0 && drawLayer.attribDepth < 16) {
+        bool* saved = drawLayer.attribStack[drawLayer.attribDepth];
+        drawLayer.lighting = saved[0];
+        drawLayer.texturing = saved[1];
+        drawLayer.blending = saved[2];
+    }
+    if (drawLayer.forwardToGL) {
+        glPopAttrib();
+        traceCall(TRACE_POP_ATTRIB, NULL);
+        stateChangeCount++;
+    }
+}
 
-    // Light 2: General ambient light - brighter for late afternoon
-    GLfloat globalAmbient[] = {0.35f, 0.3f, 0.25f, 1.0f}; // warm overall ambient
-    glLightModelfv(GL_LIGHT_MODEL_AMBIENT, globalAmbient);
+void sceneBlendFunc(GLenum sfactor, GLenum dfactor) {
+    drawLayer.blendSrc = sfactor;
+    drawLayer.blendDst = dfactor;
+    if (drawLayer.forwardToGL) {
+        glBlendFunc(sfactor, dfactor);
+        const GLenum args[2] = {sfactor, dfactor};
+        traceCall(TRACE_BLEND_FUNC, args);
+        stateChangeCount++;
+    }
+}
 
+void sceneDepthMask(GLboolean flag) {
+    drawLayer.depthWrite = (flag == GL_TRUE);
+    if (drawLayer.forwardToGL) {
+        glDepthMask(flag);
+        int depthWrite = drawLayer.depthWrite ? 1 : 0;
+        traceCall(TRACE_DEPTH_MASK, &depthWrite);
+        stateChangeCount++;
+    }
 }
 
-// ====== Camera Update =======
-void updateCamera() {
-    if (cameraMode) {
-        // FPS Camera Mode
-        glRotatef(cameraAngleX, 1.0f, 0.0f, 0.0f);
-        glRotatef(cameraAngleY, 0.0f, 1.0f, 0.0f);
-        glTranslatef(-cameraPosX, -cameraPosY, -cameraPosZ);
-    } else {
-        // Orbital Camera Mode (orbit inside the room)
-        float angleRad = orbitalAngle * M_PI / 180.0f;
-        // Keep orbit radius within room bounds so camera stays inside
-        float maxRadius = 3.5f;
-        float radius = fminf(cameraDistance, maxRadius);
-        float camX = radius * sinf(angleRad);
-        float camZ = radius * cosf(angleRad);
-        float camY = 2.2f; // eye height inside room
-        gluLookAt(camX, camY, camZ,
-                  0.0f, 1.2f, 0.0f,
-                  0.0f, 1.0f, 0.0f);
+void sceneLineWidth(GLfloat width) {
+    if (drawLayer.forwardToGL) {
+        glLineWidth(width);
+        traceCall(TRACE_LINE_WIDTH, &width);
+        stateChangeCount++;
     }
 }
 
-// =========== Texture Loading =======
-// ============= Texture Loading Function =============
-void loadTextures() {
-    // Ensure OpenGL state is properly set up
-    glViewport(0, 0, WINDOW_WIDTH, WINDOW_HEIGHT);
-    glMatrixMode(GL_PROJECTION);
-    glLoadIdentity();
-    glMatrixMode(GL_MODELVIEW);
-    glLoadIdentity();
-    
-    // Enable texture mapping
-    glEnable(GL_TEXTURE_2D);
-    // Ensure tightly packed rows for stb_image (avoid alignment issues)
-    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-    
-    // Generate texture IDs individually to avoid any accidental index mixups
-    glGenTextures(1, &textureWood);
-    printf("Generated textureWood: %u\n", textureWood);
-    glGenTextures(1, &texturePaper);
-    printf("Generated texturePaper: %u\n", texturePaper);
-    glGenTextures(1, &textureWallpaper);
-    printf("Generated textureWallpaper: %u\n", textureWallpaper);
-    glGenTextures(1, &textureCarpet);
-    printf("Generated textureCarpet: %u\n", textureCarpet);
-    glGenTextures(1, &textureCouch);
-    printf("Generated textureCouch: %u\n", textureCouch);
-    glGenTextures(1, &textureGlass);
-    printf("Generated textureGlass: %u\n", textureGlass);
-    glGenTextures(1, &textureGround);
-    printf("Generated textureGround: %u\n", textureGround);
-    glGenTextures(1, &texturePortrait);
-    printf("Generated texturePortrait: %u\n", texturePortrait);
+void scenePointSize(GLfloat size) {
+    if (drawLayer.forwardToGL) {
+        glPointSize(size);
+        traceCall(TRACE_POINT_SIZE, &size);
+        stateChangeCount++;
+    }
+}
 
-    // Load textures from files (each function will bind the named texture ID)
-    printf("Loading wood texture...\n");
-    createWoodTexture();
-    printf("Loading paper texture...\n");
-    createPaperTexture();
-    printf("Loading wallpaper texture...\n");
-    createWallpaperTexture();
-    printf("Loading carpet texture...\n");
-    createCarpetTexture();
-    printf("Loading couch texture...\n");
-    createCouchTexture();
-    printf("Loading glass texture...\n");
-    createGlassTexture();
-    printf("Loading ground texture...\n");
-    createGroundTexture();
-    
-    printf("Textures loaded successfully\n");
+void sceneMaterialfv(GLenum face, GLenum pname, const GLfloat* params) {
+    if (pname == GL_SPECULAR) memcpy(drawLayer.specular, params, sizeof(drawLayer.specular));
+    if (pname == GL_SHININESS) drawLayer.shininess = params[0];
+    if (drawLayer.forwardToGL) {
+        glMaterialfv(face, pname, params);
+        TraceMaterial material = {face, pname, {params[0], 0.0f, 0.0f, 0.0f}};
+        if (pname != GL_SHININESS) memcpy(material.params, params, sizeof(material.params));
+        traceCall(TRACE_MATERIAL, &material);
+        stateChangeCount++;
+    }
 }
 
-// ============= Texture Loading Functions =============
+void sceneMaterialf(GLenum face, GLenum pname, GLfloat param) {
+    if (pname == GL_SHININESS) drawLayer.shininess = param;
+    if (drawLayer.forwardToGL) {
+        glMaterialf(face, pname, param);
+        TraceMaterial material = {face, pname, {param, 0.0f, 0.0f, 0.0f}};
+        traceCall(TRACE_MATERIAL, &material);
+        stateChangeCount++;
+    }
+}
 
-void createWoodTexture() {
-    int width, height, channels;
-    unsigned char *image = stbi_load("textures/wood.jpg", &width, &height, &channels, 0);
-    
-    if (!image) {
-        printf("Failed to load wood.jpg texture\n");
-        return;
+void scenePushMatrix() {
+    if (drawLayer.capture && drawLayer.matrixDepth < 32) {
+        memcpy(drawLayer.matrixStack[drawLayer.matrixDepth], drawLayer.matrix, sizeof(drawLayer.matrix));
+    }
+    drawLayer.matrixDepth++;
+    if (drawLayer.forwardToGL) {
+        glPushMatrix();
+        traceCall(TRACE_PUSH_MATRIX, NULL);
     }
-    
-    glBindTexture(GL_TEXTURE_2D, textureWood);
-    
-    GLenum format = (channels == 4) ? GL_RGBA : GL_RGB;
-    glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, image);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-    
-    stbi_image_free(image);
-    printf("Wood texture loaded (ID: %d)\n", textureWood);
 }
 
+void scenePopMatrix() {
+    drawLayer.matrixDepth--;
+    if (drawLayer.capture && drawLayer.matrixDepth >= 0 && drawLayer.matrixDepth < 32) {
+        memcpy(drawLayer.matrix, drawLayer.matrixStack[drawLayer.matrixDepth], sizeof(drawLayer.matrix));
+        updateLayerNormalMatrix();
+    }
+    if (drawLayer.forwardToGL) {
+        glPopMatrix();
+        traceCall(TRACE_POP_MATRIX, NULL);
+    }
+}
 
-void createPaperTexture() {
-    if (texturePaper == 0) {
-        printf("ERROR: texturePaper is 0!\n");
-        return;
+void sceneTranslatef(GLfloat x, GLfloat y, GLfloat z) {
+    GLfloat m[16];
+    identityMatrix(m);
+    m[12] = x; m[13] = y; m[14] = z;
+    if (drawLayer.capture) layerMultMatrix(m);
+    if (drawLayer.forwardToGL) {
+        glTranslatef(x, y, z);
+        const GLfloat args[3] = {x, y, z};
+        traceCall(TRACE_TRANSLATE, args);
     }
-    
-    int width, height, channels;
-    unsigned char *image = stbi_load("textures/paper.jpg", &width, &height, &channels, 0);
-    
-    if (!image) {
-        printf("Failed to load paper.jpg texture\n");
-        return;
+}
+
+void sceneRotatef(GLfloat angle, GLfloat ax, GLfloat ay, GLfloat az) {
+    GLfloat length = sqrtf(ax * ax + ay * ay + az * az);
+    if (drawLayer.capture && length > 0.0f) {
+        GLfloat x = ax / length, y = ay / length, z = az / length;
+        GLfloat c = cosf(angle * (float)M_PI / 180.0f);
+        GLfloat s = sinf(angle * (float)M_PI / 180.0f);
+        GLfloat t = 1.0f - c;
+        GLfloat m[16] = {
+            t * x * x + c,     t * x * y + s * z, t * x * z - s * y, 0.0f,
+            t * x * y - s * z, t * y * y + c,     t * y * z + s * x, 0.0f,
+            t * x * z + s * y, t * y * z - s * x, t * z * z + c,     0.0f,
+            0.0f, 0.0f, 0.0f, 1.0f};
+        layerMultMatrix(m);
     }
-    
-    printf("Binding texturePaper (ID: %u), image size: %dx%d, channels: %d\n", texturePaper, width, height, channels);
-    glBindTexture(GL_TEXTURE_2D, texturePaper);
-    
-    GLenum format = (channels == 4) ? GL_RGBA : GL_RGB;
-    // Use mipmap builder which also safely resizes to max texture size if needed
-    if (gluBuild2DMipmaps(GL_TEXTURE_2D, format, width, height, format, GL_UNSIGNED_BYTE, image) != 0) {
-        printf("Failed to build mipmaps for paper texture\n");
+    if (drawLayer.forwardToGL) {
+        glRotatef(angle, ax, ay, az);
+        const GLfloat args[4] = {angle, ax, ay, az};
+        traceCall(TRACE_ROTATE, args);
     }
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
-    
-    stbi_image_free(image);
-    printf("Paper texture loaded (ID: %d)\n", texturePaper);
 }
 
-void createGlassTexture() {
-    int width, height, channels;
-    unsigned char *image = stbi_load("textures/glass.jpg", &width, &height, &channels, 0);
-    
-    if (!image) {
-        printf("Failed to load glass.jpg texture\n");
-        return;
+void sceneScalef(GLfloat x, GLfloat y, GLfloat z) {
+    GLfloat m[16];
+    identityMatrix(m);
+    m[0] = x; m[5] = y; m[10] = z;
+    if (drawLayer.capture) layerMultMatrix(m);
+    if (drawLayer.forwardToGL) {
+        glScalef(x, y, z);
+        const GLfloat args[3] = {x, y, z};
+        traceCall(TRACE_SCALE, args);
     }
-    
-    glBindTexture(GL_TEXTURE_2D, textureGlass);
-    
-    GLenum format = (channels == 4) ? GL_RGBA : GL_RGB;
-    gluBuild2DMipmaps(GL_TEXTURE_2D, format, width, height, format, GL_UNSIGNED_BYTE, image);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    
-    stbi_image_free(image);
-    printf("Glass texture loaded (ID: %d)\n", textureGlass);
 }
 
-void createGroundTexture() {
-    int width, height, channels;
-    unsigned char *image = stbi_load("textures/ground.jpg", &width, &height, &channels, 0);
-    
-    if (!image) {
-        printf("Failed to load ground.jpg texture\n");
-        return;
+// GLUT's solids are tessellated here rather than by freeglut, so they are
+// captured like everything else and need no GLUT window.
+void sceneSolidSphere(double radius, GLint slices, GLint stacks) {
+    float r = (float)radius;
+    sceneBegin(GL_TRIANGLES);
+    for (int i = 0; i < stacks; i++) {
+        float phi0 = (float)M_PI * i / stacks;
+        float phi1 = (float)M_PI * (i + 1) / stacks;
+        for (int j = 0; j < slices; j++) {
+            float theta0 = 2.0f * (float)M_PI * j / slices;
+            float theta1 = 2.0f * (float)M_PI * (j + 1) / slices;
+            float p[4][3] = {
+                {sinf(phi0) * cosf(theta0), sinf(phi0) * sinf(theta0), cosf(phi0)},
+                {sinf(phi1) * cosf(theta0), sinf(phi1) * sinf(theta0), cosf(phi1)},
+                {sinf(phi1) * cosf(theta1), sinf(phi1) * sinf(theta1), cosf(phi1)},
+                {sinf(phi0) * cosf(theta1), sinf(phi0) * sinf(theta1), cosf(phi0)}};
+            const int order[6] = {0, 1, 2, 0, 2, 3};
+            for (int k = 0; k < 6; k++) {
+                const float* n = p[order[k]];
+                sceneNormal3f(n[0], n[1], n[2]);
+                sceneVertex3f(n[0] * r, n[1] * r, n[2] * r);
+            }
+        }
     }
-    
-    glBindTexture(GL_TEXTURE_2D, textureGround);
-    
-    GLenum format = (channels == 4) ? GL_RGBA : GL_RGB;
-    gluBuild2DMipmaps(GL_TEXTURE_2D, format, width, height, format, GL_UNSIGNED_BYTE, image);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-    
-    stbi_image_free(image);
-    printf("Ground texture loaded (ID: %d)\n", textureGround);
+    sceneEnd();
 }
 
-void createWallpaperTexture() {
-    int width, height, channels;
-    unsigned char *image = stbi_load("textures/wallpaper.jpg", &width, &height, &channels, 0);
-    
-    if (!image) {
-        printf("Failed to load wallpaper.jpg texture - using procedural pattern\n");
-        // Create a simple procedural wallpaper pattern if file doesn't exist
-        glBindTexture(GL_TEXTURE_2D, textureWallpaper);
-        
-        // Create a simple beige/cream colored texture with subtle pattern
-        unsigned char wallpaperData[256 * 256 * 3];
-        for(int y = 0; y < 256; y++) {
-            for(int x = 0; x < 256; x++) {
-                int idx = (y * 256 + x) * 3;
-                // Base cream/beige color
-                wallpaperData[idx + 0] = (unsigned char)(200 + (x % 16) * 2);     // Red
-                wallpaperData[idx + 1] = (unsigned char)(190 + (y % 16));         // Green
-                wallpaperData[idx + 2] = (unsigned char)(170 + ((x+y) % 16));     // Blue
+void sceneSolidCone(double base, double height, GLint slices, GLint stacks) {
+    float b = (float)base;
+    float h = (float)height;
+    float slant = sqrtf(b * b + h * h);
+    float nz = b / slant;
+    float nr = h / slant;
+    sceneBegin(GL_TRIANGLES);
+    // Base disk facing -z
+    for (int j = 0; j < slices; j++) {
+        float theta0 = 2.0f * (float)M_PI * j / slices;
+        float theta1 = 2.0f * (float)M_PI * (j + 1) / slices;
+        sceneNormal3f(0.0f, 0.0f, -1.0f);
+        sceneVertex3f(0.0f, 0.0f, 0.0f);
+        sceneVertex3f(b * cosf(theta1), b * sinf(theta1), 0.0f);
+        sceneVertex3f(b * cosf(theta0), b * sinf(theta0), 0.0f);
+    }
+    // Side, one band per stack
+    for (int i = 0; i < stacks; i++) {
+        float z0 = h * i / stacks, z1 = h * (i + 1) / stacks;
+        float r0 = b * (1.0f - (float)i / stacks), r1 = b * (1.0f - (float)(i + 1) / stacks);
+        for (int j = 0; j < slices; j++) {
+            float theta0 = 2.0f * (float)M_PI * j / slices;
+            float theta1 = 2.0f * (float)M_PI * (j + 1) / slices;
+            float c0 = cosf(theta0), s0 = sinf(theta0), c1 = cosf(theta1), s1 = sinf(theta1);
+            float quad[4][3] = {{r0 * c0, r0 * s0, z0}, {r0 * c1, r0 * s1, z0},
+                                {r1 * c1, r1 * s1, z1}, {r1 * c0, r1 * s0, z1}};
+            float normals[4][2] = {{c0, s0}, {c1, s1}, {c1, s1}, {c0, s0}};
+            const int order[6] = {0, 1, 2, 0, 2, 3};
+            for (int k = 0; k < 6; k++) {
+                int v = order[k];
+                sceneNormal3f(normals[v][0] * nr, normals[v][1] * nr, nz);
+                sceneVertex3f(quad[v][0], quad[v][1], quad[v][2]);
             }
         }
-        
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, 256, 256, 0, GL_RGB, GL_UNSIGNED_BYTE, wallpaperData);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-        
-        printf("Procedural wallpaper texture created (ID: %d)\n", textureWallpaper);
-        return;
     }
-    
-    glBindTexture(GL_TEXTURE_2D, textureWallpaper);
-    
-    GLenum format = (channels == 4) ? GL_RGBA : GL_RGB;
-    gluBuild2DMipmaps(GL_TEXTURE_2D, format, width, height, format, GL_UNSIGNED_BYTE, image);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-    
-    stbi_image_free(image);
-    printf("Wallpaper texture loaded (ID: %d)\n", textureWallpaper);
+    sceneEnd();
 }
 
-void createCarpetTexture() {
-    int width, height, channels;
-    unsigned char *image = stbi_load("textures/carpet.jpg", &width, &height, &channels, 0);
-    
-    if (!image) {
-        printf("Failed to load carpet.jpg texture\n");
-        return;
+void sceneSolidCube(double size) {
+    static const float faces[6][3] = {{1, 0, 0}, {-1, 0, 0}, {0, 1, 0}, {0, -1, 0}, {0, 0, 1}, {0, 0, -1}};
+    float h = (float)size * 0.5f;
+    sceneBegin(GL_QUADS);
+    for (int f = 0; f < 6; f++) {
+        const float* n = faces[f];
+        // Two axes spanning the face, ordered for counter-clockwise winding
+        float u[3] = {n[1], n[2], n[0]};
+        float v[3] = {n[1] * u[2] - n[2] * u[1], n[2] * u[0] - n[0] * u[2], n[0] * u[1] - n[1] * u[0]};
+        const float corners[4][2] = {{-1, -1}, {1, -1}, {1, 1}, {-1, 1}};
+        sceneNormal3f(n[0], n[1], n[2]);
+        for (int k = 0; k < 4; k++) {
+            sceneVertex3f(h * (n[0] + corners[k][0] * u[0] + corners[k][1] * v[0]),
+                          h * (n[1] + corners[k][0] * u[1] + corners[k][1] * v[1]),
+                          h * (n[2] + corners[k][0] * u[2] + corners[k][1] * v[2]));
+        }
     }
-    
-    glBindTexture(GL_TEXTURE_2D, textureCarpet);
-    
-    GLenum format = (channels == 4) ? GL_RGBA : GL_RGB;
-    gluBuild2DMipmaps(GL_TEXTURE_2D, format, width, height, format, GL_UNSIGNED_BYTE, image);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-    
-    stbi_image_free(image);
-    printf("Carpet texture loaded (ID: %d)\n", textureCarpet);
+    sceneEnd();
 }
 
-void createCouchTexture() {
-    int width, height, channels;
-    unsigned char *image = stbi_load("textures/couch.jpg", &width, &height, &channels, 0);
-    
-    if (!image) {
-        printf("Failed to load couch.jpg texture\n");
-        return;
+// Records the whole room in world space without touching GL
+void captureScene(SceneMesh& mesh) {
+    mesh.vertices.clear();
+    mesh.draws.clear();
+    resetDrawLayer(false, &mesh);
+    for (int i = 0; i < SCENE_OBJECT_COUNT; i++) {
+        drawLayer.object = i;
+        sceneObjects[i].draw();
+    }
+    resetDrawLayer(false, NULL);
+}
+
+void drawSceneObjects(bool shadowCastersOnly) {
+    for (int i = 0; i < SCENE_OBJECT_COUNT; i++) {
+        if (shadowCastersOnly && !sceneObjects[i].castsShadow) continue;
+        drawLayer.object = i;
+        gpuTimerPush(GPU_PASS_COUNT + i);
+        sceneObjects[i].draw();
+        gpuTimerPop();
     }
-    
-    glBindTexture(GL_TEXTURE_2D, textureCouch);
-    
-    GLenum format = (channels == 4) ? GL_RGBA : GL_RGB;
-    gluBuild2DMipmaps(GL_TEXTURE_2D, format, width, height, format, GL_UNSIGNED_BYTE, image);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-    
-    stbi_image_free(image);
-    printf("Couch texture loaded (ID: %d)\n", textureCouch);
 }
 
+#define glBegin sceneBegin
+#define glEnd sceneEnd
+#define glVertex3f sceneVertex3f
+#define glNormal3f sceneNormal3f
+#define glTexCoord2f sceneTexCoord2f
+#define glColor3f sceneColor3f
+#define glColor3fv sceneColor3fv
+#define glColor4f sceneColor4f
+#define glBindTexture sceneBindTexture
+#define glEnable sceneEnable
+#define glDisable sceneDisable
+#define glPushAttrib scenePushAttrib
+#define glPopAttrib scenePopAttrib
+#define glBlendFunc sceneBlendFunc
+#define glDepthMask sceneDepthMask
+#define glLineWidth sceneLineWidth
+#define glPointSize scenePointSize
+#define glMaterialfv sceneMaterialfv
+#define glMaterialf sceneMaterialf
+#define glPushMatrix scenePushMatrix
+#define glPopMatrix scenePopMatrix
+#define glTranslatef sceneTranslatef
+#define glRotatef sceneRotatef
+#define glScalef sceneScalef
+#define glutSolidSphere sceneSolidSphere
+#define glutSolidCone sceneSolidCone
+#define glutSolidCube sceneSolidCube
+
 //================= Room Drawing Functions ===========================
 void drawRoom(){
     // Floor - use ground texture
@@ -1260,7 +11000,8 @@ void drawCapAndPapers() {
 }
 
 void drawSunlight() {
-    if (!isDaytime) return;
+    // The volumetric stage draws the real shaft after the opaque pass
+    if (!isDaytime || volumetricLightActive()) return;
 
     // Draw a simple translucent sunlight shaft entering from the window
     glPushAttrib(GL_ENABLE_BIT | GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
@@ -1433,7 +11174,9 @@ void drawDeskLamp() {
     
     // Lamp light glow effect if desk lamp is on
     if (deskLampLightOn) {
-        glColor4f(1.0f, 1.0f, 0.8f, 0.3f);
+        // Brighter than white in HDR, so the bloom picks it up
+        float glow = hdrActive() ? LAMP_GLOW_HDR_INTENSITY : 1.0f;
+        glColor4f(glow, glow, 0.8f * glow, 0.3f * deskLampIntensity);
         glEnable(GL_BLEND);
         glBlendFunc(GL_SRC_ALPHA, GL_ONE);
         glPushMatrix();
@@ -1712,4 +11455,32 @@ void drawAxes() {
     glLineWidth(1.0f);
     
     glEnable(GL_LIGHTING);
-}
\ No newline at end of file
+}
+
+#undef glBegin
+#undef glEnd
+#undef glVertex3f
+#undef glNormal3f
+#undef glTexCoord2f
+#undef glColor3f
+#undef glColor3fv
+#undef glColor4f
+#undef glBindTexture
+#undef glEnable
+#undef glDisable
+#undef glPushAttrib
+#undef glPopAttrib
+#undef glBlendFunc
+#undef glDepthMask
+#undef glLineWidth
+#undef glPointSize
+#undef glMaterialfv
+#undef glMaterialf
+#undef glPushMatrix
+#undef glPopMatrix
+#undef glTranslatef
+#undef glRotatef
+#undef glScalef
+#undef glutSolidSphere
+#undef glutSolidCone
+#undef glutSolidCube
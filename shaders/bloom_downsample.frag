@@ -0,0 +1,44 @@
+#version 330 compatibility
+// One step of the bloom chain: halves the source with four bilinear taps
+// (a 4x4 box). Built with PREFILTER for the first step, which reads the HDR
+// scene and keeps only what is above the threshold.
+
+uniform sampler2D uSource;
+uniform vec2 uTargetSize;
+
+#ifdef PREFILTER
+uniform float uThreshold;
+#endif
+
+out vec4 fragColor;
+
+#ifdef PREFILTER
+// Soft knee around the threshold, and each tap weighted by 1 / (1 + luma)
+// so single very bright pixels do not flicker as the camera moves
+vec3 brightPass(vec3 c, out float weight) {
+    float luma = dot(c, vec3(0.2126, 0.7152, 0.0722));
+    float knee = 0.5 * uThreshold;
+    float soft = clamp(luma - uThreshold + knee, 0.0, 2.0 * knee);
+    soft = soft * soft / (4.0 * knee + 1e-5);
+    float contribution = max(soft, luma - uThreshold) / max(luma, 1e-5);
+    weight = 1.0 / (1.0 + luma);
+    return c * contribution * weight;
+}
+#endif
+
+void main() {
+    vec2 uv = gl_FragCoord.xy / uTargetSize;
+    vec2 d = 0.5 / uTargetSize;
+    vec3 a = texture(uSource, uv + vec2(-d.x, -d.y)).rgb;
+    vec3 b = texture(uSource, uv + vec2( d.x, -d.y)).rgb;
+    vec3 c = texture(uSource, uv + vec2(-d.x,  d.y)).rgb;
+    vec3 e = texture(uSource, uv + vec2( d.x,  d.y)).rgb;
+
+#ifdef PREFILTER
+    float wa, wb, wc, we;
+    vec3 sum = brightPass(a, wa) + brightPass(b, wb) + brightPass(c, wc) + brightPass(e, we);
+    fragColor = vec4(sum / (wa + wb + wc + we), 1.0);
+#else
+    fragColor = vec4((a + b + c + e) * 0.25, 1.0);
+#endif
+}
@@ -0,0 +1,17 @@
+#version 330 compatibility
+// Walks the bloom chain back up: a 3x3 tent filter over the coarser level,
+// added onto the next finer one (blended with GL_ONE, GL_ONE).
+
+uniform sampler2D uSource;
+uniform vec2 uTargetSize;
+
+out vec4 fragColor;
+
+void main() {
+    // Four bilinear taps half a texel off the diagonals add up to the tent
+    vec2 uv = gl_FragCoord.xy / uTargetSize;
+    vec2 d = 0.5 / vec2(textureSize(uSource, 0));
+    vec3 sum = texture(uSource, uv + vec2(-d.x, -d.y)).rgb + texture(uSource, uv + vec2(d.x, -d.y)).rgb +
+               texture(uSource, uv + vec2(-d.x, d.y)).rgb + texture(uSource, uv + vec2(d.x, d.y)).rgb;
+    fragColor = vec4(sum * 0.25, 1.0);
+}
@@ -0,0 +1,78 @@
+#version 330 compatibility
+// Clustered forward shading: the sun comes from the light block as in
+// scene.frag, every point light (the desk lamp included) from the cluster
+// this fragment falls in. Lists are rebuilt on the CPU every frame.
+
+layout(std140) uniform MaterialBlock {
+    vec4 matSpecular;
+    vec4 matParams;   // shininess, lighting enabled, texturing enabled, blending
+};
+
+uniform sampler2D uTexture;
+
+in vec3 vEyePos;
+in vec3 vEyeNormal;
+in vec2 vTexCoord;
+in vec4 vColor;
+in float vOcclusion;
+
+void main() {
+    vec4 texel = (matParams.z > 0.5) ? texture(uTexture, vTexCoord) : vec4(1.0);
+
+    if (matParams.y < 0.5) {
+        writeColor(vColor * texel);
+        return;
+    }
+
+    vec3 N = normalize(vEyeNormal);
+    vec3 V = normalize(-vEyePos);
+    vec3 color = globalAmbient.rgb * vColor.rgb * vOcclusion;
+
+    // Sun
+    if (lights[0].attenuation.w > 0.5) {
+        vec3 L = normalize(lights[0].position.xyz);
+        float NdotL = max(dot(N, L), 0.0);
+        float shadow = (NdotL > 0.0 && uSunShadowEnabled != 0) ? sunShadow(vEyePos, NdotL) : 1.0;
+        color += lights[0].ambient.rgb * vColor.rgb * vOcclusion +
+                 shadow * NdotL * lights[0].diffuse.rgb * vColor.rgb;
+        if (NdotL > 0.0) {
+            float NdotH = max(dot(N, normalize(L + V)), 0.0);
+            float s = (matParams.x > 0.0) ? pow(NdotH, matParams.x) : 1.0;
+            color += shadow * s * lights[0].specular.rgb * matSpecular.rgb;
+        }
+    }
+
+    // Point lights of this cluster
+    uvec2 cluster = texelFetch(uClusterGrid, clusterIndex(vEyePos)).xy;
+    for (uint i = 0u; i < cluster.y; i++) {
+        int base = int(texelFetch(uLightIndices, int(cluster.x + i)).x) * 5;
+        vec4 positionRadius = texelFetch(uLightData, base);
+        vec4 diffuse = texelFetch(uLightData, base + 1);
+        vec3 ambient = texelFetch(uLightData, base + 2).rgb;
+        vec3 specular = texelFetch(uLightData, base + 3).rgb;
+        vec3 attenuation = texelFetch(uLightData, base + 4).xyz;
+
+        vec3 toLight = positionRadius.xyz - vEyePos;
+        float d = length(toLight);
+        if (d >= positionRadius.w) continue;
+        vec3 L = toLight / d;
+        // Fixed-function falloff, windowed to zero at the cluster radius
+        float ratio = d / positionRadius.w;
+        float window = clamp(1.0 - ratio * ratio * ratio * ratio, 0.0, 1.0);
+        float atten = window * window / (attenuation.x + attenuation.y * d + attenuation.z * d * d);
+
+        float NdotL = max(dot(N, L), 0.0);
+        float shadow = 1.0;
+        if (NdotL > 0.0 && diffuse.w > 0.5 && uLampShadowEnabled != 0) shadow = lampShadow(vEyePos, NdotL);
+
+        vec3 term = ambient * vColor.rgb * vOcclusion + shadow * NdotL * diffuse.rgb * vColor.rgb;
+        if (NdotL > 0.0) {
+            float NdotH = max(dot(N, normalize(L + V)), 0.0);
+            float s = (matParams.x > 0.0) ? pow(NdotH, matParams.x) : 1.0;
+            term += shadow * s * specular * matSpecular.rgb;
+        }
+        color += atten * term;
+    }
+
+    writeColor(vec4(max(color, 0.0), vColor.a) * texel);
+}
@@ -0,0 +1,95 @@
+#version 330 compatibility
+// Deferred lighting pass: the same sun + clustered point light shading as
+// clustered.frag, with the surface read back from the G-buffer written by
+// gbuffer.frag instead of interpolated from the vertices.
+
+uniform sampler2D uGBufferAlbedo;
+uniform sampler2D uGBufferTexel;
+uniform sampler2D uGBufferNormal;
+uniform sampler2D uGBufferDepth;
+uniform vec2 uGBufferSize;
+
+vec3 decodeNormal(vec2 e) {
+    e = e * 2.0 - 1.0;
+    vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+    if (n.z < 0.0) n.xy = (1.0 - abs(n.yx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+    return normalize(n);
+}
+
+void main() {
+    ivec2 pixel = ivec2(gl_FragCoord.xy);
+    float depth = texelFetch(uGBufferDepth, pixel, 0).r;
+    if (depth >= 1.0) discard;  // nothing drawn here
+
+    vec4 albedo = texelFetch(uGBufferAlbedo, pixel, 0);
+    vec4 texelSpecular = texelFetch(uGBufferTexel, pixel, 0);
+    vec4 normalParams = texelFetch(uGBufferNormal, pixel, 0);
+    vec4 texel = vec4(texelSpecular.rgb, 1.0);
+    gl_FragDepth = depth;
+
+    if (normalParams.w < 0.5) {
+        fragColor = vec4(albedo.rgb, 1.0) * texel;
+        return;
+    }
+
+    vec4 ndc = vec4(gl_FragCoord.xy / uGBufferSize * 2.0 - 1.0, depth * 2.0 - 1.0, 1.0);
+    vec4 eye = gl_ProjectionMatrixInverse * ndc;
+    vec3 eyePos = eye.xyz / eye.w;
+
+    vec3 vColor = albedo.rgb;
+    float occlusion = albedo.a;
+    vec3 matSpecular = vec3(texelSpecular.a);
+    float shininess = normalParams.z * 128.0;
+
+    vec3 N = decodeNormal(normalParams.xy);
+    vec3 V = normalize(-eyePos);
+    vec3 color = globalAmbient.rgb * vColor * occlusion;
+
+    // Sun
+    if (lights[0].attenuation.w > 0.5) {
+        vec3 L = normalize(lights[0].position.xyz);
+        float NdotL = max(dot(N, L), 0.0);
+        float shadow = (NdotL > 0.0 && uSunShadowEnabled != 0) ? sunShadow(eyePos, NdotL) : 1.0;
+        color += lights[0].ambient.rgb * vColor * occlusion +
+                 shadow * NdotL * lights[0].diffuse.rgb * vColor;
+        if (NdotL > 0.0) {
+            float NdotH = max(dot(N, normalize(L + V)), 0.0);
+            float s = (shininess > 0.0) ? pow(NdotH, shininess) : 1.0;
+            color += shadow * s * lights[0].specular.rgb * matSpecular;
+        }
+    }
+
+    // Point lights of this cluster
+    uvec2 cluster = texelFetch(uClusterGrid, clusterIndex(eyePos)).xy;
+    for (uint i = 0u; i < cluster.y; i++) {
+        int base = int(texelFetch(uLightIndices, int(cluster.x + i)).x) * 5;
+        vec4 positionRadius = texelFetch(uLightData, base);
+        vec4 diffuse = texelFetch(uLightData, base + 1);
+        vec3 ambient = texelFetch(uLightData, base + 2).rgb;
+        vec3 specular = texelFetch(uLightData, base + 3).rgb;
+        vec3 attenuation = texelFetch(uLightData, base + 4).xyz;
+
+        vec3 toLight = positionRadius.xyz - eyePos;
+        float d = length(toLight);
+        if (d >= positionRadius.w) continue;
+        vec3 L = toLight / d;
+        // Fixed-function falloff, windowed to zero at the cluster radius
+        float ratio = d / positionRadius.w;
+        float window = clamp(1.0 - ratio * ratio * ratio * ratio, 0.0, 1.0);
+        float atten = window * window / (attenuation.x + attenuation.y * d + attenuation.z * d * d);
+
+        float NdotL = max(dot(N, L), 0.0);
+        float shadow = 1.0;
+        if (NdotL > 0.0 && diffuse.w > 0.5 && uLampShadowEnabled != 0) shadow = lampShadow(eyePos, NdotL);
+
+        vec3 term = ambient * vColor * occlusion + shadow * NdotL * diffuse.rgb * vColor;
+        if (NdotL > 0.0) {
+            float NdotH = max(dot(N, normalize(L + V)), 0.0);
+            float s = (shininess > 0.0) ? pow(NdotH, shininess) : 1.0;
+            term += shadow * s * specular * matSpecular;
+        }
+        color += atten * term;
+    }
+
+    fragColor = vec4(max(color, 0.0), 1.0) * texel;
+}
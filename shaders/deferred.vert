@@ -0,0 +1,7 @@
+#version 330 compatibility
+// Full-screen passes (deferred lighting, transparency resolve): one
+// triangle covering the viewport, given directly in clip space.
+
+void main() {
+    gl_Position = vec4(gl_Vertex.xy, 0.0, 1.0);
+}
@@ -0,0 +1,48 @@
+#version 330 compatibility
+// Fast approximate anti-aliasing (after Lottes' FXAA 3.11 console version):
+// finds the edge direction from the luma of the four diagonal neighbours
+// and blurs along it. Runs before tone mapping when HDR is on, so luma is
+// taken from x / (1 + x) to keep bright values from dominating.
+
+uniform sampler2D uScene;
+
+out vec4 fragColor;
+
+const float FXAA_REDUCE_MIN = 1.0 / 128.0;
+const float FXAA_REDUCE_MUL = 1.0 / 8.0;
+const float FXAA_SPAN_MAX = 8.0;
+
+float luma(vec3 c) {
+    return dot(c / (1.0 + c), vec3(0.299, 0.587, 0.114));
+}
+
+void main() {
+    vec2 texel = 1.0 / vec2(textureSize(uScene, 0));
+    vec2 uv = gl_FragCoord.xy * texel;
+
+    vec3 rgbM = texture(uScene, uv).rgb;
+    float lumaNW = luma(texture(uScene, uv + vec2(-1.0, -1.0) * texel).rgb);
+    float lumaNE = luma(texture(uScene, uv + vec2( 1.0, -1.0) * texel).rgb);
+    float lumaSW = luma(texture(uScene, uv + vec2(-1.0,  1.0) * texel).rgb);
+    float lumaSE = luma(texture(uScene, uv + vec2( 1.0,  1.0) * texel).rgb);
+    float lumaM = luma(rgbM);
+    float lumaMin = min(lumaM, min(min(lumaNW, lumaNE), min(lumaSW, lumaSE)));
+    float lumaMax = max(lumaM, max(max(lumaNW, lumaNE), max(lumaSW, lumaSE)));
+
+    // Flat areas are left alone
+    if (lumaMax - lumaMin < max(0.0312, lumaMax * 0.125)) {
+        fragColor = vec4(rgbM, 1.0);
+        return;
+    }
+
+    vec2 dir = vec2(-((lumaNW + lumaNE) - (lumaSW + lumaSE)), (lumaNW + lumaSW) - (lumaNE + lumaSE));
+    float dirReduce = max((lumaNW + lumaNE + lumaSW + lumaSE) * 0.25 * FXAA_REDUCE_MUL, FXAA_REDUCE_MIN);
+    float rcpDirMin = 1.0 / (min(abs(dir.x), abs(dir.y)) + dirReduce);
+    dir = clamp(dir * rcpDirMin, vec2(-FXAA_SPAN_MAX), vec2(FXAA_SPAN_MAX)) * texel;
+
+    vec3 rgbA = 0.5 * (texture(uScene, uv + dir * (1.0 / 3.0 - 0.5)).rgb +
+                       texture(uScene, uv + dir * (2.0 / 3.0 - 0.5)).rgb);
+    vec3 rgbB = rgbA * 0.5 + 0.25 * (texture(uScene, uv - dir * 0.5).rgb + texture(uScene, uv + dir * 0.5).rgb);
+    float lumaB = luma(rgbB);
+    fragColor = vec4((lumaB < lumaMin || lumaB > lumaMax) ? rgbA : rgbB, 1.0);
+}
@@ -0,0 +1,39 @@
+#version 330 compatibility
+// Deferred geometry pass: writes the surface attributes the lighting pass
+// needs into three render targets, 12 bytes per pixel plus depth.
+//   0 RGBA8     vertex color, baked occlusion
+//   1 RGBA8     texture color, specular intensity
+//   2 RGB10_A2  octahedral normal, shininess / 128, lit flag
+
+layout(std140) uniform MaterialBlock {
+    vec4 matSpecular;
+    vec4 matParams;   // shininess, lighting enabled, texturing enabled, blending
+};
+
+uniform sampler2D uTexture;
+
+in vec3 vEyePos;
+in vec3 vEyeNormal;
+in vec2 vTexCoord;
+in vec4 vColor;
+in float vOcclusion;
+
+layout(location = 0) out vec4 gAlbedo;
+layout(location = 1) out vec4 gTexel;
+layout(location = 2) out vec4 gNormal;
+
+vec2 encodeNormal(vec3 n) {
+    n /= abs(n.x) + abs(n.y) + abs(n.z);
+    if (n.z < 0.0) n.xy = (1.0 - abs(n.yx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+    return n.xy * 0.5 + 0.5;
+}
+
+void main() {
+    vec4 texel = (matParams.z > 0.5) ? texture(uTexture, vTexCoord) : vec4(1.0);
+    float specular = max(matSpecular.r, max(matSpecular.g, matSpecular.b));
+
+    gAlbedo = vec4(vColor.rgb, vOcclusion);
+    gTexel = vec4(texel.rgb, specular);
+    gNormal = vec4(encodeNormal(normalize(vEyeNormal)), clamp(matParams.x / 128.0, 0.0, 1.0),
+                   matParams.y > 0.5 ? 1.0 : 0.0);
+}
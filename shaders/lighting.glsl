@@ -0,0 +1,103 @@
+// Shared by the lit fragment shaders (scene.frag, clustered.frag,
+// deferred.frag): loadProgram() puts this file between their #version line
+// and their own source when asked for SHADER_LIGHTING_PRELUDE.
+
+struct Light {
+    vec4 position;    // eye space, w = 0 for directional
+    vec4 ambient;
+    vec4 diffuse;
+    vec4 specular;
+    vec4 attenuation; // constant, linear, quadratic, enabled
+};
+
+layout(std140) uniform LightBlock {
+    vec4 globalAmbient;
+    Light lights[2];
+};
+
+// Shadow maps: light 0 (sun) is directional, light 1 (desk lamp) a point light
+uniform sampler2DShadow uSunShadow;
+uniform samplerCubeShadow uLampShadow;
+uniform int uSunShadowEnabled;
+uniform int uLampShadowEnabled;
+uniform mat4 uEyeToSunShadow;  // eye space -> sun shadow map [0,1] coordinates
+uniform sampler2DShadow uSunShadowNext;  // next key time's map, cross-faded in
+uniform mat4 uEyeToSunShadowNext;
+uniform float uSunShadowBlend;
+uniform mat4 uEyeToWorld;
+uniform vec3 uLampWorldPos;
+uniform float uLampShadowFar;
+
+// Clustered point lights. Five texels per light: eye position + radius,
+// diffuse + lamp shadow flag, ambient, specular, attenuation (constant,
+// linear, quadratic)
+uniform samplerBuffer uLightData;
+uniform usamplerBuffer uClusterGrid;   // offset, count per cluster
+uniform usamplerBuffer uLightIndices;
+uniform ivec3 uClusterDims;
+uniform vec2 uClusterTileSize;         // pixels
+uniform vec2 uClusterDepth;            // near, far of the sliced range
+
+#ifdef WEIGHTED_OIT
+// Weighted blended order-independent transparency (McGuire and Bavoil):
+// premultiplied color and coverage are summed with a depth weight, the
+// revealage target is multiplied by (1 - alpha) by the blend unit
+layout(location = 0) out vec4 oitAccum;
+layout(location = 1) out vec4 oitRevealage;
+
+void writeColor(vec4 color) {
+    float z = 1.0 / gl_FragCoord.w;  // eye-space depth under a perspective projection
+    float weight = color.a * clamp(10.0 / (1e-5 + pow(z / 5.0, 2.0) + pow(z / 200.0, 6.0)), 1e-2, 3e3);
+    oitAccum = vec4(color.rgb * color.a, color.a) * weight;
+    oitRevealage = vec4(color.a);
+}
+#else
+out vec4 fragColor;
+
+void writeColor(vec4 color) {
+    fragColor = color;
+}
+#endif
+
+float sunShadowMap(sampler2DShadow map, mat4 eyeToShadow, vec3 eyePos, float NdotL) {
+    vec4 coord = eyeToShadow * vec4(eyePos, 1.0);
+    vec3 p = coord.xyz / coord.w;
+    if (any(lessThan(p, vec3(0.0))) || any(greaterThan(p, vec3(1.0)))) return 1.0;
+
+    // 3x3 PCF on top of the hardware 2x2 compare filter
+    float bias = mix(0.004, 0.001, NdotL);
+    vec2 texel = 1.0 / vec2(textureSize(map, 0));
+    float lit = 0.0;
+    for (int y = -1; y <= 1; y++) {
+        for (int x = -1; x <= 1; x++) {
+            lit += texture(map, vec3(p.xy + vec2(x, y) * texel, p.z - bias));
+        }
+    }
+    return lit / 9.0;
+}
+
+// Shadow maps exist only for the time-of-day key times; in between, the
+// two nearest are cross-faded
+float sunShadow(vec3 eyePos, float NdotL) {
+    float lit = sunShadowMap(uSunShadow, uEyeToSunShadow, eyePos, NdotL);
+    if (uSunShadowBlend > 0.0) {
+        lit = mix(lit, sunShadowMap(uSunShadowNext, uEyeToSunShadowNext, eyePos, NdotL), uSunShadowBlend);
+    }
+    return lit;
+}
+
+float lampShadow(vec3 eyePos, float NdotL) {
+    vec3 worldPos = (uEyeToWorld * vec4(eyePos, 1.0)).xyz;
+    vec3 toFragment = worldPos - uLampWorldPos;
+    float bias = mix(0.006, 0.002, NdotL);
+    return texture(uLampShadow, vec4(toFragment, length(toFragment) / uLampShadowFar - bias));
+}
+
+int clusterIndex(vec3 eyePos) {
+    ivec2 tile = ivec2(gl_FragCoord.xy / uClusterTileSize);
+    tile = clamp(tile, ivec2(0), uClusterDims.xy - 1);
+    float depth = max(-eyePos.z, uClusterDepth.x);
+    int slice = int(log(depth / uClusterDepth.x) / log(uClusterDepth.y / uClusterDepth.x) * float(uClusterDims.z));
+    slice = clamp(slice, 0, uClusterDims.z - 1);
+    return (slice * uClusterDims.y + tile.y) * uClusterDims.x + tile.x;
+}
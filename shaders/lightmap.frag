@@ -0,0 +1,22 @@
+#version 330 compatibility
+// Baked lighting applied like the fixed-function model: the light multiplies
+// the vertex color, is clamped, then modulated by the texture. The day and
+// night bakes are blended by the time of day.
+
+uniform sampler2D uTexture;
+uniform sampler2D uLightmap;       // day
+uniform sampler2D uLightmapNight;
+uniform float uDayWeight;
+uniform int uTextured;
+
+in vec2 vTexCoord;
+in vec2 vLightmapCoord;
+in vec4 vColor;
+
+out vec4 fragColor;
+
+void main() {
+    vec4 texel = (uTextured != 0) ? texture(uTexture, vTexCoord) : vec4(1.0);
+    vec3 light = mix(texture(uLightmapNight, vLightmapCoord).rgb, texture(uLightmap, vLightmapCoord).rgb, uDayWeight);
+    fragColor = vec4(clamp(light * vColor.rgb, 0.0, 1.0), vColor.a) * texel;
+}
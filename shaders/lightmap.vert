@@ -0,0 +1,18 @@
+#version 330 compatibility
+// Static geometry in world space; the modelview holds only the camera.
+
+layout(location = 0) in vec3 aPosition;
+layout(location = 1) in vec2 aTexCoord;
+layout(location = 2) in vec2 aLightmapCoord;
+layout(location = 3) in vec4 aColor;
+
+out vec2 vTexCoord;
+out vec2 vLightmapCoord;
+out vec4 vColor;
+
+void main() {
+    vTexCoord = aTexCoord;
+    vLightmapCoord = aLightmapCoord;
+    vColor = aColor;
+    gl_Position = gl_ModelViewProjectionMatrix * vec4(aPosition, 1.0);
+}
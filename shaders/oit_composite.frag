@@ -0,0 +1,17 @@
+#version 330 compatibility
+// Resolves the weighted blended transparency targets over the opaque scene
+// (blended with GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA).
+
+uniform sampler2D uAccum;
+uniform sampler2D uRevealage;
+
+out vec4 fragColor;
+
+void main() {
+    ivec2 pixel = ivec2(gl_FragCoord.xy);
+    float revealage = texelFetch(uRevealage, pixel, 0).r;
+    if (revealage >= 1.0) discard;  // no transparent surface here
+
+    vec4 accum = texelFetch(uAccum, pixel, 0);
+    fragColor = vec4(accum.rgb / max(accum.a, 1e-5), 1.0 - revealage);
+}
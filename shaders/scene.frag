@@ -0,0 +1,68 @@
+#version 330 compatibility
+// Per-pixel Blinn-Phong matching the fixed-function light setup
+// (GL_COLOR_MATERIAL on ambient+diffuse, GL_MODULATE texturing). Lights,
+// shadows and the color output come from lighting.glsl.
+
+layout(std140) uniform MaterialBlock {
+    vec4 matSpecular;
+    vec4 matParams;   // shininess, lighting enabled, texturing enabled, blending
+};
+
+uniform sampler2D uTexture;
+
+in vec3 vEyePos;
+in vec3 vEyeNormal;
+in vec2 vTexCoord;
+in vec4 vColor;
+in float vOcclusion;
+
+void main() {
+    vec4 texel = (matParams.z > 0.5) ? texture(uTexture, vTexCoord) : vec4(1.0);
+
+    if (matParams.y < 0.5) {
+        writeColor(vColor * texel);
+        return;
+    }
+
+    vec3 N = normalize(vEyeNormal);
+    vec3 V = normalize(-vEyePos);
+    // Ambient light is what the baked occlusion attenuates
+    vec3 color = globalAmbient.rgb * vColor.rgb * vOcclusion;
+
+    for (int i = 0; i < 2; i++) {
+        if (lights[i].attenuation.w < 0.5) continue;
+
+        vec3 L;
+        float atten = 1.0;
+        if (lights[i].position.w == 0.0) {
+            L = normalize(lights[i].position.xyz);
+        } else {
+            vec3 toLight = lights[i].position.xyz - vEyePos;
+            float d = length(toLight);
+            L = toLight / d;
+            atten = 1.0 / (lights[i].attenuation.x +
+                           lights[i].attenuation.y * d +
+                           lights[i].attenuation.z * d * d);
+        }
+
+        float NdotL = max(dot(N, L), 0.0);
+        float shadow = 1.0;
+        if (NdotL > 0.0) {
+            if (i == 0 && uSunShadowEnabled != 0) shadow = sunShadow(vEyePos, NdotL);
+            if (i == 1 && uLampShadowEnabled != 0) shadow = lampShadow(vEyePos, NdotL);
+        }
+
+        vec3 term = lights[i].ambient.rgb * vColor.rgb * vOcclusion +
+                    shadow * NdotL * lights[i].diffuse.rgb * vColor.rgb;
+        if (NdotL > 0.0) {
+            vec3 H = normalize(L + V);
+            float NdotH = max(dot(N, H), 0.0);
+            float s = (matParams.x > 0.0) ? pow(NdotH, matParams.x) : 1.0;
+            term += shadow * s * lights[i].specular.rgb * matSpecular.rgb;
+        }
+        color += atten * term;
+    }
+
+    // Left unclamped for the HDR target; fixed-point targets clamp on write
+    writeColor(vec4(max(color, 0.0), vColor.a) * texel);
+}
@@ -0,0 +1,23 @@
+#version 330 compatibility
+// Per-pixel lighting vertex stage.
+// Reads the immediate-mode attributes (gl_Vertex, gl_Normal, gl_Color,
+// gl_MultiTexCoord0) so the existing draw functions work unchanged.
+
+// Baked per-vertex ambient occlusion; a constant 1.0 for immediate-mode draws
+layout(location = 6) in float aOcclusion;
+
+out vec3 vEyePos;
+out vec3 vEyeNormal;
+out vec2 vTexCoord;
+out vec4 vColor;
+out float vOcclusion;
+
+void main() {
+    vec4 eyePos = gl_ModelViewMatrix * gl_Vertex;
+    vEyePos = eyePos.xyz;
+    vEyeNormal = gl_NormalMatrix * gl_Normal;
+    vTexCoord = gl_MultiTexCoord0.xy;
+    vColor = gl_Color;
+    vOcclusion = aOcclusion;
+    gl_Position = gl_ProjectionMatrix * eyePos;
+}
@@ -0,0 +1,23 @@
+#version 330 compatibility
+// Writes shadow map depth. Blended surfaces (glass, light shafts, glow)
+// do not cast shadows.
+
+layout(std140) uniform MaterialBlock {
+    vec4 matSpecular;
+    vec4 matParams;   // shininess, lighting, texturing, blending
+};
+
+// > 0 for the lamp cube map: store distance to the light / far plane
+uniform float uLinearDepthFar;
+
+in vec3 vLightPos;
+
+void main() {
+    if (matParams.w > 0.5) discard;
+
+    if (uLinearDepthFar > 0.0) {
+        gl_FragDepth = length(vLightPos) / uLinearDepthFar;
+    } else {
+        gl_FragDepth = gl_FragCoord.z;
+    }
+}
@@ -0,0 +1,11 @@
+#version 330 compatibility
+// Shadow map depth pass. The modelview/projection are the light's, set up
+// through the fixed-function matrix stack before the casters are drawn.
+
+out vec3 vLightPos;
+
+void main() {
+    vec4 lightPos = gl_ModelViewMatrix * gl_Vertex;
+    vLightPos = lightPos.xyz;
+    gl_Position = gl_ProjectionMatrix * lightPos;
+}
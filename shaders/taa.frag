@@ -0,0 +1,48 @@
+#version 330 compatibility
+// Temporal anti-aliasing resolve: the frame was drawn with a sub-pixel
+// jitter, each pixel is reprojected into last frame's output through the
+// depth buffer (the room is static, so camera motion is all the motion
+// there is), and the history is clamped to the current 3x3 neighbourhood
+// before blending so disoccluded pixels do not ghost.
+
+uniform sampler2D uCurrent;
+uniform sampler2D uHistory;
+uniform sampler2D uDepth;
+uniform mat4 uEyeToPreviousClip;  // current eye space -> last frame's unjittered clip space
+uniform float uBlend;             // weight of the current frame
+uniform int uHistoryValid;
+
+out vec4 fragColor;
+
+void main() {
+    ivec2 pixel = ivec2(gl_FragCoord.xy);
+    ivec2 size = textureSize(uCurrent, 0);
+    vec3 current = texelFetch(uCurrent, pixel, 0).rgb;
+    if (uHistoryValid == 0) {
+        fragColor = vec4(current, 1.0);
+        return;
+    }
+
+    vec3 lo = current;
+    vec3 hi = current;
+    for (int y = -1; y <= 1; y++) {
+        for (int x = -1; x <= 1; x++) {
+            vec3 c = texelFetch(uCurrent, clamp(pixel + ivec2(x, y), ivec2(0), size - 1), 0).rgb;
+            lo = min(lo, c);
+            hi = max(hi, c);
+        }
+    }
+
+    float depth = texelFetch(uDepth, pixel, 0).r;
+    vec4 ndc = vec4((vec2(pixel) + 0.5) / vec2(size) * 2.0 - 1.0, depth * 2.0 - 1.0, 1.0);
+    vec4 eye = gl_ProjectionMatrixInverse * ndc;
+    vec4 previous = uEyeToPreviousClip * (eye / eye.w);
+    vec2 previousUV = previous.xy / previous.w * 0.5 + 0.5;
+    if (any(lessThan(previousUV, vec2(0.0))) || any(greaterThan(previousUV, vec2(1.0)))) {
+        fragColor = vec4(current, 1.0);
+        return;
+    }
+
+    vec3 history = clamp(texture(uHistory, previousUV).rgb, lo, hi);
+    fragColor = vec4(mix(history, current, uBlend), 1.0);
+}
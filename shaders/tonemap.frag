@@ -0,0 +1,27 @@
+#version 330 compatibility
+// Finishes the HDR frame: adds the bloom, applies the exposure and a filmic
+// curve (Narkowicz's fit of the ACES reference transform), and dithers
+// before the 8-bit window framebuffer. The scene's colors are authored for
+// display directly, so no sRGB conversion is applied. The scene may be
+// smaller than the output (dynamic resolution) and is filtered up.
+
+uniform sampler2D uScene;
+uniform sampler2D uBloom;
+uniform float uBloomStrength;
+uniform float uExposure;
+uniform vec2 uOutputSize;
+
+out vec4 fragColor;
+
+vec3 filmic(vec3 x) {
+    return clamp((x * (2.51 * x + 0.03)) / (x * (2.43 * x + 0.59) + 0.14), 0.0, 1.0);
+}
+
+void main() {
+    vec2 uv = gl_FragCoord.xy / uOutputSize;
+    vec3 hdr = texture(uScene, uv).rgb + texture(uBloom, uv).rgb * uBloomStrength;
+
+    vec3 color = filmic(hdr * uExposure);
+    float noise = fract(52.9829189 * fract(dot(gl_FragCoord.xy, vec2(0.06711056, 0.00583715))));
+    fragColor = vec4(color + (noise - 0.5) / 255.0, 1.0);
+}
@@ -0,0 +1,124 @@
+#version 330 compatibility
+// Sun shaft in-scattering, ray-marched at reduced resolution. A sample is
+// lit when its ray toward the sun leaves through the window opening and
+// the sun shadow map has no furniture in the way; the walls themselves do
+// not cast shadows, so the opening stands in for them.
+
+uniform sampler2D uSceneDepth;       // full resolution
+uniform sampler2DShadow uSunShadow;
+uniform int uSunShadowEnabled;
+uniform mat4 uEyeToWorld;
+uniform mat4 uWorldToSunShadow;
+uniform sampler2DShadow uSunShadowNext;
+uniform mat4 uWorldToSunShadowNext;
+uniform float uSunShadowBlend;
+uniform vec3 uSunDirection;          // world space, toward the sun
+uniform vec3 uWindowMin;             // world-space bounds of the glass
+uniform vec3 uWindowMax;
+uniform int uWindowAxis;             // axis the window faces along
+uniform int uSteps;
+uniform float uMaxDistance;
+uniform float uDensity;
+uniform float uTime;                 // seconds, drifts the dust
+uniform float uScale;                // full-resolution pixels per texel
+
+out vec4 result;  // in-scattering, linear depth of the pixel it stands for
+
+float hash(vec3 p) {
+    p = fract(p * 0.3183099 + 0.1);
+    p *= 17.0;
+    return fract(p.x * p.y * p.z * (p.x + p.y + p.z));
+}
+
+float valueNoise(vec3 p) {
+    vec3 i = floor(p);
+    vec3 f = fract(p);
+    f = f * f * (3.0 - 2.0 * f);
+    return mix(mix(mix(hash(i), hash(i + vec3(1, 0, 0)), f.x),
+                   mix(hash(i + vec3(0, 1, 0)), hash(i + vec3(1, 1, 0)), f.x), f.y),
+               mix(mix(hash(i + vec3(0, 0, 1)), hash(i + vec3(1, 0, 1)), f.x),
+                   mix(hash(i + vec3(0, 1, 1)), hash(i + vec3(1, 1, 1)), f.x), f.y), f.z);
+}
+
+// Clips the view ray to the beam: the prism swept from the window opening
+// away from the sun. Every constraint is linear along the ray, so the lit
+// part is a single interval and no step is spent outside it.
+bool clipToBeam(vec3 origin, vec3 dir, inout float t0, inout float t1) {
+    int axis = uWindowAxis;
+    float d = uSunDirection[axis];
+    if (abs(d) < 1e-4) return false;
+    float plane = 0.5 * (uWindowMin[axis] + uWindowMax[axis]);
+
+    for (int k = 0; k < 3; k++) {
+        // Distance toward the sun to the window plane must be positive; the
+        // point it reaches there must lie within the opening
+        float toPlane = (plane - origin[axis]) / d;
+        float base = (k == axis) ? toPlane : origin[k] + toPlane * uSunDirection[k];
+        float slope = (k == axis) ? -dir[axis] / d : dir[k] - dir[axis] / d * uSunDirection[k];
+        float lo = (k == axis) ? 0.0 : uWindowMin[k];
+        float hi = (k == axis) ? 1e9 : uWindowMax[k];
+        if (abs(slope) < 1e-6) {
+            if (base < lo || base > hi) return false;
+        } else {
+            float ta = (lo - base) / slope;
+            float tb = (hi - base) / slope;
+            t0 = max(t0, min(ta, tb));
+            t1 = min(t1, max(ta, tb));
+        }
+    }
+    return t0 < t1;
+}
+
+float shadowMapVisibility(sampler2DShadow map, mat4 worldToShadow, vec3 p) {
+    vec4 coord = worldToShadow * vec4(p, 1.0);
+    if (any(lessThan(coord.xyz, vec3(0.0))) || any(greaterThan(coord.xyz, vec3(1.0)))) return 1.0;
+    return texture(map, vec3(coord.xy, coord.z - 0.002));
+}
+
+float sunVisibility(vec3 p) {
+    if (uSunShadowEnabled == 0) return 1.0;
+    float lit = shadowMapVisibility(uSunShadow, uWorldToSunShadow, p);
+    if (uSunShadowBlend > 0.0) {
+        lit = mix(lit, shadowMapVisibility(uSunShadowNext, uWorldToSunShadowNext, p), uSunShadowBlend);
+    }
+    return lit;
+}
+
+void main() {
+    ivec2 size = textureSize(uSceneDepth, 0);
+    ivec2 pixel = min(ivec2(gl_FragCoord.xy * uScale), size - 1);
+    float depth = texelFetch(uSceneDepth, pixel, 0).r;
+    vec4 ndc = vec4((vec2(pixel) + 0.5) / vec2(size) * 2.0 - 1.0, depth * 2.0 - 1.0, 1.0);
+    vec4 eye = gl_ProjectionMatrixInverse * ndc;
+    eye /= eye.w;
+
+    vec3 origin = (uEyeToWorld * vec4(0.0, 0.0, 0.0, 1.0)).xyz;
+    vec3 dir = mat3(uEyeToWorld) * normalize(eye.xyz);
+    float t0 = 0.0;
+    float t1 = min(length(eye.xyz), uMaxDistance);
+    if (!clipToBeam(origin, dir, t0, t1)) {
+        result = vec4(0.0, -eye.z, 0.0, 0.0);
+        return;
+    }
+    float stepLength = (t1 - t0) / float(uSteps);
+
+    // Interleaved gradient noise offsets the samples per pixel; the
+    // upsample blurs the resulting noise instead of showing step banding
+    float jitter = fract(52.9829189 * fract(dot(gl_FragCoord.xy, vec2(0.06711056, 0.00583715))));
+
+    float light = 0.0;
+    for (int i = 0; i < uSteps; i++) {
+        vec3 p = origin + dir * (t0 + (float(i) + jitter) * stepLength);
+        // Slow drifting haze plus sparse bright motes
+        float haze = valueNoise(p * 3.0 + vec3(0.0, -0.05 * uTime, 0.02 * uTime));
+        float motes = pow(valueNoise(p * 30.0 + vec3(0.0, -0.2 * uTime, 0.0)), 24.0) * 20.0;
+        light += sunVisibility(p) * (0.5 + haze + motes);
+    }
+
+    // Henyey-Greenstein forward scattering, brighter looking into the sun
+    const float g = 0.5;
+    float cosTheta = dot(dir, uSunDirection);
+    float phase = (1.0 - g * g) / pow(1.0 + g * g - 2.0 * g * cosTheta, 1.5);
+
+    result = vec4(light * stepLength * uDensity * phase, -eye.z, 0.0, 0.0);
+}
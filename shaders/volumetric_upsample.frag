@@ -0,0 +1,39 @@
+#version 330 compatibility
+// Depth-aware bilateral upsample of the sun shaft buffer, added over the
+// scene. Low-resolution texels whose depth differs from this pixel's are
+// down-weighted so the shaft does not bleed across silhouettes.
+
+uniform sampler2D uScattering;  // in-scattering, linear depth
+uniform sampler2D uSceneDepth;  // full resolution
+uniform float uScale;
+uniform vec3 uLightColor;
+
+out vec4 fragColor;
+
+void main() {
+    ivec2 pixel = ivec2(gl_FragCoord.xy);
+    ivec2 size = textureSize(uSceneDepth, 0);
+    float depth = texelFetch(uSceneDepth, pixel, 0).r;
+    vec4 ndc = vec4((vec2(pixel) + 0.5) / vec2(size) * 2.0 - 1.0, depth * 2.0 - 1.0, 1.0);
+    vec4 eye = gl_ProjectionMatrixInverse * ndc;
+    float linearDepth = -eye.z / eye.w;
+
+    ivec2 lowSize = textureSize(uScattering, 0);
+    vec2 low = gl_FragCoord.xy / uScale - 0.5;
+    ivec2 base = ivec2(floor(low));
+    vec2 f = fract(low);
+
+    float sum = 0.0;
+    float weightSum = 0.0;
+    for (int y = 0; y <= 1; y++) {
+        for (int x = 0; x <= 1; x++) {
+            vec2 s = texelFetch(uScattering, clamp(base + ivec2(x, y), ivec2(0), lowSize - 1), 0).rg;
+            float bilinear = (x == 1 ? f.x : 1.0 - f.x) * (y == 1 ? f.y : 1.0 - f.y);
+            float w = bilinear / (0.01 + abs(s.g - linearDepth) / linearDepth);
+            sum += w * s.r;
+            weightSum += w;
+        }
+    }
+
+    fragColor = vec4(uLightColor * sum / max(weightSum, 1e-6), 1.0);
+}